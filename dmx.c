@@ -19,10 +19,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 
 // Windows-specific stuff
+#include <winsock2.h> // For Art-Net. This has to be before windows.h, otherwise we get the old winsock.h
+#include <ws2tcpip.h>
 #include <windows.h>
+#include <emmintrin.h> // SSE2, every x64 CPU has it
 
 // libusbK
 #include <usb.h>
@@ -30,6 +34,7 @@
 
 // uDMX-specific stuff
 #include "uDMX_cmds.h"
+#include "udmx_shm.h"
 
 KUSB_DRIVER_API Usb;
 
@@ -59,604 +64,9216 @@ static BOOL KUSB_API ShowDevicesCB(KLST_HANDLE DeviceList,
 
 
 
+/*
+    Timing helpers.
+    Everything that needs a timestamp uses QueryPerformanceCounter() ticks.
+*/
+
+static LONGLONG qpc_frequency = 0;
+
+static LONGLONG now_ticks(void)
+{
+    LARGE_INTEGER now;
+
+    if(!qpc_frequency)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        qpc_frequency = frequency.QuadPart;
+    }
+
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// Waits until the performance counter reaches 'deadline'. Sleep() is only good for a millisecond or so,
+// so we sleep while we are far away, and spin for the last bit.
+static void wait_until(LONGLONG deadline)
+{
+    LONGLONG remaining;
+
+    while((remaining = deadline - now_ticks()) > 0)
+    {
+        if(remaining > qpc_frequency / 500) // more than 2 ms away
+            Sleep(1);
+    }
+}
+
+// The first argument of the benchmarks that try a list of sizes: a vector of up to 'capacity' whole numbers, between 1
+// and 'maximum'. Empty or missing is the defaults. Returns the number of sizes in 'sizes', or 0 if the input is wrong.
+static ULONG bench_sizes(const mxArray *input, const double *defaults, ULONG no_of_defaults, ULONG capacity, double maximum, double *sizes)
+{
+    if(input == NULL || mxIsEmpty(input))
+    {
+        memcpy(sizes, defaults, no_of_defaults * sizeof(double));
+        return no_of_defaults;
+    }
+
+    ULONG no_of_sizes = (ULONG) mxGetNumberOfElements(input);
+    if(!mxIsDouble(input) || mxIsComplex(input) || no_of_sizes > capacity)
+        return 0;
+
+    for(ULONG i = 0; i < no_of_sizes; i++)
+    {
+        sizes[i] = ((mxDouble *) mxGetData(input))[i];
+        if(!(sizes[i] >= 1 && sizes[i] <= maximum) || sizes[i] != (ULONG) sizes[i])
+            return 0;
+    }
+    return no_of_sizes;
+}
+
+// Calls step(context) over and over, for at least 'seconds', and returns how long one call took, in microseconds.
+// The clock is only read every 100 calls, so it doesn't count much.
+static double bench_time(void (*step)(void *context), void *context, double seconds)
+{
+    ULONG no_of_calls = 0;
+    LONGLONG start = now_ticks(), end = start + (LONGLONG) (seconds * qpc_frequency);
+    LONGLONG stop;
+
+    do
+    {
+        for(int i = 0; i < 100; i++)
+            step(context);
+        no_of_calls += 100;
+    }
+    while((stop = now_ticks()) < end);
+
+    return (double) (stop - start) * 1e6 / qpc_frequency / no_of_calls;
+}
+
+
+
+/*
+    Simulated uDMX.
+
+    This is for when the dongle is not around. It does the same sanity checks as usbFunctionSetup()
+    in the firmware, keeps a copy of the universe, and takes roughly as long as the real thing would.
+    The latency model is a fixed cost for the setup stage, plus a cost for each 8-byte low-speed data packet.
+    Optionally, a transfer that runs over the boundary of a DMX frame takes a bit longer, as if the firmware
+    was busy with the break. This is what the frame sync in the refresh thread locks on to.
+    It can also pretend to be one of the clones that can't take a whole universe in one transfer.
+*/
+
+static struct
+{
+    BOOL enabled;
+    UCHAR universe[512];
+    double setup_latency_us;
+    double packet_latency_us;
+    double frame_period_us;
+    double boundary_stall_us;       // 0 means frame boundaries don't matter
+    USHORT buffer_size;             // longer transfers are stalled, like a clone with a small buffer would
+} simulator = {FALSE, {0}, 1000.0, 125.0, 22676.0, 0.0, 512};
+
+// When a transfer of 'length' bytes that gets on the bus at 'start' is done. 'with_setup' is FALSE when the setup
+// latency is hidden behind a transfer that is still in flight (see the pipelined transfers).
+static LONGLONG simulator_deadline(LONGLONG start, UINT length, BOOL with_setup)
+{
+    UINT no_of_packets = (length + 7) / 8;
+    LONGLONG deadline = start + (LONGLONG)(((with_setup ? simulator.setup_latency_us : 0) + no_of_packets * simulator.packet_latency_us) * qpc_frequency / 1e6);
+
+    if(simulator.boundary_stall_us > 0)
+    {
+        LONGLONG frame_period = (LONGLONG) (simulator.frame_period_us * qpc_frequency / 1e6);
+        if(start / frame_period != deadline / frame_period)
+            deadline += (LONGLONG) (simulator.boundary_stall_us * qpc_frequency / 1e6);
+    }
+
+    return deadline;
+}
+
+// Does what the firmware would do with the transfer, straight away. Returns FALSE where the firmware would stall.
+static BOOL simulator_apply(WINUSB_SETUP_PACKET Pkt, PUCHAR buffer, UINT length, PUINT transferred)
+{
+    *transferred = 0;
+
+    switch(Pkt.Request)
+    {
+        case cmd_SetSingleChannel:
+            if(Pkt.Index > 511 || Pkt.Value > 255)
+                return FALSE;
+            simulator.universe[Pkt.Index] = (UCHAR) Pkt.Value;
+            break;
+
+        case cmd_SetChannelRange:
+            if(Pkt.Index > 511 || Pkt.Value < 1 || Pkt.Value > 512 - Pkt.Index || length < Pkt.Value || length > simulator.buffer_size)
+                return FALSE;
+            memcpy(&simulator.universe[Pkt.Index], buffer, Pkt.Value);
+            *transferred = length;
+            break;
+
+        default:
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOL simulator_transfer(WINUSB_SETUP_PACKET Pkt, PUCHAR buffer, UINT length, PUINT transferred)
+{
+    LONGLONG deadline = simulator_deadline(now_ticks(), length, TRUE);
+
+    if(!simulator_apply(Pkt, buffer, length, transferred))
+        return FALSE;
+
+    wait_until(deadline);
+    return TRUE;
+}
+
+
+
+/*
+    Transfer capture.
+
+    When an experiment misbehaves, it's nice to know what was actually sent to the dongle.
+    Every transfer that goes through udmx_transfer() can be logged into a preallocated ring buffer,
+    and a background thread writes the ring to a binary file. The sending side only pays for
+    a timestamp and a memcpy, the encoding and the disk are never touched from there.
+
+    Logging the payloads as they are would produce gigabytes in a long session, but consecutive
+    transfers rarely change more than a few channels. So the writer thread keeps track of the universe,
+    and stores the universe after each transfer either as:
+    -a keyframe: all 512 channels, every CAPTURE_KEYFRAME_INTERVAL records, or
+    -a delta: the XOR against the previous universe, run-length encoded as (skip, count, count bytes) tokens.
+    The payload of every transfer can be reconstructed from the universe, so it's not stored separately.
+
+    File layout (little-endian, no padding):
+    -capture_file_header, once
+    -capture_file_record followed by 'encoded_length' bytes, for every transfer
+    -capture_index_entry for every keyframe, so we can seek without decoding everything before
+    -capture_file_trailer, once. If this is missing (i.e. Matlab crashed), the index is rebuilt by scanning.
+*/
+
+#define CAPTURE_MAGIC "uDMXcap2"
+#define CAPTURE_INDEX_MAGIC "uDMXidx2"
+#define CAPTURE_DEFAULT_SLOTS 4096 // Must be a power of 2.
+#define CAPTURE_KEYFRAME_INTERVAL 256
+
+#define CAPTURE_KEYFRAME 0
+#define CAPTURE_DELTA 1
+
+#pragma pack(push, 1)
+typedef struct
+{
+    char magic[8];
+    LONGLONG qpc_frequency;     // ticks per second of the timestamps below
+    ULONG keyframe_interval;
+} capture_file_header;
+
+typedef struct
+{
+    LONGLONG timestamp;         // when the transfer was issued, in QueryPerformanceCounter() ticks
+    LONGLONG duration;          // how long the transfer took, in ticks
+    UCHAR request;              // Pkt.Request
+    UCHAR success;              // what the transfer returned
+    USHORT value;               // Pkt.Value
+    USHORT index;               // Pkt.Index
+    USHORT length;              // Pkt.Length, the number of payload bytes in the transfer
+    UCHAR kind;                 // CAPTURE_KEYFRAME or CAPTURE_DELTA
+    USHORT encoded_length;      // number of bytes following this record
+} capture_file_record;
+
+typedef struct
+{
+    ULONGLONG record_number;
+    LONGLONG offset;            // where the keyframe's capture_file_record starts in the file
+} capture_index_entry;
+
+typedef struct
+{
+    ULONGLONG no_of_records;
+    ULONGLONG no_of_keyframes;
+    LONGLONG index_offset;
+    char magic[8];
+} capture_file_trailer;
+#pragma pack(pop)
+
+// This is what the firmware does to its buffer when it gets a transfer.
+static void capture_apply(UCHAR *universe, const capture_file_record *record, const UCHAR *payload)
+{
+    if(record->index > 511)
+        return;
+
+    if(record->request == cmd_SetSingleChannel)
+        universe[record->index] = (UCHAR) record->value;
+
+    if(record->request == cmd_SetChannelRange)
+        memcpy(&universe[record->index], payload, min(record->length, 512 - record->index));
+}
+
+// ...and this is how we get the payload back from the universe.
+static void capture_payload(const UCHAR *universe, const capture_file_record *record, UCHAR *payload)
+{
+    USHORT no_of_bytes = 0;
+
+    if(record->request == cmd_SetChannelRange && record->index < 512)
+        no_of_bytes = min(record->length, 512 - record->index);
+
+    memcpy(payload, &universe[record->index], no_of_bytes);
+    memset(&payload[no_of_bytes], 0, record->length - no_of_bytes);
+}
+
+/*
+    Encodes the difference between two universes as (skip, count, count XOR-ed bytes) tokens.
+    Trailing unchanged channels are not stored. If the delta would not be smaller than a keyframe,
+    this gives up and returns 512, so 'encoded' never needs more than 512 bytes.
+*/
+static ULONG delta_encode(const UCHAR *previous, const UCHAR *current, UCHAR *encoded)
+{
+    ULONG position = 0, encoded_length = 0;
+
+    while(position < 512)
+    {
+        ULONG skip = 0, count = 0;
+        ULONGLONG previous_word, current_word;
+
+        // Unchanged channels come in long runs, so check 8 at a time first.
+        while(position + skip + 8 <= 512 && skip + 8 <= 255)
+        {
+            memcpy(&previous_word, &previous[position + skip], 8);
+            memcpy(&current_word, &current[position + skip], 8);
+            if(previous_word != current_word)
+                break;
+            skip += 8;
+        }
+        while(position + skip < 512 && skip < 255 && previous[position + skip] == current[position + skip])
+            skip++;
+
+        position += skip;
+        if(position == 512)
+            break;
+
+        while(position + count < 512 && count < 255 && previous[position + count] != current[position + count])
+            count++;
+
+        if(encoded_length + 2 + count >= 512)
+            return 512;
+
+        encoded[encoded_length++] = (UCHAR) skip;
+        encoded[encoded_length++] = (UCHAR) count;
+        for(ULONG i = 0; i < count; i++)
+            encoded[encoded_length++] = previous[position + i] ^ current[position + i];
+
+        position += count;
+    }
+
+    return encoded_length;
+}
+
+// Applies a delta to the universe. Returns FALSE if the delta is corrupt.
+static BOOL delta_decode(UCHAR *universe, const UCHAR *encoded, ULONG encoded_length)
+{
+    ULONG position = 0, i = 0;
+
+    while(i + 2 <= encoded_length)
+    {
+        ULONG count = encoded[i + 1];
+
+        position += encoded[i];
+        i += 2;
+        if(position + count > 512 || i + count > encoded_length)
+            return FALSE;
+
+        for(ULONG j = 0; j < count; j++)
+            universe[position + j] ^= encoded[i + j];
+
+        position += count;
+        i += count;
+    }
+
+    return (i == encoded_length);
+}
+
+typedef struct
+{
+    UCHAR universe[512];        // the universe after the last encoded transfer
+    ULONG keyframe_interval;
+    ULONG records_since_keyframe;
+    ULONGLONG no_of_records;
+    LONGLONG offset;            // where the next record goes
+    capture_index_entry *index;
+    ULONGLONG no_of_keyframes;
+    ULONGLONG index_capacity;
+} capture_encoder;
+
+static void capture_encoder_init(capture_encoder *encoder, ULONG keyframe_interval, LONGLONG offset)
+{
+    memset(encoder, 0, sizeof(capture_encoder));
+    encoder->keyframe_interval = keyframe_interval;
+    encoder->offset = offset;
+}
+
+// Fills in record->kind and record->encoded_length, and the encoded bytes. 'encoded' must hold 512 bytes.
+static void capture_encode(capture_encoder *encoder, capture_file_record *record, const UCHAR *payload, UCHAR *encoded)
+{
+    UCHAR previous[512];
+    ULONG encoded_length = 512;
+
+    memcpy(previous, encoder->universe, 512);
+    capture_apply(encoder->universe, record, payload);
+
+    if(encoder->no_of_records && encoder->records_since_keyframe < encoder->keyframe_interval)
+        encoded_length = delta_encode(previous, encoder->universe, encoded);
+
+    if(encoded_length < 512)
+    {
+        record->kind = CAPTURE_DELTA;
+        encoder->records_since_keyframe++;
+    }
+    else
+    {
+        record->kind = CAPTURE_KEYFRAME;
+        memcpy(encoded, encoder->universe, 512);
+        encoder->records_since_keyframe = 1;
+
+        if(encoder->no_of_keyframes == encoder->index_capacity)
+        {
+            ULONGLONG new_capacity = encoder->index_capacity ? 2 * encoder->index_capacity : 1024;
+            capture_index_entry *new_index = realloc(encoder->index, new_capacity * sizeof(capture_index_entry));
+            if(new_index != NULL)
+            {
+                encoder->index = new_index;
+                encoder->index_capacity = new_capacity;
+            }
+        }
+        // If we ran out of memory, the reader will just start decoding from an earlier keyframe.
+        if(encoder->no_of_keyframes < encoder->index_capacity)
+        {
+            encoder->index[encoder->no_of_keyframes].record_number = encoder->no_of_records;
+            encoder->index[encoder->no_of_keyframes].offset = encoder->offset;
+            encoder->no_of_keyframes++;
+        }
+    }
+
+    record->encoded_length = (USHORT) encoded_length;
+    encoder->offset += sizeof(capture_file_record) + encoded_length;
+    encoder->no_of_records++;
+}
+
+typedef struct
+{
+    capture_file_record record; // kind and encoded_length are filled in by the writer thread
+    UCHAR payload[512];
+} capture_slot;
+
+static struct
+{
+    volatile LONG running;
+    capture_slot *slots;
+    ULONG no_of_slots;
+    volatile ULONG head;        // Only the sending side writes this.
+    volatile ULONG tail;        // Only the writer thread writes this.
+    volatile LONG dropped;      // Transfers that didn't fit in the ring.
+    volatile LONG in_flight;    // Senders between their check of 'running' and the end of their write into the ring.
+    BOOL write_failed;          // The file is incomplete: the disk was full, or gone. Only the writer thread sets this.
+    capture_encoder encoder;    // Only the writer thread touches this, until it's stopped.
+    FILE *file;
+    HANDLE thread;
+    HANDLE stop_event;
+} capture;
+
+// Called after every transfer (when capture.running, so it costs nothing otherwise). This must stay cheap: no
+// allocation, no system calls.
+// The transfers can come from another thread than the one that calls capture_stop(), so that can happen at any
+// time. We say that we are in here before we look at 'running' again, and capture_stop() waits until nobody is,
+// before it frees the ring. Both are interlocked (full barriers), so either we see that it stopped, or it sees us.
+static void capture_transfer(LONGLONG timestamp, LONGLONG duration, WINUSB_SETUP_PACKET Pkt, PUCHAR buffer, UINT length, BOOL success)
+{
+    ULONG head;
+    capture_slot *slot;
+
+    InterlockedIncrement(&capture.in_flight);
+    if(!capture.running)
+    {
+        InterlockedDecrement(&capture.in_flight);
+        return;
+    }
+
+    head = capture.head;
+    if(head - capture.tail >= capture.no_of_slots)
+    {
+        // The writer thread can't keep up. Don't block the sender.
+        InterlockedIncrement(&capture.dropped);
+        InterlockedDecrement(&capture.in_flight);
+        return;
+    }
+
+    if(length > 512)
+        length = 512;
+
+    slot = &capture.slots[head & (capture.no_of_slots - 1)];
+    slot->record.timestamp = timestamp;
+    slot->record.duration = duration;
+    slot->record.request = Pkt.Request;
+    slot->record.success = (UCHAR) (success != FALSE);
+    slot->record.value = Pkt.Value;
+    slot->record.index = Pkt.Index;
+    slot->record.length = (USHORT) length;
+    if(length)
+        memcpy(slot->payload, buffer, length);
+
+    // Make sure the slot is complete before the writer thread can see it.
+    MemoryBarrier();
+    capture.head = head + 1;
+    InterlockedDecrement(&capture.in_flight);
+}
+
+static DWORD WINAPI capture_writer_thread(LPVOID context)
+{
+    BOOL stopping = FALSE;
+    UCHAR encoded[512];
+
+    while(!stopping)
+    {
+        stopping = (WaitForSingleObject(capture.stop_event, 10) == WAIT_OBJECT_0);
+
+        // Empty the ring. When stopping, this also gets whatever arrived before the stop.
+        // After a failed write, the rest of the file would be garbage: the ring is still emptied, but not written.
+        while(capture.tail != capture.head)
+        {
+            capture_slot *slot = &capture.slots[capture.tail & (capture.no_of_slots - 1)];
+
+            if(!capture.write_failed)
+            {
+                capture_encode(&capture.encoder, &slot->record, slot->payload, encoded);
+                if(fwrite(&slot->record, sizeof(capture_file_record), 1, capture.file) != 1
+                    || fwrite(encoded, 1, slot->record.encoded_length, capture.file) != slot->record.encoded_length)
+                    capture.write_failed = TRUE;
+            }
+
+            MemoryBarrier();
+            capture.tail++;
+        }
+        if(fflush(capture.file))
+            capture.write_failed = TRUE;
+    }
+
+    return 0;
+}
+
+// Returns NULL if the capture has started, otherwise an error message.
+static const char *capture_start(const char *filename, ULONG no_of_slots)
+{
+    capture_file_header header;
+
+    if(capture.running)
+        return "dmx.mex::Capture is already running. Call dmx('capture_stop') first.\n";
+
+    capture.file = fopen(filename, "wb");
+    if(capture.file == NULL)
+        return "dmx.mex::Could not open the capture file for writing.\n";
+
+    capture.slots = (capture_slot*) malloc(no_of_slots * sizeof(capture_slot));
+    if(capture.slots == NULL)
+    {
+        fclose(capture.file);
+        return "dmx.mex::Could not allocate the capture ring.\n";
+    }
+
+    now_ticks(); // Makes sure qpc_frequency is set.
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.qpc_frequency = qpc_frequency;
+    header.keyframe_interval = CAPTURE_KEYFRAME_INTERVAL;
+
+    capture_encoder_init(&capture.encoder, CAPTURE_KEYFRAME_INTERVAL, sizeof(header));
+    capture.no_of_slots = no_of_slots;
+    capture.head = 0;
+    capture.tail = 0;
+    capture.dropped = 0;
+    capture.write_failed = FALSE;
+    capture.stop_event = NULL;
+    capture.thread = NULL;
+
+    // The thread waits for the event, so that comes first.
+    const char *error_message = NULL;
+    if(fwrite(&header, sizeof(header), 1, capture.file) != 1)
+        error_message = "dmx.mex::Could not write the capture file.\n";
+    else if((capture.stop_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL
+        || (capture.thread = CreateThread(NULL, 0, capture_writer_thread, NULL, 0, NULL)) == NULL)
+        error_message = "dmx.mex::Could not start the capture writer thread.\n";
+
+    if(error_message != NULL)
+    {
+        if(capture.stop_event != NULL)
+            CloseHandle(capture.stop_event);
+        capture.stop_event = NULL;
+        free(capture.encoder.index);
+        capture.encoder.index = NULL;
+        free(capture.slots);
+        capture.slots = NULL;
+        fclose(capture.file);
+        return error_message;
+    }
+
+    capture.running = TRUE;
+
+    // The ring and the thread must outlive this call, so don't let Matlab unload us.
+    mexLock();
+    return NULL;
+}
+
+// Stops the capture, writes the keyframe index, and puts the number of dropped transfers in *dropped. Returns NULL if
+// everything made it to the file, otherwise an error message. Either way, the capture is stopped.
+static const char *capture_stop(LONG *dropped)
+{
+    capture_file_trailer trailer;
+
+    *dropped = 0;
+    if(!capture.running)
+        return NULL;
+
+    // Nobody gets past the check from now on. Whoever already did finishes their record, and the writer thread
+    // still gets it.
+    InterlockedExchange(&capture.running, FALSE);
+    while(capture.in_flight != 0)
+        YieldProcessor();
+    SetEvent(capture.stop_event);
+    WaitForSingleObject(capture.thread, INFINITE);
+    CloseHandle(capture.thread);
+    CloseHandle(capture.stop_event);
+
+    // Without all the records, there is no point in an index: the reader scans what is there.
+    BOOL write_failed = capture.write_failed;
+    if(!write_failed)
+    {
+        trailer.no_of_records = capture.encoder.no_of_records;
+        trailer.no_of_keyframes = capture.encoder.no_of_keyframes;
+        trailer.index_offset = capture.encoder.offset;
+        memcpy(trailer.magic, CAPTURE_INDEX_MAGIC, sizeof(trailer.magic));
+        write_failed = fwrite(capture.encoder.index, sizeof(capture_index_entry), (size_t) capture.encoder.no_of_keyframes, capture.file) != capture.encoder.no_of_keyframes
+            || fwrite(&trailer, sizeof(trailer), 1, capture.file) != 1;
+    }
+    if(fclose(capture.file))
+        write_failed = TRUE;
+
+    free(capture.encoder.index);
+    capture.encoder.index = NULL;
+    free(capture.slots);
+    capture.slots = NULL;
+
+    mexUnlock();
+    *dropped = capture.dropped;
+    return write_failed ? "dmx.mex::Writing the capture file failed (is the disk full?), so it's incomplete.\n" : NULL;
+}
+
+/*
+    Reading captures back.
+    capture_reader_next() returns the transfers in order, capture_reader_seek() jumps anywhere using the keyframe index.
+*/
+
+typedef struct
+{
+    FILE *file;
+    capture_file_header header;
+    capture_index_entry *index;
+    ULONGLONG no_of_keyframes;
+    ULONGLONG no_of_records;
+    LONGLONG records_end;       // where the records stop and the index starts
+    LONGLONG position;
+    ULONGLONG next_record;      // the record number capture_reader_next() returns next
+    UCHAR universe[512];
+} capture_reader;
+
+static void capture_reader_close(capture_reader *reader)
+{
+    if(reader->file != NULL)
+        fclose(reader->file);
+    free(reader->index);
+    memset(reader, 0, sizeof(capture_reader));
+}
+
+// TRUE if every keyframe in the index is a record in between the header and the index, in order.
+static BOOL capture_index_valid(const capture_reader *reader, const capture_file_trailer *trailer)
+{
+    LONGLONG previous_offset = 0;
+
+    if(trailer->no_of_keyframes > trailer->no_of_records)
+        return FALSE;
+
+    for(ULONGLONG keyframe = 0; keyframe < trailer->no_of_keyframes; keyframe++)
+    {
+        const capture_index_entry *entry = &reader->index[keyframe];
+
+        if(entry->offset < (LONGLONG) sizeof(capture_file_header) || entry->offset <= previous_offset
+            || entry->offset > trailer->index_offset - (LONGLONG) sizeof(capture_file_record)
+            || entry->record_number >= trailer->no_of_records
+            || (keyframe > 0 && entry->record_number <= reader->index[keyframe - 1].record_number))
+            return FALSE;
+        previous_offset = entry->offset;
+    }
+
+    return TRUE;
+}
+
+// Returns NULL if the file is open, otherwise an error message.
+static const char *capture_reader_open(capture_reader *reader, const char *filename)
+{
+    capture_file_trailer trailer;
+    capture_file_record record;
+
+    memset(reader, 0, sizeof(capture_reader));
+    reader->file = fopen(filename, "rb");
+    if(reader->file == NULL)
+        return "dmx.mex::Could not open the capture file.\n";
+
+    if(fread(&reader->header, sizeof(capture_file_header), 1, reader->file) != 1 || memcmp(reader->header.magic, CAPTURE_MAGIC, sizeof(reader->header.magic)))
+    {
+        capture_reader_close(reader);
+        return "dmx.mex::This is not a capture file.\n";
+    }
+
+    // Do we have an index? It must fill the space between the records and the trailer exactly, which we check before
+    // allocating anything for it: the file may have been cut, or written by someone else.
+    LONGLONG index_end = 0;
+    BOOL has_trailer = !_fseeki64(reader->file, -(LONGLONG) sizeof(trailer), SEEK_END)
+        && (index_end = _ftelli64(reader->file)) > 0
+        && fread(&trailer, sizeof(trailer), 1, reader->file) == 1
+        && !memcmp(trailer.magic, CAPTURE_INDEX_MAGIC, sizeof(trailer.magic));
+    if(has_trailer
+        && trailer.index_offset >= (LONGLONG) sizeof(capture_file_header) && trailer.index_offset <= index_end
+        && (ULONGLONG) (index_end - trailer.index_offset) % sizeof(capture_index_entry) == 0
+        && (ULONGLONG) (index_end - trailer.index_offset) / sizeof(capture_index_entry) == trailer.no_of_keyframes)
+    {
+        reader->index = malloc((size_t) trailer.no_of_keyframes * sizeof(capture_index_entry) + 1);
+        if(reader->index == NULL)
+        {
+            capture_reader_close(reader);
+            return "dmx.mex::Could not allocate the keyframe index.\n";
+        }
+        if(!_fseeki64(reader->file, trailer.index_offset, SEEK_SET)
+            && fread(reader->index, sizeof(capture_index_entry), (size_t) trailer.no_of_keyframes, reader->file) == trailer.no_of_keyframes
+            && capture_index_valid(reader, &trailer))
+        {
+            reader->no_of_keyframes = trailer.no_of_keyframes;
+            reader->no_of_records = trailer.no_of_records;
+            reader->records_end = trailer.index_offset;
+        }
+    }
+
+    // No index (the capture was not stopped properly), or one we can't trust. Scan through the file to build one.
+    // With a trailer, the records can't go past the index, and stop where the trailer says if we get there.
+    if(reader->records_end == 0)
+    {
+        ULONGLONG index_capacity = 0;
+        LONGLONG offset = sizeof(capture_file_header);
+        LONGLONG scan_end = index_end;
+
+        if(!has_trailer && (_fseeki64(reader->file, 0, SEEK_END) || (scan_end = _ftelli64(reader->file)) < 0))
+            scan_end = 0;
+
+        _fseeki64(reader->file, offset, SEEK_SET);
+        while(!(has_trailer && offset == trailer.index_offset)
+            && fread(&record, sizeof(record), 1, reader->file) == 1 && record.encoded_length <= 512
+            && (record.kind == CAPTURE_DELTA || (record.kind == CAPTURE_KEYFRAME && record.encoded_length == 512)))
+        {
+            // Don't include the last record if it's truncated. (Seeking past the end works, so ask the size.)
+            if(offset + (LONGLONG) sizeof(record) + record.encoded_length > scan_end
+                || _fseeki64(reader->file, offset + sizeof(record) + record.encoded_length, SEEK_SET))
+                break;
+
+            if(record.kind == CAPTURE_KEYFRAME)
+            {
+                if(reader->no_of_keyframes == index_capacity)
+                {
+                    index_capacity = index_capacity ? 2 * index_capacity : 1024;
+                    capture_index_entry *new_index = realloc(reader->index, (size_t) index_capacity * sizeof(capture_index_entry));
+                    if(new_index == NULL)
+                    {
+                        capture_reader_close(reader);
+                        return "dmx.mex::Could not allocate the keyframe index.\n";
+                    }
+                    reader->index = new_index;
+                }
+                reader->index[reader->no_of_keyframes].record_number = reader->no_of_records;
+                reader->index[reader->no_of_keyframes].offset = offset;
+                reader->no_of_keyframes++;
+            }
+
+            offset += sizeof(record) + record.encoded_length;
+            reader->no_of_records++;
+        }
+        reader->records_end = offset;
+    }
+
+    reader->position = sizeof(capture_file_header);
+    reader->next_record = 0;
+    _fseeki64(reader->file, reader->position, SEEK_SET);
+    return NULL;
+}
+
+// Reads the next transfer, and reconstructs its payload. 'payload' must hold 512 bytes.
+static BOOL capture_reader_next(capture_reader *reader, capture_file_record *record, UCHAR *payload)
+{
+    UCHAR encoded[512];
+
+    if(reader->position + (LONGLONG) sizeof(capture_file_record) > reader->records_end)
+        return FALSE;
+
+    if(fread(record, sizeof(capture_file_record), 1, reader->file) != 1
+        || record->encoded_length > 512 || record->length > 512
+        || fread(encoded, 1, record->encoded_length, reader->file) != record->encoded_length)
+        return FALSE;
+
+    if(record->kind == CAPTURE_KEYFRAME)
+    {
+        if(record->encoded_length != 512)
+            return FALSE;
+        memcpy(reader->universe, encoded, 512);
+    }
+    else if(!delta_decode(reader->universe, encoded, record->encoded_length))
+        return FALSE;
+
+    capture_payload(reader->universe, record, payload);
+
+    reader->position += sizeof(capture_file_record) + record->encoded_length;
+    reader->next_record++;
+    return TRUE;
+}
+
+// Positions the reader so that the next capture_reader_next() returns 'record_number'.
+static BOOL capture_reader_seek(capture_reader *reader, ULONGLONG record_number)
+{
+    capture_file_record record;
+    UCHAR payload[512];
+    ULONGLONG low = 0, high = reader->no_of_keyframes;
+
+    if(record_number >= reader->no_of_records || !reader->no_of_keyframes)
+        return FALSE;
+
+    // Find the last keyframe at or before the record we want.
+    while(high - low > 1)
+    {
+        ULONGLONG middle = (low + high) / 2;
+        if(reader->index[middle].record_number <= record_number)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    // If we are already between that keyframe and the record we want, just keep on decoding.
+    if(reader->next_record > record_number || reader->next_record < reader->index[low].record_number)
+    {
+        reader->position = reader->index[low].offset;
+        reader->next_record = reader->index[low].record_number;
+        _fseeki64(reader->file, reader->position, SEEK_SET);
+    }
+
+    while(reader->next_record < record_number)
+    {
+        if(!capture_reader_next(reader, &record, payload))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+/*
+    Transfer tuning.
+
+    The uDMX takes a whole universe in one control transfer, but the clones vary: some have smaller buffers in the
+    firmware, and some take longer to get back to us. dmx('probe') measures how long transfers of different sizes take,
+    works out which size gets a universe out the quickest, and how long the gap between two transfers has to be.
+    The result is kept for each device (by its InstanceID, for as long as the mex file is loaded), and
+    udmx_send_range() splits the ranges that are longer than that. Devices that were not probed get everything
+    in one transfer, like before.
+*/
+
+#define TUNING_MAX_DEVICES 8
+#define TUNING_NO_OF_SIZES 8
+#define TUNING_REPEATS 16
+#define TUNING_SIMULATOR_ID "simulator"
+#define TUNING_MAX_INSTANCE_ID 256
+
+static const USHORT tuning_sizes[TUNING_NO_OF_SIZES] = {1, 8, 16, 32, 64, 128, 256, 512};
+
+typedef struct
+{
+    char instance_id[TUNING_MAX_INSTANCE_ID];
+    USHORT max_chunk;                           // channels in one transfer
+    double spacing_us;                          // the gap between the transfers of a split range
+    double latency_us[TUNING_NO_OF_SIZES];      // median round trip for each size, 0 if the size didn't work
+    double single_latency_us;                   // the same for cmd_SetSingleChannel, 0 if the device didn't take it
+} transfer_tuning;
+
+static struct
+{
+    transfer_tuning devices[TUNING_MAX_DEVICES];
+    ULONG no_of_devices;
+    ULONG next_slot;                            // when it's full, the oldest one goes
+    char open_instance_id[TUNING_MAX_INSTANCE_ID]; // the device udmx_open() opened last
+    const transfer_tuning *open_device;         // ...and how it was tuned, NULL if it wasn't probed
+} tuning;
+
+// Returns NULL if this device was not probed.
+static transfer_tuning *tuning_find(const char *instance_id)
+{
+    for(ULONG i = 0; i < tuning.no_of_devices; i++)
+    {
+        if(!strcmp(tuning.devices[i].instance_id, instance_id))
+            return &tuning.devices[i];
+    }
+
+    return NULL;
+}
+
+/*
+    Output daemon.
+
+    udmxd (see udmxd.c) is a small program that keeps the device open, merges what its clients put in their layers
+    of the shared memory (see udmx_shm.h), and sends the result. With dmx('daemon', true), we claim a layer, and the
+    transfers go there instead of the device: a transfer becomes a copy of a few bytes and a SetEvent(), and we
+    don't go through the USB devices on every call. The daemon sends the channels that changed as soon as it sees
+    the doorbell. Several Matlab instances (and other programs) can be connected at the same time, and if Matlab
+    crashes, the lights stay on.
+    The simulator still takes precedence, so you can test with it while connected.
+*/
+
+static struct
+{
+    HANDLE mapping;
+    udmx_shm *shm;                  // NULL when we're not connected
+    HANDLE doorbell;
+    DWORD daemon_pid;               // the one we connected to
+    int layer;                      // the one we write, -1 if we don't have one
+} daemon = {NULL, NULL, NULL, 0, -1};
+
+static void daemon_disconnect(void)
+{
+    if(daemon.shm != NULL && daemon.layer >= 0)
+    {
+        udmx_shm_release(daemon.shm, daemon.layer);
+        SetEvent(daemon.doorbell); // So the daemon takes our channels over straight away.
+    }
+    if(daemon.shm != NULL)
+        UnmapViewOfFile(daemon.shm);
+    if(daemon.mapping != NULL)
+        CloseHandle(daemon.mapping);
+    if(daemon.doorbell != NULL)
+        CloseHandle(daemon.doorbell);
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.layer = -1;
+}
+
+// Returns NULL if we're connected to a running daemon, and have a layer, otherwise an error message.
+// Our layer drops out of the merge if we don't write anything for 'timeout_ms' (0 if it shouldn't).
+static const char *daemon_connect(LONG timeout_ms)
+{
+    daemon_disconnect();
+
+    daemon.mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, UDMX_SHM_NAME);
+    if(daemon.mapping == NULL)
+        return "dmx.mex::The daemon is not running. Start udmxd first.\n";
+
+    daemon.shm = (udmx_shm *) MapViewOfFile(daemon.mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(udmx_shm));
+    if(daemon.shm == NULL)
+    {
+        daemon_disconnect();
+        return "dmx.mex::Could not map the shared universe.\n";
+    }
+
+    if(daemon.shm->magic != UDMX_SHM_MAGIC || daemon.shm->version != UDMX_SHM_VERSION)
+    {
+        daemon_disconnect();
+        return "dmx.mex::The daemon is a different version. Compile udmxd and dmx.mex from the same source.\n";
+    }
+
+    // The mapping stays there while any client has it open, even if the daemon is long gone.
+    daemon.daemon_pid = daemon.shm->daemon_pid;
+    if(daemon.daemon_pid == 0 || !udmx_shm_process_alive(daemon.daemon_pid))
+    {
+        daemon_disconnect();
+        return "dmx.mex::The daemon is not running. Start udmxd first.\n";
+    }
+
+    daemon.doorbell = OpenEventA(EVENT_MODIFY_STATE, FALSE, UDMX_SHM_DOORBELL_NAME);
+    if(daemon.doorbell == NULL)
+    {
+        daemon_disconnect();
+        return "dmx.mex::Could not open the daemon's doorbell.\n";
+    }
+
+    daemon.layer = udmx_shm_claim(daemon.shm, timeout_ms);
+    if(daemon.layer < 0)
+    {
+        daemon_disconnect();
+        return "dmx.mex::The daemon has no more room for sources.\n";
+    }
+
+    return NULL;
+}
+
+// Instead of UsbK_ControlTransfer(), when we're connected to the daemon.
+static BOOL daemon_transfer(WINUSB_SETUP_PACKET Pkt, PUCHAR buffer, UINT length, PUINT transferred)
+{
+    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+
+    // A daemon that exited properly says so. One that crashed doesn't, but then the user will see the lights.
+    if(daemon.shm->daemon_pid != daemon.daemon_pid)
+    {
+        SetLastError(ERROR_DEVICE_NOT_CONNECTED);
+        return FALSE;
+    }
+
+    if(defPkt->Request == cmd_SetSingleChannel && defPkt->Index < 512)
+    {
+        UCHAR value = (UCHAR) defPkt->Value;
+        udmx_shm_write(daemon.shm, daemon.layer, defPkt->Index, 1, &value);
+    }
+    else if(defPkt->Request == cmd_SetChannelRange && defPkt->Index < 512 && defPkt->Value <= length && defPkt->Index + defPkt->Value <= 512)
+        udmx_shm_write(daemon.shm, daemon.layer, defPkt->Index, defPkt->Value, buffer);
+    else
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    SetEvent(daemon.doorbell);
+    *transferred = length;
+    return TRUE;
+}
+
+/*
+    Network outputs.
+
+    Some rooms have Art-Net nodes or sACN (E1.31) receivers instead of (or as well as) the uDMX. With dmx('artnet', ...)
+    or dmx('sacn', ...), every transfer also goes out over the network, so the nodes show the same as the uDMX, from
+    the same shadow universe. The packets always carry the whole universe, so we keep a copy of it here: a transfer
+    changes the copy, and then the whole copy goes out. udmx_send_range() holds the packets back until the whole range
+    is in the copy, so a range that the device takes in several chunks is still one packet for each destination.
+    There is no sendmmsg() on Windows, so the packets for all the destinations go out from one WSASendTo() loop instead.
+    The headers are made when the destinations are set, and each packet is gathered from its header and the copy of
+    the universe, so only the sequence number changes, and nothing is copied or allocated for a packet.
+*/
+
+#define NET_SEND_BUFFER (1 << 20) // So that a batch to many destinations doesn't get dropped before it's on the wire.
+#define NET_MAX_HEADER_LENGTH 126
+
+#define ARTNET_PORT 6454
+#define ARTNET_MAX_NODES 32
+#define ARTNET_HEADER_LENGTH 18
+#define ARTNET_BENCH_PACKETS 100000
+
+#define SACN_PORT 5568
+#define SACN_MAX_UNIVERSES 256
+#define SACN_HEADER_LENGTH 126       // the root, framing and DMP layers, and the start code
+#define SACN_DEFAULT_PRIORITY 100
+#define SACN_BENCH_RATE 44.0
+#define SACN_BENCH_COUNTS 5
+
+static const ULONG sacn_bench_counts[SACN_BENCH_COUNTS] = {1, 4, 16, 64, 256};
+
+typedef struct
+{
+    struct sockaddr_in address;
+    USHORT universe;                            // Art-Net: the 15-bit port-address, sACN: 1-63999
+    UCHAR sequence;                             // the last one sent to this universe
+    UCHAR header[NET_MAX_HEADER_LENGTH];
+} net_destination;
+
+// One of these for each protocol.
+typedef struct
+{
+    ULONG header_length;
+    ULONG sequence_offset;                      // where the sequence number is in the header
+    UCHAR lowest_sequence;                      // Art-Net takes 0 as 'no sequence', so it goes 1...255
+    BOOL enabled;
+    net_destination destinations[SACN_MAX_UNIVERSES];
+    ULONG no_of_destinations;
+    double packets_sent;
+    double send_errors;
+} net_protocol;
+
+static struct
+{
+    SOCKET socket;
+    BOOL only;                                  // TRUE if there is no uDMX, only the network
+    UCHAR universe[512];
+    LONG held;                                  // udmx_send_range() is collecting a range, don't send yet
+    UCHAR sacn_cid[16];                         // who we are to the sACN receivers
+} net = {INVALID_SOCKET};
+
+static net_protocol artnet = {ARTNET_HEADER_LENGTH, 12, 1};
+static net_protocol sacn = {SACN_HEADER_LENGTH, 111, 0};
+
+static BOOL net_enabled(void)
+{
+    return artnet.enabled || sacn.enabled;
+}
+
+static void artnet_header(net_destination *destination)
+{
+    UCHAR *header = destination->header;
+
+    memcpy(header, "Art-Net", 8);               // with the '\0'
+    header[8] = 0x00;                           // OpDmx (0x5000), low byte first
+    header[9] = 0x50;
+    header[10] = 0;                             // protocol version 14, high byte first
+    header[11] = 14;
+    header[12] = 0;                             // sequence, filled in when it's sent
+    header[13] = 0;                             // physical port
+    header[14] = destination->universe & 0xFF;  // SubUni
+    header[15] = (destination->universe >> 8) & 0x7F; // Net
+    header[16] = 512 >> 8;                      // length, high byte first
+    header[17] = 512 & 0xFF;
+}
+
+// Everything in sACN is high byte first.
+static void sacn_put16(UCHAR *where, USHORT value)
+{
+    where[0] = value >> 8;
+    where[1] = value & 0xFF;
+}
+
+static void sacn_header(net_destination *destination, UCHAR priority)
+{
+    static const UCHAR acn_packet_identifier[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+    UCHAR *header = destination->header;
+
+    memset(header, 0, SACN_HEADER_LENGTH);
+
+    // Root layer
+    sacn_put16(&header[0], 0x0010);             // preamble size
+    memcpy(&header[4], acn_packet_identifier, sizeof(acn_packet_identifier));
+    sacn_put16(&header[16], 0x7000 | (SACN_HEADER_LENGTH + 512 - 16)); // flags and length, to the end of the packet
+    header[21] = 0x04;                          // VECTOR_ROOT_E131_DATA
+    memcpy(&header[22], net.sacn_cid, sizeof(net.sacn_cid));
+
+    // Framing layer
+    sacn_put16(&header[38], 0x7000 | (SACN_HEADER_LENGTH + 512 - 38));
+    header[43] = 0x02;                          // VECTOR_E131_DATA_PACKET
+    strncpy((char *) &header[44], "dmx.mex", 63); // source name, 64 bytes with the '\0'
+    header[108] = priority;
+    header[111] = 0;                            // sequence, filled in when it's sent
+    sacn_put16(&header[113], destination->universe);
+
+    // DMP layer
+    sacn_put16(&header[115], 0x7000 | (SACN_HEADER_LENGTH + 512 - 115));
+    header[117] = 0x02;                         // VECTOR_DMP_SET_PROPERTY
+    header[118] = 0xA1;                         // address and data type
+    sacn_put16(&header[119], 0x0000);           // first property address
+    sacn_put16(&header[121], 0x0001);           // address increment
+    sacn_put16(&header[123], 513);              // the start code and the 512 channels
+    header[125] = 0x00;                         // start code
+}
+
+// Every sACN universe has a multicast address of its own: 239.255, and then the universe, high byte first.
+static void sacn_multicast_address(net_destination *destination)
+{
+    memset(&destination->address, 0, sizeof(destination->address));
+    destination->address.sin_family = AF_INET;
+    destination->address.sin_port = htons(SACN_PORT);
+    destination->address.sin_addr.s_addr = htonl(0xEFFF0000 | destination->universe);
+}
+
+// The CID is a UUID that stays the same for as long as the mex file is loaded. It doesn't have to be
+// unguessable, just different from everyone else's, so the clock and the process ID will do.
+static void sacn_make_cid(void)
+{
+    ULONGLONG state = (ULONGLONG) now_ticks() ^ ((ULONGLONG) GetCurrentProcessId() << 32) ^ GetTickCount64();
+
+    for(int i = 0; i < 16; i += 8)
+    {
+        // splitmix64
+        ULONGLONG z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        memcpy(&net.sacn_cid[i], &z, 8);
+    }
+    net.sacn_cid[6] = (net.sacn_cid[6] & 0x0F) | 0x40; // version 4
+    net.sacn_cid[8] = (net.sacn_cid[8] & 0x3F) | 0x80; // variant 1
+}
+
+// Sends the copy of the universe to every destination of a protocol. Returns FALSE if any of them failed.
+static BOOL net_protocol_send(net_protocol *protocol)
+{
+    BOOL success = TRUE;
+    DWORD sent = 0;
+
+    if(!protocol->enabled)
+        return TRUE;
+
+    for(ULONG i = 0; i < protocol->no_of_destinations; i++)
+    {
+        net_destination *destination = &protocol->destinations[i];
+        WSABUF buffers[2] = {{protocol->header_length, (char *) destination->header}, {512, (char *) net.universe}};
+
+        destination->sequence = (destination->sequence == 255) ? protocol->lowest_sequence : destination->sequence + 1;
+        destination->header[protocol->sequence_offset] = destination->sequence;
+        if(WSASendTo(net.socket, buffers, 2, &sent, 0, (const struct sockaddr *) &destination->address, sizeof(destination->address), NULL, NULL) == SOCKET_ERROR)
+        {
+            protocol->send_errors++;
+            success = FALSE;
+        }
+        else
+            protocol->packets_sent++;
+    }
+
+    if(!success)
+        SetLastError(WSAGetLastError());
+
+    return success;
+}
+
+static BOOL net_send(void)
+{
+    BOOL artnet_success = net_protocol_send(&artnet);
+    BOOL sacn_success = net_protocol_send(&sacn);
+    return artnet_success && sacn_success;
+}
+
+// Puts what a transfer would change into the copy of the universe. The setup packet is checked like the firmware would.
+static void net_apply(WINUSB_SETUP_PACKET Pkt, PUCHAR buffer, UINT length)
+{
+    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+
+    if(defPkt->Request == cmd_SetSingleChannel && defPkt->Index < 512)
+        net.universe[defPkt->Index] = (UCHAR) defPkt->Value;
+    else if(defPkt->Request == cmd_SetChannelRange && defPkt->Index < 512 && defPkt->Value <= length && defPkt->Index + defPkt->Value <= 512)
+        memcpy(&net.universe[defPkt->Index], buffer, defPkt->Value);
+}
+
+// Closes the socket if neither of the protocols needs it.
+static void net_close_unused(void)
+{
+    if(net_enabled())
+        return;
+
+    if(net.socket != INVALID_SOCKET)
+    {
+        closesocket(net.socket);
+        WSACleanup();
+    }
+    net.socket = INVALID_SOCKET;
+    net.only = FALSE;
+}
+
+// Switches a protocol off.
+static void net_protocol_close(net_protocol *protocol)
+{
+    protocol->enabled = FALSE;
+    protocol->no_of_destinations = 0;
+    net_close_unused();
+}
+
+// Opens a UDP socket for sending. Returns NULL if it worked, otherwise an error message.
+static const char *net_open(void)
+{
+    WSADATA wsa_data;
+    BOOL broadcast = TRUE;
+    int send_buffer = NET_SEND_BUFFER;
+
+    if(net.socket != INVALID_SOCKET)
+        return NULL;
+
+    if(WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+        return "dmx.mex::Could not start Winsock.\n";
+
+    net.socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(net.socket == INVALID_SOCKET)
+    {
+        WSACleanup();
+        return "dmx.mex::Could not open a UDP socket.\n";
+    }
+
+    // The Art-Net nodes can be broadcast addresses too, like 2.255.255.255.
+    setsockopt(net.socket, SOL_SOCKET, SO_BROADCAST, (const char *) &broadcast, sizeof(broadcast));
+    setsockopt(net.socket, SOL_SOCKET, SO_SNDBUF, (const char *) &send_buffer, sizeof(send_buffer));
+
+    if(net.sacn_cid[6] == 0)
+        sacn_make_cid();
+
+    return NULL;
+}
+
+// Reads IPv4 addresses from a string or a cell array of strings into 'destinations'. With 'port'.
+static const char *net_addresses(const mxArray *addresses_input, ULONG no_of_addresses, USHORT port, net_destination *destinations)
+{
+    char address[64];
+
+    if(!mxIsCell(addresses_input) && !mxIsChar(addresses_input))
+        return "dmx.mex::The addresses must be an IP address, or a cell array of them.\n";
+
+    if((mxIsCell(addresses_input) ? mxGetNumberOfElements(addresses_input) : 1) != no_of_addresses)
+        return "dmx.mex::There must be an address for each universe.\n";
+
+    for(ULONG i = 0; i < no_of_addresses; i++)
+    {
+        const mxArray *address_input = mxIsCell(addresses_input) ? mxGetCell(addresses_input, i) : addresses_input;
+        if(address_input == NULL || !mxIsChar(address_input) || mxGetString(address_input, address, sizeof(address)))
+            return "dmx.mex::The addresses must be an IP address, or a cell array of them.\n";
+
+        memset(&destinations[i].address, 0, sizeof(destinations[i].address));
+        destinations[i].address.sin_family = AF_INET;
+        destinations[i].address.sin_port = htons(port);
+        if(inet_pton(AF_INET, address, &destinations[i].address.sin_addr) != 1)
+            return "dmx.mex::The addresses must be IPv4 addresses, like '2.0.0.10'.\n";
+    }
+
+    return NULL;
+}
+
+// Reads the universe numbers (between 'lowest' and 'highest') into 'destinations'. Returns NULL if they are all
+// right, otherwise an error message.
+static const char *net_universes(const mxArray *universes_input, ULONG no_of_universes, USHORT lowest, USHORT highest, net_destination *destinations)
+{
+    if(!mxIsDouble(universes_input) || mxGetNumberOfElements(universes_input) != no_of_universes)
+        return "dmx.mex::There must be a universe for each address.\n";
+
+    for(ULONG i = 0; i < no_of_universes; i++)
+    {
+        double universe = ((mxDouble *) mxGetData(universes_input))[i];
+        if(!(universe >= lowest && universe <= highest) || universe != (USHORT) universe)
+            return (lowest == 0) ? "dmx.mex::The Art-Net universes must be whole numbers between 0 and 32767.\n" : "dmx.mex::The sACN universes must be whole numbers between 1 and 63999.\n";
+
+        destinations[i].universe = (USHORT) universe;
+    }
+
+    return NULL;
+}
+
+// Reads 'both' or 'only' (if it's there). Returns NULL if it's one of them, otherwise an error message.
+static const char *net_mode(const mxArray *mode_input, BOOL *only)
+{
+    char mode[8];
+
+    *only = FALSE;
+    if(mode_input == NULL)
+        return NULL;
+
+    if(!mxIsChar(mode_input) || mxGetString(mode_input, mode, sizeof(mode)) || (strcmp(mode, "both") && strcmp(mode, "only")))
+        return "dmx.mex::The mode is either 'both' or 'only'.\n";
+
+    *only = !strcmp(mode, "only");
+    return NULL;
+}
+
+// Makes the destinations the ones a protocol sends to. The caller marks the universe dirty, so it all goes out.
+static void net_protocol_start(net_protocol *protocol, const net_destination *destinations, ULONG no_of_destinations, BOOL only)
+{
+    memcpy(protocol->destinations, destinations, no_of_destinations * sizeof(net_destination));
+    protocol->no_of_destinations = no_of_destinations;
+    protocol->packets_sent = protocol->send_errors = 0;
+    protocol->enabled = TRUE;
+    net.only = only;
+}
+
+// dmx('artnet_bench') and dmx('sacn_bench') send to this, on the same computer.
+typedef struct
+{
+    SOCKET socket;
+    struct sockaddr_in address;
+    HANDLE thread;
+    volatile LONG stop;
+    double packets_received;
+} net_receiver;
+
+// Counts the Art-Net and sACN packets that arrive, until it's told to stop, and nothing came for a while.
+static DWORD WINAPI net_receiver_thread(LPVOID context)
+{
+    net_receiver *receiver = (net_receiver *) context;
+    char packet[NET_MAX_HEADER_LENGTH + 512];
+
+    for(;;)
+    {
+        int length = recv(receiver->socket, packet, sizeof(packet), 0);
+        if(length == ARTNET_HEADER_LENGTH + 512 && !memcmp(packet, "Art-Net", 8))
+            receiver->packets_received++;
+        else if(length == SACN_HEADER_LENGTH + 512 && !memcmp(&packet[4], "ASC-E1.17", 9))
+            receiver->packets_received++;
+        else if(length == SOCKET_ERROR && receiver->stop)
+            break;
+    }
+
+    return 0;
+}
+
+// Opens a socket on 127.0.0.1, on a port Windows picks, and starts counting. Returns NULL if it worked,
+// otherwise an error message. Winsock has to be started already.
+static const char *net_receiver_start(net_receiver *receiver)
+{
+    int address_length = sizeof(receiver->address);
+    int receive_buffer = 8 * NET_SEND_BUFFER;
+    DWORD timeout_ms = 200;
+
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(receiver->socket == INVALID_SOCKET)
+        return "dmx.mex::Could not open a UDP socket.\n";
+
+    receiver->address.sin_family = AF_INET;
+    receiver->address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    receiver->address.sin_port = 0;
+    setsockopt(receiver->socket, SOL_SOCKET, SO_RCVBUF, (const char *) &receive_buffer, sizeof(receive_buffer));
+    setsockopt(receiver->socket, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout_ms, sizeof(timeout_ms));
+
+    if(bind(receiver->socket, (const struct sockaddr *) &receiver->address, sizeof(receiver->address)) == SOCKET_ERROR
+       || getsockname(receiver->socket, (struct sockaddr *) &receiver->address, &address_length) == SOCKET_ERROR)
+    {
+        closesocket(receiver->socket);
+        return "dmx.mex::Could not open the receiver on 127.0.0.1.\n";
+    }
+
+    receiver->thread = CreateThread(NULL, 0, net_receiver_thread, receiver, 0, NULL);
+    if(receiver->thread == NULL)
+    {
+        closesocket(receiver->socket);
+        return "dmx.mex::Could not start the receiver thread.\n";
+    }
+
+    return NULL;
+}
+
+static void net_receiver_stop(net_receiver *receiver)
+{
+    InterlockedExchange(&receiver->stop, TRUE);
+    WaitForSingleObject(receiver->thread, INFINITE);
+    CloseHandle(receiver->thread);
+    closesocket(receiver->socket);
+}
+
+// Returns a struct with what a protocol sends to: enabled, only, (addresses_name), universes, packets_sent, send_errors
+static mxArray *net_protocol_status(const net_protocol *protocol, const char *addresses_name)
+{
+    const char *field_names[] = {"enabled", "only", addresses_name, "universes", "packets_sent", "send_errors"};
+    mxArray *addresses = mxCreateCellMatrix(1, protocol->no_of_destinations);
+    mxArray *universes = mxCreateDoubleMatrix(1, protocol->no_of_destinations, mxREAL);
+    mxDouble *universes_output_pointer = mxGetData(universes);
+    char address[INET_ADDRSTRLEN];
+
+    for(ULONG i = 0; i < protocol->no_of_destinations; i++)
+    {
+        inet_ntop(AF_INET, &protocol->destinations[i].address.sin_addr, address, sizeof(address));
+        mxSetCell(addresses, i, mxCreateString(address));
+        universes_output_pointer[i] = protocol->destinations[i].universe;
+    }
+
+    mxArray *status = mxCreateStructMatrix(1, 1, 6, field_names);
+    mxSetField(status, 0, "enabled", mxCreateLogicalScalar(protocol->enabled));
+    mxSetField(status, 0, "only", mxCreateLogicalScalar(protocol->enabled && net.only));
+    mxSetField(status, 0, addresses_name, addresses);
+    mxSetField(status, 0, "universes", universes);
+    mxSetField(status, 0, "packets_sent", mxCreateDoubleScalar(protocol->packets_sent));
+    mxSetField(status, 0, "send_errors", mxCreateDoubleScalar(protocol->send_errors));
+    return status;
+}
+
+// TRUE if the transfers go to a device that we open ourselves: not to the simulator, not to the daemon,
+// and not only to the network.
+static BOOL device_is_local(void)
+{
+    return !simulator.enabled && daemon.shm == NULL && !net.only;
+}
+
+// The tuning for where the transfers go now. The daemon splits the ranges itself, and the network doesn't need to.
+static const transfer_tuning *tuning_active(void)
+{
+    if(simulator.enabled)
+        return tuning_find(TUNING_SIMULATOR_ID);
+
+    return (daemon.shm != NULL || net.only) ? NULL : tuning.open_device;
+}
+
+
+
+/*
+    Every transfer to the device should go through here:
+    -It goes to the simulator instead of the device when it's enabled
+    -It goes to the daemon instead of the device when we're connected
+    -It goes to the Art-Net nodes and the sACN receivers as well, when there are any
+    -It gets captured when the capture is running
+*/
+
+static BOOL udmx_transfer(KUSB_HANDLE handle, WINUSB_SETUP_PACKET Pkt, PUCHAR buffer, UINT length, PUINT transferred)
+{
+    LONGLONG transfer_start = now_ticks();
+    BOOL success;
+
+    if(simulator.enabled)
+        success = simulator_transfer(Pkt, buffer, length, transferred);
+    else if(daemon.shm != NULL)
+        success = daemon_transfer(Pkt, buffer, length, transferred);
+    else if(net.only)
+    {
+        *transferred = length;
+        success = TRUE;
+    }
+    else
+        success = UsbK_ControlTransfer(handle, Pkt, buffer, length, transferred, NULL);
+
+    if(net_enabled())
+    {
+        net_apply(Pkt, buffer, length);
+        if(net.held == 0 && !net_send())
+            success = FALSE;
+    }
+
+    if(capture.running)
+        capture_transfer(transfer_start, now_ticks() - transfer_start, Pkt, buffer, length, success);
+
+    return success;
+}
+
+// Finds and opens the uDMX device. Returns NULL when all is well, otherwise an error message.
+static const char *udmx_open(KLST_HANDLE deviceList, KUSB_HANDLE *handle)
+{
+    KLST_DEVINFO_HANDLE deviceInfo = NULL;
+
+    if (!LstK_FindByVidPid(deviceList, UDMX_VENDOR_ID, UDMX_PRODUCT_ID, &deviceInfo))
+        return "dmx.mex::Could not find the uDMX device.\n";
+
+    LibK_LoadDriverAPI(&Usb, deviceInfo->DriverID);
+
+    if(!Usb.Init(handle, deviceInfo))
+    {
+        mexPrintf("dmx.mex::Error code: %d", GetLastError());
+        return "dmx.mex::Failed to open device.\n";
+    }
+
+    strncpy(tuning.open_instance_id, deviceInfo->Common.InstanceID, TUNING_MAX_INSTANCE_ID - 1);
+    tuning.open_instance_id[TUNING_MAX_INSTANCE_ID - 1] = '\0';
+    tuning.open_device = tuning_find(tuning.open_instance_id);
+
+    return NULL;
+}
+
+/*
+    Shadow universe.
+
+    This is our copy of what the device should have in its buffer. Everything that changes channels
+    writes here first, and marks the channels as dirty. Then either shadow_flush() sends the dirty range
+    to the device with udmx_send_range(), or the refresh thread picks it up with the next frame.
+
+    The levels are 16-bit: 8-bit values are stored as x * 257 (so 255 is 65535), and fractions are kept.
+    This is what makes 16-bit channels and dithering possible.
+*/
+
+static USHORT shadow_universe[512];
+static USHORT dirty_first = 512, dirty_last = 0; // Nothing is dirty when dirty_first > dirty_last.
+
+// The refresh thread reads the shadow universe and everything in the output stage, while Matlab changes them.
+// Hold this while touching any of them, but never call mexErrMsgTxt() with it held.
+static CRITICAL_SECTION engine_lock;
+
+static void shadow_mark_dirty(USHORT first, USHORT last)
+{
+    if(first < dirty_first)
+        dirty_first = first;
+    if(last > dirty_last)
+        dirty_last = last;
+}
+
+/*
+    Priority lanes.
+
+    The refresh thread sends what changed in a frame as one range, and when that range is split (see the transfer
+    tuning and the pipeline), a blackout or a shutter closing would have to wait behind all of it, and then for the
+    next frame. So there are two lanes. Writes to the channels flagged as critical, and dmx('blackout'), go in the
+    urgent lane too: the refresh thread is woken up straight away, and if it's in the middle of a split range, the
+    urgent channels go before the next chunk. A transfer that's already on the bus can't be taken back, so the worst
+    case is one chunk (or a pipeline window of them), and the urgent transfer itself.
+    The urgent channels are rendered into the frame that's going out, so the rest of it doesn't put the old levels back.
+    Without the refresh thread, every write goes out straight away anyway, so there is nothing to jump ahead of.
+*/
+
+static struct
+{
+    UCHAR critical[512];            // TRUE for the channels that go in the urgent lane
+    USHORT first, last;             // what's waiting in the urgent lane, nothing when first > last
+    volatile LONG pending;
+    volatile LONG blackout;         // every channel is 0 until it's turned off again
+    BOOL sending;                   // so the urgent transfer doesn't get interrupted by itself
+    HANDLE event;                   // wakes up the refresh thread, NULL when it's not running
+    LONGLONG requested;             // when the oldest write still waiting in the lane was made
+    ULONG no_of_writes;             // how many urgent transfers went out, and how long they took from the write
+    LONGLONG latency_sum, latency_max, last_latency;
+    LONGLONG input_received;        // when the oldest bridged packet still waiting in the lane arrived, 0 if none
+    ULONG no_of_inputs;             // the same as above, for the transfers with bridged packets in them
+    LONGLONG input_latency_sum, input_latency_max, last_input_latency;
+} urgent = {{0}, 512, 0};
+
+// Puts the critical channels in [first, last] in the urgent lane, or all of them if 'all_channels' is TRUE.
+// Call this with engine_lock held.
+static void urgent_mark(USHORT first, USHORT last, BOOL all_channels)
+{
+    if(urgent.event == NULL)
+        return;
+
+    if(!all_channels)
+    {
+        while(first <= last && !urgent.critical[first])
+            first++;
+        while(last > first && !urgent.critical[last])
+            last--;
+        if(first > last)
+            return;
+    }
+
+    if(!urgent.pending)
+        urgent.requested = now_ticks();
+    if(first < urgent.first)
+        urgent.first = first;
+    if(last > urgent.last)
+        urgent.last = last;
+    urgent.pending = TRUE;
+    SetEvent(urgent.event);
+}
+
+// Sends what's waiting in the urgent lane. It's with the refresh thread, because it needs the session.
+static void urgent_send(void);
+
+// TRUE when the refresh thread should send the urgent lane before it goes on with a bulk range.
+static BOOL urgent_waiting(void)
+{
+    return urgent.pending && !urgent.sending && urgent.event != NULL;
+}
+
+// Converts a 0-255 level (fractions are fine) to 16 bits. Anything outside is clamped.
+static USHORT level_to_16bit(double value)
+{
+    if(!(value > 0))
+        return 0;
+    if(value >= 255)
+        return 65535;
+    return (USHORT) (value * 257.0 + 0.5);
+}
+
+// The same as level_to_16bit() for a whole column of doubles, two at a time. The results go 'stride' elements apart,
+// so a Matlab column (one channel of many frames) ends up as one channel of many native frames.
+// MAXPD returns its second operand if either is NaN, so NaN becomes 0, like in level_to_16bit().
+static void levels_to_16bit(const double *input, size_t no_of_values, USHORT *output, size_t stride)
+{
+    const __m128d zero = _mm_setzero_pd(), full = _mm_set1_pd(255.0), scale = _mm_set1_pd(257.0), half = _mm_set1_pd(0.5);
+    size_t i = 0;
+
+    for(; i + 2 <= no_of_values; i += 2)
+    {
+        __m128d value = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(&input[i]), zero), full);
+        __m128i level = _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(value, scale), half));
+
+        output[i * stride] = (USHORT) _mm_cvtsi128_si32(level);
+        output[(i + 1) * stride] = (USHORT) _mm_cvtsi128_si32(_mm_srli_si128(level, 4));
+    }
+
+    for(; i < no_of_values; i++)
+        output[i * stride] = level_to_16bit(input[i]);
+}
+
+/*
+    Output stage.
+
+    The shadow universe has what the user asked for. On the way to the device, the intensity masters are applied:
+    every group has a submaster, and there is a grand master for all the channels that are in at least one group.
+    These are fused into a per-channel gain table, so the output stage is a single multiply per channel,
+    done 8 channels at a time with SSE2. Channels that are not in any group go out untouched.
+*/
+
+#define MAX_GROUPS 32
+
+static struct
+{
+    double master;                  // 0-1
+    double submasters[MAX_GROUPS];  // 0-1
+    ULONG group_mask[512];          // bit n is set if the channel is in group n+1
+    USHORT channel_gain[512];       // 0-65535, this is what the output stage uses
+} intensity;
+
+static BOOL output_initialized = FALSE;
+
+static void output_init(void)
+{
+    if(output_initialized)
+        return;
+
+    intensity.master = 1.0;
+    for(unsigned int i = 0; i < MAX_GROUPS; i++)
+        intensity.submasters[i] = 1.0;
+    for(unsigned int i = 0; i < 512; i++)
+        intensity.channel_gain[i] = 65535;
+
+    InitializeCriticalSection(&engine_lock);
+
+    output_initialized = TRUE;
+}
+
+// Recalculates the gain table from the masters, and marks the channels whose gain has changed.
+static void intensity_update(void)
+{
+    for(USHORT channel = 0; channel < 512; channel++)
+    {
+        double gain = 1.0;
+        USHORT new_gain;
+
+        if(intensity.group_mask[channel])
+        {
+            gain = intensity.master;
+            for(unsigned int group = 0; group < MAX_GROUPS; group++)
+            {
+                if(intensity.group_mask[channel] & (1UL << group))
+                    gain *= intensity.submasters[group];
+            }
+        }
+
+        new_gain = (USHORT) (gain * 65535.0 + 0.5);
+        if(new_gain != intensity.channel_gain[channel])
+        {
+            intensity.channel_gain[channel] = new_gain;
+            shadow_mark_dirty(channel, channel);
+            urgent_mark(channel, channel, FALSE);
+        }
+    }
+}
+
+/*
+    Dimmer curves.
+
+    LEDs are very non-linear, so channels can have a lookup table applied after the masters.
+    A curve is either 256 entries (indexed by the top 8 bits of the 16-bit level after the masters),
+    or 65536 entries (indexed by the whole 16-bit level). The curves give 16-bit levels, so they work
+    for 16-bit and dithered channels too. Channels set in the same dmx('set_curve') call share a curve.
+*/
+
+#define MAX_CURVES 64
+
+typedef struct
+{
+    USHORT *table;
+    UCHAR shift;                    // 8 for 256-entry tables, 0 for 65536-entry ones
+} dimmer_curve;
+
+static struct
+{
+    dimmer_curve curves[MAX_CURVES];
+    UCHAR channel_curve[512];       // curve number + 1, 0 means linear
+    USHORT curved_channels[512];    // the channels that have a curve, in increasing order, for the output stage
+    USHORT no_of_curved_channels;
+} curves;
+
+// Assigns a curve (or no curve, with -1) to channels, and frees the curves nobody uses any more.
+static void curves_assign(const ULONG *channel_list, mwSize no_of_channels, LONG curve_number)
+{
+    BOOL in_use[MAX_CURVES] = {FALSE};
+
+    for(mwSize i = 0; i < no_of_channels; i++)
+    {
+        curves.channel_curve[channel_list[i]] = (UCHAR) (curve_number + 1);
+        shadow_mark_dirty((USHORT) channel_list[i], (USHORT) channel_list[i]);
+    }
+
+    curves.no_of_curved_channels = 0;
+    for(USHORT channel = 0; channel < 512; channel++)
+    {
+        if(curves.channel_curve[channel])
+        {
+            in_use[curves.channel_curve[channel] - 1] = TRUE;
+            curves.curved_channels[curves.no_of_curved_channels++] = channel;
+        }
+    }
+
+    for(unsigned int i = 0; i < MAX_CURVES; i++)
+    {
+        if(!in_use[i] && curves.curves[i].table != NULL)
+        {
+            free(curves.curves[i].table);
+            curves.curves[i].table = NULL;
+        }
+    }
+}
+
+/*
+    Channel modes.
+
+    Most channels are 8-bit: the top 8 bits of the level go out. The others are:
+    -16-bit: the channel is the coarse half of a pair, and the next one is the fine half.
+    -Dithered: an 8-bit channel, but the fraction below the top 8 bits is accumulated from frame to frame,
+        and when it adds up to a whole step, the channel goes one higher for a frame. Over many frames, the
+        average output is the exact 16-bit level. This needs the refresh thread, see dmx('start').
+*/
+
+#define CHANNEL_8BIT 0
+#define CHANNEL_16BIT 1
+#define CHANNEL_FINE 2 // The fine half of a 16-bit pair, its output comes from the channel before.
+#define CHANNEL_DITHER 3
+
+static struct
+{
+    UCHAR mode[512];
+    USHORT special_channels[512];       // 16-bit and dithered channels, in increasing order
+    USHORT no_of_special_channels;
+    USHORT dither_first, dither_last;   // range of the dithered channels, these must go out in every frame
+    UCHAR dither_error[512];            // the accumulated fraction of each dithered channel
+} channel_modes = {{0}, {0}, 0, 512, 0};
+
+static void channel_mode_set(USHORT channel, UCHAR mode)
+{
+    // Break up pairs first.
+    if(channel_modes.mode[channel] == CHANNEL_16BIT)
+        channel_modes.mode[channel + 1] = CHANNEL_8BIT;
+    if(channel_modes.mode[channel] == CHANNEL_FINE)
+        channel_modes.mode[channel - 1] = CHANNEL_8BIT;
+
+    channel_modes.mode[channel] = mode;
+    channel_modes.dither_error[channel] = 0;
+    shadow_mark_dirty(channel, channel);
+
+    if(mode == CHANNEL_16BIT)
+    {
+        if(channel_modes.mode[channel + 1] == CHANNEL_16BIT)
+            channel_modes.mode[channel + 2] = CHANNEL_8BIT;
+        channel_modes.mode[channel + 1] = CHANNEL_FINE;
+        shadow_mark_dirty(channel, channel + 1);
+    }
+}
+
+// Rebuilds the list of special channels. Call this after changing modes.
+static void channel_modes_update(void)
+{
+    channel_modes.no_of_special_channels = 0;
+    channel_modes.dither_first = 512;
+    channel_modes.dither_last = 0;
+
+    for(USHORT channel = 0; channel < 512; channel++)
+    {
+        if(channel_modes.mode[channel] == CHANNEL_16BIT || channel_modes.mode[channel] == CHANNEL_DITHER)
+            channel_modes.special_channels[channel_modes.no_of_special_channels++] = channel;
+
+        if(channel_modes.mode[channel] == CHANNEL_DITHER)
+        {
+            if(channel < channel_modes.dither_first)
+                channel_modes.dither_first = channel;
+            channel_modes.dither_last = channel;
+        }
+    }
+}
+
+// 16-bit pairs must always be rendered together.
+static void output_range_fix(USHORT *first, USHORT *last)
+{
+    if(channel_modes.mode[*first] == CHANNEL_FINE)
+        (*first)--;
+    if(channel_modes.mode[*last] == CHANNEL_16BIT)
+        (*last)++;
+}
+
+/*
+    Renders channels [first, last] of the shadow universe into 'output'.
+
+    First the gain table is applied to the 16-bit levels, 8 channels at a time with SSE2. This is (level * (gain + 1)) >> 16,
+    so full gain gives back exactly what went in, and zero gain is zero. SSE2 only gives us the top and the bottom
+    16 bits of the product, so the +1 is added as a carry into the top half.
+    Then the channels with dimmer curves are looked up from the 16-bit levels. There is no 16-bit gather in SSE2,
+    so this goes through the list of curved channels instead of checking every channel.
+    Finally, the top 8 bits of every level go out, except for 16-bit and dithered channels, which are done one by one.
+*/
+static void output_render(USHORT first, USHORT last, UCHAR *output)
+{
+    USHORT levels[512 + 16];
+    USHORT channel = first;
+    const __m128i sign_bit = _mm_set1_epi16((short) 0x8000);
+
+    for(; channel + 8 <= last + 1; channel += 8)
+    {
+        __m128i shadow_levels = _mm_loadu_si128((const __m128i*) &shadow_universe[channel]);
+        __m128i gains = _mm_loadu_si128((const __m128i*) &intensity.channel_gain[channel]);
+        __m128i product_low = _mm_mullo_epi16(shadow_levels, gains);
+        __m128i sum_low = _mm_add_epi16(product_low, shadow_levels);
+        // If the low half overflowed, the comparison gives -1, and subtracting it carries 1 into the top half.
+        __m128i carry = _mm_cmplt_epi16(_mm_xor_si128(sum_low, sign_bit), _mm_xor_si128(product_low, sign_bit));
+
+        _mm_storeu_si128((__m128i*) &levels[channel - first], _mm_sub_epi16(_mm_mulhi_epu16(shadow_levels, gains), carry));
+    }
+
+    for(; channel <= last; channel++)
+        levels[channel - first] = (USHORT) (((ULONG) shadow_universe[channel] * ((ULONG) intensity.channel_gain[channel] + 1)) >> 16);
+
+    for(USHORT i = 0; i < curves.no_of_curved_channels; i++)
+    {
+        channel = curves.curved_channels[i];
+        if(channel < first)
+            continue;
+        if(channel > last)
+            break;
+
+        const dimmer_curve *curve = &curves.curves[curves.channel_curve[channel] - 1];
+        levels[channel - first] = curve->table[levels[channel - first] >> curve->shift];
+    }
+
+    channel = first;
+    for(; channel + 16 <= last + 1; channel += 16)
+    {
+        __m128i low = _mm_srli_epi16(_mm_loadu_si128((const __m128i*) &levels[channel - first]), 8);
+        __m128i high = _mm_srli_epi16(_mm_loadu_si128((const __m128i*) &levels[channel - first + 8]), 8);
+        _mm_storeu_si128((__m128i*) &output[channel - first], _mm_packus_epi16(low, high));
+    }
+
+    for(; channel <= last; channel++)
+        output[channel - first] = (UCHAR) (levels[channel - first] >> 8);
+
+    for(USHORT i = 0; i < channel_modes.no_of_special_channels; i++)
+    {
+        channel = channel_modes.special_channels[i];
+        if(channel < first)
+            continue;
+        if(channel > last)
+            break;
+
+        USHORT level = levels[channel - first];
+
+        if(channel_modes.mode[channel] == CHANNEL_16BIT)
+        {
+            output[channel - first] = (UCHAR) (level >> 8);
+            if(channel < last)
+                output[channel - first + 1] = (UCHAR) (level & 0xFF);
+        }
+        else
+        {
+            // Dithered channel: 255 is 65535 here, so scale it to 1/256ths of a step first.
+            // Then add up the fraction, and go one higher when it's a whole step.
+            USHORT scaled = (USHORT) (((ULONG) level * 256 + 128) / 257);
+            USHORT error = channel_modes.dither_error[channel] + (scaled & 0xFF);
+            output[channel - first] = (UCHAR) (scaled >> 8);
+            if(error >= 256)
+                output[channel - first]++;
+            channel_modes.dither_error[channel] = (UCHAR) error;
+        }
+    }
+
+    // The blackout wins over everything. The dithering still carries on above, so it picks up smoothly afterwards.
+    if(urgent.blackout)
+        memset(output, 0, last - first + 1);
+}
+
+// The setup packet of a cmd_SetChannelRange transfer.
+static void udmx_range_packet(WINUSB_SETUP_PACKET *Pkt, USHORT start_address, USHORT no_of_channels)
+{
+    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)Pkt;
+
+    memset(Pkt, 0, sizeof(*Pkt));
+    defPkt->BmRequest.Dir	= 0; // This should be BMREQUEST_DIR_HOST_TO_DEVICE
+    defPkt->BmRequest.Type	= 2; // This should be BMREQUEST_TYPE_VENDOR
+    defPkt->Request			= (UCHAR) cmd_SetChannelRange;
+    defPkt->Value			= (UINT) no_of_channels;
+    defPkt->Index			= start_address;
+    defPkt->Length			= no_of_channels;
+}
+
+// Sends channels [start_address, start_address + no_of_channels - 1] from 'data' in one cmd_SetChannelRange transfer.
+static BOOL udmx_send_chunk(KUSB_HANDLE handle, USHORT start_address, USHORT no_of_channels, PUCHAR data, PUINT transferred)
+{
+    WINUSB_SETUP_PACKET Pkt;
+
+    udmx_range_packet(&Pkt, start_address, no_of_channels);
+
+    *transferred = 0;
+    return udmx_transfer(handle, Pkt, data, no_of_channels, transferred);
+}
+
+// Sends one channel with cmd_SetSingleChannel. The value and the address are in the setup packet, so there is no
+// data stage: this is a whole USB transaction less than a 1-channel cmd_SetChannelRange.
+static BOOL udmx_send_single(KUSB_HANDLE handle, USHORT address, UCHAR value)
+{
+    WINUSB_SETUP_PACKET Pkt;
+    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+    UINT transferred = 0;
+
+    memset(&Pkt, 0, sizeof(Pkt));
+    defPkt->BmRequest.Dir	= 0; // This should be BMREQUEST_DIR_HOST_TO_DEVICE
+    defPkt->BmRequest.Type	= 2; // This should be BMREQUEST_TYPE_VENDOR
+    defPkt->Request			= (UCHAR) cmd_SetSingleChannel;
+    defPkt->Value			= value;
+    defPkt->Index			= address;
+    defPkt->Length			= 0;
+
+    return udmx_transfer(handle, Pkt, NULL, 0, &transferred);
+}
+
+// TRUE if this many channels go with cmd_SetSingleChannel. It's only one channel, and only if the device
+// took cmd_SetSingleChannel when it was probed (the ones that weren't probed are trusted to).
+static BOOL udmx_is_single(USHORT no_of_channels)
+{
+    const transfer_tuning *device_tuning = tuning_active();
+
+    return no_of_channels == 1 && (device_tuning == NULL || device_tuning->single_latency_us > 0);
+}
+
+/*
+    Pipelined transfers.
+
+    When a range goes in several chunks, one after the other, every chunk waits for its own round trip: we submit it,
+    the host controller picks it up in the next USB frame, the device takes it, and only then do we submit the next one.
+    With the pipeline on, the chunks are submitted as overlapped transfers, and up to 'window' of them are in flight
+    at the same time. The transfers on the control endpoint still go one at a time on the bus, but the next one
+    is always queued up when the one before it finishes, so the gaps between them go.
+    The chunks can go from the lowest address up, or from the highest down. Clones with small buffers may show the
+    chunks as they arrive, and this decides which end of the universe is updated first.
+    A device that needed a gap between the transfers when it was probed can't take them back to back, so it's not pipelined.
+*/
+
+#define PIPELINE_MAX_WINDOW 16
+#define PIPELINE_TIMEOUT_MS 1000
+#define PIPELINE_ASCENDING 0
+#define PIPELINE_DESCENDING 1
+
+static struct
+{
+    USHORT chunk_size;          // channels in one transfer, 0 is off
+    ULONG window;               // transfers in flight at the same time, 1 is the same as no pipeline
+    UCHAR order;
+} pipeline = {0, 4, PIPELINE_ASCENDING};
+
+typedef struct
+{
+    KOVL_HANDLE overlapped;     // NULL in the simulator
+    WINUSB_SETUP_PACKET Pkt;
+    PUCHAR buffer;
+    USHORT length;
+    BOOL success;               // the simulator knows it straight away
+    LONGLONG submitted;
+    LONGLONG completed;         // in the simulator, when it will be done
+} pipeline_transfer;
+
+// Submits a transfer, and doesn't wait for it. In the simulator, the bus is busy until 'bus_free': if a transfer is still
+// in flight, this one's setup is already queued behind it, and it goes on the bus as soon as the other one is done.
+static BOOL pipeline_submit(KUSB_HANDLE handle, KOVL_POOL_HANDLE pool, pipeline_transfer *transfer, LONGLONG *bus_free)
+{
+    UINT transferred = 0;
+
+    transfer->submitted = now_ticks();
+    transfer->overlapped = NULL;
+
+    if(simulator.enabled)
+    {
+        BOOL queued = (*bus_free > transfer->submitted);
+
+        transfer->success = simulator_apply(transfer->Pkt, transfer->buffer, transfer->length, &transferred) && transferred == transfer->length;
+        transfer->completed = transfer->success ? simulator_deadline(queued ? *bus_free : transfer->submitted, transfer->length, !queued) : transfer->submitted;
+        *bus_free = max(*bus_free, transfer->completed);
+        return TRUE;
+    }
+
+    if(!OvlK_Acquire(&transfer->overlapped, pool))
+        return FALSE;
+
+    // It usually returns FALSE with ERROR_IO_PENDING, but it may be done already.
+    if(!UsbK_ControlTransfer(handle, transfer->Pkt, transfer->buffer, transfer->length, &transferred, (LPOVERLAPPED) transfer->overlapped)
+        && GetLastError() != ERROR_IO_PENDING)
+    {
+        OvlK_Release(transfer->overlapped);
+        transfer->overlapped = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Waits for a transfer that's in flight (it gets cancelled if it takes too long), and captures it.
+// Returns FALSE if it failed, or not all of it went out.
+static BOOL pipeline_complete(pipeline_transfer *transfer)
+{
+    if(transfer->overlapped != NULL)
+    {
+        UINT transferred = 0;
+
+        transfer->success = OvlK_WaitOrCancel(transfer->overlapped, PIPELINE_TIMEOUT_MS, &transferred) && transferred == transfer->length;
+        transfer->completed = now_ticks();
+        OvlK_Release(transfer->overlapped);
+        transfer->overlapped = NULL;
+    }
+    else
+        wait_until(transfer->completed);
+
+    if(capture.running)
+        capture_transfer(transfer->submitted, transfer->completed - transfer->submitted, transfer->Pkt, transfer->buffer, transfer->length, transfer->success);
+
+    return transfer->success;
+}
+
+// Waits for everything in flight. Returns FALSE if any of them failed.
+static BOOL pipeline_drain(pipeline_transfer *in_flight, ULONG *oldest, ULONG *no_in_flight)
+{
+    BOOL success = TRUE;
+
+    while(*no_in_flight > 0)
+    {
+        if(!pipeline_complete(&in_flight[*oldest]))
+            success = FALSE;
+        *oldest = (*oldest + 1) % pipeline.window;
+        (*no_in_flight)--;
+    }
+
+    return success;
+}
+
+// Sends a range in chunks of 'chunk_size', with up to pipeline.window of them in flight.
+static BOOL udmx_send_pipelined(KUSB_HANDLE handle, USHORT start_address, USHORT no_of_channels, PUCHAR data, USHORT chunk_size)
+{
+    pipeline_transfer in_flight[PIPELINE_MAX_WINDOW];
+    KOVL_POOL_HANDLE pool = NULL;
+    ULONG no_of_chunks = (no_of_channels + chunk_size - 1) / chunk_size;
+    ULONG oldest = 0, no_in_flight = 0;
+    LONGLONG bus_free = 0;
+    BOOL success = TRUE;
+
+    if(!simulator.enabled && !OvlK_Init(&pool, handle, pipeline.window, 0))
+        return FALSE;
+
+    for(ULONG i = 0; i < no_of_chunks && success; i++)
+    {
+        USHORT offset = (USHORT) (((pipeline.order == PIPELINE_DESCENDING) ? no_of_chunks - 1 - i : i) * chunk_size);
+
+        // Something came up in the urgent lane: it goes next, as soon as what's in flight is done.
+        if(i > 0 && urgent_waiting())
+        {
+            if(!(success = pipeline_drain(in_flight, &oldest, &no_in_flight)))
+                break;
+            urgent_send();
+        }
+
+        // The window is full: wait for the oldest one.
+        if(no_in_flight == pipeline.window)
+        {
+            success = pipeline_complete(&in_flight[oldest]);
+            oldest = (oldest + 1) % pipeline.window;
+            no_in_flight--;
+            if(!success)
+                break;
+        }
+
+        pipeline_transfer *transfer = &in_flight[(oldest + no_in_flight) % pipeline.window];
+        transfer->buffer = &data[offset];
+        transfer->length = min(chunk_size, no_of_channels - offset);
+        udmx_range_packet(&transfer->Pkt, start_address + offset, transfer->length);
+
+        if(!pipeline_submit(handle, pool, transfer, &bus_free))
+            success = FALSE;
+        else
+            no_in_flight++;
+    }
+
+    // Everything in flight has to finish (or get cancelled) before the buffers and the pool go, even if something failed.
+    if(!pipeline_drain(in_flight, &oldest, &no_in_flight))
+        success = FALSE;
+
+    if(pool != NULL)
+        OvlK_Free(pool);
+
+    return success;
+}
+
+// Sends a range of channels. If the device was probed, and it's better to split the range, it goes in
+// several transfers, with a gap between them. With the pipeline on, long ranges are split, and go back to back.
+// A single channel goes with cmd_SetSingleChannel.
+static BOOL udmx_send_range_to_device(KUSB_HANDLE handle, USHORT start_address, USHORT no_of_channels, PUCHAR data)
+{
+    const transfer_tuning *device_tuning = tuning_active();
+    USHORT max_chunk = (device_tuning != NULL) ? device_tuning->max_chunk : 512;
+    LONGLONG spacing = (device_tuning != NULL) ? (LONGLONG) (device_tuning->spacing_us * qpc_frequency / 1e6) : 0;
+    LONGLONG last_completed = 0;
+    UINT transferred = 0;
+
+    if(udmx_is_single(no_of_channels))
+        return udmx_send_single(handle, start_address, data[0]);
+
+    // The daemon has the device, and Art-Net doesn't have one, so there is nothing to pipeline there.
+    BOOL pipelined = pipeline.chunk_size > 0 && pipeline.window > 1 && spacing == 0 && (simulator.enabled || device_is_local());
+    if(pipelined && no_of_channels > min(pipeline.chunk_size, max_chunk))
+        return udmx_send_pipelined(handle, start_address, no_of_channels, data, min(pipeline.chunk_size, max_chunk));
+
+    for(USHORT offset = 0; offset < no_of_channels; offset += max_chunk)
+    {
+        if(offset > 0 && urgent_waiting())
+        {
+            wait_until(last_completed + spacing);
+            urgent_send();
+            last_completed = now_ticks();
+        }
+
+        if(offset > 0 && spacing > 0)
+            wait_until(last_completed + spacing);
+
+        if(!udmx_send_chunk(handle, start_address + offset, min(no_of_channels - offset, max_chunk), &data[offset], &transferred))
+            return FALSE;
+        last_completed = now_ticks();
+    }
+
+    return TRUE;
+}
+
+// Sends a range of channels to wherever the transfers go now.
+static BOOL udmx_send_range(KUSB_HANDLE handle, USHORT start_address, USHORT no_of_channels, PUCHAR data)
+{
+    if(!net_enabled())
+        return udmx_send_range_to_device(handle, start_address, no_of_channels, data);
+
+    // The network gets the whole range in one packet, however many transfers it takes for the device.
+    // An urgent write can come in the middle of it: that goes out to the network straight away, but the
+    // range around it is still held back until it's done, that's why this is a counter.
+    memcpy(&net.universe[start_address], data, no_of_channels);
+    net.held++;
+    BOOL success = udmx_send_range_to_device(handle, start_address, no_of_channels, data);
+    net.held--;
+
+    if(!net_send())
+        success = FALSE;
+
+    return success;
+}
+
+// Sorts 'values', and returns the one in the middle.
+static double tuning_median(double *values, int no_of_values)
+{
+    for(int i = 1; i < no_of_values; i++)
+    {
+        double value = values[i];
+        int j = i;
+
+        for(; j > 0 && values[j - 1] > value; j--)
+            values[j] = values[j - 1];
+        values[j] = value;
+    }
+
+    return values[no_of_values / 2];
+}
+
+// Sends 'no_of_channels' from address 0, and returns how long it took in us, or -1 if the device didn't take all of it.
+// 0 channels is a cmd_SetSingleChannel for address 0.
+static double tuning_transfer(KUSB_HANDLE handle, USHORT no_of_channels, PUCHAR data)
+{
+    UINT transferred;
+    LONGLONG start = now_ticks();
+
+    if(no_of_channels == 0)
+    {
+        if(!udmx_send_single(handle, 0, data[0]))
+            return -1;
+    }
+    else if(!udmx_send_chunk(handle, 0, no_of_channels, data, &transferred) || transferred != no_of_channels)
+        return -1;
+
+    return (double) (now_ticks() - start) * 1e6 / qpc_frequency;
+}
+
+/*
+    Measures the device behind 'handle' (or the simulator), and keeps the result for 'instance_id'.
+    'data' is a whole universe of what the device should have anyway, so the probes don't change anything on the bus.
+    Every size is sent TUNING_REPEATS times, until one doesn't work: the bigger ones wouldn't either, and a clone
+    may not like it. The chunk size is what gets a universe out the quickest. Then, the gap: the shortest one after
+    which a second transfer works, and is not slower than usual. Last, whether it takes cmd_SetSingleChannel,
+    and how long that takes.
+    Returns NULL if not even a 1-channel transfer worked.
+*/
+static const transfer_tuning *tuning_probe(KUSB_HANDLE handle, const char *instance_id, PUCHAR data)
+{
+    static const double spacings_us[] = {0, 250, 500, 1000, 2000, 5000};
+    transfer_tuning result;
+    double durations[TUNING_REPEATS];
+    double best_time = 0;
+    int chunk_index = -1;
+
+    memset(&result, 0, sizeof(result));
+    strncpy(result.instance_id, instance_id, TUNING_MAX_INSTANCE_ID - 1);
+
+    for(int size_index = 0; size_index < TUNING_NO_OF_SIZES; size_index++)
+    {
+        USHORT size = tuning_sizes[size_index];
+        int repeat;
+
+        for(repeat = 0; repeat < TUNING_REPEATS; repeat++)
+        {
+            if((durations[repeat] = tuning_transfer(handle, size, data)) < 0)
+                break;
+        }
+        if(repeat < TUNING_REPEATS)
+            break;
+
+        result.latency_us[size_index] = tuning_median(durations, TUNING_REPEATS);
+
+        double universe_time = ceil(512.0 / size) * result.latency_us[size_index];
+        if(chunk_index < 0 || universe_time < best_time)
+        {
+            best_time = universe_time;
+            chunk_index = size_index;
+        }
+    }
+
+    if(chunk_index < 0)
+        return NULL;
+
+    result.max_chunk = tuning_sizes[chunk_index];
+    result.spacing_us = spacings_us[sizeof(spacings_us) / sizeof(spacings_us[0]) - 1];
+    for(unsigned int spacing_index = 0; spacing_index < sizeof(spacings_us) / sizeof(spacings_us[0]); spacing_index++)
+    {
+        LONGLONG spacing = (LONGLONG) (spacings_us[spacing_index] * qpc_frequency / 1e6);
+        int repeat;
+
+        for(repeat = 0; repeat < TUNING_REPEATS; repeat++)
+        {
+            if(tuning_transfer(handle, result.max_chunk, data) < 0)
+                break;
+            wait_until(now_ticks() + spacing);
+            if((durations[repeat] = tuning_transfer(handle, result.max_chunk, data)) < 0)
+                break;
+        }
+
+        if(repeat == TUNING_REPEATS && tuning_median(durations, TUNING_REPEATS) <= 1.5 * result.latency_us[chunk_index] + 100)
+        {
+            result.spacing_us = spacings_us[spacing_index];
+            break;
+        }
+    }
+
+    int repeat;
+    for(repeat = 0; repeat < TUNING_REPEATS; repeat++)
+    {
+        if((durations[repeat] = tuning_transfer(handle, 0, data)) < 0)
+            break;
+    }
+    if(repeat == TUNING_REPEATS)
+        result.single_latency_us = tuning_median(durations, TUNING_REPEATS);
+
+    transfer_tuning *device_tuning = tuning_find(instance_id);
+    if(device_tuning == NULL)
+    {
+        device_tuning = &tuning.devices[tuning.next_slot];
+        tuning.next_slot = (tuning.next_slot + 1) % TUNING_MAX_DEVICES;
+        if(tuning.no_of_devices < TUNING_MAX_DEVICES)
+            tuning.no_of_devices++;
+    }
+    *device_tuning = result;
+    tuning.open_device = tuning_find(tuning.open_instance_id); // The slot may have been someone else's.
+
+    return device_tuning;
+}
+
+/*
+    Effects.
+
+    Chases and flicker used to be worked out in Matlab, and sent frame by frame, so they were only as good as the
+    interpreter's timing. Now an effect can be bound to a set of channels, and the refresh thread calculates it
+    for every frame, for the time the frame is due to go out. This way, the frequency is as accurate as the refresh clock.
+    For the i-th of the n channels, the phase is u = frequency * t - spread * i / n (in cycles), and the level is
+    low + (high - low) * waveform(u). The channels are done four at a time with SSE2.
+*/
+
+#define EFFECT_MAX 32
+
+#define EFFECT_SINE 1
+#define EFFECT_CHASE 2
+#define EFFECT_STROBE 3
+#define EFFECT_NOISE 4
+
+typedef struct
+{
+    UCHAR type;                     // 0 means this slot is free
+    USHORT no_of_channels;
+    USHORT first_channel, last_channel;
+    double frequency;               // Hz
+    LONGLONG start_ticks;
+    float low, high;                // 16-bit levels
+    float width;                    // the part of the period a chase or a strobe is on for
+    LONGLONG last_cycle;            // noise gets new values when this changes
+    USHORT channels[512];
+    float phase[512];               // -spread * i / n
+    ULONG noise_state[512];
+} effect;
+
+static struct
+{
+    effect slots[EFFECT_MAX];
+    ULONG no_of_effects;
+} effects;
+
+/*
+    cos(2 * pi * u) for four phases at a time. SSE2 doesn't have sin() or cos(), so this is folded to a quarter
+    period, and the rest is a Taylor series up to x^10. The error is below 1e-6, which is way under a 16-bit step.
+*/
+static __m128 cos_cycles_ps(__m128 u)
+{
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    const __m128 sign_bit = _mm_set1_ps(-0.0f);
+
+    // Whole cycles don't matter, and cos() is even: u is now between 0 and 0.5.
+    u = _mm_sub_ps(u, _mm_cvtepi32_ps(_mm_cvtps_epi32(u)));
+    u = _mm_andnot_ps(sign_bit, u);
+
+    // cos(2 * pi * u) = -cos(2 * pi * (0.5 - u)), so 0 to 0.25 is enough.
+    __m128 flip = _mm_cmpgt_ps(u, quarter);
+    u = _mm_or_ps(_mm_andnot_ps(flip, u), _mm_and_ps(flip, _mm_sub_ps(_mm_set1_ps(0.5f), u)));
+
+    __m128 x = _mm_mul_ps(u, _mm_set1_ps(6.28318531f));
+    __m128 x2 = _mm_mul_ps(x, x);
+    __m128 c = _mm_set1_ps(-1.0f / 3628800.0f);
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(1.0f / 40320.0f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(-1.0f / 720.0f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(1.0f / 24.0f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(-0.5f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(1.0f));
+
+    return _mm_xor_ps(c, _mm_and_ps(flip, sign_bit));
+}
+
+// Sets up an effect in a free slot. The caller holds engine_lock. Returns the slot number, or -1 if they are all used.
+static int effect_add(UCHAR type, const ULONG *channel_list, USHORT no_of_channels, double frequency,
+                      USHORT low, USHORT high, double spread, double width)
+{
+    int slot;
+
+    for(slot = 0; slot < EFFECT_MAX; slot++)
+        if(effects.slots[slot].type == 0)
+            break;
+    if(slot == EFFECT_MAX)
+        return -1;
+
+    effect *e = &effects.slots[slot];
+    e->no_of_channels = no_of_channels;
+    e->first_channel = 511;
+    e->last_channel = 0;
+    for(USHORT i = 0; i < no_of_channels; i++)
+    {
+        e->channels[i] = (USHORT) channel_list[i];
+        e->phase[i] = (float) (-spread * i / no_of_channels);
+        e->noise_state[i] = (ULONG) (now_ticks() * 2654435761u) ^ (ULONG) ((slot * 512 + i + 1) * 2246822519u);
+        if(e->noise_state[i] == 0)
+            e->noise_state[i] = 1; // xorshift would be stuck at zero
+        e->first_channel = min(e->first_channel, e->channels[i]);
+        e->last_channel = max(e->last_channel, e->channels[i]);
+    }
+    // The SIMD loop reads a few entries past the end, keep them harmless.
+    for(USHORT i = no_of_channels; i < 512 && (i & 3); i++)
+    {
+        e->phase[i] = 0;
+        e->noise_state[i] = 1;
+    }
+
+    e->frequency = frequency;
+    e->low = (float) low;
+    e->high = (float) high;
+    e->width = (float) width;
+    e->last_cycle = -1;
+    e->start_ticks = now_ticks();
+    e->type = type;
+    effects.no_of_effects++;
+
+    return slot;
+}
+
+static void effect_remove(int slot)
+{
+    if(effects.slots[slot].type == 0)
+        return;
+    effects.slots[slot].type = 0;
+    effects.no_of_effects--;
+}
+
+// Widens [*first, *last] to the channels the effects write to. The caller holds engine_lock.
+static void effects_range(int *first, int *last)
+{
+    for(int slot = 0; slot < EFFECT_MAX && effects.no_of_effects > 0; slot++)
+    {
+        if(effects.slots[slot].type == 0)
+            continue;
+        *first = min(*first, effects.slots[slot].first_channel);
+        *last = max(*last, effects.slots[slot].last_channel);
+    }
+}
+
+// Writes every running effect into the shadow universe, as it should be at frame_ticks. The caller holds engine_lock.
+static void effects_render(LONGLONG frame_ticks)
+{
+    const __m128 ones = _mm_set1_ps(1.0f);
+    const __m128i offset = _mm_set1_epi32(32768);
+    const __m128i sign_bit = _mm_set1_epi16((short) 0x8000);
+
+    if(effects.no_of_effects == 0)
+        return;
+
+    for(int slot = 0; slot < EFFECT_MAX; slot++)
+    {
+        effect *e = &effects.slots[slot];
+        if(e->type == 0)
+            continue;
+
+        // The time is in double, so a long running effect doesn't lose precision. Only the fraction goes to SIMD.
+        double cycles = e->frequency * (double) (frame_ticks - e->start_ticks) / (double) qpc_frequency;
+        if(cycles < 0)
+            cycles = 0;
+        LONGLONG cycle = (LONGLONG) cycles;
+        __m128 base = _mm_set1_ps((float) (cycles - (double) cycle));
+        __m128 low = _mm_set1_ps(e->low);
+        __m128 range = _mm_set1_ps(e->high - e->low);
+        __m128 width = _mm_set1_ps(e->width);
+
+        // Noise holds a random level for a whole period. xorshift32, four lanes at a time.
+        if(e->type == EFFECT_NOISE && cycle != e->last_cycle)
+        {
+            for(USHORT i = 0; i < e->no_of_channels; i += 4)
+            {
+                __m128i x = _mm_loadu_si128((const __m128i*) &e->noise_state[i]);
+                x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+                x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+                x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+                _mm_storeu_si128((__m128i*) &e->noise_state[i], x);
+            }
+            e->last_cycle = cycle;
+        }
+
+        for(USHORT i = 0; i < e->no_of_channels; i += 4)
+        {
+            __m128 u = _mm_add_ps(base, _mm_loadu_ps(&e->phase[i]));
+            __m128 waveform;
+            USHORT levels[8];
+
+            switch(e->type)
+            {
+                case EFFECT_SINE:
+                    // Starts at 'low', and peaks at 'high' half a period later.
+                    waveform = _mm_mul_ps(_mm_set1_ps(0.5f), _mm_sub_ps(ones, cos_cycles_ps(u)));
+                    break;
+
+                case EFFECT_NOISE:
+                    waveform = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(_mm_loadu_si128((const __m128i*) &e->noise_state[i]), 8)), _mm_set1_ps(1.0f / 16777215.0f));
+                    break;
+
+                default:
+                    // Chase and strobe: on for the first 'width' of the period. u is between -1 and 1 here.
+                    u = _mm_add_ps(u, _mm_and_ps(_mm_cmplt_ps(u, _mm_setzero_ps()), ones));
+                    u = _mm_sub_ps(u, _mm_and_ps(_mm_cmpge_ps(u, ones), ones));
+                    waveform = _mm_and_ps(_mm_cmplt_ps(u, width), ones);
+                    break;
+            }
+
+            // To 16 bits: there is no unsigned saturating pack in SSE2, so shift it to signed and back.
+            __m128i level = _mm_sub_epi32(_mm_cvtps_epi32(_mm_add_ps(low, _mm_mul_ps(range, waveform))), offset);
+            _mm_storeu_si128((__m128i*) levels, _mm_xor_si128(_mm_packs_epi32(level, level), sign_bit));
+
+            for(USHORT k = 0; k < 4 && i + k < e->no_of_channels; k++)
+                shadow_universe[e->channels[i + k]] = levels[k];
+        }
+
+        shadow_mark_dirty(e->first_channel, e->last_channel);
+    }
+}
+
+
+
+/*
+    Frame sync.
+
+    The uDMX sends frames on its own clock, so an update that arrives in the middle of a frame is split:
+    the first part of the universe has the new levels, the rest still has the old ones.
+    We can't ask the firmware where it is, but a transfer that runs over a frame boundary takes a bit longer.
+    So we keep track of how long a transfer of each size normally takes, and when one is slow, there was a boundary
+    in it. A phase-locked loop on these boundaries gives us the frame period and phase. When it's locked,
+    the refresh thread sends its transfers so that they finish just before a boundary.
+    While there is nothing to send, it sends a 1-byte probe (the same value the device already has) across a
+    boundary now and then, to keep the loop locked.
+*/
+
+#define SYNC_NOMINAL_PERIOD_US 22676.0 // break, mark after break, start code and 512 slots at 250 kbit/s
+#define SYNC_MIN_OBSERVATIONS 8
+#define SYNC_ACQUISITION_OBSERVATIONS 12
+#define SYNC_FIT_OBSERVATIONS 64
+
+typedef struct
+{
+    double baseline;                // ticks, how long the transfer takes when there is no boundary in it
+    double jitter;                  // ticks, the average deviation from the baseline
+    ULONG no_of_samples;
+} sync_transfer_timing;
+
+static struct
+{
+    BOOL enabled;
+    BOOL locked;
+    double nominal_period_us;
+    double nominal_period;          // ticks
+    double period;                  // ticks, estimated
+    double boundary;                // ticks, one of the estimated frame boundaries
+    double phase_error;             // ticks, of the last observation
+    double phase_error_square;      // ticks^2, moving average of the squared phase error
+    sync_transfer_timing timing[65]; // by the number of 8-byte packets, 0 is cmd_SetSingleChannel without any
+    ULONG no_of_transfers;
+    ULONG no_of_observations;
+    ULONG split_transfers;          // data transfers that ran over a boundary
+    double first_observed;          // ticks, the times below are from here
+    double fit_period_number;       // the period number of the last observation in the fit
+    double fit_sums[6];             // of the line fitted to the first observations
+    ULONG probe_counter;
+    ULONG probe_misses;
+    ULONG frames_since_probe;
+    LONGLONG next_acquisition;      // ticks, when to look for the boundaries again if it didn't work
+    double last_target;             // ticks, the boundary the last frame was sent for
+} frame_sync = {FALSE, FALSE, SYNC_NOMINAL_PERIOD_US};
+
+// Forgets everything. 'nominal_period_us' is where the period estimate starts from.
+static void sync_reset(double nominal_period_us)
+{
+    now_ticks(); // Makes sure qpc_frequency is set.
+    memset(&frame_sync.timing, 0, sizeof(frame_sync.timing));
+    frame_sync.locked = FALSE;
+    frame_sync.nominal_period_us = nominal_period_us;
+    frame_sync.nominal_period = nominal_period_us * qpc_frequency / 1e6;
+    frame_sync.period = frame_sync.nominal_period;
+    frame_sync.boundary = 0;
+    frame_sync.phase_error = 0;
+    frame_sync.phase_error_square = 0;
+    frame_sync.no_of_transfers = 0;
+    frame_sync.no_of_observations = 0;
+    frame_sync.split_transfers = 0;
+    frame_sync.probe_counter = 0;
+    frame_sync.probe_misses = 0;
+    frame_sync.frames_since_probe = 0;
+    frame_sync.next_acquisition = 0;
+    frame_sync.last_target = 0;
+}
+
+// Feeds the timing of a transfer to the loop. Only the refresh thread calls this.
+// Returns TRUE if there was a frame boundary in the transfer.
+// Only the probes move the loop: they are centred around where we think the boundary is, so the ones that hit
+// are spread evenly around the real one. Data transfers are aimed before the boundary, so they would drag it early.
+static BOOL sync_observe(LONGLONG submitted, LONGLONG completed, UINT length, BOOL is_data)
+{
+    sync_transfer_timing *timing = &frame_sync.timing[(min(length, 512) + 7) / 8];
+    double duration = (double) (completed - submitted);
+    double excess = duration - timing->baseline;
+
+    frame_sync.no_of_transfers++;
+
+    if(timing->no_of_samples == 0)
+    {
+        timing->baseline = duration;
+        timing->jitter = 0;
+        timing->no_of_samples = 1;
+        return FALSE;
+    }
+
+    // Normal transfer: update the baseline. If we started with a slow one, this pulls the baseline down quickly.
+    if(excess <= 4 * timing->jitter + qpc_frequency / 20000.0)
+    {
+        timing->baseline += excess / ((excess < 0) ? 4 : 16);
+        timing->jitter += (fabs(excess) - timing->jitter) / 16;
+        timing->no_of_samples++;
+        return FALSE;
+    }
+
+    if(timing->no_of_samples < SYNC_MIN_OBSERVATIONS)
+        return FALSE; // We don't know what normal is for this size yet.
+
+    if(is_data)
+    {
+        frame_sync.split_transfers++;
+        return TRUE;
+    }
+
+    // The boundary is somewhere in the transfer. The middle is our best guess, the loop averages out the rest.
+    double observed = (double) submitted + timing->baseline / 2;
+
+    if(frame_sync.no_of_observations++ == 0)
+    {
+        frame_sync.boundary = observed;
+        frame_sync.first_observed = observed;
+        frame_sync.fit_period_number = 0;
+        memset(&frame_sync.fit_sums, 0, sizeof(frame_sync.fit_sums));
+    }
+
+    double no_of_periods = floor((observed - frame_sync.boundary) / frame_sync.period + 0.5);
+    double predicted = frame_sync.boundary + no_of_periods * frame_sync.period;
+    double error = observed - predicted;
+
+    // Something way off is more likely to be Windows getting in the way than the uDMX, so it's ignored.
+    // If it keeps happening, we unlock.
+    if(frame_sync.no_of_observations > 1 && fabs(error) > frame_sync.period / 4)
+    {
+        frame_sync.no_of_observations--;
+        frame_sync.phase_error_square += (error * error - frame_sync.phase_error_square) / 8;
+        if(frame_sync.phase_error_square > (frame_sync.period / 8) * (frame_sync.period / 8))
+            frame_sync.locked = FALSE;
+        return TRUE;
+    }
+
+    frame_sync.phase_error = error;
+
+    if(frame_sync.no_of_observations <= SYNC_FIT_OBSERVATIONS)
+    {
+        // At first, fit a line on (period number, time): this pulls in from a nominal period that's a bit off,
+        // and it gets more accurate as the observations spread out. The period numbers are not ambiguous,
+        // because we never go more than a few periods without an observation while acquiring, and after that,
+        // the period is accurate enough to count a lot of them.
+        double k = (frame_sync.fit_period_number += no_of_periods);
+        double t = observed - frame_sync.first_observed;
+        double *sums = frame_sync.fit_sums; // n, sum(k), sum(t), sum(k^2), sum(k*t), sum(t^2)
+
+        sums[0] += 1;
+        sums[1] += k;
+        sums[2] += t;
+        sums[3] += k * k;
+        sums[4] += k * t;
+        sums[5] += t * t;
+
+        double determinant = sums[0] * sums[3] - sums[1] * sums[1];
+        double slope = 0, intercept = 0;
+        if(sums[0] >= 3 && determinant > 0)
+        {
+            slope = (sums[0] * sums[4] - sums[1] * sums[2]) / determinant;
+            intercept = (sums[2] - slope * sums[1]) / sums[0];
+        }
+
+        if(slope > frame_sync.nominal_period * 0.9 && slope < frame_sync.nominal_period * 1.1)
+        {
+            frame_sync.period = slope;
+            frame_sync.boundary = frame_sync.first_observed + intercept + k * slope;
+
+            // The residual of the fit is the phase error. We are locked if the observations are on a straight line.
+            if(frame_sync.no_of_observations >= SYNC_ACQUISITION_OBSERVATIONS)
+            {
+                frame_sync.phase_error_square = max(sums[5] - intercept * sums[2] - slope * sums[4], 0) / sums[0];
+                frame_sync.locked = (frame_sync.phase_error_square < timing->baseline * timing->baseline);
+            }
+        }
+        else
+            frame_sync.boundary = predicted + error / 2;
+
+        return TRUE;
+    }
+
+    // After that, a second order loop with a narrow bandwidth follows the drift.
+    frame_sync.phase_error_square += (error * error - frame_sync.phase_error_square) / 8;
+    frame_sync.boundary = predicted + error / 4;
+    if(no_of_periods >= 1)
+    {
+        double correction = error / (16 * no_of_periods);
+        correction = max(correction, -frame_sync.period / 1000);
+        correction = min(correction, frame_sync.period / 1000);
+        frame_sync.period += correction;
+    }
+
+    // Keep the period sane, a few bad observations shouldn't send it anywhere silly.
+    frame_sync.period = max(frame_sync.period, frame_sync.nominal_period * 0.9);
+    frame_sync.period = min(frame_sync.period, frame_sync.nominal_period * 1.1);
+
+    frame_sync.locked = (frame_sync.phase_error_square < timing->baseline * timing->baseline);
+
+    return TRUE;
+}
+
+// The first estimated frame boundary after 'time', which is also well after the one the last frame was sent for.
+static double sync_next_boundary(double time)
+{
+    double boundary = frame_sync.boundary + ceil((time - frame_sync.boundary) / frame_sync.period) * frame_sync.period;
+
+    while(boundary < frame_sync.last_target + frame_sync.period / 2)
+        boundary += frame_sync.period;
+
+    return boundary;
+}
+
+// How long before a boundary a transfer of 'length' bytes has to start, to finish just before it.
+// If we haven't seen this size enough times, a bigger one we did see will do. Failing that, scale up the biggest we've seen.
+static double sync_lead(UINT length)
+{
+    UINT no_of_packets = (min(length, 512) + 7) / 8;
+    UINT i;
+
+    for(i = no_of_packets; i <= 64; i++)
+        if(frame_sync.timing[i].no_of_samples >= SYNC_MIN_OBSERVATIONS)
+            break;
+
+    if(i > 64)
+    {
+        for(i = no_of_packets; i > 0; i--)
+            if(frame_sync.timing[i].no_of_samples >= SYNC_MIN_OBSERVATIONS)
+                break;
+        if(i == 0)
+            return frame_sync.period / 2; // We know nothing yet.
+    }
+
+    const sync_transfer_timing *timing = &frame_sync.timing[i];
+    double baseline = (i > 0) ? timing->baseline * max(no_of_packets, i) / i : timing->baseline;
+
+    return baseline + 4 * timing->jitter + sqrt(frame_sync.phase_error_square) + qpc_frequency / 10000.0;
+}
+
+
+
+/*
+    Error reporting.
+
+    mexErrMsgTxt() jumps straight out of mexFunction(), so everything that should be released has to be released
+    before it's called. This is also slow, and in a loop that sends frames, one bad frame shouldn't stop everything.
+    So the errors of the commands that are called in a loop, and the failed transfers (also from the refresh thread),
+    are recorded here with a code, and dmx('last_error') tells what happened.
+*/
+
+#define DMX_ERROR_NONE 0
+#define DMX_ERROR_ARGUMENT 1        // something was wrong with the arguments
+#define DMX_ERROR_DEVICE 2          // the device couldn't be found or opened
+#define DMX_ERROR_TRANSFER 3        // a transfer failed
+
+static struct
+{
+    LONG code;
+    DWORD system_error;             // GetLastError(), if Windows or libusbK had something to say
+    char command[32];
+    char message[256];
+    LONGLONG timestamp;             // ticks
+    ULONG no_of_errors;             // since dmx('start'), or since it was cleared
+} last_error;
+
+// This is called from both Matlab's thread and the refresh thread.
+static void error_record(LONG code, const char *command, const char *message, DWORD system_error)
+{
+    const char *prefix = "dmx.mex::";
+
+    if(!strncmp(message, prefix, strlen(prefix)))
+        message += strlen(prefix);
+
+    EnterCriticalSection(&engine_lock);
+    last_error.code = code;
+    last_error.system_error = system_error;
+    last_error.timestamp = now_ticks();
+    last_error.no_of_errors++;
+    strncpy(last_error.command, command, sizeof(last_error.command) - 1);
+    last_error.command[sizeof(last_error.command) - 1] = '\0';
+    strncpy(last_error.message, message, sizeof(last_error.message) - 1);
+    last_error.message[sizeof(last_error.message) - 1] = '\0';
+    last_error.message[strcspn(last_error.message, "\n")] = '\0';
+    LeaveCriticalSection(&engine_lock);
+}
+
+
+
+/*
+    Worker thread settings.
+
+    The refresh thread competes with Matlab's own threads, the graphics, and everything else on the machine.
+    dmx('config') can raise its priority, register it with the multimedia class scheduler (MMCSS, this is what
+    audio software uses), pin it to some CPUs, and make the Windows timer tick faster, so that Sleep() and the waits
+    in the thread wake up when they should, and not up to 15.6 ms later.
+    The avrt and winmm functions are looked up when they are needed, so the build line stays the same.
+    To see if it helped, the thread keeps track of how late the transfers were issued, compared to when they were due.
+*/
+
+#define WORKER_MAX_MMCSS_TASK 64
+#define WORKER_HISTOGRAM_BINS 256
+#define WORKER_HISTOGRAM_BIN_US 20.0 // so the histogram goes up to about 5 ms
+
+typedef HANDLE (WINAPI *mmcss_begin_function)(LPCSTR, DWORD *);
+typedef BOOL (WINAPI *mmcss_priority_function)(HANDLE, int);
+typedef BOOL (WINAPI *mmcss_end_function)(HANDLE);
+typedef UINT (WINAPI *timer_period_function)(UINT);
+
+static struct
+{
+    int priority;                           // THREAD_PRIORITY_...
+    DWORD_PTR affinity_mask;                // 0 is wherever Windows wants
+    UINT timer_resolution_ms;               // 0 leaves it alone
+    char mmcss_task[WORKER_MAX_MMCSS_TASK]; // empty if not used
+    UINT timer_resolution_set;              // what we asked for with timeBeginPeriod(), so it can be undone
+    HMODULE avrt;
+    HMODULE winmm;
+    volatile LONG mmcss_active;
+    volatile LONG cpu;                      // the CPU the last transfer was issued from
+    // How late the transfers were issued. Only the refresh thread writes these.
+    ULONG no_of_issues;
+    double issue_late_sum;                  // ticks
+    double issue_late_square_sum;
+    double issue_late_max;
+    ULONG issue_histogram[WORKER_HISTOGRAM_BINS + 1]; // the last one is for everything later than that
+} worker = {THREAD_PRIORITY_NORMAL};
+
+// Returns NULL if the library or the function is not there.
+static FARPROC worker_function(HMODULE *library, const char *library_name, const char *function_name)
+{
+    if(*library == NULL)
+        *library = LoadLibraryA(library_name);
+
+    return (*library != NULL) ? GetProcAddress(*library, function_name) : NULL;
+}
+
+static void worker_reset_statistics(void)
+{
+    worker.no_of_issues = 0;
+    worker.issue_late_sum = 0;
+    worker.issue_late_square_sum = 0;
+    worker.issue_late_max = 0;
+    worker.cpu = -1;
+    memset(worker.issue_histogram, 0, sizeof(worker.issue_histogram));
+}
+
+// Called from the refresh thread for every transfer with data.
+static void worker_issued(LONGLONG due, LONGLONG issued)
+{
+    double late = (double) max(issued - due, 0);
+    ULONG bin = (ULONG) (late * 1e6 / (qpc_frequency * WORKER_HISTOGRAM_BIN_US));
+
+    worker.no_of_issues++;
+    worker.issue_late_sum += late;
+    worker.issue_late_square_sum += late * late;
+    if(late > worker.issue_late_max)
+        worker.issue_late_max = late;
+    worker.issue_histogram[min(bin, WORKER_HISTOGRAM_BINS)]++;
+    worker.cpu = (LONG) GetCurrentProcessorNumber();
+}
+
+// The lateness 'fraction' of the transfers were issued within, in ms. This is only as good as the histogram bins.
+static double worker_issue_percentile(double fraction)
+{
+    ULONG target = (ULONG) ceil(fraction * worker.no_of_issues), sum = 0;
+
+    if(worker.no_of_issues == 0)
+        return 0;
+
+    for(ULONG bin = 0; bin < WORKER_HISTOGRAM_BINS; bin++)
+    {
+        sum += worker.issue_histogram[bin];
+        if(sum >= target)
+            return (bin + 1) * WORKER_HISTOGRAM_BIN_US / 1000.0;
+    }
+
+    return worker.issue_late_max * 1000.0 / qpc_frequency;
+}
+
+// Returns NULL if the timer resolution was set (or there was nothing to do), otherwise an error message.
+static const char *worker_timer_begin(void)
+{
+    if(worker.timer_resolution_ms == 0)
+        return NULL;
+
+    timer_period_function time_begin_period = (timer_period_function) worker_function(&worker.winmm, "winmm.dll", "timeBeginPeriod");
+    if(time_begin_period == NULL)
+        return "dmx.mex::timeBeginPeriod() is not available, so the timer resolution can't be set.\n";
+
+    if(time_begin_period(worker.timer_resolution_ms) != 0) // TIMERR_NOERROR
+        return "dmx.mex::Windows didn't accept the timer resolution. Try a longer one.\n";
+
+    worker.timer_resolution_set = worker.timer_resolution_ms;
+    return NULL;
+}
+
+static void worker_timer_end(void)
+{
+    if(worker.timer_resolution_set == 0)
+        return;
+
+    timer_period_function time_end_period = (timer_period_function) worker_function(&worker.winmm, "winmm.dll", "timeEndPeriod");
+    if(time_end_period != NULL)
+        time_end_period(worker.timer_resolution_set);
+    worker.timer_resolution_set = 0;
+}
+
+// Sets the priority and the affinity of the thread. Returns NULL if it worked, otherwise an error message.
+static const char *worker_apply(HANDLE thread)
+{
+    if(!SetThreadPriority(thread, worker.priority))
+        return "dmx.mex::Could not set the priority of the refresh thread.\n";
+
+    if(worker.affinity_mask != 0 && !SetThreadAffinityMask(thread, worker.affinity_mask))
+        return "dmx.mex::Could not pin the refresh thread to the CPUs given.\n";
+
+    return NULL;
+}
+
+// This must be called from the thread itself. Returns the MMCSS handle, or NULL if it's not used or it didn't work.
+static HANDLE worker_mmcss_begin(void)
+{
+    DWORD task_index = 0;
+    HANDLE mmcss = NULL;
+
+    worker.mmcss_active = FALSE;
+    if(worker.mmcss_task[0] == '\0')
+        return NULL;
+
+    mmcss_begin_function mmcss_begin = (mmcss_begin_function) worker_function(&worker.avrt, "avrt.dll", "AvSetMmThreadCharacteristicsA");
+    mmcss_priority_function mmcss_priority = (mmcss_priority_function) worker_function(&worker.avrt, "avrt.dll", "AvSetMmThreadPriority");
+    if(mmcss_begin == NULL || (mmcss = mmcss_begin(worker.mmcss_task, &task_index)) == NULL)
+        return NULL;
+
+    if(mmcss_priority != NULL)
+        mmcss_priority(mmcss, 1); // AVRT_PRIORITY_HIGH
+
+    worker.mmcss_active = TRUE;
+    return mmcss;
+}
+
+static void worker_mmcss_end(HANDLE mmcss)
+{
+    if(mmcss == NULL)
+        return;
+
+    mmcss_end_function mmcss_end = (mmcss_end_function) worker_function(&worker.avrt, "avrt.dll", "AvRevertMmThreadCharacteristics");
+    if(mmcss_end != NULL)
+        mmcss_end(mmcss);
+    worker.mmcss_active = FALSE;
+}
+
+
+
+/*
+    Background refresh.
+
+    dmx('start') keeps the device open, and starts a thread that renders and sends a frame at a fixed rate.
+    Only the channels that actually changed since the last frame are sent, so this is mostly idle,
+    unless there are dithered channels. While it's running, the commands just update the shadow universe.
+*/
+
+#define REFRESH_DEFAULT_RATE 44.0 // Hz, a full DMX512 frame takes about 22.7 ms.
+
+static struct
+{
+    volatile LONG running;
+    KLST_HANDLE device_list;
+    KUSB_HANDLE handle;
+    HANDLE thread;
+    HANDLE stop_event;
+    double refresh_rate;
+    UCHAR sent[512];                // what the device has, as far as we know
+    UCHAR output[512];              // the frame being sent, the urgent lane renders into it too
+    BOOL resync;                    // send everything in the next frame, we don't know what the device has
+    volatile LONG frames;
+    volatile LONG failed_transfers;
+} session;
+
+static void urgent_send(void)
+{
+    EnterCriticalSection(&engine_lock);
+    if(!urgent.pending)
+    {
+        LeaveCriticalSection(&engine_lock);
+        return;
+    }
+
+    USHORT first = urgent.first, last = urgent.last;
+    LONGLONG requested = urgent.requested, input_received = urgent.input_received;
+    urgent.first = 512;
+    urgent.last = 0;
+    urgent.pending = FALSE;
+    urgent.input_received = 0;
+    output_range_fix(&first, &last);
+    output_render(first, last, &session.output[first]);
+    LeaveCriticalSection(&engine_lock);
+
+    urgent.sending = TRUE;
+    BOOL success = udmx_send_range(session.handle, first, last - first + 1, &session.output[first]);
+    urgent.sending = FALSE;
+
+    EnterCriticalSection(&engine_lock);
+    if(success)
+    {
+        LONGLONG latency = now_ticks() - requested;
+
+        memcpy(&session.sent[first], &session.output[first], last - first + 1);
+        urgent.no_of_writes++;
+        urgent.latency_sum += latency;
+        urgent.last_latency = latency;
+        if(latency > urgent.latency_max)
+            urgent.latency_max = latency;
+
+        if(input_received != 0)
+        {
+            latency = now_ticks() - input_received;
+            urgent.no_of_inputs++;
+            urgent.input_latency_sum += latency;
+            urgent.last_input_latency = latency;
+            if(latency > urgent.input_latency_max)
+                urgent.input_latency_max = latency;
+        }
+    }
+    else
+        shadow_mark_dirty(first, last); // It goes with the next frame then, not straight away again.
+    LeaveCriticalSection(&engine_lock);
+
+    if(!success)
+    {
+        error_record(DMX_ERROR_TRANSFER, "refresh", "An urgent transfer from the refresh thread failed.", GetLastError());
+        InterlockedIncrement(&session.failed_transfers);
+    }
+}
+
+// Like wait_until(), but returns FALSE straight away if the session is being stopped.
+// Whatever comes up in the urgent lane in the meantime is sent straight away.
+static BOOL refresh_wait_until(LONGLONG deadline)
+{
+    HANDLE events[2] = {session.stop_event, urgent.event};
+
+    while(deadline - now_ticks() > qpc_frequency / 500)
+    {
+        DWORD result = WaitForMultipleObjects(2, events, FALSE, 1);
+        if(result == WAIT_OBJECT_0)
+            return FALSE;
+        if(result == WAIT_OBJECT_0 + 1)
+            urgent_send();
+    }
+    wait_until(deadline);
+    if(urgent.pending)
+        urgent_send();
+
+    return (WaitForSingleObject(session.stop_event, 0) != WAIT_OBJECT_0);
+}
+
+/*
+    Sends 1-byte probes (the same value the device already has) for the frame sync.
+    To find the boundaries, it sends them back to back for a few frames, so every boundary hits one of them.
+    This keeps the thread busy for about a third of a second, so if it didn't work out, it only tries again
+    a few seconds later. Once locked, a single probe goes around where we think the next boundary is, give or
+    take the length of the probe. The offsets come from the golden ratio, so they are spread evenly.
+    The probes are always cmd_SetChannelRange, even though they are 1 channel: the boundaries were found with a data stage.
+    Returns FALSE if the session is being stopped.
+*/
+static BOOL refresh_probe(void)
+{
+    LONGLONG submitted;
+    UINT transferred;
+
+    frame_sync.frames_since_probe = 0;
+
+    if(!frame_sync.locked)
+    {
+        LONGLONG end = now_ticks() + (LONGLONG) ((SYNC_ACQUISITION_OBSERVATIONS + 4) * frame_sync.nominal_period * 1.1);
+
+        frame_sync.no_of_observations = 0;
+        frame_sync.period = frame_sync.nominal_period;
+        while(!frame_sync.locked && now_ticks() < end)
+        {
+            if(WaitForSingleObject(session.stop_event, 0) == WAIT_OBJECT_0)
+                return FALSE;
+            if(urgent.pending)
+                urgent_send();
+
+            submitted = now_ticks();
+            if(!udmx_send_chunk(session.handle, 0, 1, &session.sent[0], &transferred))
+                break;
+            sync_observe(submitted, now_ticks(), 1, FALSE);
+        }
+
+        if(!frame_sync.locked)
+            frame_sync.next_acquisition = now_ticks() + 3 * qpc_frequency;
+        return TRUE;
+    }
+
+    double offset = frame_sync.probe_counter++ * 0.6180339887;
+    double probe_length = frame_sync.timing[1].baseline;
+    double boundary = sync_next_boundary((double) now_ticks() + 2 * probe_length);
+
+    offset -= floor(offset);
+    frame_sync.last_target = boundary; // The next frame goes out at the boundary after.
+    if(!refresh_wait_until((LONGLONG) (boundary - probe_length / 2 + (offset - 0.5) * 2 * probe_length)))
+        return FALSE;
+
+    submitted = now_ticks();
+    if(udmx_send_chunk(session.handle, 0, 1, &session.sent[0], &transferred))
+    {
+        if(sync_observe(submitted, now_ticks(), 1, FALSE))
+            frame_sync.probe_misses = 0;
+        else if(++frame_sync.probe_misses >= 12)
+        {
+            frame_sync.locked = FALSE; // Should have hit by now. Look for the boundaries again.
+            frame_sync.probe_misses = 0;
+        }
+    }
+
+    return TRUE;
+}
+
+static DWORD WINAPI refresh_thread(LPVOID context)
+{
+    LONGLONG period = (LONGLONG) (qpc_frequency / session.refresh_rate);
+    LONGLONG next_frame = now_ticks();
+    UCHAR *output = session.output;
+    BOOL idle = FALSE;
+    HANDLE mmcss = worker_mmcss_begin();
+
+    while(refresh_wait_until(next_frame))
+    {
+        int first, last;
+        LONGLONG frame_ticks = next_frame;
+        LONGLONG due = next_frame;
+        BOOL synced = frame_sync.enabled && frame_sync.locked;
+        double target = 0;
+
+        next_frame += period;
+        if(next_frame < now_ticks())
+            next_frame = now_ticks() + period; // We fell behind. Don't try to catch up with a burst of frames.
+
+        // When locked, probe now and then to stay locked: every 4th frame when there is nothing else to do,
+        // and every 16th when busy, because this pushes the frame back by one DMX frame.
+        if(frame_sync.enabled && !session.resync)
+        {
+            frame_sync.frames_since_probe++;
+            if(synced ? (frame_sync.frames_since_probe >= (idle ? 4u : 16u)) : (now_ticks() >= frame_sync.next_acquisition))
+            {
+                if(!refresh_probe())
+                    break;
+                synced = frame_sync.enabled && frame_sync.locked;
+            }
+        }
+
+        EnterCriticalSection(&engine_lock);
+
+        // The frame is for the next boundary we can still make with everything that may have to go out.
+        // The effects are worked out for when it will be on the bus.
+        if(synced)
+        {
+            first = min(dirty_first, channel_modes.dither_first);
+            last = max((dirty_first <= dirty_last) ? dirty_last : 0, (channel_modes.dither_first <= channel_modes.dither_last) ? channel_modes.dither_last : 0);
+            effects_range(&first, &last);
+            target = sync_next_boundary((double) now_ticks() + sync_lead((first <= last) ? min(last - first + 2, 512) : 1) + qpc_frequency / 2000.0);
+            frame_ticks = (LONGLONG) target;
+        }
+
+        effects_render(frame_ticks);
+        first = min(dirty_first, channel_modes.dither_first);
+        last = max((dirty_first <= dirty_last) ? dirty_last : 0, (channel_modes.dither_first <= channel_modes.dither_last) ? channel_modes.dither_last : 0);
+        if(first <= last)
+        {
+            USHORT render_first = (USHORT) first, render_last = (USHORT) last;
+            output_range_fix(&render_first, &render_last);
+            output_render(render_first, render_last, &output[render_first]);
+            first = render_first;
+            last = render_last;
+        }
+        dirty_first = 512;
+        dirty_last = 0;
+        LeaveCriticalSection(&engine_lock);
+
+        // Only send what actually changed.
+        if(!session.resync)
+        {
+            while(first <= last && output[first] == session.sent[first])
+                first++;
+            while(last >= first && output[last] == session.sent[last])
+                last--;
+        }
+
+        idle = (first > last);
+        if(!idle)
+        {
+            UINT length = (UINT) (last - first + 1);
+            UINT data_length = udmx_is_single((USHORT) length) ? 0 : length; // what the sync sees of it
+
+            if(synced)
+            {
+                // If something held us up (before or while waiting), it's better to go one frame later than to split this one.
+                double lead = sync_lead(data_length);
+                BOOL on_time = FALSE;
+
+                while(!on_time)
+                {
+                    while((double) now_ticks() > target - lead)
+                        target += frame_sync.period;
+                    if(!refresh_wait_until((LONGLONG) (target - lead)))
+                        break;
+                    on_time = ((double) now_ticks() <= target - lead + qpc_frequency / 5000.0); // the lead has a bit of margin
+                }
+                if(!on_time)
+                    break; // The session is being stopped.
+                frame_sync.last_target = target;
+                due = (LONGLONG) (target - lead);
+            }
+
+            LONGLONG submitted = now_ticks();
+            worker_issued(due, submitted);
+            if(udmx_send_range(session.handle, (USHORT) first, (USHORT) length, &output[first]))
+            {
+                sync_observe(submitted, now_ticks(), data_length, TRUE);
+                memcpy(&session.sent[first], &output[first], length);
+                session.resync = FALSE;
+            }
+            else
+            {
+                // Try again in the next frame.
+                error_record(DMX_ERROR_TRANSFER, "refresh", "A transfer from the refresh thread failed.", GetLastError());
+                InterlockedIncrement(&session.failed_transfers);
+                EnterCriticalSection(&engine_lock);
+                shadow_mark_dirty((USHORT) first, (USHORT) last);
+                LeaveCriticalSection(&engine_lock);
+            }
+        }
+
+        InterlockedIncrement(&session.frames);
+    }
+
+    worker_mmcss_end(mmcss);
+    return 0;
+}
+
+// Returns NULL if the session has started, otherwise an error message.
+static const char *session_start(double refresh_rate)
+{
+    if(session.running)
+        return "dmx.mex::The output is already running. Call dmx('stop') first.\n";
+
+    session.device_list = NULL;
+    session.handle = NULL;
+    if(device_is_local())
+    {
+        if(!LstK_Init(&session.device_list, 0))
+            return "dmx.mex::An error occured getting the device list.";
+
+        const char *error_message = udmx_open(session.device_list, &session.handle);
+        if(error_message != NULL)
+        {
+            LstK_Free(session.device_list);
+            return error_message;
+        }
+    }
+
+    now_ticks(); // Makes sure qpc_frequency is set.
+    session.refresh_rate = refresh_rate;
+    session.frames = 0;
+    session.failed_transfers = 0;
+    session.resync = TRUE;
+    sync_reset(frame_sync.nominal_period_us);
+    worker_reset_statistics();
+    memset(&last_error, 0, sizeof(last_error));
+    urgent.first = 512;
+    urgent.last = 0;
+    urgent.pending = FALSE;
+    urgent.no_of_writes = 0;
+    urgent.latency_sum = urgent.latency_max = urgent.last_latency = 0;
+    urgent.input_received = 0;
+    urgent.no_of_inputs = 0;
+    urgent.input_latency_sum = urgent.input_latency_max = urgent.last_input_latency = 0;
+
+    // Everything goes out in the first frame.
+    EnterCriticalSection(&engine_lock);
+    shadow_mark_dirty(0, 511);
+    LeaveCriticalSection(&engine_lock);
+
+    // The thread starts suspended, so it runs with the priority and on the CPUs from dmx('config') from the start.
+    const char *error_message = worker_timer_begin();
+    session.stop_event = NULL;
+    urgent.event = NULL;
+    session.thread = NULL;
+    if(error_message == NULL)
+    {
+        session.stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+        urgent.event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if(session.stop_event != NULL && urgent.event != NULL)
+            session.thread = CreateThread(NULL, 0, refresh_thread, NULL, CREATE_SUSPENDED, NULL);
+        if(session.thread == NULL)
+            error_message = "dmx.mex::Could not start the refresh thread.\n";
+        else
+            error_message = worker_apply(session.thread);
+    }
+    if(error_message != NULL)
+    {
+        if(session.thread != NULL)
+        {
+            SetEvent(session.stop_event);
+            ResumeThread(session.thread);
+            WaitForSingleObject(session.thread, INFINITE);
+            CloseHandle(session.thread);
+        }
+        if(session.stop_event != NULL)
+            CloseHandle(session.stop_event);
+        if(urgent.event != NULL)
+            CloseHandle(urgent.event);
+        urgent.event = NULL;
+        worker_timer_end();
+        if(session.handle != NULL)
+            Usb.Free(session.handle);
+        if(session.device_list != NULL)
+            LstK_Free(session.device_list);
+        return error_message;
+    }
+
+    ResumeThread(session.thread);
+    session.running = TRUE;
+
+    // The thread and the open device must outlive this call, so don't let Matlab unload us.
+    mexLock();
+    return NULL;
+}
+
+static void session_stop(void)
+{
+    if(!session.running)
+        return;
+
+    SetEvent(session.stop_event);
+    WaitForSingleObject(session.thread, INFINITE);
+    CloseHandle(session.thread);
+    CloseHandle(session.stop_event);
+    EnterCriticalSection(&engine_lock);
+    CloseHandle(urgent.event);
+    urgent.event = NULL;
+    urgent.pending = FALSE;
+    LeaveCriticalSection(&engine_lock);
+    session.running = FALSE;
+    worker_timer_end();
+
+    if(session.handle != NULL)
+        Usb.Free(session.handle);
+    if(session.device_list != NULL)
+        LstK_Free(session.device_list);
+    session.handle = NULL;
+    session.device_list = NULL;
+
+    mexUnlock();
+}
+
+// When the last flush started and finished its transfer. If there was nothing to send, both are when it was called.
+static LONGLONG flush_submitted, flush_completed;
+static DWORD flush_system_error;            // GetLastError() if the last flush failed
+
+// Returns NULL if the dirty channels were sent (or there was nothing to send), otherwise an error message.
+// *success is what the transfer returned. If it failed, the channels stay dirty, and go out with the next flush.
+// When the refresh thread is running, this does nothing: the dirty channels go out with the next frame.
+static const char *shadow_flush(KLST_HANDLE deviceList, BOOL *success)
+{
+    KUSB_HANDLE handle = NULL;
+    UCHAR output[512];
+
+    *success = TRUE;
+    flush_submitted = flush_completed = now_ticks();
+    if(session.running || dirty_first > dirty_last)
+        return NULL;
+
+    // Open the device, fail if cannot. The simulator and the daemon don't need one.
+    if(device_is_local())
+    {
+        const char *error_message = udmx_open(deviceList, &handle);
+        if(error_message != NULL)
+            return error_message;
+    }
+
+    output_range_fix(&dirty_first, &dirty_last);
+    USHORT start_address = dirty_first;
+    USHORT no_of_channels = dirty_last - dirty_first + 1;
+
+    output_render(dirty_first, dirty_last, output);
+    flush_submitted = now_ticks();
+    *success = udmx_send_range(handle, start_address, no_of_channels, output);
+    flush_completed = now_ticks();
+    flush_system_error = (*success) ? ERROR_SUCCESS : GetLastError();
+    #ifdef VERBOSE
+    mexPrintf("dmx.mex::UsbK_ControlTransfer():\n\tPkt.Value (no_of_channels): %d,\n\tPkt.Index (start_address): %d,\n\tPkt.Length (no_of_channels): %d\n", no_of_channels, start_address, no_of_channels);
+    mexPrintf("dmx.mex::Cleaning up..\n");
+    #endif
+
+    if(*success)
+    {
+        dirty_first = 512;
+        dirty_last = 0;
+    }
+
+    if(handle != NULL)
+        Usb.Free(handle);
+
+    return NULL;
+}
+
+/*
+    Network input bridge.
+
+    This is for driving the uDMX from a lighting console (or anything else that talks Art-Net or sACN), through the
+    refresh thread, so it goes through the same shadow universe, patch, curves and transfers as everything else.
+    A thread listens for one universe, and the levels that changed since the last packet are written into the shadow
+    universe, like dmx('send') would. They also go in the urgent lane, so the refresh thread sends the changed range
+    straight away, instead of waiting for the next frame. Whatever Matlab writes to the same channels stays until the
+    console changes them again.
+    There is no recvmmsg() on Windows, so when the socket wakes us up, we read everything that's waiting in a loop
+    (the socket is non-blocking), and only merge once for all of it: a console sending faster than the device can take
+    costs one transfer for a batch, not one for each packet.
+*/
+
+#define BRIDGE_POLL_MS 100          // how often the thread checks if it should stop
+#define BRIDGE_MAX_BATCH 64         // merge after this many packets even if there are more
+#define BRIDGE_MAX_PACKET 1144      // the longest Art-Net or sACN packet we take, with some room
+#define BRIDGE_SOURCE_TIMEOUT_MS 2500 // E1.31 says a source is gone after this
+#define BRIDGE_MAX_SOURCES 8        // sources we keep track of at the same time
+#define BRIDGE_BENCH_PACKETS 20000
+
+enum {BRIDGE_ARTNET = 1, BRIDGE_SACN = 2};
+
+// A source: an sACN one by its CID, an Art-Net one by its address and port (there is nothing else to go by). The
+// sequence numbers are for each source, and so is the priority, for sACN.
+typedef struct
+{
+    BOOL used;
+    UCHAR cid[16];                  // for Art-Net, the sockaddr_in's address and port, and zeros
+    UCHAR priority;
+    UCHAR sequence;
+    LONGLONG heard;                 // when its last packet came in
+} bridge_source;
+
+static struct
+{
+    volatile LONG running;
+    volatile LONG stop;
+    int protocol;                   // BRIDGE_ARTNET or BRIDGE_SACN
+    USHORT universe;
+    struct sockaddr_in address;     // where we listen
+    SOCKET socket;
+    HANDLE thread;
+    USHORT input[512];              // the last levels from the network, 0xFFFF until the first packet has the channel
+    bridge_source sources[BRIDGE_MAX_SOURCES];
+    volatile LONG packets_received; // packets for our universe
+    volatile LONG packets_ignored;  // everything else that came in on the socket
+    volatile LONG batches;
+    volatile LONG max_batch;
+    volatile LONG channels_changed;
+} bridge = {FALSE, FALSE, 0, 0, {0}, INVALID_SOCKET};
+
+// Finds the source with 'cid', or a free slot for it (NULL if there is none). Sources we haven't heard from for
+// BRIDGE_SOURCE_TIMEOUT_MS are forgotten on the way.
+static bridge_source *bridge_find_source(const UCHAR *cid, LONGLONG received)
+{
+    bridge_source *free_slot = NULL;
+
+    for(int i = 0; i < BRIDGE_MAX_SOURCES; i++)
+    {
+        bridge_source *source = &bridge.sources[i];
+
+        if(source->used && received - source->heard > BRIDGE_SOURCE_TIMEOUT_MS * qpc_frequency / 1000)
+            source->used = FALSE;
+        if(source->used && !memcmp(source->cid, cid, 16))
+            return source;
+        if(!source->used && free_slot == NULL)
+            free_slot = source;
+    }
+
+    return free_slot;
+}
+
+// Reads the levels from an ArtDmx packet for our universe. Returns the number of channels, or 0 if it's not for us.
+// Late packets (that arrived after a newer one from the same sender) are ignored, unless the sender doesn't number
+// them: Art-Net's sequence 0 means that.
+static USHORT bridge_parse_artnet(const UCHAR *packet, int length, UCHAR *levels, const struct sockaddr_in *sender, LONGLONG received)
+{
+    if(length < ARTNET_HEADER_LENGTH + 2 || memcmp(packet, "Art-Net", 8) || packet[8] != 0x00 || packet[9] != 0x50)
+        return 0;
+
+    if((USHORT) (packet[14] | ((packet[15] & 0x7F) << 8)) != bridge.universe)
+        return 0;
+
+    USHORT no_of_channels = (USHORT) ((packet[16] << 8) | packet[17]);
+    if(no_of_channels < 2 || no_of_channels > 512 || ARTNET_HEADER_LENGTH + no_of_channels > length)
+        return 0;
+
+    if(packet[12] != 0)
+    {
+        UCHAR id[16] = {0};
+        memcpy(&id[0], &sender->sin_addr, 4);
+        memcpy(&id[4], &sender->sin_port, 2);
+
+        bridge_source *source = bridge_find_source(id, received);
+        if(source != NULL) // with more senders than we keep track of, the rest just go through
+        {
+            // The same window as for sACN. The sequence goes 1...255, and then 1 again, so this works across that too.
+            signed char behind = (signed char) (packet[12] - source->sequence);
+            if(source->used && behind <= 0 && behind > -20)
+                return 0;
+
+            source->used = TRUE;
+            memcpy(source->cid, id, 16);
+            source->sequence = packet[12];
+            source->heard = received;
+        }
+    }
+
+    memcpy(levels, &packet[ARTNET_HEADER_LENGTH], no_of_channels);
+    return no_of_channels;
+}
+
+// The same for an E1.31 data packet. Previews, stream terminations, packets from lower priority sources, and late
+// packets (that arrived after a newer one from the same source) are ignored too. The sources are told apart by their
+// CID, so a main and a backup console (or two of anything) don't get in each other's way.
+static USHORT bridge_parse_sacn(const UCHAR *packet, int length, UCHAR *levels, LONGLONG received)
+{
+    if(length < SACN_HEADER_LENGTH || packet[1] != 0x10 || memcmp(&packet[4], "ASC-E1.17", 9))
+        return 0;
+
+    // the root and the framing layer vectors, the universe, and the DMP layer's header and the start code
+    if(packet[21] != 0x04 || packet[43] != 0x02 || ((packet[113] << 8) | packet[114]) != bridge.universe
+       || packet[117] != 0x02 || packet[118] != 0xA1 || packet[125] != 0x00)
+        return 0;
+
+    bridge_source *source = bridge_find_source(&packet[22], received);
+    if(source == NULL) // more sources than we keep track of
+        return 0;
+
+    if(packet[112] & 0x40) // the source is going away
+    {
+        source->used = FALSE;
+        return 0;
+    }
+    if(packet[112] & 0x80) // preview data
+        return 0;
+
+    USHORT no_of_channels = (USHORT) (((packet[123] << 8) | packet[124]) - 1);
+    if(no_of_channels < 1 || no_of_channels > 512 || SACN_HEADER_LENGTH + no_of_channels > length)
+        return 0;
+
+    // E1.31 6.7.2: a packet that's up to 20 behind the last one from the same source is out of order.
+    signed char behind = (signed char) (packet[111] - source->sequence);
+    if(source->used && behind <= 0 && behind > -20)
+        return 0;
+
+    if(!source->used)
+    {
+        source->used = TRUE;
+        memcpy(source->cid, &packet[22], 16);
+    }
+    source->sequence = packet[111];
+    source->priority = packet[108];
+    source->heard = received;
+
+    // Only the sources with the highest priority we hear get through.
+    for(int i = 0; i < BRIDGE_MAX_SOURCES; i++)
+    {
+        const bridge_source *other = &bridge.sources[i];
+        if(other->used && other->priority > source->priority && received - other->heard <= BRIDGE_SOURCE_TIMEOUT_MS * qpc_frequency / 1000)
+            return 0;
+    }
+
+    memcpy(levels, &packet[SACN_HEADER_LENGTH], no_of_channels);
+    return no_of_channels;
+}
+
+// Writes the levels that changed into the shadow universe, and puts them in the urgent lane.
+static void bridge_merge(const UCHAR *levels, USHORT no_of_channels, LONGLONG received)
+{
+    USHORT first = 512, last = 0;
+    LONG changed = 0;
+
+    EnterCriticalSection(&engine_lock);
+    for(USHORT channel = 0; channel < no_of_channels; channel++)
+    {
+        if(bridge.input[channel] == levels[channel])
+            continue;
+
+        bridge.input[channel] = levels[channel];
+        shadow_universe[channel] = levels[channel] * 257;
+        if(channel < first)
+            first = channel;
+        last = channel;
+        changed++;
+    }
+
+    if(first <= last)
+    {
+        shadow_mark_dirty(first, last);
+        if(urgent.input_received == 0)
+            urgent.input_received = received;
+        urgent_mark(first, last, TRUE);
+    }
+    LeaveCriticalSection(&engine_lock);
+
+    InterlockedExchangeAdd(&bridge.channels_changed, changed);
+}
+
+static DWORD WINAPI bridge_thread(LPVOID context)
+{
+    UCHAR packet[BRIDGE_MAX_PACKET];
+    UCHAR levels[512];
+
+    while(!bridge.stop)
+    {
+        fd_set readable;
+        struct timeval timeout = {0, BRIDGE_POLL_MS * 1000};
+
+        FD_ZERO(&readable);
+        FD_SET(bridge.socket, &readable);
+        if(select((int) bridge.socket + 1, &readable, NULL, NULL, &timeout) <= 0)
+            continue;
+
+        // Everything that's waiting now is one batch. The levels are overwritten, so the latest packet wins.
+        LONGLONG received = now_ticks();
+        USHORT no_of_channels = 0;
+        LONG batch = 0;
+        for(; batch < BRIDGE_MAX_BATCH; batch++)
+        {
+            struct sockaddr_in sender;
+            int sender_length = sizeof(sender);
+            int length = recvfrom(bridge.socket, (char *) packet, sizeof(packet), 0, (struct sockaddr *) &sender, &sender_length);
+            if(length == SOCKET_ERROR)
+                break; // WSAEWOULDBLOCK, that was all of it
+
+            USHORT packet_channels = (bridge.protocol == BRIDGE_ARTNET) ? bridge_parse_artnet(packet, length, levels, &sender, received) : bridge_parse_sacn(packet, length, levels, received);
+            if(packet_channels == 0)
+            {
+                InterlockedIncrement(&bridge.packets_ignored);
+                continue;
+            }
+
+            InterlockedIncrement(&bridge.packets_received);
+            if(packet_channels > no_of_channels)
+                no_of_channels = packet_channels;
+        }
+
+        if(batch == 0)
+            continue;
+        InterlockedIncrement(&bridge.batches);
+        if(batch > bridge.max_batch)
+            bridge.max_batch = batch;
+
+        if(no_of_channels > 0)
+            bridge_merge(levels, no_of_channels, received);
+    }
+
+    return 0;
+}
+
+static void bridge_stop(void)
+{
+    if(!bridge.running)
+        return;
+
+    InterlockedExchange(&bridge.stop, TRUE);
+    WaitForSingleObject(bridge.thread, INFINITE);
+    CloseHandle(bridge.thread);
+    closesocket(bridge.socket);
+    WSACleanup();
+    bridge.socket = INVALID_SOCKET;
+    bridge.running = FALSE;
+}
+
+// Opens the socket, joins the multicast group for sACN, and starts the thread. Returns NULL if it worked, otherwise
+// an error message.
+static const char *bridge_start(int protocol, USHORT universe, const struct sockaddr_in *address)
+{
+    WSADATA wsa_data;
+    BOOL reuse = TRUE;
+    int receive_buffer = NET_SEND_BUFFER;
+    u_long non_blocking = 1;
+
+    if(WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+        return "dmx.mex::Could not start Winsock.\n";
+
+    bridge.socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(bridge.socket == INVALID_SOCKET)
+    {
+        WSACleanup();
+        return "dmx.mex::Could not open a UDP socket.\n";
+    }
+
+    // Other programs on this computer may be listening for Art-Net too.
+    setsockopt(bridge.socket, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(reuse));
+    setsockopt(bridge.socket, SOL_SOCKET, SO_RCVBUF, (const char *) &receive_buffer, sizeof(receive_buffer));
+    ioctlsocket(bridge.socket, FIONBIO, &non_blocking);
+
+    if(bind(bridge.socket, (const struct sockaddr *) address, sizeof(*address)) == SOCKET_ERROR)
+    {
+        closesocket(bridge.socket);
+        WSACleanup();
+        bridge.socket = INVALID_SOCKET;
+        return "dmx.mex::Could not listen on that address. Is something else using the port?\n";
+    }
+
+    // The sources send to 239.255.x.y. If there is no multicast on this network, unicast still works.
+    if(protocol == BRIDGE_SACN)
+    {
+        struct ip_mreq membership;
+        membership.imr_multiaddr.s_addr = htonl(0xEFFF0000 | universe);
+        membership.imr_interface.s_addr = address->sin_addr.s_addr;
+        setsockopt(bridge.socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *) &membership, sizeof(membership));
+    }
+
+    bridge.protocol = protocol;
+    bridge.universe = universe;
+    bridge.address = *address;
+    for(int i = 0; i < 512; i++)
+        bridge.input[i] = 0xFFFF;
+    memset(bridge.sources, 0, sizeof(bridge.sources));
+    bridge.packets_received = bridge.packets_ignored = 0;
+    bridge.batches = bridge.max_batch = bridge.channels_changed = 0;
+    bridge.stop = FALSE;
+
+    bridge.thread = CreateThread(NULL, 0, bridge_thread, NULL, 0, NULL);
+    if(bridge.thread == NULL)
+    {
+        closesocket(bridge.socket);
+        WSACleanup();
+        bridge.socket = INVALID_SOCKET;
+        return "dmx.mex::Could not start the bridge thread.\n";
+    }
+
+    bridge.running = TRUE;
+    return NULL;
+}
+
+
+
+/*
+    Status buffers.
+
+    In a tight loop, creating the return value for every call keeps Matlab's memory manager busy. Instead, the hot
+    commands can write what happened into a buffer the caller made once: [fail, issued, completed], where the times
+    are when the transfer started and finished, in seconds on the performance counter.
+    This writes into an input argument, which Matlab doesn't expect. Variables share their data until one of them is
+    changed, so the buffer must be made with zeros() and not copied to another variable, or both will change.
+*/
+
+#define STATUS_BUFFER_LENGTH 3
+
+static BOOL status_buffer_valid(const mxArray *buffer)
+{
+    return mxIsDouble(buffer) && !mxIsComplex(buffer) && mxGetNumberOfElements(buffer) >= STATUS_BUFFER_LENGTH;
+}
+
+static void status_buffer_write(const mxArray *buffer, BOOL failed)
+{
+    mxDouble *status_pointer = mxGetData(buffer);
+
+    status_pointer[0] = failed;
+    status_pointer[1] = (double) flush_submitted / qpc_frequency;
+    status_pointer[2] = (double) flush_completed / qpc_frequency;
+}
+
+// Returns 'fail' in the status buffer if there is one, otherwise as the return value, if it was asked for.
+// 'more_outputs' is for the commands that return something after 'fail': when those are asked for, Matlab can't
+// skip the first one, so then 'fail' is returned even with a status buffer.
+static void command_result(int nlhs, mxArray *plhs[], const mxArray *status_input, BOOL failed, BOOL more_outputs)
+{
+    if(status_input != NULL)
+        status_buffer_write(status_input, failed);
+    if((status_input == NULL && nlhs > 0) || (more_outputs && nlhs > 1))
+        plhs[0] = mxCreateLogicalScalar(failed);
+}
+
+// For the commands that are called in a loop. The error is recorded, and while the refresh thread is running,
+// that's it: the command returns 'fail'. Otherwise, this throws, like it always did.
+// Release everything before calling this.
+static void command_failed(LONG code, const char *command, const char *message, DWORD system_error)
+{
+    error_record(code, command, message, system_error);
+    flush_submitted = flush_completed = now_ticks();
+    if(!session.running)
+        mexErrMsgTxt(message);
+}
+
+// The end of the commands that write into the shadow universe, and are called in a loop: without the refresh
+// thread, the dirty range is sent now, otherwise the thread sends it. Errors are recorded (and thrown, without the
+// refresh thread), like in command_failed(). Returns TRUE if it failed.
+static BOOL shadow_flush_command(const char *command)
+{
+    const char *error_message = NULL;
+    BOOL success = TRUE;
+    DWORD system_error = ERROR_SUCCESS;
+
+    // The refresh thread sends it, so as far as this command goes, it's out now. Like shadow_flush() would say.
+    if(session.running)
+    {
+        flush_submitted = flush_completed = now_ticks();
+        return FALSE;
+    }
+
+    KLST_HANDLE device_list = NULL;
+    if(device_is_local() && !LstK_Init(&device_list, 0))
+    {
+        error_message = "dmx.mex::An error occured getting the device list.\n";
+        system_error = GetLastError();
+    }
+    else
+    {
+        error_message = shadow_flush(device_list, &success);
+        system_error = GetLastError();
+        if(device_list != NULL)
+            LstK_Free(device_list);
+    }
+
+    if(error_message != NULL)
+        command_failed(DMX_ERROR_DEVICE, command, error_message, system_error);
+    else if(!success)
+        error_record(DMX_ERROR_TRANSFER, command, "The transfer failed.", flush_system_error);
+
+    return error_message != NULL || !success;
+}
+
+
+
+/*
+    Fixture patch.
+
+    Instead of working out base address offsets in Matlab for every frame, the fixtures can be patched once:
+    each fixture has a name, a base address, and a list of parameter names in channel order.
+    A parameter name ending in ':16' takes two channels: coarse, then fine.
+    The parameters are looked up by "fixture.parameter" in a hash table, or even quicker, by the number
+    dmx('resolve') returns for them.
+*/
+
+#define PATCH_MAX_PARAMETERS 1024
+#define PATCH_HASH_SLOTS 2048 // Power of 2, and at least twice the number of parameters.
+#define PATCH_MAX_NAME 64
+
+typedef struct
+{
+    char name[2 * PATCH_MAX_NAME];  // "fixture.parameter", without the ':16'
+    USHORT channel;                 // 0-511, the coarse channel for 16-bit parameters
+    UCHAR is_16bit;
+} patch_parameter;
+
+typedef struct
+{
+    patch_parameter parameters[PATCH_MAX_PARAMETERS];
+    ULONG no_of_parameters;
+    USHORT hash_table[PATCH_HASH_SLOTS]; // Parameter number + 1, 0 means empty.
+} patch_table;
+
+static patch_table patch;
+
+// FNV-1a of "fixture.parameter". If parameter is NULL, fixture is already the full name.
+static ULONG patch_hash(const char *fixture, const char *parameter)
+{
+    ULONG hash = 2166136261u;
+
+    while(*fixture)
+        hash = (hash ^ (UCHAR) *fixture++) * 16777619u;
+
+    if(parameter != NULL)
+    {
+        hash = (hash ^ (UCHAR) '.') * 16777619u;
+        while(*parameter)
+            hash = (hash ^ (UCHAR) *parameter++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static BOOL patch_name_matches(const char *name, const char *fixture, const char *parameter)
+{
+    size_t fixture_length;
+
+    if(parameter == NULL)
+        return !strcmp(name, fixture);
+
+    fixture_length = strlen(fixture);
+    return !strncmp(name, fixture, fixture_length) && name[fixture_length] == '.' && !strcmp(&name[fixture_length + 1], parameter);
+}
+
+// Returns the parameter number, or -1 if there is no such parameter.
+static LONG patch_find(const patch_table *table, const char *fixture, const char *parameter)
+{
+    ULONG slot = patch_hash(fixture, parameter) & (PATCH_HASH_SLOTS - 1);
+
+    while(table->hash_table[slot])
+    {
+        const patch_parameter *candidate = &table->parameters[table->hash_table[slot] - 1];
+        if(patch_name_matches(candidate->name, fixture, parameter))
+            return table->hash_table[slot] - 1;
+        slot = (slot + 1) & (PATCH_HASH_SLOTS - 1);
+    }
+
+    return -1;
+}
+
+// Writes a parameter into the shadow universe. 16-bit parameters go to the coarse channel, and are split when rendered.
+// Call this with engine_lock held.
+static void patch_write(ULONG parameter_number, double value)
+{
+    const patch_parameter *parameter = &patch.parameters[parameter_number];
+
+    if(parameter->is_16bit)
+    {
+        if(!(value > 0))
+            value = 0;
+        if(value > 65535)
+            value = 65535;
+        shadow_universe[parameter->channel] = (USHORT) (value + 0.5);
+        shadow_mark_dirty(parameter->channel, parameter->channel + 1);
+        urgent_mark(parameter->channel, parameter->channel + 1, FALSE);
+    }
+    else
+    {
+        shadow_universe[parameter->channel] = level_to_16bit(value);
+        shadow_mark_dirty(parameter->channel, parameter->channel);
+        urgent_mark(parameter->channel, parameter->channel, FALSE);
+    }
+}
+
+// Number of strings in a string or a cell array of strings.
+static mwSize string_count(const mxArray *array)
+{
+    if(mxIsChar(array))
+        return 1;
+    if(mxIsCell(array))
+        return mxGetNumberOfElements(array);
+    return 0;
+}
+
+// Gets the i-th string from a string or a cell array of strings. Returns FALSE if it's not a string, or it's too long.
+static BOOL string_element(const mxArray *array, mwSize i, char *buffer, mwSize buffer_length)
+{
+    if(mxIsChar(array))
+        return !mxGetString(array, buffer, buffer_length);
+
+    if(mxIsCell(array))
+    {
+        const mxArray *cell = mxGetCell(array, i);
+        return cell != NULL && mxIsChar(cell) && !mxGetString(cell, buffer, buffer_length);
+    }
+
+    return FALSE;
+}
+
+/*
+    Turns names into parameter numbers.
+    -If fixtures is NULL, parameters are full "fixture.parameter" names.
+    -Otherwise, fixtures and parameters are paired up. If one of them has only one name, it's used for all the others.
+    Returns NULL when all is well, otherwise an error message.
+*/
+static const char *patch_resolve(const mxArray *fixtures, const mxArray *parameters, ULONG *parameter_numbers, mwSize *no_of_parameters)
+{
+    char fixture_name[2 * PATCH_MAX_NAME], parameter_name[PATCH_MAX_NAME];
+    mwSize no_of_fixtures = (fixtures == NULL) ? 1 : string_count(fixtures);
+    mwSize no_of_parameter_names = string_count(parameters);
+    mwSize count = max(no_of_fixtures, no_of_parameter_names);
+
+    if(!no_of_fixtures || !no_of_parameter_names)
+        return "dmx.mex::Fixture and parameter names must be strings, or cell arrays of strings.\n";
+
+    if(no_of_fixtures != no_of_parameter_names && no_of_fixtures != 1 && no_of_parameter_names != 1)
+        return "dmx.mex::The number of fixture names and parameter names must match, or one of them must be a single name.\n";
+
+    if(count > PATCH_MAX_PARAMETERS)
+        return "dmx.mex::Too many parameters in one go.\n";
+
+    for(mwSize i = 0; i < count; i++)
+    {
+        LONG parameter_number;
+
+        if(fixtures == NULL)
+        {
+            if(!string_element(parameters, i, fixture_name, sizeof(fixture_name)))
+                return "dmx.mex::Parameter names must be strings, and not too long.\n";
+            parameter_number = patch_find(&patch, fixture_name, NULL);
+        }
+        else
+        {
+            if(!string_element(fixtures, (no_of_fixtures == 1) ? 0 : i, fixture_name, PATCH_MAX_NAME)
+                || !string_element(parameters, (no_of_parameter_names == 1) ? 0 : i, parameter_name, sizeof(parameter_name)))
+                return "dmx.mex::Fixture and parameter names must be strings, and not too long.\n";
+            parameter_number = patch_find(&patch, fixture_name, parameter_name);
+        }
+
+        if(parameter_number < 0)
+        {
+            mexPrintf("dmx.mex::Unknown parameter: %s%s%s\n", fixture_name, (fixtures == NULL) ? "" : ".", (fixtures == NULL) ? "" : parameter_name);
+            return "dmx.mex::This parameter is not in the patch.\n";
+        }
+
+        parameter_numbers[i] = (ULONG) parameter_number;
+    }
+
+    *no_of_parameters = count;
+    return NULL;
+}
+
+
+
+/*
+    Gets a list of channels (0-511) from either a vector of addresses (1-512), or a cell array of patched parameter names.
+    For 16-bit parameters, this is the coarse channel: the output stage deals with the pair.
+    'channel_list' must hold 512 channels. Returns NULL when all is well, otherwise an error message.
+*/
+static const char *channels_from_input(const mxArray *channels_input, ULONG *channel_list, mwSize *no_of_channels)
+{
+    *no_of_channels = 0;
+
+    if(mxIsDouble(channels_input) && !mxIsComplex(channels_input))
+    {
+        mxDouble *channels_input_pointer = mxGetData(channels_input);
+        if(mxGetNumberOfElements(channels_input) > 512)
+            return "dmx.mex::You only can have 512 elements in a DMX512 frame.\n";
+
+        for(mwSize i = 0; i < mxGetNumberOfElements(channels_input); i++)
+        {
+            if(channels_input_pointer[i] < 1 || channels_input_pointer[i] > 512 || channels_input_pointer[i] != (ULONG) channels_input_pointer[i])
+                return "dmx.mex::The addresses must be integers between 1 and 512.\n";
+            channel_list[(*no_of_channels)++] = (ULONG) channels_input_pointer[i] - 1;
+        }
+    }
+    else if(!mxIsEmpty(channels_input))
+    {
+        ULONG parameter_numbers[PATCH_MAX_PARAMETERS];
+        mwSize no_of_parameters;
+
+        const char *error_message = patch_resolve(NULL, channels_input, parameter_numbers, &no_of_parameters);
+        if(error_message != NULL)
+            return error_message;
+        if(no_of_parameters > 512)
+            return "dmx.mex::You only can have 512 elements in a DMX512 frame.\n";
+
+        for(mwSize i = 0; i < no_of_parameters; i++)
+            channel_list[(*no_of_channels)++] = patch.parameters[parameter_numbers[i]].channel;
+    }
+
+    return NULL;
+}
+
+// The sanity checks and data preparation for dmx('send'). 'levels' gets the 16-bit levels from 'start_address',
+// for 'no_of_channels'. Returns NULL if everything is fine, otherwise an error message.
+static const char *send_arguments(const mxArray *prhs[], USHORT *start_address, USHORT *no_of_channels, USHORT *levels)
+{
+    // Check if the inputs are numeric arrays.
+    if(!mxIsNumeric(prhs[1]))
+        return "dmx.mex::Addresses must be numbers.\n";
+
+    if(!mxIsNumeric(prhs[2]))
+        return "dmx.mex::Data values must be numbers.\n";
+
+    // Check dimensions of the address array
+    if(mxGetNumberOfDimensions(prhs[1]) > 2)
+        return "dmx.mex::Addresses must be packed into a vector.\n";
+
+    // Check dimensions of the data array
+    if(mxGetNumberOfDimensions(prhs[2]) > 2)
+        return "dmx.mex::Data values must be packed into a vector.\n";
+
+    // Get the dimensions of each array
+    mwSize no_of_elements_address, no_of_elements_data;
+    no_of_elements_address = mxGetNumberOfElements(prhs[1]);
+    no_of_elements_data = mxGetNumberOfElements(prhs[2]);
+
+    if(no_of_elements_address != no_of_elements_data)
+        return "dmx.mex::The address and data array do not have the same number of elements.\n";
+
+    if(no_of_elements_address > 512)
+        return "dmx.mex::You only can have 512 elements in a DMX512 frame.\n";
+
+
+    // Check if the input arrays are empty.
+    if(mxIsEmpty(prhs[1]))
+        return "dmx.mex::Addresses must not be empty.";
+
+    if(mxIsEmpty(prhs[2]))
+        return "dmx.mex::Data values must not be empty.";
+
+    // Are we getting vectors?
+    size_t addresses_no_of_rows = mxGetM(prhs[1]);
+    size_t addresses_no_of_columns = mxGetN(prhs[1]);
+    size_t data_values_no_of_rows = mxGetM(prhs[2]);
+    size_t data_values_no_of_columns = mxGetN(prhs[2]);
+    #ifdef VERBOSE
+    mexPrintf("dmx.mex::Addresses have %d rows and %d columns,\nData values have %d rows and %d columns.\n", addresses_no_of_rows, addresses_no_of_columns, data_values_no_of_rows, data_values_no_of_columns);
+    #endif
+
+    if(addresses_no_of_rows != 1 && addresses_no_of_columns != 1)
+        return "dmx.mex::The addresses must be in a vector.\n";
+
+    if(data_values_no_of_rows != 1 && data_values_no_of_columns != 1)
+        return "dmx.mex::The data valaues must be in a vector.\n";
+
+
+    USHORT addresses_converted[512];
+
+    mxDouble *addresses_input_pointer = mxGetData(prhs[1]);
+    mxDouble *data_values_input_pointer = mxGetData(prhs[2]);
+
+    // Is the list of addresses in strictly monotonically increasing order?
+    for(unsigned int i = 1; i<no_of_elements_address; i++)
+    {
+        if(addresses_input_pointer[i] - addresses_input_pointer[i-1] != 1)
+            return "dmx.mex::The addresses must increase one by one.\n";
+
+    }
+
+    // ...and are they in the frame?
+    if(addresses_input_pointer[0] < 1 || addresses_input_pointer[no_of_elements_address - 1] > 512)
+        return "dmx.mex::The addresses must be between 1 and 512.\n";
+
+    //Copy the arrays over while casting them to the required format.
+    for(unsigned int i = 0; i<no_of_elements_address; i++)
+    {
+        // In this loop, we fetch the input data, and cast it before saving.
+        #ifdef VERBOSE
+        mexPrintf("%d: Addr: %d; Data: %d.\n", i, (USHORT) addresses_input_pointer[i], (UCHAR) data_values_input_pointer[i]);
+        #endif
+        addresses_converted[i] = (USHORT) addresses_input_pointer[i] -1; // off-by-one error: the dongle expects [0-511], reality expects [1-512].
+        levels[i] = level_to_16bit(data_values_input_pointer[i]);
+    }
+
+
+    USHORT end_address = 0;
+
+    // Add the offset.
+    if(no_of_elements_address > 1)
+    {
+        *start_address = addresses_converted[0];
+        end_address = addresses_converted[no_of_elements_address - 1];
+        *no_of_channels = end_address - *start_address + 1;
+    }
+    else
+    {
+        // Special case: only 1 channel argument:
+        *start_address = addresses_converted[0];
+        *no_of_channels = 1;
+    }
+
+
+    #ifdef VERBOSE
+    mexPrintf("dmx.mex::All sanity checks passed, showing converted address range: %03d - %03d = %d\n", end_address, *start_address, *no_of_channels);
+    #endif
+
+    return NULL;
+}
+
+// The arguments of dmx('set'): works out which form it is, and finds the parameters and the values.
+// *status_input is the status buffer, or NULL if there isn't a valid one. Returns NULL if everything is fine,
+// otherwise an error message.
+static const char *set_arguments(int nrhs, const mxArray *prhs[], ULONG *parameter_numbers, mwSize *no_of_parameters,
+                                 const mxArray **values_input, const mxArray **status_input)
+{
+    *status_input = NULL;
+    if(nrhs < 3 || nrhs > 5)
+        return "dmx.mex::This function needs three, four or five arguments.\n";
+
+    // The values are always doubles, and the names never are. So if there is a double where a name would be
+    // without a status buffer, there is one.
+    if(nrhs == 5 || (nrhs == 4 && (mxIsDouble(prhs[1]) || mxIsDouble(prhs[2]))))
+    {
+        if(!status_buffer_valid(prhs[--nrhs]))
+            return "dmx.mex::The status buffer must be a vector of at least 3 doubles.\n";
+        *status_input = prhs[nrhs];
+    }
+
+    *values_input = prhs[nrhs - 1];
+
+    if(nrhs == 3 && mxIsDouble(prhs[1]))
+    {
+        // Parameter numbers from dmx('resolve').
+        mxDouble *ids_input_pointer = mxGetData(prhs[1]);
+        *no_of_parameters = mxGetNumberOfElements(prhs[1]);
+        if(*no_of_parameters > PATCH_MAX_PARAMETERS)
+            return "dmx.mex::Too many parameters in one go.\n";
+
+        for(mwSize i = 0; i < *no_of_parameters; i++)
+        {
+            if(ids_input_pointer[i] < 1 || ids_input_pointer[i] > patch.no_of_parameters || ids_input_pointer[i] != (ULONG) ids_input_pointer[i])
+                return "dmx.mex::Parameter ids must come from dmx('resolve'), with the current patch.\n";
+            parameter_numbers[i] = (ULONG) ids_input_pointer[i] - 1;
+        }
+    }
+    else
+    {
+        const char *error_message = patch_resolve((nrhs == 4) ? prhs[1] : NULL, prhs[nrhs - 2], parameter_numbers, no_of_parameters);
+        if(error_message != NULL)
+            return error_message;
+    }
+
+    if(!mxIsDouble(*values_input) || mxIsComplex(*values_input) || mxGetNumberOfElements(*values_input) != *no_of_parameters)
+        return "dmx.mex::There must be exactly one value (double) for each parameter.\n";
+
+    return NULL;
+}
+
+/*
+    Prepared address plans.
+
+    dmx('send') checks the addresses every time, but a script usually sends to the same block of channels over
+    and over. dmx('prepare') does the checks once, and keeps the result in a table: the runs of consecutive
+    addresses, and where each run's values are in the value vector. The addresses don't have to be consecutive,
+    or in order, but they can't repeat. dmx('send_prepared') only checks the number of values, and copies them.
+    A handle is a number that is never given out twice, so a plan that was cleared can't be mistaken for a new one
+    in the same slot.
+*/
+
+#define PLAN_MAX 64
+
+typedef struct
+{
+    USHORT start_address;
+    USHORT no_of_channels;
+    USHORT offset;                  // of the first value in the value vector
+} plan_run;
+
+typedef struct
+{
+    double handle;                  // 0 if the slot is free
+    USHORT no_of_channels;
+    USHORT first, last;             // the lowest and the highest address
+    USHORT no_of_runs;
+    plan_run runs[512];
+} address_plan;
+
+static struct
+{
+    address_plan plans[PLAN_MAX];
+    double last_handle;
+} plans;
+
+// Returns NULL if 'handle' is not a plan we have.
+static const address_plan *plan_find(const mxArray *handle_input)
+{
+    if(!mxIsDouble(handle_input) || mxGetNumberOfElements(handle_input) != 1)
+        return NULL;
+
+    double handle = mxGetScalar(handle_input);
+    if(!(handle >= 1) || handle != (ULONG) handle)
+        return NULL;
+
+    const address_plan *plan = &plans.plans[((ULONG) handle - 1) % PLAN_MAX];
+    return (plan->handle == handle) ? plan : NULL;
+}
+
+// Checks the addresses, and fills in a plan. Returns NULL if everything is fine, otherwise an error message.
+static const char *plan_prepare(const mxArray *addresses_input, address_plan *plan)
+{
+    BOOL used[512] = {FALSE};
+
+    if(!mxIsDouble(addresses_input) || mxIsComplex(addresses_input))
+        return "dmx.mex::Addresses must be numbers.\n";
+
+    if(mxGetNumberOfDimensions(addresses_input) > 2 || (mxGetM(addresses_input) != 1 && mxGetN(addresses_input) != 1))
+        return "dmx.mex::The addresses must be in a vector.\n";
+
+    if(mxIsEmpty(addresses_input))
+        return "dmx.mex::Addresses must not be empty.\n";
+
+    if(mxGetNumberOfElements(addresses_input) > 512)
+        return "dmx.mex::You only can have 512 elements in a DMX512 frame.\n";
+
+    mxDouble *addresses_input_pointer = mxGetData(addresses_input);
+    plan->no_of_channels = (USHORT) mxGetNumberOfElements(addresses_input);
+    plan->first = 511;
+    plan->last = 0;
+    plan->no_of_runs = 0;
+
+    for(USHORT i = 0; i < plan->no_of_channels; i++)
+    {
+        if(!(addresses_input_pointer[i] >= 1 && addresses_input_pointer[i] <= 512) || addresses_input_pointer[i] != (USHORT) addresses_input_pointer[i])
+            return "dmx.mex::The addresses must be integers between 1 and 512.\n";
+
+        USHORT address = (USHORT) addresses_input_pointer[i] - 1;
+        if(used[address])
+            return "dmx.mex::The addresses must not repeat.\n";
+        used[address] = TRUE;
+
+        plan->first = min(plan->first, address);
+        plan->last = max(plan->last, address);
+
+        // A new run, unless it carries on from the one before.
+        plan_run *run = (plan->no_of_runs > 0) ? &plan->runs[plan->no_of_runs - 1] : NULL;
+        if(run == NULL || address != run->start_address + run->no_of_channels)
+        {
+            run = &plan->runs[plan->no_of_runs++];
+            run->start_address = address;
+            run->no_of_channels = 0;
+            run->offset = i;
+        }
+        run->no_of_channels++;
+    }
+
+    return NULL;
+}
+
+/*
+    Pixel mapping.
+
+    For when the stimulus is an image, and the fixtures are its pixels. dmx('pixelmap_define') takes the map: which
+    pixel each fixture shows, where the fixture is, and the order of its colour channels. dmx('pixelmap_push') then
+    samples an image, and writes straight into the shadow universe, instead of building a channel vector in Matlab.
+    The push goes in three steps:
+    -The gather: the R, G and B of each fixture's pixel are picked out of the image, into one array for each colour.
+     Matlab images are column-major, with the colours in separate planes, so this is three loads per fixture.
+     There is no gather instruction in SSE2, so this is a plain loop.
+    -The conversion, with SSE2, 16 fixtures (uint8) or 2 fixtures (double) at a time: the white is the common part
+     of R, G and B, and for the fixtures that have a white channel, it's taken out of them. Then everything becomes
+     16-bit levels.
+    -The shuffle: the levels go to the fixtures' channels, in their colour order. The map was turned into a list of
+     (channel, level) pairs when it was defined, so this is one loop over the channels, with the lock held.
+*/
+
+#define PIXELMAP_MAX_FIXTURES 512
+#define PIXELMAP_BENCH_SIZES 4
+#define PIXELMAP_BENCH_SECONDS 0.2
+
+static const double pixelmap_bench_sizes[PIXELMAP_BENCH_SIZES] = {32, 128, 512, 1024};
+
+enum {PIXELMAP_RED, PIXELMAP_GREEN, PIXELMAP_BLUE, PIXELMAP_WHITE};
+
+typedef struct
+{
+    USHORT no_of_fixtures;
+    ULONG row[PIXELMAP_MAX_FIXTURES];       // 0-based
+    ULONG column[PIXELMAP_MAX_FIXTURES];
+    ULONG max_row, max_column;              // the image must be at least this big
+    UCHAR white_mask[PIXELMAP_MAX_FIXTURES + 16]; // 0xFF if the fixture has a white channel, so the white is taken out of R, G and B
+    double white_gain[PIXELMAP_MAX_FIXTURES + 2]; // the same, 1 or 0
+    USHORT no_of_channels;
+    USHORT channel[512];                    // where each level goes...
+    USHORT level[512];                      // ...and which one it is: colour * PIXELMAP_MAX_FIXTURES + fixture
+    USHORT first, last;
+} pixelmap_table;
+
+static pixelmap_table pixelmap;
+
+// The gathered colours, padded to 16 fixtures, so the SSE2 loop doesn't need a tail.
+static UCHAR pixelmap_colours_8bit[3][PIXELMAP_MAX_FIXTURES + 16];
+static double pixelmap_colours_double[4][PIXELMAP_MAX_FIXTURES + 2];    // the white is the 4th
+
+// Checks the map, and fills in a table. Returns NULL if everything is fine, otherwise an error message.
+static const char *pixelmap_prepare(const mxArray *map_input, pixelmap_table *table)
+{
+    BOOL used[512] = {FALSE};
+    char order[8];
+
+    if(!mxIsStruct(map_input) || mxGetFieldNumber(map_input, "pixel") < 0 || mxGetFieldNumber(map_input, "address") < 0)
+        return "dmx.mex::The map must be a struct array, with 'pixel', 'address' and (optionally) 'order' fields.\n";
+
+    if(mxGetNumberOfElements(map_input) < 1 || mxGetNumberOfElements(map_input) > PIXELMAP_MAX_FIXTURES)
+        return "dmx.mex::The map must have between 1 and 512 fixtures.\n";
+
+    memset(table, 0, sizeof(*table));
+    table->no_of_fixtures = (USHORT) mxGetNumberOfElements(map_input);
+    table->first = 511;
+
+    for(USHORT fixture = 0; fixture < table->no_of_fixtures; fixture++)
+    {
+        const mxArray *pixel_field = mxGetField(map_input, fixture, "pixel");
+        const mxArray *address_field = mxGetField(map_input, fixture, "address");
+        const mxArray *order_field = (mxGetFieldNumber(map_input, "order") >= 0) ? mxGetField(map_input, fixture, "order") : NULL;
+
+        if(pixel_field == NULL || !mxIsDouble(pixel_field) || mxGetNumberOfElements(pixel_field) != 2)
+            return "dmx.mex::The pixel of a fixture must be [row, column].\n";
+
+        double row = ((mxDouble *) mxGetData(pixel_field))[0], column = ((mxDouble *) mxGetData(pixel_field))[1];
+        if(!(row >= 1 && row <= 65536) || row != (ULONG) row || !(column >= 1 && column <= 65536) || column != (ULONG) column)
+            return "dmx.mex::The pixel coordinates must be whole numbers, from 1.\n";
+
+        if(address_field == NULL || !mxIsNumeric(address_field) || mxGetNumberOfElements(address_field) != 1)
+            return "dmx.mex::Fixture addresses must be numbers.\n";
+
+        double address = mxGetScalar(address_field);
+        if(address < 1 || address > 512 || address != (USHORT) address)
+            return "dmx.mex::Fixture addresses must be integers between 1 and 512.\n";
+
+        strcpy(order, "rgb");
+        if(order_field != NULL && !mxIsEmpty(order_field) && (!mxIsChar(order_field) || mxGetString(order_field, order, sizeof(order))))
+            return "dmx.mex::The colour order is a string, like 'rgb', 'grb' or 'rgbw'.\n";
+
+        size_t no_of_colours = strlen(order);
+        if(no_of_colours < 1 || no_of_colours > 4 || strspn(order, "rgbw") != no_of_colours)
+            return "dmx.mex::The colour order is a string, like 'rgb', 'grb' or 'rgbw'.\n";
+
+        if(address + no_of_colours - 1 > 512)
+            return "dmx.mex::A fixture in the map does not fit in the universe.\n";
+
+        table->row[fixture] = (ULONG) row - 1;
+        table->column[fixture] = (ULONG) column - 1;
+        table->max_row = max(table->max_row, (ULONG) row);
+        table->max_column = max(table->max_column, (ULONG) column);
+
+        for(size_t i = 0; i < no_of_colours; i++)
+        {
+            USHORT channel = (USHORT) address - 1 + (USHORT) i;
+            if(strchr(&order[i + 1], order[i]) != NULL)
+                return "dmx.mex::A colour can only be once in the colour order.\n";
+            if(used[channel])
+                return "dmx.mex::The fixtures in the map must not overlap.\n";
+            used[channel] = TRUE;
+
+            UCHAR colour = (order[i] == 'r') ? PIXELMAP_RED : (order[i] == 'g') ? PIXELMAP_GREEN : (order[i] == 'b') ? PIXELMAP_BLUE : PIXELMAP_WHITE;
+            if(colour == PIXELMAP_WHITE)
+            {
+                table->white_mask[fixture] = 0xFF;
+                table->white_gain[fixture] = 1.0;
+            }
+            table->channel[table->no_of_channels] = channel;
+            table->level[table->no_of_channels] = colour * PIXELMAP_MAX_FIXTURES + fixture;
+            table->no_of_channels++;
+            table->first = min(table->first, channel);
+            table->last = max(table->last, channel);
+        }
+    }
+
+    return NULL;
+}
+
+// TRUE if 'image' is a height x width x 3 uint8 or double array, big enough for the map.
+static BOOL pixelmap_image_valid(const pixelmap_table *table, const mxArray *image)
+{
+    const mwSize *dimensions = mxGetDimensions(image);
+
+    return (mxIsUint8(image) || mxIsDouble(image)) && !mxIsComplex(image) && mxGetNumberOfDimensions(image) == 3 && dimensions[2] == 3
+           && dimensions[0] >= table->max_row && dimensions[1] >= table->max_column;
+}
+
+// Samples the image, and puts the 16-bit levels of each colour in 'levels' (4 x PIXELMAP_MAX_FIXTURES).
+static void pixelmap_render(const pixelmap_table *table, const mxArray *image, USHORT *levels)
+{
+    size_t height = mxGetDimensions(image)[0];
+    size_t plane = height * mxGetDimensions(image)[1];
+    USHORT *red = &levels[PIXELMAP_RED * PIXELMAP_MAX_FIXTURES], *green = &levels[PIXELMAP_GREEN * PIXELMAP_MAX_FIXTURES];
+    USHORT *blue = &levels[PIXELMAP_BLUE * PIXELMAP_MAX_FIXTURES], *white = &levels[PIXELMAP_WHITE * PIXELMAP_MAX_FIXTURES];
+
+    if(mxIsUint8(image))
+    {
+        const UCHAR *pixels = (const UCHAR *) mxGetData(image);
+
+        for(USHORT i = 0; i < table->no_of_fixtures; i++)
+        {
+            size_t pixel = table->row[i] + table->column[i] * height;
+            pixelmap_colours_8bit[0][i] = pixels[pixel];
+            pixelmap_colours_8bit[1][i] = pixels[pixel + plane];
+            pixelmap_colours_8bit[2][i] = pixels[pixel + 2 * plane];
+        }
+
+        // Unpacking a byte with itself is x * 257, which is how 8-bit levels become 16-bit here.
+        for(USHORT i = 0; i < table->no_of_fixtures; i += 16)
+        {
+            __m128i r = _mm_loadu_si128((const __m128i *) &pixelmap_colours_8bit[0][i]);
+            __m128i g = _mm_loadu_si128((const __m128i *) &pixelmap_colours_8bit[1][i]);
+            __m128i b = _mm_loadu_si128((const __m128i *) &pixelmap_colours_8bit[2][i]);
+            __m128i w = _mm_min_epu8(_mm_min_epu8(r, g), b);
+            __m128i taken_out = _mm_and_si128(w, _mm_loadu_si128((const __m128i *) &table->white_mask[i]));
+
+            r = _mm_subs_epu8(r, taken_out);
+            g = _mm_subs_epu8(g, taken_out);
+            b = _mm_subs_epu8(b, taken_out);
+            _mm_storeu_si128((__m128i *) &red[i], _mm_unpacklo_epi8(r, r));
+            _mm_storeu_si128((__m128i *) &red[i + 8], _mm_unpackhi_epi8(r, r));
+            _mm_storeu_si128((__m128i *) &green[i], _mm_unpacklo_epi8(g, g));
+            _mm_storeu_si128((__m128i *) &green[i + 8], _mm_unpackhi_epi8(g, g));
+            _mm_storeu_si128((__m128i *) &blue[i], _mm_unpacklo_epi8(b, b));
+            _mm_storeu_si128((__m128i *) &blue[i + 8], _mm_unpackhi_epi8(b, b));
+            _mm_storeu_si128((__m128i *) &white[i], _mm_unpacklo_epi8(w, w));
+            _mm_storeu_si128((__m128i *) &white[i + 8], _mm_unpackhi_epi8(w, w));
+        }
+        return;
+    }
+
+    const double *pixels = (const double *) mxGetData(image);
+    const __m128d zero = _mm_setzero_pd(), full = _mm_set1_pd(255.0);
+
+    for(USHORT i = 0; i < table->no_of_fixtures; i++)
+    {
+        size_t pixel = table->row[i] + table->column[i] * height;
+        pixelmap_colours_double[0][i] = pixels[pixel];
+        pixelmap_colours_double[1][i] = pixels[pixel + plane];
+        pixelmap_colours_double[2][i] = pixels[pixel + 2 * plane];
+    }
+
+    // The levels are clamped first (NaN becomes 0, see levels_to_16bit()), so the white comes out right.
+    for(USHORT i = 0; i < table->no_of_fixtures; i += 2)
+    {
+        __m128d r = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(&pixelmap_colours_double[0][i]), zero), full);
+        __m128d g = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(&pixelmap_colours_double[1][i]), zero), full);
+        __m128d b = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(&pixelmap_colours_double[2][i]), zero), full);
+        __m128d w = _mm_min_pd(_mm_min_pd(r, g), b);
+        __m128d taken_out = _mm_mul_pd(w, _mm_loadu_pd(&table->white_gain[i]));
+
+        _mm_storeu_pd(&pixelmap_colours_double[0][i], _mm_sub_pd(r, taken_out));
+        _mm_storeu_pd(&pixelmap_colours_double[1][i], _mm_sub_pd(g, taken_out));
+        _mm_storeu_pd(&pixelmap_colours_double[2][i], _mm_sub_pd(b, taken_out));
+        _mm_storeu_pd(&pixelmap_colours_double[3][i], w);
+    }
+
+    levels_to_16bit(pixelmap_colours_double[0], table->no_of_fixtures, red, 1);
+    levels_to_16bit(pixelmap_colours_double[1], table->no_of_fixtures, green, 1);
+    levels_to_16bit(pixelmap_colours_double[2], table->no_of_fixtures, blue, 1);
+    levels_to_16bit(pixelmap_colours_double[3], table->no_of_fixtures, white, 1);
+}
+
+// Puts the levels on the fixtures' channels, in their colour order.
+static void pixelmap_scatter(const pixelmap_table *table, const USHORT *levels, USHORT *universe)
+{
+    for(USHORT i = 0; i < table->no_of_channels; i++)
+        universe[table->channel[i]] = levels[table->level[i]];
+}
+
+// One push for dmx('pixelmap_bench'), into a scratch universe.
+typedef struct
+{
+    const pixelmap_table *table;
+    const mxArray *image;
+    USHORT levels[4 * PIXELMAP_MAX_FIXTURES];
+    USHORT universe[512];
+} pixelmap_bench_context;
+
+static void pixelmap_bench_step(void *context)
+{
+    pixelmap_bench_context *bench = context;
+
+    pixelmap_render(bench->table, bench->image, bench->levels);
+    pixelmap_scatter(bench->table, bench->levels, bench->universe);
+}
+
+/*
+    Colour conversion.
+
+    For vision experiments, colours are specified in CIE xyY, and every fixture needs its own calibration to get
+    there. dmx('colour_define') takes the calibration of each fixture once: the XYZ of each of its primaries at full
+    output (measured with a spectroradiometer, say), and how its output goes with the level (a gamma, or a measured
+    response). Then dmx('colour_set') converts a batch of xyY colours, one for each fixture, to levels, and writes
+    them into the shadow universe.
+    -With three primaries, there is only one way to make a colour: the inverse of the primaries matrix. This is
+     worked out when the fixtures are defined.
+    -With four (RGBW, or RGBA, etc.), there are many. We use as much of the 4th primary as we can: the colour is made
+     from the other three, then the 4th primary is swapped in for its own colour, until one of the three runs out.
+    -A colour outside the gamut needs a negative level, or more than full. With 'scale' (the default), the levels are
+     scaled down together, so the colour stays the same but gets darker, and then whatever is negative is clipped.
+     With 'clip', each level is clipped on its own.
+    -Then the level for the output we want comes from the inverse of the response, from a table with linear
+     interpolation in between.
+    The solve goes 4 fixtures at a time with SSE2, in single precision, which is plenty for 16-bit levels. The
+    matrices are stored one element for all the fixtures after another, so each load gets the same element of 4
+    fixtures. The table lookups are a plain loop: there is no gather instruction in SSE2.
+*/
+
+#define COLOUR_MAX_FIXTURES 512         // not in a universe, but dmx('colour_bench') goes up to this
+#define COLOUR_TABLE_SIZE 1024          // steps in the inverse response tables
+#define COLOUR_RESPONSE_POINTS 256      // a measured response has this many levels, 0 to 255
+#define COLOUR_BENCH_COUNTS 5
+#define COLOUR_BENCH_SECONDS 0.2
+
+static const double colour_bench_counts[COLOUR_BENCH_COUNTS] = {16, 64, 128, 256, 512};
+
+typedef struct
+{
+    USHORT no_of_fixtures;
+    BOOL clip;                                      // 'clip', otherwise 'scale'
+    float inverse_matrix[9][COLOUR_MAX_FIXTURES];   // XYZ to the first three primaries, row by row
+    float white_mix[3][COLOUR_MAX_FIXTURES];        // the first three primaries that make the 4th one's colour
+    float has_white[COLOUR_MAX_FIXTURES];           // 1 if there is a 4th primary, 0 if not
+    USHORT address[COLOUR_MAX_FIXTURES];            // 0-based
+    UCHAR no_of_primaries[COLOUR_MAX_FIXTURES];
+    UCHAR offset[4][COLOUR_MAX_FIXTURES];           // which channel of the fixture each primary is on (the 4th is the last)
+    float *inverse;                                 // no_of_fixtures x 4 x (COLOUR_TABLE_SIZE + 1): output to 16-bit level
+    USHORT first, last;
+} colour_table;
+
+static colour_table colour;
+
+// The SSE2 solve writes the weights of the primaries here, and whether each fixture was out of the gamut.
+static float colour_weights[4][COLOUR_MAX_FIXTURES];
+static float colour_outside[COLOUR_MAX_FIXTURES];
+static float colour_input[3][COLOUR_MAX_FIXTURES];
+static colour_table colour_reordered;                // the calibration of the fixtures in dmx('colour_set'), when they are not in order
+
+static void colour_free(colour_table *table)
+{
+    free(table->inverse);
+    table->inverse = NULL;
+    table->no_of_fixtures = 0;
+}
+
+// Inverts a 3x3 matrix (column-major, like Matlab). Returns FALSE if it's singular.
+static BOOL colour_invert(const double *m, double *inverse)
+{
+    double cofactors[9] = {
+        m[4] * m[8] - m[5] * m[7], m[5] * m[6] - m[3] * m[8], m[3] * m[7] - m[4] * m[6],
+        m[2] * m[7] - m[1] * m[8], m[0] * m[8] - m[2] * m[6], m[1] * m[6] - m[0] * m[7],
+        m[1] * m[5] - m[2] * m[4], m[2] * m[3] - m[0] * m[5], m[0] * m[4] - m[1] * m[3]};
+    double determinant = m[0] * cofactors[0] + m[1] * cofactors[1] + m[2] * cofactors[2];
+
+    if(!(fabs(determinant) > 1e-12))
+        return FALSE;
+
+    // The inverse is the transpose of the cofactors, over the determinant. Column-major again.
+    for(int row = 0; row < 3; row++)
+    {
+        for(int column = 0; column < 3; column++)
+            inverse[row + 3 * column] = cofactors[3 * row + column] / determinant;
+    }
+    return TRUE;
+}
+
+// Fills in the inverse of a response: for each output (0 to 1, in COLOUR_TABLE_SIZE steps), the 16-bit level.
+// 'response' is the output at COLOUR_RESPONSE_POINTS levels, from 0 to 255, and it must not go down. NULL means
+// the output is level ^ gamma.
+static void colour_inverse_table(const double *response, double gamma, float *table)
+{
+    ULONG point = 0;
+
+    for(ULONG step = 0; step <= COLOUR_TABLE_SIZE; step++)
+    {
+        double output = (double) step / COLOUR_TABLE_SIZE;
+        double level;
+
+        if(response == NULL)
+            level = pow(output, 1.0 / gamma);
+        else
+        {
+            double full = response[COLOUR_RESPONSE_POINTS - 1];
+
+            while(point < COLOUR_RESPONSE_POINTS - 2 && response[point + 1] < output * full)
+                point++;
+
+            double below = response[point], above = response[point + 1];
+            level = (above > below) ? (point + (output * full - below) / (above - below)) / (COLOUR_RESPONSE_POINTS - 1) : (double) point / (COLOUR_RESPONSE_POINTS - 1);
+        }
+
+        table[step] = (float) (min(max(level, 0.0), 1.0) * 65535.0);
+    }
+}
+
+// Fills in the inverse response tables of 'no_of_primaries' primaries, one after the other, from the 'gamma' field of a
+// fixture: a scalar gamma, one for each primary, or a measured response in each column. Empty (or NULL) is gamma 1.
+// Returns NULL if everything is fine, otherwise an error message.
+static const char *colour_responses(const mxArray *gamma_field, UCHAR no_of_primaries, float *tables)
+{
+    const double *response = NULL;
+    const double *gammas = NULL;
+    BOOL one_gamma = FALSE;
+
+    if(gamma_field != NULL && !mxIsEmpty(gamma_field))
+    {
+        if(!mxIsDouble(gamma_field) || mxIsComplex(gamma_field))
+            return "dmx.mex::The gamma must be a number, one for each primary, or a 256-row response for each primary.\n";
+
+        if(mxGetNumberOfElements(gamma_field) == 1 || mxGetNumberOfElements(gamma_field) == no_of_primaries)
+        {
+            gammas = (const double *) mxGetData(gamma_field);
+            one_gamma = (mxGetNumberOfElements(gamma_field) == 1);
+            for(UCHAR i = 0; i < no_of_primaries; i++)
+            {
+                if(!(gammas[one_gamma ? 0 : i] >= 0.1 && gammas[one_gamma ? 0 : i] <= 10))
+                    return "dmx.mex::The gamma must be between 0.1 and 10.\n";
+            }
+        }
+        else if(mxGetM(gamma_field) == COLOUR_RESPONSE_POINTS && mxGetN(gamma_field) == no_of_primaries)
+        {
+            response = (const double *) mxGetData(gamma_field);
+            for(UCHAR i = 0; i < no_of_primaries; i++)
+            {
+                const double *column = &response[i * COLOUR_RESPONSE_POINTS];
+                for(int point = 1; point < COLOUR_RESPONSE_POINTS; point++)
+                {
+                    if(!(column[point] >= column[point - 1]))
+                        return "dmx.mex::A measured response must not go down.\n";
+                }
+                if(!(column[COLOUR_RESPONSE_POINTS - 1] > column[0]))
+                    return "dmx.mex::A measured response must go up.\n";
+            }
+        }
+        else
+            return "dmx.mex::The gamma must be a number, one for each primary, or a 256-row response for each primary.\n";
+    }
+
+    for(UCHAR i = 0; i < no_of_primaries; i++)
+    {
+        double gamma = (gammas != NULL) ? gammas[one_gamma ? 0 : i] : 1.0;
+        colour_inverse_table((response != NULL) ? &response[i * COLOUR_RESPONSE_POINTS] : NULL, gamma, &tables[i * (COLOUR_TABLE_SIZE + 1)]);
+    }
+
+    return NULL;
+}
+
+// The 16-bit level for a weight (0 to 1) from an inverse response table.
+static USHORT colour_level(const float *inverse, float weight)
+{
+    float position = weight * COLOUR_TABLE_SIZE;
+    int step = min((int) position, COLOUR_TABLE_SIZE - 1);
+
+    return (USHORT) (inverse[step] + (position - step) * (inverse[step + 1] - inverse[step]) + 0.5f);
+}
+
+// Checks the fixtures, and fills in a table. Returns NULL if everything is fine, otherwise an error message.
+// The table's inverse responses are allocated here, colour_free() frees them.
+static const char *colour_prepare(const mxArray *fixtures_input, colour_table *table)
+{
+    BOOL used[512] = {FALSE};
+
+    if(!mxIsStruct(fixtures_input) || mxGetFieldNumber(fixtures_input, "address") < 0 || mxGetFieldNumber(fixtures_input, "primaries") < 0)
+        return "dmx.mex::The fixtures must be a struct array, with 'address', 'primaries' and (optionally) 'gamma' fields.\n";
+
+    if(mxGetNumberOfElements(fixtures_input) < 1 || mxGetNumberOfElements(fixtures_input) > 170)
+        return "dmx.mex::There must be between 1 and 170 fixtures.\n";
+
+    table->no_of_fixtures = (USHORT) mxGetNumberOfElements(fixtures_input);
+    table->first = 511;
+    table->last = 0;
+    table->inverse = malloc(table->no_of_fixtures * 4 * (COLOUR_TABLE_SIZE + 1) * sizeof(float));
+    if(table->inverse == NULL)
+        return "dmx.mex::Not enough memory for the response tables.\n";
+
+    for(USHORT fixture = 0; fixture < table->no_of_fixtures; fixture++)
+    {
+        const mxArray *address_field = mxGetField(fixtures_input, fixture, "address");
+        const mxArray *primaries_field = mxGetField(fixtures_input, fixture, "primaries");
+        const mxArray *gamma_field = (mxGetFieldNumber(fixtures_input, "gamma") >= 0) ? mxGetField(fixtures_input, fixture, "gamma") : NULL;
+
+        if(address_field == NULL || !mxIsNumeric(address_field) || mxGetNumberOfElements(address_field) != 1)
+            return "dmx.mex::Fixture addresses must be numbers.\n";
+
+        double address = mxGetScalar(address_field);
+        if(address < 1 || address > 512 || address != (USHORT) address)
+            return "dmx.mex::Fixture addresses must be integers between 1 and 512.\n";
+
+        if(primaries_field == NULL || !mxIsDouble(primaries_field) || mxIsComplex(primaries_field) || mxGetM(primaries_field) != 3 || (mxGetN(primaries_field) != 3 && mxGetN(primaries_field) != 4))
+            return "dmx.mex::The primaries must be 3x3 or 3x4: the XYZ of each primary at full, in the order of the channels.\n";
+
+        UCHAR no_of_primaries = (UCHAR) mxGetN(primaries_field);
+        if(address + no_of_primaries - 1 > 512)
+            return "dmx.mex::A fixture does not fit in the universe.\n";
+
+        for(UCHAR i = 0; i < no_of_primaries; i++)
+        {
+            USHORT channel = (USHORT) address - 1 + i;
+            if(used[channel])
+                return "dmx.mex::The fixtures must not overlap.\n";
+            used[channel] = TRUE;
+            table->offset[i][fixture] = i;
+            table->first = min(table->first, channel);
+            table->last = max(table->last, channel);
+        }
+
+        // The first three primaries make the colour, the 4th (if there is one) is swapped in for them.
+        const double *primaries = (const double *) mxGetData(primaries_field);
+        double inverse_matrix[9];
+        if(!colour_invert(primaries, inverse_matrix))
+            return "dmx.mex::The first three primaries of a fixture must not be in a line: they can't make colours.\n";
+
+        for(int row = 0; row < 3; row++)
+        {
+            for(int column = 0; column < 3; column++)
+                table->inverse_matrix[3 * row + column][fixture] = (float) inverse_matrix[row + 3 * column];
+
+            double white_mix = 0;
+            if(no_of_primaries == 4)
+            {
+                for(int column = 0; column < 3; column++)
+                    white_mix += inverse_matrix[row + 3 * column] * primaries[9 + column];
+            }
+            table->white_mix[row][fixture] = (float) white_mix;
+        }
+        table->has_white[fixture] = (no_of_primaries == 4) ? 1.0f : 0.0f;
+        table->address[fixture] = (USHORT) address - 1;
+        table->no_of_primaries[fixture] = no_of_primaries;
+
+        const char *error_message = colour_responses(gamma_field, no_of_primaries, &table->inverse[fixture * 4 * (COLOUR_TABLE_SIZE + 1)]);
+        if(error_message != NULL)
+            return error_message;
+    }
+
+    return NULL;
+}
+
+// Works out the weights of the primaries for the colours in colour_input (x, y and Y of each fixture), into
+// colour_weights, 4 fixtures at a time. Out of the gamut is 1 in colour_outside.
+static void colour_solve(const colour_table *table, USHORT no_of_fixtures)
+{
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), huge = _mm_set1_ps(1e30f), margin = _mm_set1_ps(1e-4f);
+
+    for(USHORT i = 0; i < no_of_fixtures; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&colour_input[0][i]), y = _mm_loadu_ps(&colour_input[1][i]), Y = _mm_loadu_ps(&colour_input[2][i]);
+
+        // xyY to XYZ. y = 0 is black.
+        __m128 valid = _mm_cmpgt_ps(y, zero);
+        __m128 Y_over_y = _mm_and_ps(valid, _mm_div_ps(Y, _mm_or_ps(y, _mm_andnot_ps(valid, one))));
+        __m128 xyz[3] = {_mm_mul_ps(x, Y_over_y), _mm_and_ps(valid, Y), _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, x), y), Y_over_y)};
+
+        // The first three primaries.
+        __m128 weights[4];
+        for(int row = 0; row < 3; row++)
+        {
+            weights[row] = _mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(_mm_loadu_ps(&table->inverse_matrix[3 * row][i]), xyz[0]),
+                _mm_mul_ps(_mm_loadu_ps(&table->inverse_matrix[3 * row + 1][i]), xyz[1])),
+                _mm_mul_ps(_mm_loadu_ps(&table->inverse_matrix[3 * row + 2][i]), xyz[2]));
+        }
+
+        // Swap in as much of the 4th as we can: until the first of the three that go into it runs out, or it's at full.
+        __m128 white = huge;
+        for(int row = 0; row < 3; row++)
+        {
+            __m128 mix = _mm_loadu_ps(&table->white_mix[row][i]);
+            __m128 takes = _mm_cmpgt_ps(mix, zero);
+            white = _mm_min_ps(white, _mm_or_ps(_mm_and_ps(takes, _mm_div_ps(weights[row], _mm_or_ps(mix, _mm_andnot_ps(takes, one)))), _mm_andnot_ps(takes, huge)));
+        }
+        white = _mm_mul_ps(_mm_min_ps(_mm_max_ps(white, zero), one), _mm_loadu_ps(&table->has_white[i]));
+        for(int row = 0; row < 3; row++)
+            weights[row] = _mm_sub_ps(weights[row], _mm_mul_ps(white, _mm_loadu_ps(&table->white_mix[row][i])));
+        weights[3] = white;
+
+        // Out of the gamut?
+        __m128 lowest = _mm_min_ps(_mm_min_ps(weights[0], weights[1]), weights[2]);
+        __m128 highest = _mm_max_ps(_mm_max_ps(weights[0], weights[1]), _mm_max_ps(weights[2], weights[3]));
+        __m128 outside = _mm_or_ps(_mm_cmplt_ps(lowest, _mm_sub_ps(zero, margin)), _mm_cmpgt_ps(highest, _mm_add_ps(one, margin)));
+        _mm_storeu_ps(&colour_outside[i], _mm_and_ps(outside, one));
+
+        // 'scale' keeps the colour and makes it darker, if it's too bright. Whatever is left over is clipped.
+        if(!table->clip)
+        {
+            __m128 scale = _mm_div_ps(one, _mm_max_ps(highest, one));
+            for(int row = 0; row < 4; row++)
+                weights[row] = _mm_mul_ps(weights[row], scale);
+        }
+        for(int row = 0; row < 4; row++)
+            _mm_storeu_ps(&colour_weights[row][i], _mm_min_ps(_mm_max_ps(weights[row], zero), one));
+    }
+}
+
+// Looks up the levels for the weights, and puts them on the fixtures' channels in 'universe'.
+static void colour_levels(const colour_table *table, const USHORT *fixtures, USHORT no_of_fixtures, USHORT *universe)
+{
+    for(USHORT i = 0; i < no_of_fixtures; i++)
+    {
+        USHORT fixture = fixtures[i];
+
+        for(UCHAR primary = 0; primary < table->no_of_primaries[fixture]; primary++)
+        {
+            const float *inverse = &table->inverse[(fixture * 4 + primary) * (COLOUR_TABLE_SIZE + 1)];
+            universe[table->address[fixture] + table->offset[primary][fixture]] = colour_level(inverse, colour_weights[primary][i]);
+        }
+    }
+}
+
+// Converts the xyY colours (n x 3, column-major) for 'fixtures' (n of them, 0-based) into 'universe'. When the
+// fixtures are not all of them in order, the solve needs their calibration next to each other, so it's copied.
+static void colour_convert(const colour_table *table, const double *xyY, const USHORT *fixtures, USHORT no_of_fixtures, USHORT *universe, colour_table *scratch)
+{
+    const colour_table *solved = table;
+    BOOL in_order = TRUE;
+
+    for(USHORT i = 0; i < no_of_fixtures; i++)
+    {
+        for(int j = 0; j < 3; j++)
+            colour_input[j][i] = (float) xyY[j * no_of_fixtures + i];
+        in_order = in_order && (fixtures[i] == i);
+    }
+
+    if(!in_order)
+    {
+        for(USHORT i = 0; i < no_of_fixtures; i++)
+        {
+            for(int j = 0; j < 9; j++)
+                scratch->inverse_matrix[j][i] = table->inverse_matrix[j][fixtures[i]];
+            for(int j = 0; j < 3; j++)
+                scratch->white_mix[j][i] = table->white_mix[j][fixtures[i]];
+            scratch->has_white[i] = table->has_white[fixtures[i]];
+        }
+        scratch->clip = table->clip;
+        solved = scratch;
+    }
+
+    colour_solve(solved, no_of_fixtures);
+    colour_levels(table, fixtures, no_of_fixtures, universe);
+}
+
+// One batch for dmx('colour_bench'), into a scratch universe.
+typedef struct
+{
+    const colour_table *table;
+    const double *xyY;
+    const USHORT *fixtures;
+    USHORT no_of_fixtures;
+    USHORT *universe;
+} colour_bench_context;
+
+static void colour_bench_step(void *context)
+{
+    colour_bench_context *bench = context;
+
+    colour_convert(bench->table, bench->xyY, bench->fixtures, bench->no_of_fixtures, bench->universe, &colour_reordered);
+}
+
+
+
+/*
+    Spectral mixing.
+
+    With more primaries than three (RGBAW+UV, say), a fixture can get close to a spectrum, not just a colour.
+    dmx('spectral_define') takes the spectrum of each primary at full, and dmx('spectral_set') finds the weights of
+    the primaries that get closest to a target spectrum (in the least squares sense), with every weight between 0 and
+    1, and sends them. The weights go through the same response tables as in the colour conversion, so the levels
+    are 16-bit.
+    The least squares problem is the same for every target, only the right hand side changes. So when the fixture is
+    defined, we work out A' * A (the Gram matrix of the primaries), its Cholesky factorisation, and from that, the
+    pseudo-inverse. Then:
+    -Most of the time, the weights from the pseudo-inverse are all between 0 and 1 already, and that's it: one
+     matrix-vector product, which is done with SSE2.
+    -If not, the bounded problem is solved with an active set method (like Lawson-Hanson's NNLS, but with an upper
+     bound as well): the primaries at 0 or at full are held there, and the rest are solved for with the Gram
+     matrix. There are at most 8 primaries, so this is on tiny matrices, and the number of steps is capped, so the
+     time it takes has a limit.
+*/
+
+#define SPECTRAL_MAX_FIXTURES 128
+#define SPECTRAL_MAX_PRIMARIES 8
+#define SPECTRAL_MAX_SAMPLES 1024        // 380 to 780 nm at 1 nm is 401
+#define SPECTRAL_MAX_STEPS(n) (3 * (n) + 3)
+#define SPECTRAL_BENCH_SIZES 3
+#define SPECTRAL_BENCH_SECONDS 0.2
+
+static const double spectral_bench_primaries[SPECTRAL_BENCH_SIZES] = {3, 5, 8};
+
+typedef struct
+{
+    USHORT address;                     // 0-based
+    UCHAR no_of_primaries;
+    USHORT no_of_samples;
+    double gram[SPECTRAL_MAX_PRIMARIES][SPECTRAL_MAX_PRIMARIES];
+    double *spectra;                    // the primaries, one after the other (no_of_primaries x no_of_samples)
+    double *pseudo_inverse;             // the same layout, one row for each primary
+    float *inverse;                     // no_of_primaries x (COLOUR_TABLE_SIZE + 1): weight to 16-bit level
+} spectral_fixture;
+
+typedef struct
+{
+    USHORT no_of_fixtures;
+    spectral_fixture fixtures[SPECTRAL_MAX_FIXTURES];
+} spectral_table;
+
+static spectral_table spectral;
+
+static void spectral_free(spectral_table *table)
+{
+    for(USHORT i = 0; i < table->no_of_fixtures; i++)
+    {
+        free(table->fixtures[i].spectra);     // the pseudo-inverse and the response tables are in the same block
+        table->fixtures[i].spectra = NULL;
+    }
+    table->no_of_fixtures = 0;
+}
+
+static double spectral_dot(const double *a, const double *b, USHORT n)
+{
+    __m128d sum_0 = _mm_setzero_pd(), sum_1 = _mm_setzero_pd();
+    USHORT i = 0;
+
+    for(; i + 4 <= n; i += 4)
+    {
+        sum_0 = _mm_add_pd(sum_0, _mm_mul_pd(_mm_loadu_pd(&a[i]), _mm_loadu_pd(&b[i])));
+        sum_1 = _mm_add_pd(sum_1, _mm_mul_pd(_mm_loadu_pd(&a[i + 2]), _mm_loadu_pd(&b[i + 2])));
+    }
+    sum_0 = _mm_add_pd(sum_0, sum_1);
+
+    double sum = _mm_cvtsd_f64(_mm_add_sd(sum_0, _mm_unpackhi_pd(sum_0, sum_0)));
+    for(; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// Cholesky factorisation of the symmetric n x n matrix in 'a' (row stride SPECTRAL_MAX_PRIMARIES), in place: the
+// lower triangle is L. Returns FALSE if the matrix is not positive definite, or nearly singular.
+static BOOL spectral_cholesky(double a[][SPECTRAL_MAX_PRIMARIES], UCHAR n)
+{
+    double largest = 0;
+
+    for(UCHAR i = 0; i < n; i++)
+        largest = max(largest, a[i][i]);
+
+    for(UCHAR j = 0; j < n; j++)
+    {
+        double pivot = a[j][j];
+        for(UCHAR k = 0; k < j; k++)
+            pivot -= a[j][k] * a[j][k];
+        if(!(pivot > largest * 1e-12))
+            return FALSE;
+        a[j][j] = sqrt(pivot);
+
+        for(UCHAR i = j + 1; i < n; i++)
+        {
+            double value = a[i][j];
+            for(UCHAR k = 0; k < j; k++)
+                value -= a[i][k] * a[j][k];
+            a[i][j] = value / a[j][j];
+        }
+    }
+    return TRUE;
+}
+
+// Solves L * L' * x = b, with L from spectral_cholesky(). 'b' is overwritten with x.
+static void spectral_cholesky_solve(double l[][SPECTRAL_MAX_PRIMARIES], UCHAR n, double *b)
+{
+    for(UCHAR i = 0; i < n; i++)
+    {
+        for(UCHAR k = 0; k < i; k++)
+            b[i] -= l[i][k] * b[k];
+        b[i] /= l[i][i];
+    }
+    for(int i = n - 1; i >= 0; i--)
+    {
+        for(UCHAR k = i + 1; k < n; k++)
+            b[i] -= l[k][i] * b[k];
+        b[i] /= l[i][i];
+    }
+}
+
+// Works out the Gram matrix and the pseudo-inverse of a fixture, whose spectra are filled in already.
+// Returns FALSE if the primaries are not independent: then there are many solutions.
+static BOOL spectral_factorise(spectral_fixture *fixture)
+{
+    double cholesky[SPECTRAL_MAX_PRIMARIES][SPECTRAL_MAX_PRIMARIES];
+    double column[SPECTRAL_MAX_PRIMARIES];
+    UCHAR n = fixture->no_of_primaries;
+    USHORT m = fixture->no_of_samples;
+
+    for(UCHAR i = 0; i < n; i++)
+    {
+        for(UCHAR j = 0; j <= i; j++)
+            fixture->gram[i][j] = fixture->gram[j][i] = spectral_dot(&fixture->spectra[i * m], &fixture->spectra[j * m], m);
+    }
+
+    memcpy(cholesky, fixture->gram, sizeof(cholesky));
+    if(!spectral_cholesky(cholesky, n))
+        return FALSE;
+
+    // The pseudo-inverse is (A' * A) \ A', one sample (a column of it) at a time.
+    for(USHORT sample = 0; sample < m; sample++)
+    {
+        for(UCHAR i = 0; i < n; i++)
+            column[i] = fixture->spectra[i * m + sample];
+        spectral_cholesky_solve(cholesky, n, column);
+        for(UCHAR i = 0; i < n; i++)
+            fixture->pseudo_inverse[i * m + sample] = column[i];
+    }
+    return TRUE;
+}
+
+// Allocates the spectra, the pseudo-inverse and the response tables of a fixture, in one block.
+static BOOL spectral_allocate(spectral_fixture *fixture)
+{
+    size_t no_of_values = (size_t) fixture->no_of_primaries * fixture->no_of_samples;
+
+    fixture->spectra = malloc(2 * no_of_values * sizeof(double) + fixture->no_of_primaries * (COLOUR_TABLE_SIZE + 1) * sizeof(float));
+    if(fixture->spectra == NULL)
+        return FALSE;
+    fixture->pseudo_inverse = fixture->spectra + no_of_values;
+    fixture->inverse = (float *) (fixture->pseudo_inverse + no_of_values);
+    return TRUE;
+}
+
+// Checks the fixtures, and fills in a table. Returns NULL if everything is fine, otherwise an error message.
+// The blocks of the fixtures are allocated here, spectral_free() frees them, even if this failed.
+static const char *spectral_prepare(const mxArray *fixtures_input, spectral_table *table)
+{
+    BOOL used[512] = {FALSE};
+
+    if(!mxIsStruct(fixtures_input) || mxGetFieldNumber(fixtures_input, "address") < 0 || mxGetFieldNumber(fixtures_input, "spectra") < 0)
+        return "dmx.mex::The fixtures must be a struct array, with 'address', 'spectra' and (optionally) 'gamma' fields.\n";
+
+    if(mxGetNumberOfElements(fixtures_input) < 1 || mxGetNumberOfElements(fixtures_input) > SPECTRAL_MAX_FIXTURES)
+        return "dmx.mex::There must be between 1 and 128 fixtures.\n";
+
+    for(USHORT i = 0; i < (USHORT) mxGetNumberOfElements(fixtures_input); i++)
+    {
+        spectral_fixture *fixture = &table->fixtures[i];
+        const mxArray *address_field = mxGetField(fixtures_input, i, "address");
+        const mxArray *spectra_field = mxGetField(fixtures_input, i, "spectra");
+        const mxArray *gamma_field = (mxGetFieldNumber(fixtures_input, "gamma") >= 0) ? mxGetField(fixtures_input, i, "gamma") : NULL;
+
+        if(address_field == NULL || !mxIsNumeric(address_field) || mxGetNumberOfElements(address_field) != 1)
+            return "dmx.mex::Fixture addresses must be numbers.\n";
+
+        double address = mxGetScalar(address_field);
+        if(address < 1 || address > 512 || address != (USHORT) address)
+            return "dmx.mex::Fixture addresses must be integers between 1 and 512.\n";
+
+        if(spectra_field == NULL || !mxIsDouble(spectra_field) || mxIsComplex(spectra_field) || mxGetN(spectra_field) < 1 || mxGetN(spectra_field) > SPECTRAL_MAX_PRIMARIES
+            || mxGetM(spectra_field) < mxGetN(spectra_field) || mxGetM(spectra_field) > SPECTRAL_MAX_SAMPLES)
+            return "dmx.mex::The spectra must be samples x primaries (up to 1024 x 8), one column for each primary at full, in the order of the channels.\n";
+
+        fixture->address = (USHORT) address - 1;
+        fixture->no_of_primaries = (UCHAR) mxGetN(spectra_field);
+        fixture->no_of_samples = (USHORT) mxGetM(spectra_field);
+        if(fixture->address + fixture->no_of_primaries > 512)
+            return "dmx.mex::A fixture does not fit in the universe.\n";
+
+        for(UCHAR j = 0; j < fixture->no_of_primaries; j++)
+        {
+            if(used[fixture->address + j])
+                return "dmx.mex::The fixtures must not overlap.\n";
+            used[fixture->address + j] = TRUE;
+        }
+
+        if(!spectral_allocate(fixture))
+            return "dmx.mex::Not enough memory for the spectra.\n";
+        table->no_of_fixtures = i + 1;
+
+        // Matlab's columns are the primaries, so this is the layout we want already.
+        memcpy(fixture->spectra, mxGetData(spectra_field), (size_t) fixture->no_of_primaries * fixture->no_of_samples * sizeof(double));
+        for(ULONG j = 0; j < (ULONG) fixture->no_of_primaries * fixture->no_of_samples; j++)
+        {
+            if(!isfinite(fixture->spectra[j]))
+                return "dmx.mex::The spectra must be finite.\n";
+        }
+        if(!spectral_factorise(fixture))
+            return "dmx.mex::The spectra of a fixture's primaries must be independent: none of them can be mixed from the others.\n";
+
+        const char *error_message = colour_responses(gamma_field, fixture->no_of_primaries, fixture->inverse);
+        if(error_message != NULL)
+            return error_message;
+    }
+
+    return NULL;
+}
+
+// Finds the weights (0 to 1) of the primaries that get closest to 'target'. Returns the number of active set steps
+// it took, 0 if the pseudo-inverse was enough.
+static ULONG spectral_solve(const spectral_fixture *fixture, const double *target, double *weights)
+{
+    UCHAR n = fixture->no_of_primaries;
+    USHORT m = fixture->no_of_samples;
+    double projection[SPECTRAL_MAX_PRIMARIES];
+    BOOL inside = TRUE;
+
+    for(UCHAR i = 0; i < n; i++)
+    {
+        weights[i] = spectral_dot(&fixture->pseudo_inverse[i * m], target, m);
+        inside = inside && weights[i] >= 0 && weights[i] <= 1;
+    }
+    if(inside)
+        return 0;
+
+    // The bounded problem: minimise x' * G * x / 2 - b' * x, where G = A' * A, and b = A' * target.
+    // 'bound' is -1 for the weights held at 0, 1 for the ones held at full, and 0 for the free ones.
+    signed char bound[SPECTRAL_MAX_PRIMARIES];
+    double scale = 0;
+    ULONG steps = 0;
+
+    for(UCHAR i = 0; i < n; i++)
+    {
+        projection[i] = spectral_dot(&fixture->spectra[i * m], target, m);
+        weights[i] = 0;
+        bound[i] = -1;
+        scale = max(scale, fixture->gram[i][i]);
+    }
+
+    while(steps < SPECTRAL_MAX_STEPS(n))
+    {
+        // Free the held weight that the gradient pulls away from its bound the most.
+        int freed = -1;
+        double pull = scale * 1e-12;
+        for(UCHAR i = 0; i < n; i++)
+        {
+            if(bound[i] == 0)
+                continue;
+
+            double gradient = -projection[i];
+            for(UCHAR j = 0; j < n; j++)
+                gradient += fixture->gram[i][j] * weights[j];
+            if(gradient * bound[i] > pull)
+            {
+                pull = gradient * bound[i];
+                freed = i;
+            }
+        }
+        if(freed < 0)
+            break;
+        bound[freed] = 0;
+
+        // Solve for the free weights, with the others held. If that goes past a bound, go only as far as the first
+        // one, hold it there, and try again with the rest.
+        while(steps++ < SPECTRAL_MAX_STEPS(n))
+        {
+            double system[SPECTRAL_MAX_PRIMARIES][SPECTRAL_MAX_PRIMARIES];
+            double solution[SPECTRAL_MAX_PRIMARIES];
+            UCHAR free_weights[SPECTRAL_MAX_PRIMARIES];
+            UCHAR no_of_free = 0;
+
+            for(UCHAR i = 0; i < n; i++)
+            {
+                if(bound[i] == 0)
+                    free_weights[no_of_free++] = i;
+            }
+            for(UCHAR i = 0; i < no_of_free; i++)
+            {
+                solution[i] = projection[free_weights[i]];
+                for(UCHAR j = 0; j < n; j++)
+                {
+                    if(bound[j] != 0)
+                        solution[i] -= fixture->gram[free_weights[i]][j] * weights[j];
+                }
+                for(UCHAR j = 0; j < no_of_free; j++)
+                    system[i][j] = fixture->gram[free_weights[i]][free_weights[j]];
+            }
+            if(!spectral_cholesky(system, no_of_free))
+                break;
+            spectral_cholesky_solve(system, no_of_free, solution);
+
+            double step = 1;
+            int limit = -1;
+            for(UCHAR i = 0; i < no_of_free; i++)
+            {
+                double weight = weights[free_weights[i]];
+                double to_bound = (solution[i] < 0) ? weight / (weight - solution[i]) : (solution[i] > 1) ? (1 - weight) / (solution[i] - weight) : 1;
+                if(to_bound < step)
+                {
+                    step = to_bound;
+                    limit = i;
+                }
+            }
+
+            for(UCHAR i = 0; i < no_of_free; i++)
+            {
+                UCHAR free_weight = free_weights[i];
+                weights[free_weight] += step * (solution[i] - weights[free_weight]);
+
+                // The one that got there first, and any others that got there at the same time.
+                if(limit >= 0 && (i == limit || (solution[i] < 0 && weights[free_weight] <= 1e-12) || (solution[i] > 1 && weights[free_weight] >= 1 - 1e-12)))
+                {
+                    weights[free_weight] = (solution[i] < 0) ? 0 : 1;
+                    bound[free_weight] = (solution[i] < 0) ? -1 : 1;
+                }
+            }
+            if(limit < 0)
+                break;
+        }
+    }
+
+    for(UCHAR i = 0; i < n; i++)
+        weights[i] = min(max(weights[i], 0.0), 1.0);
+    return max(steps, 1);
+}
+
+// Looks up the levels for the weights, and puts them on the fixture's channels in 'universe'.
+static void spectral_levels(const spectral_fixture *fixture, const double *weights, USHORT *universe)
+{
+    for(UCHAR i = 0; i < fixture->no_of_primaries; i++)
+        universe[fixture->address + i] = colour_level(&fixture->inverse[i * (COLOUR_TABLE_SIZE + 1)], (float) weights[i]);
+}
+
+// One solve for dmx('spectral_bench'), of the next of its 64 targets. Each is timed on its own, for the longest.
+typedef struct
+{
+    const spectral_fixture *fixture;
+    const double *targets;
+    ULONG next_target;
+    ULONG no_of_solves;
+    ULONG no_of_constrained;
+    LONGLONG total;
+    LONGLONG longest;
+    USHORT universe[512];
+} spectral_bench_context;
+
+static void spectral_bench_step(void *context)
+{
+    spectral_bench_context *bench = context;
+    double weights[SPECTRAL_MAX_PRIMARIES];
+
+    LONGLONG start = now_ticks();
+    bench->no_of_constrained += (spectral_solve(bench->fixture, &bench->targets[bench->next_target * bench->fixture->no_of_samples], weights) > 0);
+    spectral_levels(bench->fixture, weights, bench->universe);
+    LONGLONG took = now_ticks() - start;
+
+    bench->total += took;
+    bench->longest = max(bench->longest, took);
+    bench->no_of_solves++;
+    bench->next_target = (bench->next_target + 1) % 64;
+}
+
+
+
+// Called when Matlab unloads the mex file, or exits.
+static void dmx_cleanup(void)
+{
+    LONG dropped;
+
+    bridge_stop();
+    session_stop();
+    capture_stop(&dropped);
+    daemon_disconnect();
+    net_protocol_close(&artnet);
+    net_protocol_close(&sacn);
+    colour_free(&colour);
+    spectral_free(&spectral);
+
+    for(unsigned int i = 0; i < MAX_CURVES; i++)
+    {
+        free(curves.curves[i].table);
+        curves.curves[i].table = NULL;
+    }
+    memset(curves.channel_curve, 0, sizeof(curves.channel_curve));
+    curves.no_of_curved_channels = 0;
+
+    if(worker.avrt != NULL)
+        FreeLibrary(worker.avrt);
+    if(worker.winmm != NULL)
+        FreeLibrary(worker.winmm);
+    worker.avrt = NULL;
+    worker.winmm = NULL;
+
+    if(output_initialized)
+    {
+        DeleteCriticalSection(&engine_lock);
+        output_initialized = FALSE;
+    }
+}
+
+
+
+
+/*
+    This is a multiple entry-point function. when you call this, the first argument is the function's name.
+*/
+
+void mexFunction( int nlhs, mxArray *plhs[],
+                  int nrhs, const mxArray *prhs[])
+{
+    /*
+        Local variables
+    */
+    char stringBuffer[128]; // This is for the function name. 128 bytes are generous.
+
+    mexAtExit(dmx_cleanup);
+    output_init();
+
+    /*
+        Sanity checks on the first input argument.
+        Everything else is done within the corresponding parts.
+    */
+
+    // Do we at least have 1 input argument?.
+	if (nrhs < 1) {
+		mexErrMsgTxt("dmx.mex::This function needs at least one input argument!\n");
+	}
+
+	// Is the first input argument a string?
+	if (!mxIsChar(prhs[0])) {
+		mexErrMsgTxt("dmx.mex::The first argument is a function name string. Check the documentation on what is available.\n");
+	}
+
+
+    // Process the string
+    if (mxGetString(prhs[0], stringBuffer, sizeof(stringBuffer) - 1)) {
+		mexErrMsgTxt("dmx.mex::The funcion name is suspiciosly too long. Check the documentation.\n");
+	}
+
+
+
+    /*
+        fail = dmx('send_prepared', handle, data_values)
+        dmx('send_prepared', handle, data_values, status)
+
+        The same as dmx('send'), for the addresses of a plan from dmx('prepare'). 'data_values' are in the same order
+        as the addresses were, doubles (0-255, fractions are fine, anything outside is clamped) or uint8.
+        Only the number of values is checked.
+        This one comes before the device list: while the refresh thread is running, it doesn't need the device,
+        and going through all the USB devices would take longer than everything else here.
+    */
+
+    if(!strcmp(stringBuffer, "send_prepared"))
+    {
+        const mxArray *status_input = (nrhs == 4) ? prhs[3] : NULL;
+        const address_plan *plan = NULL;
+        const char *error_message = NULL;
+
+        if(nrhs != 3 && nrhs != 4)
+            error_message = "dmx.mex::This function needs three or four arguments.\n";
+        else if(status_input != NULL && !status_buffer_valid(status_input))
+        {
+            error_message = "dmx.mex::The status buffer must be a vector of at least 3 doubles.\n";
+            status_input = NULL;
+        }
+        else if((plan = plan_find(prhs[1])) == NULL)
+            error_message = "dmx.mex::This is not a prepared plan. Get one with dmx('prepare', addresses).\n";
+        else if((!mxIsDouble(prhs[2]) && !mxIsUint8(prhs[2])) || mxIsComplex(prhs[2]) || mxGetNumberOfElements(prhs[2]) != plan->no_of_channels)
+            error_message = "dmx.mex::There must be exactly one value (double or uint8) for each address of the plan.\n";
+
+        if(error_message != NULL)
+        {
+            command_failed(DMX_ERROR_ARGUMENT, stringBuffer, error_message, ERROR_SUCCESS);
+            command_result(nlhs, plhs, status_input, TRUE, FALSE);
+            return;
+        }
+
+        EnterCriticalSection(&engine_lock);
+        for(USHORT i = 0; i < plan->no_of_runs; i++)
+        {
+            const plan_run *run = &plan->runs[i];
+
+            if(mxIsDouble(prhs[2]))
+                levels_to_16bit(&((mxDouble *) mxGetData(prhs[2]))[run->offset], run->no_of_channels, &shadow_universe[run->start_address], 1);
+            else
+            {
+                UCHAR *data_values_input_pointer = &((UCHAR *) mxGetData(prhs[2]))[run->offset];
+                for(USHORT j = 0; j < run->no_of_channels; j++)
+                    shadow_universe[run->start_address + j] = (USHORT) data_values_input_pointer[j] * 257;
+            }
+        }
+        shadow_mark_dirty(plan->first, plan->last);
+        urgent_mark(plan->first, plan->last, FALSE);
+        LeaveCriticalSection(&engine_lock);
+
+        BOOL failed = shadow_flush_command(stringBuffer);
+        command_result(nlhs, plhs, status_input, failed, FALSE); // fail. :)
+        return;
+    }
+
+
+
+    /*
+        fail = dmx('pixelmap_push', image, [status_buffer])
+
+        Samples 'image' with the map from dmx('pixelmap_define'), and sends the fixtures' channels, like dmx('send').
+        'image' is height x width x 3, uint8, or double with levels between 0 and 255 (like everywhere else here,
+        so an image from im2double() has to be multiplied by 255 first). The status buffer is like in dmx('send').
+    */
+
+    if(!strcmp(stringBuffer, "pixelmap_push"))
+    {
+        const mxArray *status_input = (nrhs == 3) ? prhs[2] : NULL;
+        const char *error_message = NULL;
+        USHORT levels[4 * PIXELMAP_MAX_FIXTURES];
+
+        if(nrhs != 2 && nrhs != 3)
+            error_message = "dmx.mex::This function needs two or three arguments.\n";
+        else if(status_input != NULL && !status_buffer_valid(status_input))
+        {
+            error_message = "dmx.mex::The status buffer must be a vector of at least 3 doubles.\n";
+            status_input = NULL;
+        }
+        else if(pixelmap.no_of_fixtures == 0)
+            error_message = "dmx.mex::There is no pixel map. Define one with dmx('pixelmap_define', map).\n";
+        else if(!pixelmap_image_valid(&pixelmap, prhs[1]))
+            error_message = "dmx.mex::The image must be height x width x 3, uint8 or double, and big enough for the map.\n";
+
+        if(error_message != NULL)
+        {
+            command_failed(DMX_ERROR_ARGUMENT, stringBuffer, error_message, ERROR_SUCCESS);
+            command_result(nlhs, plhs, status_input, TRUE, FALSE);
+            return;
+        }
+
+        pixelmap_render(&pixelmap, prhs[1], levels);
+
+        EnterCriticalSection(&engine_lock);
+        pixelmap_scatter(&pixelmap, levels, shadow_universe);
+        shadow_mark_dirty(pixelmap.first, pixelmap.last);
+        urgent_mark(pixelmap.first, pixelmap.last, FALSE);
+        LeaveCriticalSection(&engine_lock);
+
+        BOOL failed = shadow_flush_command(stringBuffer);
+        command_result(nlhs, plhs, status_input, failed, FALSE);
+        return;
+    }
+
+
+
+    /*
+        [fail, out_of_gamut] = dmx('colour_set', xyY, [fixtures, [status_buffer]])
+
+        Converts CIE xyY colours to levels for the fixtures from dmx('colour_define'), and sends them, like
+        dmx('send'). 'xyY' is n x 3, one row for each fixture, with Y relative to the fixture at full (so it's
+        between 0 and 1 in the gamut). 'fixtures' are the indices of the fixtures in the definition, the default is
+        the first n. 'out_of_gamut' is a logical vector, true for the colours the fixture couldn't make, and these
+        are scaled or clipped. The status buffer is like in dmx('send'): with one, 'fail' only goes there, unless
+        'out_of_gamut' is asked for too (Matlab can't skip the first output).
+    */
+
+    if(!strcmp(stringBuffer, "colour_set"))
+    {
+        const mxArray *status_input = (nrhs == 4) ? prhs[3] : NULL;
+        const char *error_message = NULL;
+        USHORT fixtures[COLOUR_MAX_FIXTURES];
+        USHORT no_of_fixtures = 0;
+
+        if(nrhs < 2 || nrhs > 4)
+            error_message = "dmx.mex::This function needs two to four arguments.\n";
+        else if(status_input != NULL && !status_buffer_valid(status_input))
+        {
+            error_message = "dmx.mex::The status buffer must be a vector of at least 3 doubles.\n";
+            status_input = NULL;
+        }
+        else if(colour.no_of_fixtures == 0)
+            error_message = "dmx.mex::There are no fixtures. Define them with dmx('colour_define', fixtures).\n";
+        else if(!mxIsDouble(prhs[1]) || mxIsComplex(prhs[1]) || mxGetN(prhs[1]) != 3 || mxGetM(prhs[1]) < 1 || mxGetM(prhs[1]) > colour.no_of_fixtures)
+            error_message = "dmx.mex::The colours must be n x 3 doubles: x, y and Y, one row for each fixture.\n";
+        else
+        {
+            no_of_fixtures = (USHORT) mxGetM(prhs[1]);
+            if(nrhs >= 3 && !mxIsEmpty(prhs[2]))
+            {
+                if(!mxIsDouble(prhs[2]) || mxGetNumberOfElements(prhs[2]) != no_of_fixtures)
+                    error_message = "dmx.mex::There must be a fixture index for each colour.\n";
+                for(USHORT i = 0; i < no_of_fixtures && error_message == NULL; i++)
+                {
+                    double index = ((mxDouble *) mxGetData(prhs[2]))[i];
+                    if(!(index >= 1 && index <= colour.no_of_fixtures) || index != (USHORT) index)
+                        error_message = "dmx.mex::The fixture indices must be whole numbers, from 1 to the number of fixtures.\n";
+                    else
+                        fixtures[i] = (USHORT) index - 1;
+                }
+            }
+            else
+            {
+                for(USHORT i = 0; i < no_of_fixtures; i++)
+                    fixtures[i] = i;
+            }
+        }
+
+        if(error_message != NULL)
+        {
+            command_failed(DMX_ERROR_ARGUMENT, stringBuffer, error_message, ERROR_SUCCESS);
+            command_result(nlhs, plhs, status_input, TRUE, TRUE);
+            if(nlhs > 1)
+                plhs[1] = mxCreateLogicalMatrix(0, 1);
+            return;
+        }
+
+        USHORT levels[4 * COLOUR_MAX_FIXTURES];
+        USHORT first = 511, last = 0;
+
+        colour_convert(&colour, (const double *) mxGetData(prhs[1]), fixtures, no_of_fixtures, levels, &colour_reordered);
+
+        EnterCriticalSection(&engine_lock);
+        for(USHORT i = 0; i < no_of_fixtures; i++)
+        {
+            USHORT address = colour.address[fixtures[i]];
+            USHORT end = address + colour.no_of_primaries[fixtures[i]] - 1;
+
+            memcpy(&shadow_universe[address], &levels[address], (end - address + 1) * sizeof(USHORT));
+            first = min(first, address);
+            last = max(last, end);
+        }
+        shadow_mark_dirty(first, last);
+        urgent_mark(first, last, FALSE);
+        LeaveCriticalSection(&engine_lock);
+
+        BOOL failed = shadow_flush_command(stringBuffer);
+        command_result(nlhs, plhs, status_input, failed, TRUE);
+        if(nlhs > 1)
+        {
+            plhs[1] = mxCreateLogicalMatrix(no_of_fixtures, 1);
+            for(USHORT i = 0; i < no_of_fixtures; i++)
+                mxGetLogicals(plhs[1])[i] = (colour_outside[i] != 0);
+        }
+        return;
+    }
+
+
+
+    /*
+        [fail, weights] = dmx('spectral_set', fixture, target, [status_buffer])
+
+        Finds the levels of the primaries of 'fixture' (its index in dmx('spectral_define')) that get closest to the
+        'target' spectrum, and sends them, like dmx('send'). 'target' is sampled like the fixture's spectra, and in
+        the same units, so a target from the fixture's own primaries at full is all 1s. 'weights' are the outputs of
+        the primaries (between 0 and 1, before the response tables). The status buffer is like in dmx('colour_set'):
+        with one, 'fail' only goes there, unless 'weights' is asked for too.
+    */
+
+    if(!strcmp(stringBuffer, "spectral_set"))
+    {
+        const mxArray *status_input = (nrhs == 4) ? prhs[3] : NULL;
+        const char *error_message = NULL;
+        const spectral_fixture *fixture = NULL;
+
+        if(nrhs != 3 && nrhs != 4)
+            error_message = "dmx.mex::This function needs three or four arguments.\n";
+        else if(status_input != NULL && !status_buffer_valid(status_input))
+        {
+            error_message = "dmx.mex::The status buffer must be a vector of at least 3 doubles.\n";
+            status_input = NULL;
+        }
+        else if(spectral.no_of_fixtures == 0)
+            error_message = "dmx.mex::There are no fixtures. Define them with dmx('spectral_define', fixtures).\n";
+        else
+        {
+            double index = (mxIsNumeric(prhs[1]) && mxGetNumberOfElements(prhs[1]) == 1) ? mxGetScalar(prhs[1]) : 0;
+            if(!(index >= 1 && index <= spectral.no_of_fixtures) || index != (USHORT) index)
+                error_message = "dmx.mex::The fixture must be a whole number, from 1 to the number of fixtures.\n";
+            else
+            {
+                fixture = &spectral.fixtures[(USHORT) index - 1];
+                if(!mxIsDouble(prhs[2]) || mxIsComplex(prhs[2]) || mxGetNumberOfElements(prhs[2]) != fixture->no_of_samples)
+                    error_message = "dmx.mex::The target must be a vector of doubles, sampled like the fixture's spectra.\n";
+            }
+        }
+
+        if(error_message != NULL)
+        {
+            command_failed(DMX_ERROR_ARGUMENT, stringBuffer, error_message, ERROR_SUCCESS);
+            command_result(nlhs, plhs, status_input, TRUE, TRUE);
+            if(nlhs > 1)
+                plhs[1] = mxCreateDoubleMatrix(1, 0, mxREAL);
+            return;
+        }
+
+        double weights[SPECTRAL_MAX_PRIMARIES];
+        USHORT first = fixture->address, last = fixture->address + fixture->no_of_primaries - 1;
+
+        spectral_solve(fixture, (const double *) mxGetData(prhs[2]), weights);
+
+        EnterCriticalSection(&engine_lock);
+        spectral_levels(fixture, weights, shadow_universe);
+        shadow_mark_dirty(first, last);
+        urgent_mark(first, last, FALSE);
+        LeaveCriticalSection(&engine_lock);
+
+        BOOL failed = shadow_flush_command(stringBuffer);
+        command_result(nlhs, plhs, status_input, failed, TRUE);
+        if(nlhs > 1)
+        {
+            plhs[1] = mxCreateDoubleMatrix(1, fixture->no_of_primaries, mxREAL);
+            memcpy(mxGetData(plhs[1]), weights, fixture->no_of_primaries * sizeof(double));
+        }
+        return;
+    }
+
+
+
+    /*
+        This bit is based on the API examples of libusbK.
+        https://github.com/mcuee/libusbk/tree/master/libusbK/examples
+    */
+
+    KLST_HANDLE deviceList = NULL;
+    KLST_DEVINFO_HANDLE deviceInfo = NULL;
+    KUSB_HANDLE handle = NULL;
+    DWORD errorCode = ERROR_SUCCESS;
+    ULONG count = 0;
+
+    /*
+        Initialize a new LstK (device list) handle.
+        The list is polulated with all usb devices libusbK can access.
+        When we're connected to the daemon, it has the device, and going through the list would be most of what
+        a call costs. The same goes for when there are only Art-Net nodes. The list stays empty then, so dmx('list')
+        and the tests don't see anything.
+    */
+    if (daemon.shm == NULL && !net.only && !LstK_Init(&deviceList, 0))
+    {
+        errorCode = GetLastError();
+        mexPrintf("Error code: %d.\n", errorCode);
+        mexErrMsgTxt("dmx.mex::An error occured getting the device list.");
+    }
+
+
+    #ifdef VERBOSE
+    /*
+        dmx('mextest')
+
+        I just leave this here for future reference,
+    */
+    if(!strcmp(stringBuffer, "mextest"))
+    {
+        mexPrintf("Test function is working without crashing.\n");
+    }
+    #endif
+
+    /*
+        dmx('list')
+
+        Prints all the devices that use libusbK
+    */
+    if(!strcmp(stringBuffer, "list"))
+    {
+        // Get the number of devices contained in the device list.
+        LstK_Count(deviceList, &count);
+        if (!count)
+        {
+            // Always free the device list if LstK_Init returns TRUE
+            LstK_Free(deviceList);
+
+            mexErrMsgTxt("dmx.mex::No USB device that uses libusbK was detected.");
+        }
+        else
+        {
+            mexPrintf("\nFound the following devices that use the libusbK driver:\n");
+            // Print devices to console.
+
+            LstK_Enumerate(deviceList, ShowDevicesCB, NULL);
+            LstK_Free(deviceList);
+
+            mexPrintf("\n");
+        }
+
+
+    }
+
+
+
+    /*
+        dmx('devicetest')
+
+        This one opens and closes the device.
+    */
+
+    if(!strcmp(stringBuffer, "devicetest"))
+    {
+        bool isPresent = FALSE;
+
+        // Open the device, fail if cannot
+        if (!LstK_FindByVidPid(deviceList, UDMX_VENDOR_ID, UDMX_PRODUCT_ID, &deviceInfo))
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::Could not find the uDMX device.\n");
+        }
+
+        // If we didn't die before, then load the driver API
+        LibK_LoadDriverAPI(&Usb, deviceInfo->DriverID);
+
+        // Open device.
+        if(!Usb.Init(&handle, deviceInfo))
+        {
+            errorCode = GetLastError();
+            LstK_Free(deviceList);
+            mexPrintf("dmx.mex::Error code: %d", errorCode);
+            mexErrMsgTxt("dmx.mex::Failed to open device.\n");
+        }
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Device opened, all good.\n");
+        #endif
+
+
+        // All done, clean up.
+        Usb.Free(handle);
+        LstK_Free(deviceList);
+
+
+        plhs[0] = mxCreateLogicalScalar(isPresent);
+    }
+
+
+
+
+    /*
+        dmx('commtest')
+
+        This one opens the device, sends a few bytes, then closes the device.
+    */
+
+    if(!strcmp(stringBuffer, "commtest"))
+    {
+        bool isPresent = FALSE;
+
+        // Open the device, fail if cannot
+        if (!LstK_FindByVidPid(deviceList, UDMX_VENDOR_ID, UDMX_PRODUCT_ID, &deviceInfo))
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::Could not find the uDMX device.\n");
+        }
+
+        // If we didn't die before, then load the driver API
+        LibK_LoadDriverAPI(&Usb, deviceInfo->DriverID);
+
+        // Open device.
+        if(!Usb.Init(&handle, deviceInfo))
+        {
+            errorCode = GetLastError();
+            LstK_Free(deviceList);
+            mexPrintf("dmx.mex::Error code: %d", errorCode);
+            mexErrMsgTxt("dmx.mex::Failed to open device.\n");
+        }
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Device opened.\n");
+        #endif
+
+       /* Send a simple USB request to the uDMX device.
+          I got these from:
+          https://github.com/mirdej/udmx/blob/master/firmware/main.c, line 432, usbFunctionSetup()
+          https://github.com/mirdej/udmx/blob/master/common/uDMX_cmds.h
+          https://github.com/mirdej/udmx/blob/master/commandline/uDMX.c
+
+            There is a uchar (or uint8) data[8] array to receive the arugment.
+            -Byte 0 is either cmd_setSingleChannel (1) or cmd_setChannelRange (2) or (I don't care about this, but I leave this here for the future) cmd_StartBootloader (248)
+
+            When data[1] is cmd_setSingleChannel:
+            -data[5..8] is the channel number (0-511) (wIndex) [btw, this is some epic bitbanging, cool]
+            -data[2] is the channel data (0-255) (wValue)
+            -data[3] is to be set to 0, otherwise err_BadValue
+
+
+            When data[1] is cmd_setChannelRange:
+            -data[4] is start channel (0-511)
+            -data[5] is number of channels (0-511) (wLength)
+                There are sanity checks here, so the channels need to be strictly monotonically increasing
+
+                    After the sanity checks, the usb (legacy libusb-win32) set to usb_ChannelRange (2)
+                    This calls usbFunctionWrite() (line 533), which accepts the uchar data array pointer, and the number of bytes to be transmitted.
+                    There are sanity checks in this one too.
+
+            ..and then, presumably, blast the data raw without any consideration for anything
+
+
+
+
+            The error codes are stored in reply[0], can can be
+            -0: All OK
+            -1: err_BadChannel (1)
+            -2: err_BadValue (2)
+
+            -----------------------------------------------------------------------------------------------------------------------------------------------------
+            this is from uDMX.c, line 156:
+            nBytes = usb_control_msg(handle,
+                                USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
+								cmd_SetChannelRange,
+                                argc-2,
+                                channel,
+                                buf,
+                                argc-2,
+                                5000);
+
+            From libusb-win32's documentation (https://sourceforge.net/p/libusb-win32/wiki/Documentation/)
+            int usb_control_msg(usb_dev_handle *dev,
+                                int requesttype,
+                                int request,
+                                int value,
+                                int index,
+                                char *bytes,
+                                int size,
+                                int timeout);
+                *dev handle is      handle
+                int requestype is   USB_TYPE_VENDOR | USB_RECIP_DEVICE |  USB_ENDPOINT_OUT (note bitwise or here)
+                int request is      cmd_setChannelRange (decimal 2)
+                int value is        index (or rather, indices, the channel numbers to be set)
+                int index is        channel (base channel address)
+                char *bytes         buf, the buffer where the channel data is
+                int size            the number of channels to be set (but for here, it's the length of the buffer)
+                int tmeout          usb request timeout in millisecons, this is libusb-win32 specific.
+
+
+
+
+            So to change channel 100, 101, 102, 103; (4 channels, base address is 100)
+            uchar channel_data[5] = [255, 0, 255, 0, 0];
+            Arguments:
+                -opcode (decimal 2)
+                -no_of_channels
+                -start_address
+                -the data to be send
+                -Length of data buffer, which corresponds to the number of channels
+
+            In here, we need to send data to the device. the first three arguments are processed by usbFunctionSetup(),
+            ..and the last two arguments are processed by usbFunctionWrite()
+
+            usb_send_somehow(cmd_setChannelRange, 4, 100, 4);
+
+            usb_send_somehow(channel_data)
+
+
+
+       */
+
+        // Some test data.
+        UCHAR opcode = cmd_SetChannelRange;
+        USHORT no_of_channels = 5;
+        USHORT start_address = 99; // Address 100 onwards! (off by 1 error)
+        UCHAR data_to_be_sent[] = {10, 255, 255, 0, 0}; // DIM, R, G, B, STROBE
+
+
+        /*
+            All these could probably go in a function for portability.
+            Source: https://github.com/mcuee/libusbk/blob/master/libusbK/examples/examples.c, line 244
+            Source: https://github.com/mcuee/libusbk/blob/master/libusbK/includes/libusbk.h, line 120
+        */
+
+        DWORD transferred = 0;
+	    BOOL success;
+	    WINUSB_SETUP_PACKET Pkt;
+	    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+
+        memset(&Pkt, 0, sizeof(Pkt));
+        defPkt->BmRequest.Dir	= 0; // This should be BMREQUEST_DIR_HOST_TO_DEVICE
+        defPkt->BmRequest.Type	= 2; // This should be BMREQUEST_TYPE_VENDOR
+        defPkt->Request			= (UCHAR) cmd_SetChannelRange;
+        defPkt->Value			= (UINT) no_of_channels;
+        defPkt->Index			= start_address;
+        defPkt->Length			= no_of_channels;
+
+
+        mexPrintf("dmx.mex::Sending data to the device.\n");
+        /*
+            BOOL __stdcall UsbK_ControlTransfer(KUSB_HANDLE InterfaceHandle,
+                                                WINUSB_SETUP_PACKET SetupPacket,
+                                                PUCHAR Buffer,
+                                                UINT BufferLength,
+                                                PUINT LengthTransferred,
+                                                LPOVERLAPPED Overlapped)
+
+        */
+
+        success = UsbK_ControlTransfer(handle, Pkt, data_to_be_sent, no_of_channels, &transferred, NULL);
+
+        mexPrintf("dmx.mex::Transferred %d Bytes.\n", transferred);
+
+        // All done, clean up.
+        mexPrintf("dmx.mex::Cleaning up..\n");
+        Usb.Free(handle);
+        LstK_Free(deviceList);
+
+
+
+
+        plhs[0] = mxCreateLogicalScalar(!success); // fail. :)
+    }
+
+
+    /*
+        dmx('inputtest')
+
+        This one checks the input arguments:
+        -'addresses' are the addresses to be changed in the DMX frame (1-512)
+        -'data_values' are the bytes that are to be assinged to the addresses (0-255)
+
+        Each input is a vector. The addresses must be strictly monotonically increasing.
+        The number of addresses must match with the number of data values.
+
+        I just used this bit for developing the sanity chesks for dmx('send', ...).
+        Just in casem I keep this here.
+
+    */
+
+    if(!strcmp(stringBuffer, "inputtest"))
+    {
+        LstK_Free(deviceList); // This one doesn't need the device.
+
+        // Create some sanity checks on the input arguments.
+
+        if(nrhs != 3)
+            mexErrMsgTxt("dmx.mex::This function needs exactly three arguments.\n");
+
+        // Check if the inputs are numeric arrays.
+        if(!mxIsNumeric(prhs[1]))
+            mexErrMsgTxt("dmx.mex::Addresses must be numbers.\n");
+
+        if(!mxIsNumeric(prhs[2]))
+            mexErrMsgTxt("dmx.mex::Data values must be numbers.\n");
+
+        // Check dimensions of the address array
+        if(mxGetNumberOfDimensions(prhs[1]) > 2)
+            mexErrMsgTxt("dmx.mex::Addresses must be packed into a vector.\n");
+
+        // Check dimensions of the data array
+        if(mxGetNumberOfDimensions(prhs[2]) > 2)
+            mexErrMsgTxt("dmx.mex::Data values must be packed into a vector.\n");
+
+        // Get the dimensions of each array
+        mwSize no_of_elements_address, no_of_elements_data;
+        no_of_elements_address = mxGetNumberOfElements(prhs[1]);
+        no_of_elements_data = mxGetNumberOfElements(prhs[2]);
+
+        if(no_of_elements_address != no_of_elements_data)
+            mexErrMsgTxt("dmx.mex::The address and data array do not have the same number of elements.\n");
+
+        if(no_of_elements_address > 512)
+            mexErrMsgTxt("dmx.mex::You only can have 512 elements in a DMX512 frame.\n");
+
+
+        // Check if the input arrays are empty.
+        if(mxIsEmpty(prhs[1]))
+            mexErrMsgTxt("dmx.mex::Addresses must not be empty.");
+
+        if(mxIsEmpty(prhs[2]))
+            mexErrMsgTxt("dmx.mex::Data values must not be empty.");
+
+        // Are we getting vectors?
+        size_t addresses_no_of_rows = mxGetM(prhs[1]);
+        size_t addresses_no_of_columns = mxGetN(prhs[1]);
+        size_t data_values_no_of_rows = mxGetM(prhs[2]);
+        size_t data_values_no_of_columns = mxGetN(prhs[2]);
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Addresses have %d rows and %d columns,\nData values have %d rows and %d columns.\n", addresses_no_of_rows, addresses_no_of_columns, data_values_no_of_rows, data_values_no_of_columns);
+        #endif
+
+        if(addresses_no_of_rows != 1 && addresses_no_of_columns != 1)
+            mexErrMsgTxt("dmx.mex::The addresses must be in a vector.\n");
+
+        if(data_values_no_of_rows != 1 && data_values_no_of_columns != 1)
+            mexErrMsgTxt("dmx.mex::The data valaues must be in a vector.\n");
+
+
+        USHORT addresses_converted[512];
+        UCHAR data_values_converted[512];
+
+        mxDouble *addresses_input_pointer = mxGetData(prhs[1]);
+        mxDouble *data_values_input_pointer = mxGetData(prhs[2]);
+
+        // Is the list of addresses in strictly monotonically increasing order?
+        for(unsigned int i = 1; i<no_of_elements_address; i++)
+        {
+            if(addresses_input_pointer[i] - addresses_input_pointer[i-1] != 1)
+                mexErrMsgTxt("dmx.mex::The addresses must increase one by one.\n");
+
+        }
+
+        //Copy the arrays over while casting them to the required format.
+        for(unsigned int i = 0; i<no_of_elements_address; i++)
+        {
+            // In this loop, we fetch the input data, and cast it before saving.
+            #ifdef VERBOSE
+            mexPrintf("%d: Addr: %d; Data: %d.\n", i, (USHORT) addresses_input_pointer[i], (UCHAR) data_values_input_pointer[i]);
+            #endif
+            addresses_converted[i] = (USHORT) addresses_input_pointer[i] -1; // off-by-one error: the dongle expects [0-511], reality expects [1-512].
+            data_values_converted[i] = (UCHAR) data_values_input_pointer[i];
+        }
+
+
+        // Add the offset.
+        USHORT start_address = addresses_converted[0];
+        USHORT end_address = addresses_converted[no_of_elements_address - 1];
+        USHORT no_of_channels = end_address - start_address;
+
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::All sanity checks passed, showing converted address range: %03d - %03d = %d\n", end_address, start_address, no_of_channels);
+        #endif
+
+        // Check the work: dmx('inputtest', [100, 101, 102, 103, 104, 105], [255, 255; 255, 255; 0, 0]);
+
+
+    }
+
+
+
+    /*
+        dmx('send')
+
+        This one checks the input arguments:
+        -'addresses' are the addresses to be changed in the DMX frame (1-512)
+        -'data_values' are the bytes that are to be assinged to the addresses (0-255)
+        -'status' is optional, a status buffer (see above), this is written instead of returning anything.
+
+        Each input is a vector. The addresses must be strictly monotonically increasing.
+        The number of addresses must match with the number of data values.
+    */
+
+    if(!strcmp(stringBuffer, "send"))
+    {
+        /*
+            The Sanity check and data preparation stuff
+        */
+
+        USHORT start_address;
+        USHORT no_of_channels;
+        USHORT data_values_converted[512]; // 16-bit levels, see level_to_16bit()
+        const mxArray *status_input = (nrhs == 4) ? prhs[3] : NULL;
+        const char *error_message = NULL;
+
+        if(nrhs != 3 && nrhs != 4)
+            error_message = "dmx.mex::This function needs three or four arguments.\n";
+        else if(status_input != NULL && !status_buffer_valid(status_input))
+        {
+            error_message = "dmx.mex::The status buffer must be a vector of at least 3 doubles.\n";
+            status_input = NULL;
+        }
+        else
+            error_message = send_arguments(prhs, &start_address, &no_of_channels, data_values_converted);
+
+        if(error_message != NULL)
+        {
+            LstK_Free(deviceList);
+            command_failed(DMX_ERROR_ARGUMENT, stringBuffer, error_message, ERROR_SUCCESS);
+            command_result(nlhs, plhs, status_input, TRUE, FALSE);
+            return;
+        }
+
+        // Check the work: dmx('inputtest', [100, 101, 102, 103, 104, 105], [255, 255; 255, 255; 0, 0]);
+
+        // Update our copy of the universe, this is what gets sent.
+        EnterCriticalSection(&engine_lock);
+        memcpy(&shadow_universe[start_address], data_values_converted, no_of_channels * sizeof(USHORT));
+        shadow_mark_dirty(start_address, start_address + no_of_channels - 1);
+        urgent_mark(start_address, start_address + no_of_channels - 1, FALSE);
+        LeaveCriticalSection(&engine_lock);
+
+        /*
+            The USB transfer stuff
+        */
+
+        BOOL success;
+        error_message = shadow_flush(deviceList, &success);
+        DWORD system_error = GetLastError();
+
+        // All done, clean up.
+        LstK_Free(deviceList);
+        if(error_message != NULL)
+            command_failed(DMX_ERROR_DEVICE, stringBuffer, error_message, system_error);
+        else if(!success)
+            error_record(DMX_ERROR_TRANSFER, stringBuffer, "The transfer failed.", flush_system_error);
+
+        command_result(nlhs, plhs, status_input, error_message != NULL || !success, FALSE); // fail. :)
+
+
+    }
+
+
+
+    /*
+        handle = dmx('prepare', addresses)
+        dmx('prepare', 'clear')
+
+        Checks 'addresses' once, and returns a handle for dmx('send_prepared'). The addresses are 1-512, and unlike
+        in dmx('send'), they don't have to be consecutive, or in order, they just can't repeat.
+        There can be 64 plans at a time. dmx('prepare', 'clear') forgets all of them.
+    */
+
+    if(!strcmp(stringBuffer, "prepare"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs != 2)
+            mexErrMsgTxt("dmx.mex::This function needs exactly two arguments.\n");
+
+        if(mxIsChar(prhs[1]))
+        {
+            char option[8];
+
+            if(mxGetString(prhs[1], option, sizeof(option)) || strcmp(option, "clear"))
+                mexErrMsgTxt("dmx.mex::The only option is 'clear'.\n");
+
+            for(ULONG slot = 0; slot < PLAN_MAX; slot++)
+                plans.plans[slot].handle = 0;
+            return;
+        }
+
+        ULONG slot;
+        for(slot = 0; slot < PLAN_MAX && plans.plans[slot].handle != 0; slot++);
+        if(slot == PLAN_MAX)
+            mexErrMsgTxt("dmx.mex::There are too many prepared plans. dmx('prepare', 'clear') forgets them.\n");
+
+        const char *error_message = plan_prepare(prhs[1], &plans.plans[slot]);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        // The next handle that lands in this slot.
+        double handle = plans.last_handle - fmod(plans.last_handle, PLAN_MAX) + slot + 1;
+        if(handle <= plans.last_handle)
+            handle += PLAN_MAX;
+        plans.plans[slot].handle = plans.last_handle = handle;
+
+        plhs[0] = mxCreateDoubleScalar(handle);
+    }
+
+
+
+    /*
+        [fail, late_frames] = dmx('send_frames', addresses, frames, interval_ms)
+
+        Sends a sequence of frames, one every 'interval_ms'. 'addresses' are checked once, the same way as in dmx('send').
+        Each row of 'frames' is a frame, with a column for each address. They can be doubles (0-255, fractions are fine,
+        anything outside is clamped) or uint8. The whole matrix is converted up front, so there is next to nothing to
+        do between the frames. If the refresh thread is running, the frames go to our copy of the universe, and the
+        thread sends them. Otherwise, they are sent straight away, and only the channels that changed from the frame
+        before are sent.
+        This blocks until the last frame is out. 'late_frames' is how many of them went out after the next one was due.
+    */
+
+    if(!strcmp(stringBuffer, "send_frames"))
+    {
+        LstK_Free(deviceList);
+        deviceList = NULL;
+
+        if(nrhs != 4)
+            mexErrMsgTxt("dmx.mex::This function needs exactly four arguments.\n");
+
+        if(!mxIsDouble(prhs[1]) || mxIsComplex(prhs[1]) || mxIsEmpty(prhs[1]) || (mxGetM(prhs[1]) != 1 && mxGetN(prhs[1]) != 1))
+            mexErrMsgTxt("dmx.mex::The addresses must be a vector of doubles.\n");
+
+        mwSize no_of_addresses = mxGetNumberOfElements(prhs[1]);
+        mxDouble *addresses_input_pointer = mxGetData(prhs[1]);
+
+        if(no_of_addresses > 512)
+            mexErrMsgTxt("dmx.mex::You only can have 512 elements in a DMX512 frame.\n");
+
+        for(mwSize i = 1; i < no_of_addresses; i++)
+        {
+            if(addresses_input_pointer[i] - addresses_input_pointer[i - 1] != 1)
+                mexErrMsgTxt("dmx.mex::The addresses must increase one by one.\n");
+        }
+
+        if(!(addresses_input_pointer[0] >= 1 && addresses_input_pointer[no_of_addresses - 1] <= 512) || addresses_input_pointer[0] != (int) addresses_input_pointer[0])
+            mexErrMsgTxt("dmx.mex::The addresses must be between 1 and 512.\n");
+
+        if((!mxIsDouble(prhs[2]) && !mxIsUint8(prhs[2])) || mxIsComplex(prhs[2]) || mxGetNumberOfDimensions(prhs[2]) > 2)
+            mexErrMsgTxt("dmx.mex::The frames must be a matrix of doubles or uint8.\n");
+
+        if(mxGetN(prhs[2]) != no_of_addresses || mxGetM(prhs[2]) == 0)
+            mexErrMsgTxt("dmx.mex::The frames must have a row for each frame, and a column for each address.\n");
+
+        if(!mxIsNumeric(prhs[3]) || mxGetNumberOfElements(prhs[3]) != 1 || !(mxGetScalar(prhs[3]) > 0 && mxGetScalar(prhs[3]) <= 60000))
+            mexErrMsgTxt("dmx.mex::The interval must be more than 0, and at most 60000 ms.\n");
+
+        USHORT start_address = (USHORT) addresses_input_pointer[0] - 1; // The dongle counts from 0.
+        USHORT no_of_channels = (USHORT) no_of_addresses;
+        size_t no_of_frames = mxGetM(prhs[2]);
+        LONGLONG interval;
+
+        // Each native frame is contiguous, so it can be copied to the shadow universe in one go. mxMalloc()ed memory
+        // is freed by Matlab if we bail out with an error.
+        USHORT *frames = mxMalloc(no_of_frames * no_of_channels * sizeof(USHORT));
+        if(mxIsDouble(prhs[2]))
+        {
+            mxDouble *frames_input_pointer = mxGetData(prhs[2]);
+            for(USHORT channel = 0; channel < no_of_channels; channel++)
+                levels_to_16bit(&frames_input_pointer[channel * no_of_frames], no_of_frames, &frames[channel], no_of_channels);
+        }
+        else
+        {
+            mxUint8 *frames_input_pointer = mxGetData(prhs[2]);
+            for(USHORT channel = 0; channel < no_of_channels; channel++)
+            {
+                for(size_t frame = 0; frame < no_of_frames; frame++)
+                    frames[frame * no_of_channels + channel] = frames_input_pointer[channel * no_of_frames + frame] * 257;
+            }
+        }
+
+        // The simulator and the daemon don't need a device.
+        if(!session.running && device_is_local())
+        {
+            if(!LstK_Init(&deviceList, 0))
+                mexErrMsgTxt("dmx.mex::An error occured getting the device list.");
+
+            const char *error_message = udmx_open(deviceList, &handle);
+            if(error_message != NULL)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt(error_message);
+            }
+        }
+
+        UCHAR output[512], sent[512];
+        BOOL failed = FALSE, resync = TRUE;
+        double no_of_late_frames = 0;
+        LONGLONG start = now_ticks();
+
+        interval = (LONGLONG) (mxGetScalar(prhs[3]) * qpc_frequency / 1000.0);
+        for(size_t frame = 0; frame < no_of_frames; frame++)
+        {
+            LONGLONG due = start + (LONGLONG) frame * interval;
+            USHORT first = start_address, last = start_address + no_of_channels - 1;
+
+            wait_until(due);
+            if(now_ticks() > due + interval)
+                no_of_late_frames++;
+
+            EnterCriticalSection(&engine_lock);
+            memcpy(&shadow_universe[start_address], &frames[frame * no_of_channels], no_of_channels * sizeof(USHORT));
+            shadow_mark_dirty(first, last);
+            urgent_mark(first, last, FALSE);
+            if(!session.running)
+            {
+                first = dirty_first;
+                last = dirty_last;
+                output_range_fix(&first, &last);
+                output_render(first, last, &output[first]);
+                dirty_first = 512;
+                dirty_last = 0;
+            }
+            LeaveCriticalSection(&engine_lock);
+
+            if(session.running)
+                continue; // The refresh thread sends it.
+
+            // Only send what changed since the last frame.
+            if(!resync)
+            {
+                while(first <= last && output[first] == sent[first])
+                    first++;
+                while(last > first && output[last] == sent[last])
+                    last--; // USHORT, so this must not go below 'first'
+                if(first > last)
+                    continue;
+            }
+
+            if(udmx_send_range(handle, first, last - first + 1, &output[first]))
+            {
+                memcpy(&sent[first], &output[first], last - first + 1);
+                resync = FALSE;
+            }
+            else
+            {
+                // Whatever we have so far goes out in the next frame, or with the next flush.
+                failed = TRUE;
+                resync = TRUE;
+                EnterCriticalSection(&engine_lock);
+                shadow_mark_dirty(first, last);
+                LeaveCriticalSection(&engine_lock);
+            }
+        }
+
+        if(handle != NULL)
+            Usb.Free(handle);
+        if(deviceList != NULL)
+            LstK_Free(deviceList);
+        mxFree(frames);
+
+        if(nlhs > 0)
+            plhs[0] = mxCreateLogicalScalar(failed);
+        if(nlhs > 1)
+            plhs[1] = mxCreateDoubleScalar(no_of_late_frames);
+    }
+
+
+
+    /*
+        dmx('simulator', enable, [setup_latency_us, packet_latency_us, [frame_period_us, boundary_stall_us, [buffer_size]]])
+        universe = dmx('simulator')
+
+        Routes every transfer to a simulated uDMX instead of the device. Handy for testing scripts
+        without the dongle, and for replaying captures. Called without arguments, it returns
+        what the simulated device would put on the bus, as a 1x512 vector.
+        If 'boundary_stall_us' is not zero, transfers that run over a DMX frame boundary take this much longer.
+        Transfers longer than 'buffer_size' (default is 512) fail, like on some of the clones.
+    */
+
+    if(!strcmp(stringBuffer, "simulator"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs == 1)
+        {
+            plhs[0] = mxCreateDoubleMatrix(1, 512, mxREAL);
+            mxDouble *universe_output_pointer = mxGetData(plhs[0]);
+            for(unsigned int i = 0; i < 512; i++)
+                universe_output_pointer[i] = simulator.universe[i];
+            return;
+        }
+
+        if(nrhs != 2 && nrhs != 4 && nrhs != 6 && nrhs != 7)
+            mexErrMsgTxt("dmx.mex::This function needs either one, two, four, six or seven arguments.\n");
+
+        if(!mxIsNumeric(prhs[1]) && !mxIsLogical(prhs[1]))
+            mexErrMsgTxt("dmx.mex::The simulator can be enabled with true, and disabled with false.\n");
+
+        if(nrhs >= 4)
+        {
+            if(!mxIsNumeric(prhs[2]) || !mxIsNumeric(prhs[3]))
+                mexErrMsgTxt("dmx.mex::The latencies must be numbers, in microseconds.\n");
+
+            if(mxGetScalar(prhs[2]) < 0 || mxGetScalar(prhs[3]) < 0)
+                mexErrMsgTxt("dmx.mex::The latencies can't be negative.\n");
+
+            simulator.setup_latency_us = mxGetScalar(prhs[2]);
+            simulator.packet_latency_us = mxGetScalar(prhs[3]);
+        }
+
+        if(nrhs == 7)
+        {
+            if(!mxIsNumeric(prhs[6]) || !(mxGetScalar(prhs[6]) >= 1 && mxGetScalar(prhs[6]) <= 512))
+                mexErrMsgTxt("dmx.mex::The buffer size must be between 1 and 512 channels.\n");
+
+            simulator.buffer_size = (USHORT) mxGetScalar(prhs[6]);
+        }
+
+        if(nrhs >= 6)
+        {
+            if(!mxIsNumeric(prhs[4]) || !mxIsNumeric(prhs[5]))
+                mexErrMsgTxt("dmx.mex::The frame period and the stall must be numbers, in microseconds.\n");
+
+            if(!(mxGetScalar(prhs[4]) >= 1000) || mxGetScalar(prhs[5]) < 0)
+                mexErrMsgTxt("dmx.mex::The frame period must be at least 1000 microseconds, and the stall can't be negative.\n");
+
+            simulator.frame_period_us = mxGetScalar(prhs[4]);
+            simulator.boundary_stall_us = mxGetScalar(prhs[5]);
+        }
+
+        if(session.running && simulator.enabled != (mxGetScalar(prhs[1]) != 0))
+            mexErrMsgTxt("dmx.mex::The simulator can't be switched while the refresh thread is running. Call dmx('stop') first.\n");
+
+        simulator.enabled = (mxGetScalar(prhs[1]) != 0);
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Simulator is %s.\n", simulator.enabled ? "on" : "off");
+        #endif
+    }
+
+
+
+    /*
+        dmx('daemon', connect, [timeout_ms])
+        status = dmx('daemon')
+
+        With true, the transfers go to udmxd instead of the device, with false, we open the device again.
+        udmxd has to be running. We are a source there, with a layer of our own, which drops out of the merge
+        if we don't send anything for 'timeout_ms'. With 0 (the default), it never drops out: when we disconnect,
+        or Matlab exits (or crashes), the daemon holds our channels where they were.
+        Called without arguments, it returns a struct:
+        connected, daemon_pid, device_connected, frames_sent, failed_transfers, heartbeat_age_ms, source, no_of_sources
+        The counters are the daemon's, so they count what every client sent.
+    */
+
+    if(!strcmp(stringBuffer, "daemon"))
+    {
+        LONG timeout_ms = 0;
+
+        LstK_Free(deviceList);
+
+        if(nrhs > 3)
+            mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
+
+        if(nrhs == 1)
+        {
+            const char *field_names[] = {"connected", "daemon_pid", "device_connected", "frames_sent", "failed_transfers", "heartbeat_age_ms", "source", "no_of_sources"};
+            BOOL connected = daemon.shm != NULL && daemon.shm->daemon_pid == daemon.daemon_pid;
+
+            plhs[0] = mxCreateStructMatrix(1, 1, 8, field_names);
+            mxSetField(plhs[0], 0, "connected", mxCreateLogicalScalar(connected));
+            mxSetField(plhs[0], 0, "daemon_pid", mxCreateDoubleScalar(connected ? daemon.daemon_pid : 0));
+            mxSetField(plhs[0], 0, "device_connected", mxCreateLogicalScalar(connected && daemon.shm->device_connected));
+            mxSetField(plhs[0], 0, "frames_sent", mxCreateDoubleScalar(connected ? (double) daemon.shm->frames_sent : 0));
+            mxSetField(plhs[0], 0, "failed_transfers", mxCreateDoubleScalar(connected ? (double) daemon.shm->failed_transfers : 0));
+            mxSetField(plhs[0], 0, "heartbeat_age_ms", mxCreateDoubleScalar(connected ? (double) (now_ticks() - daemon.shm->heartbeat) * 1000.0 / qpc_frequency : 0));
+            mxSetField(plhs[0], 0, "source", mxCreateDoubleScalar(connected ? daemon.layer + 1 : 0));
+            mxSetField(plhs[0], 0, "no_of_sources", mxCreateDoubleScalar(connected ? daemon.shm->no_of_sources : 0));
+            return;
+        }
+
+        if((!mxIsNumeric(prhs[1]) && !mxIsLogical(prhs[1])) || mxGetNumberOfElements(prhs[1]) != 1)
+            mexErrMsgTxt("dmx.mex::Connect to the daemon with true, and disconnect with false.\n");
+
+        if(nrhs == 3)
+        {
+            if(!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1 || !(mxGetScalar(prhs[2]) >= 0 && mxGetScalar(prhs[2]) <= 3600000))
+                mexErrMsgTxt("dmx.mex::The timeout must be between 0 and 3600000 milliseconds.\n");
+
+            timeout_ms = (LONG) mxGetScalar(prhs[2]);
+        }
+
+        if(session.running)
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+
+        if(mxGetScalar(prhs[1]) == 0)
+        {
+            daemon_disconnect();
+            return;
+        }
+
+        const char *error_message = daemon_connect(timeout_ms);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Connected to udmxd (process %lu), as source %d.\n", daemon.daemon_pid, daemon.layer + 1);
+        #endif
+    }
+
+
+
+    /*
+        dmx('artnet', nodes, [universes, [mode]])
+        dmx('artnet', false)
+        status = dmx('artnet')
+
+        Sends every transfer to Art-Net nodes as well, as ArtDmx packets. 'nodes' is an IP address, or a cell array
+        of them (up to 32, broadcast addresses are fine too), and 'universes' are their port-addresses (default is 0).
+        With 'only' as the mode, there is no uDMX, the transfers only go to the network; the default is 'both'.
+        The nodes get the whole universe with the next transfer. With false, it stops sending to the nodes.
+        Called without arguments, it returns a struct: enabled, only, nodes, universes, packets_sent, send_errors
+    */
+
+    if(!strcmp(stringBuffer, "artnet"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs > 4)
+            mexErrMsgTxt("dmx.mex::This function needs at most four arguments.\n");
+
+        if(nrhs == 1)
+        {
+            plhs[0] = net_protocol_status(&artnet, "nodes");
+            return;
+        }
+
+        if(session.running)
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+
+        if((mxIsLogical(prhs[1]) || mxIsNumeric(prhs[1])) && mxGetNumberOfElements(prhs[1]) == 1 && mxGetScalar(prhs[1]) == 0 && nrhs == 2)
+        {
+            net_protocol_close(&artnet);
+            return;
+        }
+
+        BOOL only = FALSE;
+        const char *error_message = net_mode((nrhs == 4) ? prhs[3] : NULL, &only);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        ULONG no_of_nodes = mxIsCell(prhs[1]) ? (ULONG) mxGetNumberOfElements(prhs[1]) : 1;
+        if(no_of_nodes < 1 || no_of_nodes > ARTNET_MAX_NODES)
+            mexErrMsgTxt("dmx.mex::There must be between 1 and 32 nodes.\n");
+
+        net_destination nodes[ARTNET_MAX_NODES];
+        memset(nodes, 0, sizeof(nodes));
+        error_message = net_addresses(prhs[1], no_of_nodes, ARTNET_PORT, nodes);
+        if(error_message == NULL && nrhs >= 3 && !mxIsEmpty(prhs[2]))
+            error_message = net_universes(prhs[2], no_of_nodes, 0, 32767, nodes);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        for(ULONG i = 0; i < no_of_nodes; i++)
+            artnet_header(&nodes[i]);
+
+        error_message = net_open();
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        net_protocol_start(&artnet, nodes, no_of_nodes, only);
+
+        // Everything goes out with the next transfer, so the network starts with what the device has.
+        EnterCriticalSection(&engine_lock);
+        shadow_mark_dirty(0, 511);
+        LeaveCriticalSection(&engine_lock);
+    }
+
+
+
+    /*
+        result = dmx('artnet_bench', [no_of_universes, [no_of_packets]])
+
+        Sends ArtDmx packets to a receiver on this computer (127.0.0.1) as fast as it can: 'no_of_universes' packets
+        in each batch (default is 1, at most 32), and 'no_of_packets' in all (default is 100000). Returns a struct:
+        universes, packets_sent, packets_received, seconds, packets_per_second, received_per_second
+        The nodes set with dmx('artnet') are kept, and they don't get these packets.
+    */
+
+    if(!strcmp(stringBuffer, "artnet_bench"))
+    {
+        ULONG no_of_universes = 1, no_of_packets = ARTNET_BENCH_PACKETS;
+        net_receiver receiver;
+
+        LstK_Free(deviceList);
+
+        if(nrhs > 3)
+            mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
+
+        if(nrhs >= 2)
+        {
+            double universes_input = mxIsNumeric(prhs[1]) && mxGetNumberOfElements(prhs[1]) == 1 ? mxGetScalar(prhs[1]) : 0;
+            if(!(universes_input >= 1 && universes_input <= ARTNET_MAX_NODES) || universes_input != (ULONG) universes_input)
+                mexErrMsgTxt("dmx.mex::The number of universes must be a whole number, between 1 and 32.\n");
+            no_of_universes = (ULONG) universes_input;
+        }
+
+        if(nrhs == 3)
+        {
+            double packets_input = mxIsNumeric(prhs[2]) && mxGetNumberOfElements(prhs[2]) == 1 ? mxGetScalar(prhs[2]) : 0;
+            if(!(packets_input >= 1 && packets_input <= 10000000) || packets_input != (ULONG) packets_input)
+                mexErrMsgTxt("dmx.mex::The number of packets must be a whole number, between 1 and 10000000.\n");
+            no_of_packets = (ULONG) packets_input;
+        }
+
+        if(session.running)
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+
+        const char *error_message = net_open();
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        error_message = net_receiver_start(&receiver);
+        if(error_message != NULL)
+        {
+            net_close_unused();
+            mexErrMsgTxt(error_message);
+        }
+
+        // Put the real nodes aside, and send to the receiver instead.
+        net_protocol saved = artnet;
+        for(ULONG i = 0; i < no_of_universes; i++)
+        {
+            memset(&artnet.destinations[i], 0, sizeof(net_destination));
+            artnet.destinations[i].address = receiver.address;
+            artnet.destinations[i].universe = (USHORT) i;
+            artnet_header(&artnet.destinations[i]);
+        }
+        artnet.no_of_destinations = no_of_universes;
+        artnet.packets_sent = 0;
+        artnet.enabled = TRUE;
+
+        ULONG no_of_batches = (no_of_packets + no_of_universes - 1) / no_of_universes;
+        LONGLONG start = now_ticks();
+        for(ULONG batch = 0; batch < no_of_batches; batch++)
+            net_protocol_send(&artnet);
+        double seconds = (double) (now_ticks() - start) / qpc_frequency;
+        double packets_sent = artnet.packets_sent;
+
+        net_receiver_stop(&receiver);
+
+        artnet = saved;
+        net_close_unused();
+
+        const char *field_names[] = {"universes", "packets_sent", "packets_received", "seconds", "packets_per_second", "received_per_second"};
+        plhs[0] = mxCreateStructMatrix(1, 1, 6, field_names);
+        mxSetField(plhs[0], 0, "universes", mxCreateDoubleScalar(no_of_universes));
+        mxSetField(plhs[0], 0, "packets_sent", mxCreateDoubleScalar(packets_sent));
+        mxSetField(plhs[0], 0, "packets_received", mxCreateDoubleScalar(receiver.packets_received));
+        mxSetField(plhs[0], 0, "seconds", mxCreateDoubleScalar(seconds));
+        mxSetField(plhs[0], 0, "packets_per_second", mxCreateDoubleScalar(seconds > 0 ? packets_sent / seconds : 0));
+        mxSetField(plhs[0], 0, "received_per_second", mxCreateDoubleScalar(seconds > 0 ? receiver.packets_received / seconds : 0));
+    }
+
+
+
+    /*
+        dmx('sacn', universes, [destinations, [mode, [priority]]])
+        dmx('sacn', false)
+        status = dmx('sacn')
+
+        Sends every transfer as E1.31 (sACN) data packets as well, to each of 'universes' (1 to 63999, up to 256 of
+        them). By default, each universe goes to its multicast address (239.255.x.y), or 'destinations' can be an IP
+        address for each universe, in a cell array, to send unicast. The mode is 'both' or 'only', like for Art-Net,
+        and 'priority' is between 0 and 200 (default is 100). Our universe goes to all of them, and the receivers
+        get the whole of it with the next transfer. With false, it stops sending sACN.
+        Called without arguments, it returns a struct: enabled, only, destinations, universes, packets_sent, send_errors
+    */
+
+    if(!strcmp(stringBuffer, "sacn"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs > 5)
+            mexErrMsgTxt("dmx.mex::This function needs at most five arguments.\n");
+
+        if(nrhs == 1)
+        {
+            plhs[0] = net_protocol_status(&sacn, "destinations");
+            return;
+        }
+
+        if(session.running)
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+
+        if((mxIsLogical(prhs[1]) || mxIsNumeric(prhs[1])) && mxGetNumberOfElements(prhs[1]) == 1 && mxGetScalar(prhs[1]) == 0 && nrhs == 2)
+        {
+            net_protocol_close(&sacn);
+            return;
+        }
+
+        BOOL only = FALSE;
+        const char *error_message = net_mode((nrhs >= 4 && !mxIsEmpty(prhs[3])) ? prhs[3] : NULL, &only);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        UCHAR priority = SACN_DEFAULT_PRIORITY;
+        if(nrhs == 5)
+        {
+            double priority_input = mxIsNumeric(prhs[4]) && mxGetNumberOfElements(prhs[4]) == 1 ? mxGetScalar(prhs[4]) : -1;
+            if(!(priority_input >= 0 && priority_input <= 200) || priority_input != (UCHAR) priority_input)
+                mexErrMsgTxt("dmx.mex::The priority must be a whole number between 0 and 200.\n");
+            priority = (UCHAR) priority_input;
+        }
+
+        ULONG no_of_universes = (ULONG) mxGetNumberOfElements(prhs[1]);
+        if(no_of_universes < 1 || no_of_universes > SACN_MAX_UNIVERSES)
+            mexErrMsgTxt("dmx.mex::There must be between 1 and 256 universes.\n");
+
+        static net_destination destinations[SACN_MAX_UNIVERSES];
+        memset(destinations, 0, sizeof(destinations));
+        error_message = net_universes(prhs[1], no_of_universes, 1, 63999, destinations);
+        if(error_message == NULL && nrhs >= 3 && !mxIsEmpty(prhs[2]))
+            error_message = net_addresses(prhs[2], no_of_universes, SACN_PORT, destinations);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        error_message = net_open();
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        for(ULONG i = 0; i < no_of_universes; i++)
+        {
+            if(nrhs < 3 || mxIsEmpty(prhs[2]))
+                sacn_multicast_address(&destinations[i]);
+            sacn_header(&destinations[i], priority);
+        }
+
+        net_protocol_start(&sacn, destinations, no_of_universes, only);
+
+        // Everything goes out with the next transfer, so the network starts with what the device has.
+        EnterCriticalSection(&engine_lock);
+        shadow_mark_dirty(0, 511);
+        LeaveCriticalSection(&engine_lock);
+    }
+
+
+
+    /*
+        result = dmx('sacn_bench', [universe_counts, [seconds]])
+
+        Sends our universe as sACN to a receiver on this computer (127.0.0.1), to 1, 4, 16, 64 and 256 universes
+        (or 'universe_counts', up to 256), at 44 frames a second, for 'seconds' each (default is 1). This is what a
+        refresh at the full DMX rate would cost. Returns a struct, with a value for each count in each field:
+        universes, packets_sent, packets_received, packets_per_second, received_per_second,
+        send_us_mean, send_us_max (how long a frame took to send), and late_ticks (frames that missed their slot)
+        The universes set with dmx('sacn') are kept, and they don't get these packets.
+    */
+
+    if(!strcmp(stringBuffer, "sacn_bench"))
+    {
+        ULONG counts[SACN_MAX_UNIVERSES];
+        ULONG no_of_counts = SACN_BENCH_COUNTS;
+        double seconds = 1.0;
+        net_receiver receiver;
+
+        LstK_Free(deviceList);
+
+        if(nrhs > 3)
+            mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
+
+        memcpy(counts, sacn_bench_counts, sizeof(sacn_bench_counts));
+        if(nrhs >= 2 && !mxIsEmpty(prhs[1]))
+        {
+            no_of_counts = (ULONG) mxGetNumberOfElements(prhs[1]);
+            if(!mxIsDouble(prhs[1]) || no_of_counts > SACN_MAX_UNIVERSES)
+                mexErrMsgTxt("dmx.mex::The universe counts must be a vector of whole numbers, between 1 and 256.\n");
+
+            for(ULONG i = 0; i < no_of_counts; i++)
+            {
+                double count = ((mxDouble *) mxGetData(prhs[1]))[i];
+                if(!(count >= 1 && count <= SACN_MAX_UNIVERSES) || count != (ULONG) count)
+                    mexErrMsgTxt("dmx.mex::The universe counts must be a vector of whole numbers, between 1 and 256.\n");
+                counts[i] = (ULONG) count;
+            }
+        }
+
+        if(nrhs == 3)
+        {
+            seconds = mxIsNumeric(prhs[2]) && mxGetNumberOfElements(prhs[2]) == 1 ? mxGetScalar(prhs[2]) : 0;
+            if(!(seconds >= 0.1 && seconds <= 60))
+                mexErrMsgTxt("dmx.mex::The duration must be between 0.1 and 60 seconds.\n");
+        }
+
+        if(session.running)
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+
+        const char *field_names[] = {"universes", "packets_sent", "packets_received", "packets_per_second", "received_per_second", "send_us_mean", "send_us_max", "late_ticks"};
+        mxArray *fields[8];
+        for(int i = 0; i < 8; i++)
+            fields[i] = mxCreateDoubleMatrix(1, no_of_counts, mxREAL);
+
+        const char *error_message = net_open();
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        // Put the real universes aside, and send to the receiver instead.
+        static net_protocol saved;
+        saved = sacn;
+        LONGLONG period = (LONGLONG) (qpc_frequency / SACN_BENCH_RATE);
+        ULONG no_of_ticks = (ULONG) (seconds * SACN_BENCH_RATE + 0.5);
+
+        for(ULONG c = 0; c < no_of_counts && error_message == NULL; c++)
+        {
+            // A new receiver for each count, so that the packets from the last one are not counted again.
+            error_message = net_receiver_start(&receiver);
+            if(error_message != NULL)
+                break;
+
+            for(ULONG i = 0; i < counts[c]; i++)
+            {
+                memset(&sacn.destinations[i], 0, sizeof(net_destination));
+                sacn.destinations[i].address = receiver.address;
+                sacn.destinations[i].universe = (USHORT) (i + 1);
+                sacn_header(&sacn.destinations[i], SACN_DEFAULT_PRIORITY);
+            }
+            sacn.no_of_destinations = counts[c];
+            sacn.packets_sent = sacn.send_errors = 0;
+            sacn.enabled = TRUE;
+
+            double send_ticks_total = 0, send_ticks_max = 0, late_ticks = 0;
+            LONGLONG start = now_ticks();
+            for(ULONG tick = 0; tick < no_of_ticks; tick++)
+            {
+                LONGLONG slot = start + tick * period;
+                if(now_ticks() > slot + period)
+                    late_ticks++;
+                wait_until(slot);
+
+                LONGLONG send_start = now_ticks();
+                net_protocol_send(&sacn);
+                double send_ticks = (double) (now_ticks() - send_start);
+                send_ticks_total += send_ticks;
+                if(send_ticks > send_ticks_max)
+                    send_ticks_max = send_ticks;
+            }
+            double elapsed = (double) (now_ticks() - start) / qpc_frequency;
+
+            net_receiver_stop(&receiver);
+
+            ((mxDouble *) mxGetData(fields[0]))[c] = counts[c];
+            ((mxDouble *) mxGetData(fields[1]))[c] = sacn.packets_sent;
+            ((mxDouble *) mxGetData(fields[2]))[c] = receiver.packets_received;
+            ((mxDouble *) mxGetData(fields[3]))[c] = elapsed > 0 ? sacn.packets_sent / elapsed : 0;
+            ((mxDouble *) mxGetData(fields[4]))[c] = elapsed > 0 ? receiver.packets_received / elapsed : 0;
+            ((mxDouble *) mxGetData(fields[5]))[c] = no_of_ticks ? send_ticks_total * 1e6 / qpc_frequency / no_of_ticks : 0;
+            ((mxDouble *) mxGetData(fields[6]))[c] = send_ticks_max * 1e6 / qpc_frequency;
+            ((mxDouble *) mxGetData(fields[7]))[c] = late_ticks;
+        }
+
+        sacn = saved;
+        net_close_unused();
+
+        if(error_message != NULL)
+        {
+            for(int i = 0; i < 8; i++)
+                mxDestroyArray(fields[i]);
+            mexErrMsgTxt(error_message);
+        }
+
+        plhs[0] = mxCreateStructMatrix(1, 1, 8, field_names);
+        for(int i = 0; i < 8; i++)
+            mxSetField(plhs[0], 0, field_names[i], fields[i]);
+    }
+
+
+
+    /*
+        dmx('bridge', protocol, universe, [address])
+        dmx('bridge', false)
+        status = dmx('bridge')
+
+        Listens for a lighting console, and forwards what it sends to the uDMX, through the refresh thread (so call
+        dmx('start') first). 'protocol' is 'artnet' or 'sacn', 'universe' is the Art-Net port-address (0-32767) or the
+        sACN universe (1-63999). It listens on 'address', which is 0.0.0.0 (everywhere) by default. The channels that
+        change go out straight away, in the urgent lane. With false, it stops listening.
+        Called without arguments, it returns a struct: running, protocol, universe, address, packets_received,
+        packets_ignored, batches, max_batch, channels_changed, forwards, and the mean, the worst and the last latency
+        from a packet arriving to the end of its transfer, in ms (latency_ms, latency_max_ms, last_latency_ms)
+    */
+
+    if(!strcmp(stringBuffer, "bridge"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs > 4)
+            mexErrMsgTxt("dmx.mex::This function needs at most four arguments.\n");
+
+        if(nrhs == 1)
+        {
+            const char *field_names[] = {"running", "protocol", "universe", "address", "packets_received", "packets_ignored", "batches", "max_batch",
+                                         "channels_changed", "forwards", "latency_ms", "latency_max_ms", "last_latency_ms"};
+            double ticks_to_ms = (qpc_frequency != 0) ? 1000.0 / (double) qpc_frequency : 0;
+            char address[INET_ADDRSTRLEN];
+
+            EnterCriticalSection(&engine_lock);
+            ULONG no_of_inputs = urgent.no_of_inputs;
+            double latency_mean = (no_of_inputs != 0) ? (double) urgent.input_latency_sum / no_of_inputs * ticks_to_ms : 0;
+            double latency_max = urgent.input_latency_max * ticks_to_ms;
+            double last_latency = urgent.last_input_latency * ticks_to_ms;
+            LeaveCriticalSection(&engine_lock);
+
+            inet_ntop(AF_INET, &bridge.address.sin_addr, address, sizeof(address));
+            plhs[0] = mxCreateStructMatrix(1, 1, 13, field_names);
+            mxSetField(plhs[0], 0, "running", mxCreateLogicalScalar(bridge.running));
+            mxSetField(plhs[0], 0, "protocol", mxCreateString(!bridge.running ? "" : (bridge.protocol == BRIDGE_ARTNET) ? "artnet" : "sacn"));
+            mxSetField(plhs[0], 0, "universe", mxCreateDoubleScalar(bridge.universe));
+            mxSetField(plhs[0], 0, "address", mxCreateString(bridge.running ? address : ""));
+            mxSetField(plhs[0], 0, "packets_received", mxCreateDoubleScalar(bridge.packets_received));
+            mxSetField(plhs[0], 0, "packets_ignored", mxCreateDoubleScalar(bridge.packets_ignored));
+            mxSetField(plhs[0], 0, "batches", mxCreateDoubleScalar(bridge.batches));
+            mxSetField(plhs[0], 0, "max_batch", mxCreateDoubleScalar(bridge.max_batch));
+            mxSetField(plhs[0], 0, "channels_changed", mxCreateDoubleScalar(bridge.channels_changed));
+            mxSetField(plhs[0], 0, "forwards", mxCreateDoubleScalar(no_of_inputs));
+            mxSetField(plhs[0], 0, "latency_ms", mxCreateDoubleScalar(latency_mean));
+            mxSetField(plhs[0], 0, "latency_max_ms", mxCreateDoubleScalar(latency_max));
+            mxSetField(plhs[0], 0, "last_latency_ms", mxCreateDoubleScalar(last_latency));
+            return;
+        }
+
+        if((mxIsLogical(prhs[1]) || mxIsNumeric(prhs[1])) && mxGetNumberOfElements(prhs[1]) == 1 && mxGetScalar(prhs[1]) == 0 && nrhs == 2)
+        {
+            bridge_stop();
+            return;
+        }
+
+        char protocol_name[8];
+        int protocol = 0;
+        if(mxIsChar(prhs[1]) && !mxGetString(prhs[1], protocol_name, sizeof(protocol_name)))
+            protocol = !strcmp(protocol_name, "artnet") ? BRIDGE_ARTNET : !strcmp(protocol_name, "sacn") ? BRIDGE_SACN : 0;
+        if(protocol == 0)
+            mexErrMsgTxt("dmx.mex::The protocol is either 'artnet' or 'sacn'.\n");
+
+        if(nrhs < 3)
+            mexErrMsgTxt("dmx.mex::The bridge needs a universe to listen to.\n");
+
+        net_destination listen;
+        memset(&listen, 0, sizeof(listen));
+        const char *error_message = (protocol == BRIDGE_ARTNET) ? net_universes(prhs[2], 1, 0, 32767, &listen) : net_universes(prhs[2], 1, 1, 63999, &listen);
+        if(error_message == NULL && nrhs == 4)
+            error_message = net_addresses(prhs[3], 1, (protocol == BRIDGE_ARTNET) ? ARTNET_PORT : SACN_PORT, &listen);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        if(nrhs < 4)
+        {
+            listen.address.sin_family = AF_INET;
+            listen.address.sin_port = htons((protocol == BRIDGE_ARTNET) ? ARTNET_PORT : SACN_PORT);
+            listen.address.sin_addr.s_addr = htonl(INADDR_ANY);
+        }
+
+        if(!session.running)
+            mexErrMsgTxt("dmx.mex::The bridge sends through the refresh thread. Call dmx('start') first.\n");
+
+        bridge_stop();
+        error_message = bridge_start(protocol, listen.universe, &listen.address);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+    }
+
+
+
+    /*
+        result = dmx('bridge_bench', [no_of_packets, [packets_per_second]])
+
+        Sends 'no_of_packets' (default is 20000) to the bridge from this computer, like a console would, with every
+        channel changing in every packet. With 'packets_per_second' they are spread out evenly, without it (or with 0)
+        they go as fast as they can. Returns a struct: packets_sent, packets_received, seconds, packets_per_second,
+        received_per_second, batches, forwards (how many transfers it took), latency_ms, latency_max_ms
+        The bridge's latencies start again with this.
+    */
+
+    if(!strcmp(stringBuffer, "bridge_bench"))
+    {
+        ULONG no_of_packets = BRIDGE_BENCH_PACKETS;
+        double rate = 0;
+
+        LstK_Free(deviceList);
+
+        if(nrhs > 3)
+            mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
+
+        if(nrhs >= 2)
+        {
+            double packets_input = mxIsNumeric(prhs[1]) && mxGetNumberOfElements(prhs[1]) == 1 ? mxGetScalar(prhs[1]) : 0;
+            if(!(packets_input >= 1 && packets_input <= 10000000) || packets_input != (ULONG) packets_input)
+                mexErrMsgTxt("dmx.mex::The number of packets must be a whole number, between 1 and 10000000.\n");
+            no_of_packets = (ULONG) packets_input;
+        }
+
+        if(nrhs == 3)
+        {
+            rate = mxIsNumeric(prhs[2]) && mxGetNumberOfElements(prhs[2]) == 1 ? mxGetScalar(prhs[2]) : -1;
+            if(!(rate >= 0 && rate <= 1000000))
+                mexErrMsgTxt("dmx.mex::The rate must be between 0 and 1000000 packets per second.\n");
+        }
+
+        if(!bridge.running)
+            mexErrMsgTxt("dmx.mex::The bridge is not running. Start it with dmx('bridge', ...) first.\n");
+
+        // A console on this computer: the packets go to 127.0.0.1 if the bridge listens everywhere.
+        net_destination console;
+        memset(&console, 0, sizeof(console));
+        console.address = bridge.address;
+        if(console.address.sin_addr.s_addr == htonl(INADDR_ANY))
+            console.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        console.universe = bridge.universe;
+        if(bridge.protocol == BRIDGE_ARTNET)
+            artnet_header(&console);
+        else
+        {
+            if(net.sacn_cid[6] == 0)
+                sacn_make_cid();
+            sacn_header(&console, 200); // so it wins over everything else that's sending
+        }
+        ULONG header_length = (bridge.protocol == BRIDGE_ARTNET) ? ARTNET_HEADER_LENGTH : SACN_HEADER_LENGTH;
+        ULONG sequence_offset = (bridge.protocol == BRIDGE_ARTNET) ? 12 : 111;
+
+        SOCKET generator = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if(generator == INVALID_SOCKET)
+            mexErrMsgTxt("dmx.mex::Could not open a UDP socket.\n");
+
+        EnterCriticalSection(&engine_lock);
+        urgent.no_of_inputs = 0;
+        urgent.input_latency_sum = urgent.input_latency_max = urgent.last_input_latency = 0;
+        LeaveCriticalSection(&engine_lock);
+
+        LONG received_before = bridge.packets_received, batches_before = bridge.batches;
+        UCHAR levels[512];
+        double packets_sent = 0;
+        LONGLONG period = (rate > 0) ? (LONGLONG) (qpc_frequency / rate) : 0;
+        LONGLONG start = now_ticks();
+
+        for(ULONG i = 0; i < no_of_packets; i++)
+        {
+            WSABUF buffers[2] = {{header_length, (char *) console.header}, {512, (char *) levels}};
+            DWORD sent = 0;
+
+            if(period != 0)
+                wait_until(start + i * period);
+
+            memset(levels, (i + 1) & 0xFF, sizeof(levels));
+            console.header[sequence_offset] = (UCHAR) ((bridge.protocol == BRIDGE_ARTNET) ? (i % 255) + 1 : i);
+            if(WSASendTo(generator, buffers, 2, &sent, 0, (const struct sockaddr *) &console.address, sizeof(console.address), NULL, NULL) != SOCKET_ERROR)
+                packets_sent++;
+        }
+        double seconds = (double) (now_ticks() - start) / qpc_frequency;
+
+        // Wait for the bridge to catch up, until nothing came for a while.
+        LONG received = bridge.packets_received;
+        do
+        {
+            received = bridge.packets_received;
+            Sleep(2 * BRIDGE_POLL_MS);
+        }
+        while(bridge.packets_received != received);
+        closesocket(generator);
+
+        double ticks_to_ms = 1000.0 / (double) qpc_frequency;
+        EnterCriticalSection(&engine_lock);
+        ULONG forwards = urgent.no_of_inputs;
+        double latency_mean = (forwards != 0) ? (double) urgent.input_latency_sum / forwards * ticks_to_ms : 0;
+        double latency_max = urgent.input_latency_max * ticks_to_ms;
+        LeaveCriticalSection(&engine_lock);
+
+        double packets_received = received - received_before;
+        const char *field_names[] = {"packets_sent", "packets_received", "seconds", "packets_per_second", "received_per_second", "batches", "forwards", "latency_ms", "latency_max_ms"};
+        plhs[0] = mxCreateStructMatrix(1, 1, 9, field_names);
+        mxSetField(plhs[0], 0, "packets_sent", mxCreateDoubleScalar(packets_sent));
+        mxSetField(plhs[0], 0, "packets_received", mxCreateDoubleScalar(packets_received));
+        mxSetField(plhs[0], 0, "seconds", mxCreateDoubleScalar(seconds));
+        mxSetField(plhs[0], 0, "packets_per_second", mxCreateDoubleScalar(seconds > 0 ? packets_sent / seconds : 0));
+        mxSetField(plhs[0], 0, "received_per_second", mxCreateDoubleScalar(seconds > 0 ? packets_received / seconds : 0));
+        mxSetField(plhs[0], 0, "batches", mxCreateDoubleScalar(bridge.batches - batches_before));
+        mxSetField(plhs[0], 0, "forwards", mxCreateDoubleScalar(forwards));
+        mxSetField(plhs[0], 0, "latency_ms", mxCreateDoubleScalar(latency_mean));
+        mxSetField(plhs[0], 0, "latency_max_ms", mxCreateDoubleScalar(latency_max));
+    }
+
+
+
+    /*
+        dmx('pixelmap_define', map)
+
+        Sets the pixel map for dmx('pixelmap_push'). 'map' is a struct array, one element for each fixture:
+        -'pixel' is [row, column] in the image (from 1)
+        -'address' is where the fixture starts (1-512)
+        -'order' is the order of its colour channels, like 'rgb' (the default), 'grb', 'bgr' or 'rgbw'. The white is
+            the common part of R, G and B, and when the fixture has a white channel, it's taken out of them.
+        The fixtures can share pixels, but not channels. dmx('pixelmap_define', []) forgets the map.
+    */
+
+    if(!strcmp(stringBuffer, "pixelmap_define"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs != 2)
+            mexErrMsgTxt("dmx.mex::This function needs exactly two arguments.\n");
+
+        if(mxIsEmpty(prhs[1]))
+        {
+            memset(&pixelmap, 0, sizeof(pixelmap));
+            return;
+        }
+
+        pixelmap_table *new_map = mxCalloc(1, sizeof(pixelmap_table));
+        const char *error_message = pixelmap_prepare(prhs[1], new_map);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        memcpy(&pixelmap, new_map, sizeof(pixelmap_table));
+        mxFree(new_map);
+    }
+
+
+
+    /*
+        result = dmx('pixelmap_bench', [sizes, [no_of_fixtures]])
+
+        Times dmx('pixelmap_push') without the transfer: the sampling, the conversion, and the writing into a copy of
+        the universe, with square images of each of 'sizes' (default is [32 128 512 1024]) pixels on a side, and
+        'no_of_fixtures' RGB fixtures (default is 170, all the universe) on pixels all over the image.
+        Returns a struct: sizes, fixtures, uint8_us and double_us (per push, for each size)
+        The map set with dmx('pixelmap_define') and the shadow universe are not touched.
+    */
+
+    if(!strcmp(stringBuffer, "pixelmap_bench"))
+    {
+        double sizes[16];
+        ULONG no_of_fixtures = 170;
+
+        LstK_Free(deviceList);
+
+        if(nrhs > 3)
+            mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
+
+        ULONG no_of_sizes = bench_sizes(nrhs >= 2 ? prhs[1] : NULL, pixelmap_bench_sizes, PIXELMAP_BENCH_SIZES, 16, 4096, sizes);
+        if(no_of_sizes == 0)
+            mexErrMsgTxt("dmx.mex::The sizes must be a vector of up to 16 whole numbers, between 1 and 4096.\n");
+
+        if(nrhs == 3)
+        {
+            double fixtures_input = mxIsNumeric(prhs[2]) && mxGetNumberOfElements(prhs[2]) == 1 ? mxGetScalar(prhs[2]) : 0;
+            if(!(fixtures_input >= 1 && fixtures_input <= 170) || fixtures_input != (ULONG) fixtures_input)
+                mexErrMsgTxt("dmx.mex::The number of fixtures must be a whole number, between 1 and 170.\n");
+            no_of_fixtures = (ULONG) fixtures_input;
+        }
+
+        mxArray *sizes_output = mxCreateDoubleMatrix(1, no_of_sizes, mxREAL);
+        mxArray *uint8_output = mxCreateDoubleMatrix(1, no_of_sizes, mxREAL);
+        mxArray *double_output = mxCreateDoubleMatrix(1, no_of_sizes, mxREAL);
+        pixelmap_table *table = mxCalloc(1, sizeof(pixelmap_table));
+        pixelmap_bench_context context;
+        context.table = table;
+
+        for(ULONG s = 0; s < no_of_sizes; s++)
+        {
+            ULONG size = (ULONG) sizes[s];
+            mwSize dimensions[3] = {size, size, 3};
+
+            // RGB fixtures back to back, on pixels spread all over the image, so the gather misses the cache like it would.
+            table->no_of_fixtures = (USHORT) no_of_fixtures;
+            table->no_of_channels = 0;
+            table->max_row = table->max_column = size;
+            for(ULONG i = 0; i < no_of_fixtures; i++)
+            {
+                table->row[i] = (i * 2654435761u) % size;
+                table->column[i] = (ULONG) (((ULONGLONG) i * size) / no_of_fixtures);
+                for(USHORT colour = 0; colour < 3; colour++)
+                {
+                    table->channel[table->no_of_channels] = (USHORT) (3 * i + colour);
+                    table->level[table->no_of_channels++] = colour * PIXELMAP_MAX_FIXTURES + (USHORT) i;
+                }
+            }
+
+            for(int is_double = 0; is_double < 2; is_double++)
+            {
+                mxArray *image = mxCreateNumericArray(3, dimensions, is_double ? mxDOUBLE_CLASS : mxUINT8_CLASS, mxREAL);
+                size_t no_of_values = (size_t) size * size * 3;
+                ULONG random = 12345;
+                for(size_t i = 0; i < no_of_values; i++)
+                {
+                    random = random * 1664525 + 1013904223;
+                    if(is_double)
+                        ((mxDouble *) mxGetData(image))[i] = (random >> 8) % 25600 / 100.0;
+                    else
+                        ((UCHAR *) mxGetData(image))[i] = (UCHAR) (random >> 24);
+                }
+
+                context.image = image;
+                ((mxDouble *) mxGetData(is_double ? double_output : uint8_output))[s] = bench_time(pixelmap_bench_step, &context, PIXELMAP_BENCH_SECONDS);
+                mxDestroyArray(image);
+            }
+
+            ((mxDouble *) mxGetData(sizes_output))[s] = size;
+        }
+        mxFree(table);
+
+        const char *field_names[] = {"sizes", "fixtures", "uint8_us", "double_us"};
+        plhs[0] = mxCreateStructMatrix(1, 1, 4, field_names);
+        mxSetField(plhs[0], 0, "sizes", sizes_output);
+        mxSetField(plhs[0], 0, "fixtures", mxCreateDoubleScalar(no_of_fixtures));
+        mxSetField(plhs[0], 0, "uint8_us", uint8_output);
+        mxSetField(plhs[0], 0, "double_us", double_output);
+    }
+
+
+
+    /*
+        dmx('colour_define', fixtures, [mode])
+
+        Sets the calibration of the fixtures for dmx('colour_set'). 'fixtures' is a struct array, one element for
+        each fixture:
+        -'address' is where the fixture starts (1-512)
+        -'primaries' is 3 x 3 or 3 x 4: the XYZ of each of its primaries at full, in the order of its channels.
+            With 4, the 4th one (white, amber, etc.) is used as much as it can be.
+        -'gamma' (optional, the default is 1) is the response of the primaries: a number, one for each primary,
+            or 256 x 3 (or 4), the measured output at each level, from 0 to 255.
+        'mode' is what happens to the colours out of the gamut: 'scale' (the default) makes them darker until they
+        fit, 'clip' clips each primary on its own. dmx('colour_define', []) forgets the fixtures.
+    */
+
+    if(!strcmp(stringBuffer, "colour_define"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs != 2 && nrhs != 3)
+            mexErrMsgTxt("dmx.mex::This function needs two or three arguments.\n");
+
+        BOOL clip = FALSE;
+        if(nrhs == 3)
+        {
+            char mode[8] = "";
+            if(!mxIsChar(prhs[2]) || mxGetString(prhs[2], mode, sizeof(mode)) != 0 || (strcmp(mode, "scale") && strcmp(mode, "clip")))
+                mexErrMsgTxt("dmx.mex::The mode must be 'scale' or 'clip'.\n");
+            clip = !strcmp(mode, "clip");
+        }
+
+        if(mxIsEmpty(prhs[1]))
+        {
+            colour_free(&colour);
+            memset(&colour, 0, sizeof(colour));
+            return;
+        }
+
+        colour_table *new_table = mxCalloc(1, sizeof(colour_table));
+        const char *error_message = colour_prepare(prhs[1], new_table);
+        if(error_message != NULL)
+        {
+            colour_free(new_table);
+            mxFree(new_table);
+            mexErrMsgTxt(error_message);
+        }
+
+        new_table->clip = clip;
+        colour_free(&colour);
+        memcpy(&colour, new_table, sizeof(colour_table));
+        mxFree(new_table);
+    }
+
+
+
+    /*
+        result = dmx('colour_bench', [counts])
+
+        Times the conversion in dmx('colour_set') without the transfer, for each of 'counts' (default is
+        [16 64 128 256 512]) RGBW fixtures with gamma 2.2, and colours all over (and outside) the gamut. The levels
+        go into a scratch universe (512 fixtures don't fit in a real one).
+        Returns a struct: counts, batch_us (per conversion of all of them), and fixtures_per_second
+        The fixtures set with dmx('colour_define') and the shadow universe are not touched.
+    */
+
+    if(!strcmp(stringBuffer, "colour_bench"))
+    {
+        double counts[16];
+
+        LstK_Free(deviceList);
+
+        if(nrhs > 2)
+            mexErrMsgTxt("dmx.mex::This function needs at most two arguments.\n");
+
+        ULONG no_of_counts = bench_sizes(nrhs == 2 ? prhs[1] : NULL, colour_bench_counts, COLOUR_BENCH_COUNTS, 16, COLOUR_MAX_FIXTURES, counts);
+        if(no_of_counts == 0)
+            mexErrMsgTxt("dmx.mex::The counts must be a vector of up to 16 whole numbers, between 1 and 512.\n");
+
+        // The primaries of a typical RGBW LED fixture, in XYZ, with Y = 1 for all of them together.
+        const double primaries[12] = {
+            0.2126, 0.1000, 0.0000,
+            0.1750, 0.5500, 0.0600,
+            0.1430, 0.0500, 0.7600,
+            0.4200, 0.4400, 0.4800};
+
+        colour_table *table = mxCalloc(1, sizeof(colour_table));
+        double *xyY = mxCalloc(3 * COLOUR_MAX_FIXTURES, sizeof(double));
+        USHORT *fixtures = mxCalloc(COLOUR_MAX_FIXTURES, sizeof(USHORT));
+        USHORT *universe = mxCalloc(4 * COLOUR_MAX_FIXTURES, sizeof(USHORT));
+        double inverse_matrix[9];
+
+        table->inverse = malloc(COLOUR_MAX_FIXTURES * 4 * (COLOUR_TABLE_SIZE + 1) * sizeof(float));
+        if(table->inverse == NULL)
+            mexErrMsgTxt("dmx.mex::Not enough memory for the response tables.\n");
+        colour_invert(primaries, inverse_matrix);
+        for(USHORT i = 0; i < COLOUR_MAX_FIXTURES; i++)
+        {
+            for(int row = 0; row < 3; row++)
+            {
+                double white_mix = 0;
+                for(int column = 0; column < 3; column++)
+                {
+                    table->inverse_matrix[3 * row + column][i] = (float) inverse_matrix[row + 3 * column];
+                    white_mix += inverse_matrix[row + 3 * column] * primaries[9 + column];
+                }
+                table->white_mix[row][i] = (float) white_mix;
+            }
+            table->has_white[i] = 1.0f;
+            table->address[i] = 4 * i;
+            table->no_of_primaries[i] = 4;
+            for(UCHAR primary = 0; primary < 4; primary++)
+            {
+                table->offset[primary][i] = primary;
+                colour_inverse_table(NULL, 2.2, &table->inverse[(i * 4 + primary) * (COLOUR_TABLE_SIZE + 1)]);
+            }
+            fixtures[i] = i;
+        }
+        table->no_of_fixtures = COLOUR_MAX_FIXTURES;
+
+        mxArray *counts_output = mxCreateDoubleMatrix(1, no_of_counts, mxREAL);
+        mxArray *batch_output = mxCreateDoubleMatrix(1, no_of_counts, mxREAL);
+        mxArray *rate_output = mxCreateDoubleMatrix(1, no_of_counts, mxREAL);
+
+        for(ULONG c = 0; c < no_of_counts; c++)
+        {
+            USHORT no_of_fixtures = (USHORT) counts[c];
+            ULONG random = 12345;
+
+            // x and y from 0.1 to 0.6, so some of them are out of the gamut. Y is up to 1.
+            for(USHORT i = 0; i < no_of_fixtures; i++)
+            {
+                for(int j = 0; j < 3; j++)
+                {
+                    random = random * 1664525 + 1013904223;
+                    xyY[j * no_of_fixtures + i] = (j < 2) ? 0.1 + (random >> 8) % 5000 / 10000.0 : (random >> 8) % 10000 / 10000.0;
+                }
+            }
+
+            colour_bench_context context = {table, xyY, fixtures, no_of_fixtures, universe};
+            double batch_us = bench_time(colour_bench_step, &context, COLOUR_BENCH_SECONDS);
+            ((mxDouble *) mxGetData(counts_output))[c] = no_of_fixtures;
+            ((mxDouble *) mxGetData(batch_output))[c] = batch_us;
+            ((mxDouble *) mxGetData(rate_output))[c] = no_of_fixtures * 1e6 / batch_us;
+        }
+
+        colour_free(table);
+        mxFree(table);
+        mxFree(xyY);
+        mxFree(fixtures);
+        mxFree(universe);
+
+        const char *field_names[] = {"counts", "batch_us", "fixtures_per_second"};
+        plhs[0] = mxCreateStructMatrix(1, 1, 3, field_names);
+        mxSetField(plhs[0], 0, "counts", counts_output);
+        mxSetField(plhs[0], 0, "batch_us", batch_output);
+        mxSetField(plhs[0], 0, "fixtures_per_second", rate_output);
+    }
+
 
-/*
-    This is a multiple entry-point function. when you call this, the first argument is the function's name.
-*/
 
-void mexFunction( int nlhs, mxArray *plhs[],
-                  int nrhs, const mxArray *prhs[])
-{
     /*
-        Local variables
+        dmx('spectral_define', fixtures)
+
+        Sets the spectra of the fixtures for dmx('spectral_set'). 'fixtures' is a struct array, one element for each
+        fixture:
+        -'address' is where the fixture starts (1-512)
+        -'spectra' is samples x primaries (up to 1024 x 8): the spectrum of each primary at full, in the order of its
+            channels. The wavelengths are up to you, but the targets must be sampled the same way.
+        -'gamma' (optional, the default is 1) is the response of the primaries, like in dmx('colour_define').
+        dmx('spectral_define', []) forgets the fixtures.
     */
-    char stringBuffer[128]; // This is for the function name. 128 bytes are generous.
+
+    if(!strcmp(stringBuffer, "spectral_define"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs != 2)
+            mexErrMsgTxt("dmx.mex::This function needs exactly two arguments.\n");
+
+        if(mxIsEmpty(prhs[1]))
+        {
+            spectral_free(&spectral);
+            return;
+        }
+
+        spectral_table *new_table = mxCalloc(1, sizeof(spectral_table));
+        const char *error_message = spectral_prepare(prhs[1], new_table);
+        if(error_message != NULL)
+        {
+            spectral_free(new_table);
+            mxFree(new_table);
+            mexErrMsgTxt(error_message);
+        }
+
+        spectral_free(&spectral);
+        memcpy(&spectral, new_table, sizeof(spectral_table));
+        mxFree(new_table);
+    }
+
 
 
     /*
-        Sanity checks on the first input argument.
-        Everything else is done within the corresponding parts.
+        result = dmx('spectral_bench', [primaries, [samples]])
+
+        Times the solve in dmx('spectral_set') and the level lookup, without the transfer, for fixtures with each
+        of 'primaries' (default is [3 5 8]) primaries, with spectra of 'samples' (default is 401, 380 to 780 nm at
+        1 nm) samples. The primaries are bell curves across the spectrum, and the targets are mixtures of them with
+        weights from -0.3 to 1.3, so a lot of them need the bounded solve.
+        Returns a struct: primaries, samples, solve_us (the mean, for each), solve_us_max, and constrained (the
+        fraction of the targets that needed the bounded solve)
+        The fixtures set with dmx('spectral_define') and the shadow universe are not touched.
     */
 
-    // Do we at least have 1 input argument?.
-	if (nrhs < 1) {
-		mexErrMsgTxt("dmx.mex::This function needs at least one input argument!\n");
-	}
+    if(!strcmp(stringBuffer, "spectral_bench"))
+    {
+        double sizes[SPECTRAL_MAX_PRIMARIES];
+        USHORT no_of_samples = 401;
+
+        LstK_Free(deviceList);
+
+        if(nrhs > 3)
+            mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
+
+        ULONG no_of_sizes = bench_sizes(nrhs >= 2 ? prhs[1] : NULL, spectral_bench_primaries, SPECTRAL_BENCH_SIZES, SPECTRAL_MAX_PRIMARIES, SPECTRAL_MAX_PRIMARIES, sizes);
+        if(no_of_sizes == 0)
+            mexErrMsgTxt("dmx.mex::The numbers of primaries must be a vector of up to 8 whole numbers, between 1 and 8.\n");
+
+        if(nrhs == 3)
+        {
+            double samples_input = mxIsNumeric(prhs[2]) && mxGetNumberOfElements(prhs[2]) == 1 ? mxGetScalar(prhs[2]) : 0;
+            if(!(samples_input >= SPECTRAL_MAX_PRIMARIES && samples_input <= SPECTRAL_MAX_SAMPLES) || samples_input != (USHORT) samples_input)
+                mexErrMsgTxt("dmx.mex::The number of samples must be a whole number, between 8 and 1024.\n");
+            no_of_samples = (USHORT) samples_input;
+        }
+
+        mxArray *primaries_output = mxCreateDoubleMatrix(1, no_of_sizes, mxREAL);
+        mxArray *mean_output = mxCreateDoubleMatrix(1, no_of_sizes, mxREAL);
+        mxArray *max_output = mxCreateDoubleMatrix(1, no_of_sizes, mxREAL);
+        mxArray *constrained_output = mxCreateDoubleMatrix(1, no_of_sizes, mxREAL);
+        double *targets = mxCalloc(64 * no_of_samples, sizeof(double));
+        spectral_bench_context *context = mxCalloc(1, sizeof(spectral_bench_context));
+
+        for(ULONG s = 0; s < no_of_sizes; s++)
+        {
+            spectral_fixture fixture = {0};
+            ULONG random = 12345;
+
+            fixture.no_of_primaries = (UCHAR) sizes[s];
+            fixture.no_of_samples = no_of_samples;
+            if(!spectral_allocate(&fixture))
+                mexErrMsgTxt("dmx.mex::Not enough memory for the spectra.\n");
+
+            // Bell curves, 40 samples wide, with their peaks spread out evenly.
+            for(UCHAR i = 0; i < fixture.no_of_primaries; i++)
+            {
+                double peak = (i + 0.5) * no_of_samples / fixture.no_of_primaries;
+                for(USHORT sample = 0; sample < no_of_samples; sample++)
+                    fixture.spectra[i * no_of_samples + sample] = exp(-(sample - peak) * (sample - peak) / (2.0 * 20 * 20));
+                colour_inverse_table(NULL, 2.2, &fixture.inverse[i * (COLOUR_TABLE_SIZE + 1)]);
+            }
+            if(!spectral_factorise(&fixture))
+            {
+                free(fixture.spectra);
+                mexErrMsgTxt("dmx.mex::With this few samples, the primaries' spectra are not independent. Use more samples.\n");
+            }
+
+            for(ULONG target = 0; target < 64; target++)
+            {
+                double *spectrum = &targets[target * no_of_samples];
+                memset(spectrum, 0, no_of_samples * sizeof(double));
+                for(UCHAR i = 0; i < fixture.no_of_primaries; i++)
+                {
+                    random = random * 1664525 + 1013904223;
+                    double weight = -0.3 + (random >> 8) % 16000 / 10000.0;
+                    for(USHORT sample = 0; sample < no_of_samples; sample++)
+                        spectrum[sample] += weight * fixture.spectra[i * no_of_samples + sample];
+                }
+            }
+
+            // The mean is of the solves alone, from the step's own timing, not of the calls.
+            memset(context, 0, sizeof(spectral_bench_context));
+            context->fixture = &fixture;
+            context->targets = targets;
+            bench_time(spectral_bench_step, context, SPECTRAL_BENCH_SECONDS);
+
+            free(fixture.spectra);
+            ((mxDouble *) mxGetData(primaries_output))[s] = fixture.no_of_primaries;
+            ((mxDouble *) mxGetData(mean_output))[s] = (double) context->total * 1e6 / qpc_frequency / context->no_of_solves;
+            ((mxDouble *) mxGetData(max_output))[s] = (double) context->longest * 1e6 / qpc_frequency;
+            ((mxDouble *) mxGetData(constrained_output))[s] = (double) context->no_of_constrained / context->no_of_solves;
+        }
+        mxFree(targets);
+        mxFree(context);
+
+        const char *field_names[] = {"primaries", "samples", "solve_us", "solve_us_max", "constrained"};
+        plhs[0] = mxCreateStructMatrix(1, 1, 5, field_names);
+        mxSetField(plhs[0], 0, "primaries", primaries_output);
+        mxSetField(plhs[0], 0, "samples", mxCreateDoubleScalar(no_of_samples));
+        mxSetField(plhs[0], 0, "solve_us", mean_output);
+        mxSetField(plhs[0], 0, "solve_us_max", max_output);
+        mxSetField(plhs[0], 0, "constrained", constrained_output);
+    }
 
-	// Is the first input argument a string?
-	if (!mxIsChar(prhs[0])) {
-		mexErrMsgTxt("dmx.mex::The first argument is a function name string. Check the documentation on what is available.\n");
-	}
 
 
-    // Process the string
-    if (mxGetString(prhs[0], stringBuffer, sizeof(stringBuffer) - 1)) {
-		mexErrMsgTxt("dmx.mex::The funcion name is suspiciosly too long. Check the documentation.\n");
-	}
     /*
-        This bit is based on the API examples of libusbK.
-        https://github.com/mcuee/libusbk/tree/master/libusbK/examples
+        dmx('merge', channels, mode)
+        htp = dmx('merge')
+
+        Sets how the daemon merges 'channels' (addresses, or patched parameter names) from its sources:
+        'htp' is highest takes precedence, 'ltp' is latest takes precedence (this is the default).
+        This is for everyone connected to the daemon, not just us. Called without arguments, it returns a
+        1x512 logical vector, true where the channel is HTP.
     */
 
-    KLST_HANDLE deviceList = NULL;
-    KLST_DEVINFO_HANDLE deviceInfo = NULL;
-    KUSB_HANDLE handle = NULL;
-    DWORD errorCode = ERROR_SUCCESS;
-    ULONG count = 0;
+    if(!strcmp(stringBuffer, "merge"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs != 1 && nrhs != 3)
+            mexErrMsgTxt("dmx.mex::This function needs either one or three arguments.\n");
+
+        if(daemon.shm == NULL)
+            mexErrMsgTxt("dmx.mex::The merge is done by the daemon. Call dmx('daemon', true) first.\n");
+
+        if(nrhs == 1)
+        {
+            plhs[0] = mxCreateLogicalMatrix(1, 512);
+            mxLogical *htp_output_pointer = mxGetData(plhs[0]);
+            for(unsigned int i = 0; i < 512; i++)
+                htp_output_pointer[i] = daemon.shm->htp[i] != 0;
+            return;
+        }
+
+        char mode[4];
+        if(!mxIsChar(prhs[2]) || mxGetString(prhs[2], mode, sizeof(mode)) || (strcmp(mode, "htp") && strcmp(mode, "ltp")))
+            mexErrMsgTxt("dmx.mex::The mode is either 'htp' or 'ltp'.\n");
+
+        ULONG channel_list[512];
+        mwSize no_of_channels;
+
+        const char *error_message = channels_from_input(prhs[1], channel_list, &no_of_channels);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        for(mwSize i = 0; i < no_of_channels; i++)
+            daemon.shm->htp[channel_list[i]] = !strcmp(mode, "htp");
+        SetEvent(daemon.doorbell);
+    }
+
+
 
     /*
-        Initialize a new LstK (device list) handle.
-        The list is polulated with all usb devices libusbK can access.
+        dmx('capture_start', filename, [no_of_slots])
+
+        Starts logging every transfer (timestamp, Pkt.Request/Value/Index/Length, payload) into a file.
+        The transfers go to a preallocated ring of 'no_of_slots' entries first (default is 4096, rounded
+        up to a power of 2), and a background thread writes them to the disk.
     */
-    if (!LstK_Init(&deviceList, 0))
+
+    if(!strcmp(stringBuffer, "capture_start"))
     {
-        errorCode = GetLastError();
-        mexPrintf("Error code: %d.\n", errorCode);
-        mexErrMsgTxt("dmx.mex::An error occured getting the device list.");
+        char filename[MAX_PATH];
+        ULONG no_of_slots = CAPTURE_DEFAULT_SLOTS;
+
+        LstK_Free(deviceList);
+
+        if(nrhs != 2 && nrhs != 3)
+            mexErrMsgTxt("dmx.mex::This function needs a file name, and optionally the size of the capture ring.\n");
+
+        if(!mxIsChar(prhs[1]) || mxGetString(prhs[1], filename, sizeof(filename)))
+            mexErrMsgTxt("dmx.mex::The capture file name must be a string, and not too long.\n");
+
+        if(nrhs == 3)
+        {
+            if(!mxIsNumeric(prhs[2]) || mxGetScalar(prhs[2]) < 1 || mxGetScalar(prhs[2]) > 1048576)
+                mexErrMsgTxt("dmx.mex::The capture ring size must be between 1 and 1048576 slots.\n");
+
+            // Round up to a power of 2, so we can wrap around with a mask.
+            no_of_slots = 1;
+            while(no_of_slots < (ULONG) mxGetScalar(prhs[2]))
+                no_of_slots <<= 1;
+        }
+
+        const char *error_message = capture_start(filename, no_of_slots);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Capturing transfers to %s, with %d slots.\n", filename, no_of_slots);
+        #endif
+    }
+
+
+
+    /*
+        dropped = dmx('capture_stop')
+
+        Stops the capture, and writes everything to the disk.
+        Returns the number of transfers that could not be captured, because the ring was full.
+        If something couldn't be written to the file, this throws an error, but the capture is stopped anyway.
+    */
+
+    if(!strcmp(stringBuffer, "capture_stop"))
+    {
+        LONG dropped;
+
+        LstK_Free(deviceList);
+
+        const char *error_message = capture_stop(&dropped);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        plhs[0] = mxCreateDoubleScalar((double) dropped);
+    }
+
+
+
+    /*
+        [fail, no_of_transfers] = dmx('replay', filename)
+
+        Reads a capture file, and re-issues every transfer in it with the original timing.
+        If the simulator is enabled, the transfers go there instead of the device.
+        This blocks until the whole capture is sent.
+    */
+
+    if(!strcmp(stringBuffer, "replay"))
+    {
+        char filename[MAX_PATH];
+        capture_reader reader;
+        capture_file_record record;
+        UCHAR payload[512];
+        LONGLONG first_timestamp = 0, replay_start = 0;
+        double no_of_transfers = 0;
+        bool failed = FALSE;
+
+        if(nrhs != 2)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::This function needs exactly two arguments.\n");
+        }
+
+        if(!mxIsChar(prhs[1]) || mxGetString(prhs[1], filename, sizeof(filename)))
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::The capture file name must be a string, and not too long.\n");
+        }
+
+        if(session.running)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+        }
+
+        const char *error_message = capture_reader_open(&reader, filename);
+        if(error_message != NULL)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt(error_message);
+        }
+
+        if(device_is_local())
+        {
+            error_message = udmx_open(deviceList, &handle);
+            if(error_message != NULL)
+            {
+                capture_reader_close(&reader);
+                LstK_Free(deviceList);
+                mexErrMsgTxt(error_message);
+            }
+        }
+
+        while(capture_reader_next(&reader, &record, payload))
+        {
+            if(no_of_transfers == 0)
+            {
+                first_timestamp = record.timestamp;
+                replay_start = now_ticks();
+            }
+
+            // Convert the captured tick count to ours: the capture may have been made on a different computer.
+            wait_until(replay_start + (LONGLONG) ((double) (record.timestamp - first_timestamp) * qpc_frequency / reader.header.qpc_frequency));
+
+            UINT transferred = 0;
+            WINUSB_SETUP_PACKET Pkt;
+            KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+
+            memset(&Pkt, 0, sizeof(Pkt));
+            defPkt->BmRequest.Dir	= 0; // This should be BMREQUEST_DIR_HOST_TO_DEVICE
+            defPkt->BmRequest.Type	= 2; // This should be BMREQUEST_TYPE_VENDOR
+            defPkt->Request			= record.request;
+            defPkt->Value			= record.value;
+            defPkt->Index			= record.index;
+            defPkt->Length			= record.length;
+
+            if(!udmx_transfer(handle, Pkt, payload, record.length, &transferred))
+                failed = TRUE;
+
+            no_of_transfers++;
+        }
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Replayed %d transfers.\n", (int) no_of_transfers);
+        #endif
+
+        capture_reader_close(&reader);
+        if(handle != NULL)
+            Usb.Free(handle);
+        LstK_Free(deviceList);
+
+        plhs[0] = mxCreateLogicalScalar(failed);
+        if(nlhs > 1)
+            plhs[1] = mxCreateDoubleScalar(no_of_transfers);
+    }
+
+
+
+    /*
+        no_of_records = dmx('capture_read', filename)
+        [universes, timestamps] = dmx('capture_read', filename, record_numbers)
+
+        Reads the universe as it was after the given transfers (1 is the first one) from a capture file.
+        Each row of 'universes' is 512 channels, and the timestamps are in seconds from the first transfer.
+        The keyframe index is used to jump around, so this doesn't decode the whole file.
+    */
+
+    if(!strcmp(stringBuffer, "capture_read"))
+    {
+        char filename[MAX_PATH];
+        capture_reader reader;
+        capture_file_record record;
+        UCHAR payload[512];
+        LONGLONG first_timestamp = 0;
+
+        LstK_Free(deviceList);
+
+        if(nrhs != 2 && nrhs != 3)
+            mexErrMsgTxt("dmx.mex::This function needs a file name, and optionally the record numbers.\n");
+
+        if(!mxIsChar(prhs[1]) || mxGetString(prhs[1], filename, sizeof(filename)))
+            mexErrMsgTxt("dmx.mex::The capture file name must be a string, and not too long.\n");
+
+        if(nrhs == 3 && (!mxIsDouble(prhs[2]) || mxIsComplex(prhs[2])))
+            mexErrMsgTxt("dmx.mex::Record numbers must be real doubles.\n");
+
+        const char *error_message = capture_reader_open(&reader, filename);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        if(nrhs == 2)
+        {
+            plhs[0] = mxCreateDoubleScalar((double) reader.no_of_records);
+            capture_reader_close(&reader);
+            return;
+        }
+
+        // We need the first timestamp to make the others relative.
+        if(capture_reader_seek(&reader, 0) && capture_reader_next(&reader, &record, payload))
+            first_timestamp = record.timestamp;
+
+        mwSize no_of_records = mxGetNumberOfElements(prhs[2]);
+        mxDouble *record_numbers_input_pointer = mxGetData(prhs[2]);
+        plhs[0] = mxCreateDoubleMatrix(no_of_records, 512, mxREAL);
+        mxDouble *universes_output_pointer = mxGetData(plhs[0]);
+        mxDouble *timestamps_output_pointer = NULL;
+        if(nlhs > 1)
+        {
+            plhs[1] = mxCreateDoubleMatrix(no_of_records, 1, mxREAL);
+            timestamps_output_pointer = mxGetData(plhs[1]);
+        }
+
+        for(mwSize i = 0; i < no_of_records; i++)
+        {
+            double record_number = record_numbers_input_pointer[i];
+
+            if(record_number < 1 || record_number > reader.no_of_records || record_number != (ULONGLONG) record_number
+                || !capture_reader_seek(&reader, (ULONGLONG) record_number - 1) || !capture_reader_next(&reader, &record, payload))
+            {
+                capture_reader_close(&reader);
+                mexErrMsgTxt("dmx.mex::Record numbers must be integers between 1 and the number of records in the capture.\n");
+            }
+
+            // Matlab is column-major, each universe is a row.
+            for(unsigned int channel = 0; channel < 512; channel++)
+                universes_output_pointer[channel * no_of_records + i] = reader.universe[channel];
+
+            if(timestamps_output_pointer != NULL)
+                timestamps_output_pointer[i] = (double) (record.timestamp - first_timestamp) / reader.header.qpc_frequency;
+        }
+
+        capture_reader_close(&reader);
+    }
+
+
+
+    /*
+        results = dmx('capture_bench', no_of_frames, no_of_fading_channels)
+
+        Benchmarks the capture encoder on a synthetic fade: every frame is a full 512-channel cmd_SetChannelRange
+        transfer, in which 'no_of_fading_channels' channels ramp up and down at different speeds.
+        Everything is done in memory, so this measures the encoder and the decoder, not the disk.
+    */
+
+    if(!strcmp(stringBuffer, "capture_bench"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs != 3 || !mxIsNumeric(prhs[1]) || !mxIsNumeric(prhs[2]))
+            mexErrMsgTxt("dmx.mex::This function needs the number of frames and the number of fading channels.\n");
+
+        double frames_input = mxGetNumberOfElements(prhs[1]) == 1 ? mxGetScalar(prhs[1]) : 0;
+        double fading_input = mxGetNumberOfElements(prhs[2]) == 1 ? mxGetScalar(prhs[2]) : -1;
+        if(!(frames_input >= 1 && frames_input <= 1000000) || frames_input != (ULONG) frames_input
+            || !(fading_input >= 0 && fading_input <= 512) || fading_input != (ULONG) fading_input)
+            mexErrMsgTxt("dmx.mex::Use 1-1000000 frames, and 0-512 fading channels, as whole numbers.\n");
+
+        ULONG no_of_frames = (ULONG) frames_input;
+        ULONG no_of_fading_channels = (ULONG) fading_input;
+
+        // Worst case, every frame is a keyframe.
+        UCHAR *encoded_frames = malloc((size_t) no_of_frames * (sizeof(capture_file_record) + 512));
+        if(encoded_frames == NULL)
+            mexErrMsgTxt("dmx.mex::Could not allocate memory for the benchmark.\n");
+
+        capture_encoder encoder;
+        capture_file_record record;
+        UCHAR universe[512], payload[512];
+        LONGLONG encode_ticks = 0, decode_ticks = 0, seek_ticks = 0, timer;
+        ULONG no_of_seeks = 1000;
+
+        memset(universe, 0, sizeof(universe));
+        capture_encoder_init(&encoder, CAPTURE_KEYFRAME_INTERVAL, 0);
+
+        for(ULONG frame = 0; frame < no_of_frames; frame++)
+        {
+            // Spread the fading channels over the universe, each with its own speed.
+            for(ULONG i = 0; i < no_of_fading_channels; i++)
+            {
+                ULONG ramp = (frame * (i % 7 + 1)) % 510;
+                universe[(i * 512) / no_of_fading_channels] = (UCHAR) (ramp < 255 ? ramp : 510 - ramp);
+            }
+
+            memset(&record, 0, sizeof(record));
+            record.timestamp = frame;
+            record.request = cmd_SetChannelRange;
+            record.value = 512;
+            record.length = 512;
+
+            timer = now_ticks();
+            capture_encode(&encoder, &record, universe, (UCHAR*) encoded_frames + encoder.offset + sizeof(capture_file_record));
+            encode_ticks += now_ticks() - timer;
+
+            memcpy(encoded_frames + encoder.offset - record.encoded_length - sizeof(capture_file_record), &record, sizeof(record));
+        }
+
+        // Sequential decoding.
+        LONGLONG offset = 0;
+        timer = now_ticks();
+        for(ULONG frame = 0; frame < no_of_frames; frame++)
+        {
+            memcpy(&record, encoded_frames + offset, sizeof(record));
+            offset += sizeof(record);
+            if(record.kind == CAPTURE_KEYFRAME)
+                memcpy(universe, encoded_frames + offset, 512);
+            else
+                delta_decode(universe, encoded_frames + offset, record.encoded_length);
+            capture_payload(universe, &record, payload);
+            offset += record.encoded_length;
+        }
+        decode_ticks = now_ticks() - timer;
+
+        // Random access: find the keyframe, and decode forward from there.
+        srand(1);
+        timer = now_ticks();
+        for(ULONG i = 0; i < no_of_seeks; i++)
+        {
+            ULONG target = (ULONG) (((ULONGLONG) rand() * (RAND_MAX + 1ULL) + rand()) % no_of_frames);
+            ULONG keyframe = 0;
+            while(keyframe + 1 < encoder.no_of_keyframes && encoder.index[keyframe + 1].record_number <= target)
+                keyframe++;
+            offset = encoder.index[keyframe].offset;
+            for(ULONGLONG frame = encoder.index[keyframe].record_number; frame <= target; frame++)
+            {
+                memcpy(&record, encoded_frames + offset, sizeof(record));
+                offset += sizeof(record);
+                if(record.kind == CAPTURE_KEYFRAME)
+                    memcpy(universe, encoded_frames + offset, 512);
+                else
+                    delta_decode(universe, encoded_frames + offset, record.encoded_length);
+                offset += record.encoded_length;
+            }
+        }
+        seek_ticks = now_ticks() - timer;
+
+        // What the capture would be without the delta compression: a record and 512 bytes per frame.
+        double raw_bytes = (double) no_of_frames * (sizeof(capture_file_record) + 512);
+        double compressed_bytes = (double) encoder.offset + encoder.no_of_keyframes * sizeof(capture_index_entry) + sizeof(capture_file_trailer);
+
+        const char *field_names[] = {"raw_bytes", "compressed_bytes", "compression_ratio", "keyframes", "encode_MBps", "decode_MBps", "random_access_us"};
+        plhs[0] = mxCreateStructMatrix(1, 1, 7, field_names);
+        mxSetField(plhs[0], 0, "raw_bytes", mxCreateDoubleScalar(raw_bytes));
+        mxSetField(plhs[0], 0, "compressed_bytes", mxCreateDoubleScalar(compressed_bytes));
+        mxSetField(plhs[0], 0, "compression_ratio", mxCreateDoubleScalar(raw_bytes / compressed_bytes));
+        mxSetField(plhs[0], 0, "keyframes", mxCreateDoubleScalar((double) encoder.no_of_keyframes));
+        // Throughput is in terms of the uncompressed universes.
+        mxSetField(plhs[0], 0, "encode_MBps", mxCreateDoubleScalar(no_of_frames * 512.0 / 1e6 / ((double) encode_ticks / qpc_frequency)));
+        mxSetField(plhs[0], 0, "decode_MBps", mxCreateDoubleScalar(no_of_frames * 512.0 / 1e6 / ((double) decode_ticks / qpc_frequency)));
+        mxSetField(plhs[0], 0, "random_access_us", mxCreateDoubleScalar(1e6 * seek_ticks / qpc_frequency / no_of_seeks));
+
+        free(encoder.index);
+        free(encoded_frames);
+    }
+
+
+
+    /*
+        dmx('patch', fixtures)
+
+        Loads the fixture patch. 'fixtures' is a struct array with these fields:
+        -'name' is the name of the fixture, i.e. 'par3'. No dots, please.
+        -'address' is the base address (1-512)
+        -'channels' is a cell array of parameter names, in channel order, i.e. {'dim', 'red', 'green', 'blue'}.
+            If a parameter name ends with ':16', it's a 16-bit parameter, and takes two channels: coarse, then fine.
+        The new patch replaces the old one. dmx('patch', []) clears the patch.
+    */
+
+    if(!strcmp(stringBuffer, "patch"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs != 2)
+            mexErrMsgTxt("dmx.mex::This function needs exactly two arguments.\n");
+
+        if(mxIsEmpty(prhs[1]))
+        {
+            EnterCriticalSection(&engine_lock);
+            for(ULONG i = 0; i < patch.no_of_parameters; i++)
+            {
+                if(patch.parameters[i].is_16bit && channel_modes.mode[patch.parameters[i].channel] == CHANNEL_16BIT)
+                    channel_mode_set(patch.parameters[i].channel, CHANNEL_8BIT);
+            }
+            channel_modes_update();
+            memset(&patch, 0, sizeof(patch));
+            LeaveCriticalSection(&engine_lock);
+            return;
+        }
+
+        if(!mxIsStruct(prhs[1]) || mxGetFieldNumber(prhs[1], "name") < 0 || mxGetFieldNumber(prhs[1], "address") < 0 || mxGetFieldNumber(prhs[1], "channels") < 0)
+            mexErrMsgTxt("dmx.mex::The patch must be a struct array, with 'name', 'address' and 'channels' fields.\n");
+
+        // Build the new patch on the side, so a bad one doesn't break the old one.
+        patch_table *new_patch = mxCalloc(1, sizeof(patch_table));
+
+        for(mwSize fixture = 0; fixture < mxGetNumberOfElements(prhs[1]); fixture++)
+        {
+            char fixture_name[PATCH_MAX_NAME], parameter_name[PATCH_MAX_NAME];
+            const mxArray *name_field = mxGetField(prhs[1], fixture, "name");
+            const mxArray *address_field = mxGetField(prhs[1], fixture, "address");
+            const mxArray *channels_field = mxGetField(prhs[1], fixture, "channels");
+
+            if(name_field == NULL || !mxIsChar(name_field) || mxGetString(name_field, fixture_name, sizeof(fixture_name)) || !fixture_name[0] || strchr(fixture_name, '.') != NULL)
+                mexErrMsgTxt("dmx.mex::Fixture names must be strings without dots, and shorter than 64 characters.\n");
+
+            if(address_field == NULL || !mxIsNumeric(address_field) || mxGetNumberOfElements(address_field) != 1)
+                mexErrMsgTxt("dmx.mex::Fixture addresses must be numbers.\n");
+
+            double address = mxGetScalar(address_field);
+            if(address < 1 || address > 512 || address != (USHORT) address)
+                mexErrMsgTxt("dmx.mex::Fixture addresses must be integers between 1 and 512.\n");
+
+            if(channels_field == NULL || !string_count(channels_field))
+                mexErrMsgTxt("dmx.mex::Fixture channels must be a cell array of parameter names.\n");
+
+            USHORT channel = (USHORT) address - 1; // off-by-one error: the dongle expects [0-511], reality expects [1-512].
+            for(mwSize i = 0; i < string_count(channels_field); i++)
+            {
+                if(!string_element(channels_field, i, parameter_name, sizeof(parameter_name)) || !parameter_name[0])
+                    mexErrMsgTxt("dmx.mex::Parameter names must be strings, and shorter than 64 characters.\n");
+
+                size_t parameter_name_length = strlen(parameter_name);
+                UCHAR is_16bit = (parameter_name_length > 3 && !strcmp(&parameter_name[parameter_name_length - 3], ":16"));
+                if(is_16bit)
+                    parameter_name[parameter_name_length - 3] = 0;
+
+                if(channel + is_16bit > 511)
+                {
+                    mexPrintf("dmx.mex::Fixture %s does not fit in the universe.\n", fixture_name);
+                    mexErrMsgTxt("dmx.mex::The patch is bigger than the universe.\n");
+                }
+
+                if(new_patch->no_of_parameters == PATCH_MAX_PARAMETERS)
+                    mexErrMsgTxt("dmx.mex::Too many parameters in the patch.\n");
+
+                if(patch_find(new_patch, fixture_name, parameter_name) >= 0)
+                {
+                    mexPrintf("dmx.mex::%s.%s is in the patch twice.\n", fixture_name, parameter_name);
+                    mexErrMsgTxt("dmx.mex::Parameter names must be unique.\n");
+                }
+
+                patch_parameter *parameter = &new_patch->parameters[new_patch->no_of_parameters];
+                snprintf(parameter->name, sizeof(parameter->name), "%s.%s", fixture_name, parameter_name);
+                parameter->channel = channel;
+                parameter->is_16bit = is_16bit;
+
+                ULONG slot = patch_hash(parameter->name, NULL) & (PATCH_HASH_SLOTS - 1);
+                while(new_patch->hash_table[slot])
+                    slot = (slot + 1) & (PATCH_HASH_SLOTS - 1);
+                new_patch->hash_table[slot] = (USHORT) ++new_patch->no_of_parameters;
+
+                channel += 1 + is_16bit;
+            }
+        }
+
+        // 16-bit parameters are pairs in the output stage. The pairs of the old patch are broken up.
+        EnterCriticalSection(&engine_lock);
+        for(ULONG i = 0; i < patch.no_of_parameters; i++)
+        {
+            if(patch.parameters[i].is_16bit && channel_modes.mode[patch.parameters[i].channel] == CHANNEL_16BIT)
+                channel_mode_set(patch.parameters[i].channel, CHANNEL_8BIT);
+        }
+        memcpy(&patch, new_patch, sizeof(patch_table));
+        for(ULONG i = 0; i < patch.no_of_parameters; i++)
+        {
+            if(patch.parameters[i].is_16bit)
+                channel_mode_set(patch.parameters[i].channel, CHANNEL_16BIT);
+        }
+        channel_modes_update();
+        LeaveCriticalSection(&engine_lock);
+        mxFree(new_patch);
+
+        #ifdef VERBOSE
+        mexPrintf("dmx.mex::Patched %d parameters.\n", patch.no_of_parameters);
+        #endif
+    }
+
+
+
+    /*
+        ids = dmx('resolve', names)
+        ids = dmx('resolve', fixtures, parameters)
+
+        Looks up parameters in the patch, and returns their numbers. These can be used with dmx('set', ids, values),
+        so there is no string handling at all when sending.
+        'names' is a "fixture.parameter" string or a cell array of these. 'fixtures' and 'parameters' are
+        strings or cell arrays of strings, paired up one by one. If one of them is a single name, it goes with all the others.
+    */
+
+    if(!strcmp(stringBuffer, "resolve"))
+    {
+        ULONG parameter_numbers[PATCH_MAX_PARAMETERS];
+        mwSize no_of_parameters;
+
+        LstK_Free(deviceList);
+
+        if(nrhs != 2 && nrhs != 3)
+            mexErrMsgTxt("dmx.mex::This function needs the parameter names, or the fixture names and parameter names.\n");
+
+        const char *error_message = patch_resolve((nrhs == 3) ? prhs[1] : NULL, prhs[nrhs - 1], parameter_numbers, &no_of_parameters);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+
+        plhs[0] = mxCreateDoubleMatrix(1, no_of_parameters, mxREAL);
+        mxDouble *ids_output_pointer = mxGetData(plhs[0]);
+        for(mwSize i = 0; i < no_of_parameters; i++)
+            ids_output_pointer[i] = parameter_numbers[i] + 1;
     }
 
 
-    #ifdef VERBOSE
-    /*
-        dmx('mextest')
 
-        I just leave this here for future reference,
-    */
-    if(!strcmp(stringBuffer, "mextest"))
-    {
-        mexPrintf("Test function is working without crashing.\n");
+    /*
+        fail = dmx('set', name, value)
+        fail = dmx('set', names, values)
+        fail = dmx('set', fixtures, parameters, values)
+        fail = dmx('set', ids, values)
+        dmx('set', ..., values, status)
+
+        Sets patched parameters. The names are the same as for dmx('resolve'), and the ids are what it returns.
+        8-bit parameters take 0-255, 16-bit parameters take 0-65535. Anything outside this is clamped.
+        The changed channels are sent to the device in one transfer.
+        Any of these can have a status buffer (see above) after the values, this is written instead of returning anything.
+    */
+
+    if(!strcmp(stringBuffer, "set"))
+    {
+        ULONG parameter_numbers[PATCH_MAX_PARAMETERS];
+        mwSize no_of_parameters;
+        const mxArray *status_input = NULL;
+        const mxArray *values_input = NULL;
+
+        const char *error_message = set_arguments(nrhs, prhs, parameter_numbers, &no_of_parameters, &values_input, &status_input);
+        if(error_message != NULL)
+        {
+            LstK_Free(deviceList);
+            command_failed(DMX_ERROR_ARGUMENT, stringBuffer, error_message, ERROR_SUCCESS);
+            command_result(nlhs, plhs, status_input, TRUE, FALSE);
+            return;
+        }
+
+        mxDouble *values_input_pointer = mxGetData(values_input);
+        EnterCriticalSection(&engine_lock);
+        for(mwSize i = 0; i < no_of_parameters; i++)
+            patch_write(parameter_numbers[i], values_input_pointer[i]);
+        LeaveCriticalSection(&engine_lock);
+
+        BOOL success;
+        error_message = shadow_flush(deviceList, &success);
+        DWORD system_error = GetLastError();
+
+        LstK_Free(deviceList);
+        if(error_message != NULL)
+            command_failed(DMX_ERROR_DEVICE, stringBuffer, error_message, system_error);
+        else if(!success)
+            error_record(DMX_ERROR_TRANSFER, stringBuffer, "The transfer failed.", flush_system_error);
+
+        command_result(nlhs, plhs, status_input, error_message != NULL || !success, FALSE); // fail. :)
     }
-    #endif
+
+
 
     /*
-        dmx('list')
+        fail = dmx('group', group_number, channels)
 
-        Prints all the devices that use libusbK
+        Puts channels in a group (1-32), replacing whatever was in it before. 'channels' is either a vector of addresses (1-512),
+        or a cell array of patched parameter names. Only put intensity channels in groups: the grand master and the
+        group's submaster scale every channel in it. An empty 'channels' clears the group.
     */
-    if(!strcmp(stringBuffer, "list"))
+
+    if(!strcmp(stringBuffer, "group"))
     {
-        // Get the number of devices contained in the device list.
-        LstK_Count(deviceList, &count);
-        if (!count)
+        ULONG channel_list[512];
+        mwSize no_of_channels = 0;
+
+        if(nrhs != 3 || !mxIsNumeric(prhs[1]) || mxGetNumberOfElements(prhs[1]) != 1)
         {
-            // Always free the device list if LstK_Init returns TRUE
             LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::This function needs a group number and the channels.\n");
+        }
 
-            mexErrMsgTxt("dmx.mex::No USB device that uses libusbK was detected.");
+        double group_number = mxGetScalar(prhs[1]);
+        if(group_number < 1 || group_number > MAX_GROUPS || group_number != (ULONG) group_number)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::Group numbers must be integers between 1 and 32.\n");
         }
-        else
+
+        const char *error_message = channels_from_input(prhs[2], channel_list, &no_of_channels);
+        if(error_message != NULL)
         {
-            mexPrintf("\nFound the following devices that use the libusbK driver:\n");
-            // Print devices to console.
+            LstK_Free(deviceList);
+            mexErrMsgTxt(error_message);
+        }
 
-            LstK_Enumerate(deviceList, ShowDevicesCB, NULL);
+        ULONG group_bit = 1UL << ((ULONG) group_number - 1);
+        EnterCriticalSection(&engine_lock);
+        for(unsigned int channel = 0; channel < 512; channel++)
+            intensity.group_mask[channel] &= ~group_bit;
+        for(mwSize i = 0; i < no_of_channels; i++)
+            intensity.group_mask[channel_list[i]] |= group_bit;
 
-            mexPrintf("\n");
-        }
+        intensity_update();
+        LeaveCriticalSection(&engine_lock);
+
+        BOOL success;
+        error_message = shadow_flush(deviceList, &success);
 
+        LstK_Free(deviceList);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
 
+        if(nlhs > 0)
+            plhs[0] = mxCreateLogicalScalar(!success); // fail. :)
     }
 
 
 
     /*
-        dmx('devicetest')
+        fail = dmx('master', level)
+        fail = dmx('submaster', group_numbers, levels)
 
-        This one opens and closes the device.
+        Sets the grand master, or the submasters of groups. Levels are between 0 and 1.
+        Only the channels whose output changes are sent to the device.
     */
 
-    if(!strcmp(stringBuffer, "devicetest"))
+    if(!strcmp(stringBuffer, "master") || !strcmp(stringBuffer, "submaster"))
     {
-        bool isPresent = FALSE;
+        BOOL is_master = !strcmp(stringBuffer, "master");
+        const mxArray *levels_input = prhs[nrhs - 1];
 
-        // Open the device, fail if cannot
-        if (!LstK_FindByVidPid(deviceList, UDMX_VENDOR_ID, UDMX_PRODUCT_ID, &deviceInfo))
-            mexErrMsgTxt("dmx.mex::Could not find the uDMX device.\n");
+        if(nrhs != (is_master ? 2 : 3) || !mxIsDouble(levels_input) || mxIsComplex(levels_input) || mxIsEmpty(levels_input))
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt(is_master ? "dmx.mex::This function needs the master level (0-1).\n" : "dmx.mex::This function needs the group numbers and the submaster levels (0-1).\n");
+        }
 
-        // If we didn't die before, then load the driver API
-        LibK_LoadDriverAPI(&Usb, deviceInfo->DriverID);
+        mwSize no_of_levels = mxGetNumberOfElements(levels_input);
+        mxDouble *levels_input_pointer = mxGetData(levels_input);
+        for(mwSize i = 0; i < no_of_levels; i++)
+        {
+            if(!(levels_input_pointer[i] >= 0 && levels_input_pointer[i] <= 1))
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::Master levels must be between 0 and 1.\n");
+            }
+        }
 
-        // Open device.
-        if(!Usb.Init(&handle, deviceInfo))
+        if(is_master)
         {
-            errorCode = GetLastError();
-            mexPrintf("dmx.mex::Error code: %d", errorCode);
-            mexErrMsgTxt("dmx.mex::Failed to open device.\n");
+            if(no_of_levels != 1)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::There is only one grand master.\n");
+            }
+        }
+        else
+        {
+            if(!mxIsDouble(prhs[1]) || mxGetNumberOfElements(prhs[1]) != no_of_levels)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::There must be exactly one level for each group number.\n");
+            }
+
+            mxDouble *groups_input_pointer = mxGetData(prhs[1]);
+            for(mwSize i = 0; i < no_of_levels; i++)
+            {
+                if(groups_input_pointer[i] < 1 || groups_input_pointer[i] > MAX_GROUPS || groups_input_pointer[i] != (ULONG) groups_input_pointer[i])
+                {
+                    LstK_Free(deviceList);
+                    mexErrMsgTxt("dmx.mex::Group numbers must be integers between 1 and 32.\n");
+                }
+            }
         }
 
-        #ifdef VERBOSE
-        mexPrintf("dmx.mex::Device opened, all good.\n");
-        #endif
+        EnterCriticalSection(&engine_lock);
+        if(is_master)
+            intensity.master = levels_input_pointer[0];
+        else
+        {
+            mxDouble *groups_input_pointer = mxGetData(prhs[1]);
+            for(mwSize i = 0; i < no_of_levels; i++)
+                intensity.submasters[(ULONG) groups_input_pointer[i] - 1] = levels_input_pointer[i];
+        }
 
+        intensity_update();
+        LeaveCriticalSection(&engine_lock);
 
-        // All done, clean up.
-        Usb.Free(handle);
-        LstK_Free(deviceList);
+        BOOL success;
+        const char *error_message = shadow_flush(deviceList, &success);
 
+        LstK_Free(deviceList);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
 
-        plhs[0] = mxCreateLogicalScalar(isPresent);
+        if(nlhs > 0)
+            plhs[0] = mxCreateLogicalScalar(!success); // fail. :)
     }
 
 
 
-
     /*
-        dmx('commtest')
+        fail = dmx('set_curve', channels, lut)
 
-        This one opens the device, sends a few bytes, then closes the device.
+        Sets the dimmer curve of channels. 'channels' is a vector of addresses, or a cell array of patched parameter names.
+        'lut' is a lookup table, either 256 entries long (8-bit in), or 65536 entries long (16-bit in). The values are
+        0-255 for double (fractions are kept, they matter for 16-bit and dithered channels) and uint8 tables, and 0-65535 for uint16 tables.
+        The curve is applied after the masters, so you can send linear intensities. An empty 'lut' makes the channels linear again.
     */
 
-    if(!strcmp(stringBuffer, "commtest"))
+    if(!strcmp(stringBuffer, "set_curve"))
     {
-        bool isPresent = FALSE;
+        ULONG channel_list[512];
+        mwSize no_of_channels;
+        LONG curve_number = -1;
 
-        // Open the device, fail if cannot
-        if (!LstK_FindByVidPid(deviceList, UDMX_VENDOR_ID, UDMX_PRODUCT_ID, &deviceInfo))
-            mexErrMsgTxt("dmx.mex::Could not find the uDMX device.\n");
+        if(nrhs != 3)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::This function needs exactly three arguments.\n");
+        }
 
-        // If we didn't die before, then load the driver API
-        LibK_LoadDriverAPI(&Usb, deviceInfo->DriverID);
+        const char *error_message = channels_from_input(prhs[1], channel_list, &no_of_channels);
+        if(error_message != NULL)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt(error_message);
+        }
 
-        // Open device.
-        if(!Usb.Init(&handle, deviceInfo))
+        if(!mxIsEmpty(prhs[2]))
         {
-            errorCode = GetLastError();
-            mexPrintf("dmx.mex::Error code: %d", errorCode);
-            mexErrMsgTxt("dmx.mex::Failed to open device.\n");
+            mwSize lut_length = mxGetNumberOfElements(prhs[2]);
+
+            if((!mxIsDouble(prhs[2]) && !mxIsUint8(prhs[2]) && !mxIsUint16(prhs[2])) || mxIsComplex(prhs[2]) || (lut_length != 256 && lut_length != 65536))
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::The lookup table must be a double, uint8 or uint16 vector, with 256 or 65536 entries.\n");
+            }
+
+            // Find a free curve. Curves used only by the channels we are about to change will be free afterwards,
+            // but let's not be clever about it.
+            for(LONG i = 0; i < MAX_CURVES; i++)
+            {
+                if(curves.curves[i].table == NULL)
+                {
+                    curve_number = i;
+                    break;
+                }
+            }
+
+            if(curve_number < 0)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::There are too many different curves. Set the same curve for many channels in one go.\n");
+            }
+
+            USHORT *table = malloc(lut_length * sizeof(USHORT));
+            if(table == NULL)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::Could not allocate memory for the curve.\n");
+            }
+
+            if(mxIsUint16(prhs[2]))
+                memcpy(table, mxGetData(prhs[2]), lut_length * sizeof(USHORT));
+            else if(mxIsUint8(prhs[2]))
+            {
+                UCHAR *lut_input_pointer = mxGetData(prhs[2]);
+                for(mwSize i = 0; i < lut_length; i++)
+                    table[i] = (USHORT) lut_input_pointer[i] * 257;
+            }
+            else
+            {
+                mxDouble *lut_input_pointer = mxGetData(prhs[2]);
+                for(mwSize i = 0; i < lut_length; i++)
+                {
+                    if(!(lut_input_pointer[i] >= 0 && lut_input_pointer[i] <= 255))
+                    {
+                        free(table);
+                        LstK_Free(deviceList);
+                        mexErrMsgTxt("dmx.mex::The values in the lookup table must be between 0 and 255.\n");
+                    }
+                    table[i] = level_to_16bit(lut_input_pointer[i]);
+                }
+            }
+
+            EnterCriticalSection(&engine_lock);
+            curves.curves[curve_number].table = table;
+            curves.curves[curve_number].shift = (lut_length == 256) ? 8 : 0;
         }
+        else
+            EnterCriticalSection(&engine_lock);
 
-        #ifdef VERBOSE
-        mexPrintf("dmx.mex::Device opened.\n");
-        #endif
+        curves_assign(channel_list, no_of_channels, curve_number);
+        LeaveCriticalSection(&engine_lock);
 
-       /* Send a simple USB request to the uDMX device.
-          I got these from:
-          https://github.com/mirdej/udmx/blob/master/firmware/main.c, line 432, usbFunctionSetup()
-          https://github.com/mirdej/udmx/blob/master/common/uDMX_cmds.h
-          https://github.com/mirdej/udmx/blob/master/commandline/uDMX.c
+        BOOL success;
+        error_message = shadow_flush(deviceList, &success);
 
-            There is a uchar (or uint8) data[8] array to receive the arugment.
-            -Byte 0 is either cmd_setSingleChannel (1) or cmd_setChannelRange (2) or (I don't care about this, but I leave this here for the future) cmd_StartBootloader (248)
+        LstK_Free(deviceList);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
 
-            When data[1] is cmd_setSingleChannel:
-            -data[5..8] is the channel number (0-511) (wIndex) [btw, this is some epic bitbanging, cool]
-            -data[2] is the channel data (0-255) (wValue)
-            -data[3] is to be set to 0, otherwise err_BadValue
+        if(nlhs > 0)
+            plhs[0] = mxCreateLogicalScalar(!success); // fail. :)
+    }
 
 
-            When data[1] is cmd_setChannelRange:
-            -data[4] is start channel (0-511)
-            -data[5] is number of channels (0-511) (wLength)
-                There are sanity checks here, so the channels need to be strictly monotonically increasing
 
-                    After the sanity checks, the usb (legacy libusb-win32) set to usb_ChannelRange (2)
-                    This calls usbFunctionWrite() (line 533), which accepts the uchar data array pointer, and the number of bytes to be transmitted.
-                    There are sanity checks in this one too.
+    /*
+        fail = dmx('set_mode', channels, mode)
+
+        Sets how channels are sent. 'channels' is a vector of addresses, or a cell array of patched parameter names. 'mode' is:
+        -'8bit': the default.
+        -'16bit': the channel is the coarse half of a 16-bit pair, and the next channel is the fine half.
+            Send 0-255 with fractions to the coarse channel, i.e. dmx('send', 100, 127.5) gives 127 and 128.
+            Patched 16-bit parameters are set up like this automatically.
+        -'dither': fractions are rendered by flickering between the two nearest levels from frame to frame,
+            so that the average is right. This only makes sense with the refresh thread, see dmx('start').
+    */
 
-            ..and then, presumably, blast the data raw without any consideration for anything
+    if(!strcmp(stringBuffer, "set_mode"))
+    {
+        ULONG channel_list[512];
+        mwSize no_of_channels;
+        char mode_name[16];
+        UCHAR mode = CHANNEL_8BIT;
+
+        if(nrhs != 3)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::This function needs exactly three arguments.\n");
+        }
+
+        const char *error_message = channels_from_input(prhs[1], channel_list, &no_of_channels);
+        if(error_message != NULL)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt(error_message);
+        }
 
+        if(!mxIsChar(prhs[2]) || mxGetString(prhs[2], mode_name, sizeof(mode_name)))
+            mode_name[0] = 0;
 
+        if(!strcmp(mode_name, "16bit"))
+            mode = CHANNEL_16BIT;
+        else if(!strcmp(mode_name, "dither"))
+            mode = CHANNEL_DITHER;
+        else if(strcmp(mode_name, "8bit"))
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::The mode must be '8bit', '16bit' or 'dither'.\n");
+        }
 
+        for(mwSize i = 0; i < no_of_channels; i++)
+        {
+            if(mode == CHANNEL_16BIT && channel_list[i] == 511)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::Channel 512 can't be the coarse half of a 16-bit pair.\n");
+            }
+        }
 
-            The error codes are stored in reply[0], can can be
-            -0: All OK
-            -1: err_BadChannel (1)
-            -2: err_BadValue (2)
+        EnterCriticalSection(&engine_lock);
+        for(mwSize i = 0; i < no_of_channels; i++)
+            channel_mode_set((USHORT) channel_list[i], mode);
+        channel_modes_update();
+        LeaveCriticalSection(&engine_lock);
 
-            -----------------------------------------------------------------------------------------------------------------------------------------------------
-            this is from uDMX.c, line 156:
-            nBytes = usb_control_msg(handle,
-                                USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-								cmd_SetChannelRange,
-                                argc-2,
-                                channel,
-                                buf,
-                                argc-2,
-                                5000);
+        BOOL success;
+        error_message = shadow_flush(deviceList, &success);
 
-            From libusb-win32's documentation (https://sourceforge.net/p/libusb-win32/wiki/Documentation/)
-            int usb_control_msg(usb_dev_handle *dev,
-                                int requesttype,
-                                int request,
-                                int value,
-                                int index,
-                                char *bytes,
-                                int size,
-                                int timeout);
-                *dev handle is      handle
-                int requestype is   USB_TYPE_VENDOR | USB_RECIP_DEVICE |  USB_ENDPOINT_OUT (note bitwise or here)
-                int request is      cmd_setChannelRange (decimal 2)
-                int value is        index (or rather, indices, the channel numbers to be set)
-                int index is        channel (base channel address)
-                char *bytes         buf, the buffer where the channel data is
-                int size            the number of channels to be set (but for here, it's the length of the buffer)
-                int tmeout          usb request timeout in millisecons, this is libusb-win32 specific.
+        LstK_Free(deviceList);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
 
+        if(nlhs > 0)
+            plhs[0] = mxCreateLogicalScalar(!success); // fail. :)
+    }
 
 
 
-            So to change channel 100, 101, 102, 103; (4 channels, base address is 100)
-            uchar channel_data[5] = [255, 0, 255, 0, 0];
-            Arguments:
-                -opcode (decimal 2)
-                -no_of_channels
-                -start_address
-                -the data to be send
-                -Length of data buffer, which corresponds to the number of channels
+    /*
+        dmx('start', [refresh_rate])
 
-            In here, we need to send data to the device. the first three arguments are processed by usbFunctionSetup(),
-            ..and the last two arguments are processed by usbFunctionWrite()
+        Opens the device (or uses the simulator), and starts a background thread that sends a frame 'refresh_rate' times
+        a second (default is 44). Only the channels that changed are sent. While this is running, dmx('send'), dmx('set')
+        and the rest only update our copy of the universe, and return straight away. This is needed for dithering.
+    */
 
-            usb_send_somehow(cmd_setChannelRange, 4, 100, 4);
+    if(!strcmp(stringBuffer, "start"))
+    {
+        double refresh_rate = REFRESH_DEFAULT_RATE;
 
-            usb_send_somehow(channel_data)
+        LstK_Free(deviceList);
 
+        if(nrhs > 2)
+            mexErrMsgTxt("dmx.mex::This function needs at most two arguments.\n");
 
+        if(nrhs == 2)
+        {
+            if(!mxIsNumeric(prhs[1]) || mxGetNumberOfElements(prhs[1]) != 1)
+                mexErrMsgTxt("dmx.mex::The refresh rate must be a number, in Hz.\n");
 
-       */
+            refresh_rate = mxGetScalar(prhs[1]);
+            if(!(refresh_rate >= 1 && refresh_rate <= 1000))
+                mexErrMsgTxt("dmx.mex::The refresh rate must be between 1 and 1000 Hz.\n");
+        }
 
-        // Some test data.
-        UCHAR opcode = cmd_SetChannelRange;
-        USHORT no_of_channels = 5;
-        USHORT start_address = 99; // Address 100 onwards! (off by 1 error)
-        UCHAR data_to_be_sent[] = {10, 255, 255, 0, 0}; // DIM, R, G, B, STROBE
+        const char *error_message = session_start(refresh_rate);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+    }
 
 
-        /*
-            All these could probably go in a function for portability.
-            Source: https://github.com/mcuee/libusbk/blob/master/libusbK/examples/examples.c, line 244
-            Source: https://github.com/mcuee/libusbk/blob/master/libusbK/includes/libusbk.h, line 120
-        */
 
-        DWORD transferred = 0;
-	    BOOL success;
-	    WINUSB_SETUP_PACKET Pkt;
-	    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+    /*
+        [frames, failed_transfers] = dmx('stop')
 
-        memset(&Pkt, 0, sizeof(Pkt));
-        defPkt->BmRequest.Dir	= 0; // This should be BMREQUEST_DIR_HOST_TO_DEVICE
-        defPkt->BmRequest.Type	= 2; // This should be BMREQUEST_TYPE_VENDOR
-        defPkt->Request			= (UCHAR) cmd_SetChannelRange;
-        defPkt->Value			= (UINT) no_of_channels;
-        defPkt->Index			= start_address;
-        defPkt->Length			= no_of_channels;
+        Stops the refresh thread (and the bridge, if it's running), and closes the device.
+        Returns the number of frames, and the number of transfers that failed while it was running.
+    */
 
+    if(!strcmp(stringBuffer, "stop"))
+    {
+        LstK_Free(deviceList);
 
-        mexPrintf("dmx.mex::Sending data to the device.\n");
-        /*
-            BOOL __stdcall UsbK_ControlTransfer(KUSB_HANDLE InterfaceHandle,
-                                                WINUSB_SETUP_PACKET SetupPacket,
-                                                PUCHAR Buffer,
-                                                UINT BufferLength,
-                                                PUINT LengthTransferred,
-                                                LPOVERLAPPED Overlapped)
+        bridge_stop(); // It has nowhere to send to without the refresh thread.
+        session_stop();
 
-        */
+        plhs[0] = mxCreateDoubleScalar((double) session.frames);
+        if(nlhs > 1)
+            plhs[1] = mxCreateDoubleScalar((double) session.failed_transfers);
+    }
 
-        success = UsbK_ControlTransfer(handle, Pkt, data_to_be_sent, no_of_channels, &transferred, NULL);
 
-        mexPrintf("dmx.mex::Transferred %d Bytes.\n", transferred);
 
-        // All done, clean up.
-        mexPrintf("dmx.mex::Cleaning up..\n");
-        Usb.Free(handle);
-        LstK_Free(deviceList);
+    /*
+        effect_id = dmx('effect', type, channels, frequency, [low, high], [spread], [width])
+        dmx('effect', 'stop', [effect_ids])
+
+        Binds an effect to 'channels' (addresses, or patched parameter names), and returns its number.
+        'type' is 'sine', 'chase', 'strobe' or 'noise'. 'frequency' is in Hz, 'low' and 'high' are levels (0-255, default is 0 and 255).
+        'spread' shifts the phase of the channels along the list, by this many periods in total (default is 1 for chases, 0 otherwise).
+        'width' is the part of the period chases and strobes are on for (default is one channel's worth for chases, and 0.5 for strobes).
+        The effects are calculated in the refresh thread, so they only run after dmx('start').
+        dmx('effect', 'stop') stops the effects listed, or all of them. The channels keep the last level they had.
+    */
 
+    if(!strcmp(stringBuffer, "effect"))
+    {
+        char effect_name[16];
+        UCHAR type = 0;
 
+        LstK_Free(deviceList);
 
+        if(nrhs < 2 || !mxIsChar(prhs[1]) || mxGetString(prhs[1], effect_name, sizeof(effect_name)))
+            mexErrMsgTxt("dmx.mex::The second argument must be 'sine', 'chase', 'strobe', 'noise' or 'stop'.\n");
 
-        plhs[0] = mxCreateLogicalScalar(!success); // fail. :)
-    }
+        if(!strcmp(effect_name, "stop"))
+        {
+            if(nrhs > 3)
+                mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
+
+            if(nrhs == 3)
+            {
+                if(!mxIsDouble(prhs[2]) || mxIsComplex(prhs[2]))
+                    mexErrMsgTxt("dmx.mex::The effect numbers must be a vector of doubles.\n");
+
+                mxDouble *effect_ids_input_pointer = mxGetData(prhs[2]);
+                for(mwSize i = 0; i < mxGetNumberOfElements(prhs[2]); i++)
+                {
+                    if(effect_ids_input_pointer[i] < 1 || effect_ids_input_pointer[i] > EFFECT_MAX || effect_ids_input_pointer[i] != (int) effect_ids_input_pointer[i])
+                        mexErrMsgTxt("dmx.mex::The effect numbers are the ones dmx('effect') returned.\n");
+                }
+
+                EnterCriticalSection(&engine_lock);
+                for(mwSize i = 0; i < mxGetNumberOfElements(prhs[2]); i++)
+                    effect_remove((int) effect_ids_input_pointer[i] - 1);
+                LeaveCriticalSection(&engine_lock);
+            }
+            else
+            {
+                EnterCriticalSection(&engine_lock);
+                for(int slot = 0; slot < EFFECT_MAX; slot++)
+                    effect_remove(slot);
+                LeaveCriticalSection(&engine_lock);
+            }
+            return;
+        }
 
+        if(!strcmp(effect_name, "sine"))
+            type = EFFECT_SINE;
+        else if(!strcmp(effect_name, "chase"))
+            type = EFFECT_CHASE;
+        else if(!strcmp(effect_name, "strobe"))
+            type = EFFECT_STROBE;
+        else if(!strcmp(effect_name, "noise"))
+            type = EFFECT_NOISE;
+        else
+            mexErrMsgTxt("dmx.mex::The second argument must be 'sine', 'chase', 'strobe', 'noise' or 'stop'.\n");
 
-    /*
-        dmx('inputtest')
+        if(nrhs < 4 || nrhs > 8 || nrhs == 5)
+            mexErrMsgTxt("dmx.mex::This function needs four, six, seven or eight arguments.\n");
 
-        This one checks the input arguments:
-        -'addresses' are the addresses to be changed in the DMX frame (1-512)
-        -'data_values' are the bytes that are to be assinged to the addresses (0-255)
+        ULONG channel_list[512];
+        mwSize no_of_channels;
+        const char *error_message = channels_from_input(prhs[2], channel_list, &no_of_channels);
+        if(error_message != NULL)
+            mexErrMsgTxt(error_message);
+        if(no_of_channels == 0)
+            mexErrMsgTxt("dmx.mex::An effect needs at least one channel.\n");
 
-        Each input is a vector. The addresses must be strictly monotonically increasing.
-        The number of addresses must match with the number of data values.
+        for(int i = 3; i < nrhs; i++)
+        {
+            if(!mxIsNumeric(prhs[i]) || mxIsComplex(prhs[i]) || mxGetNumberOfElements(prhs[i]) != 1)
+                mexErrMsgTxt("dmx.mex::The frequency, the levels, the spread and the width must be real numbers.\n");
+        }
 
-        I just used this bit for developing the sanity chesks for dmx('send', ...).
-        Just in casem I keep this here.
+        double frequency = mxGetScalar(prhs[3]);
+        if(!(frequency > 0 && frequency <= 1000))
+            mexErrMsgTxt("dmx.mex::The frequency must be more than 0, and at most 1000 Hz.\n");
 
-    */
+        double low = 0, high = 255;
+        if(nrhs >= 6)
+        {
+            low = mxGetScalar(prhs[4]);
+            high = mxGetScalar(prhs[5]);
+            if(!(low >= 0 && low <= 255 && high >= 0 && high <= 255))
+                mexErrMsgTxt("dmx.mex::The levels must be between 0 and 255.\n");
+        }
+
+        double spread = (type == EFFECT_CHASE) ? 1.0 : 0.0;
+        if(nrhs >= 7)
+        {
+            spread = mxGetScalar(prhs[6]);
+            if(!(spread >= -1 && spread <= 1))
+                mexErrMsgTxt("dmx.mex::The spread must be between -1 and 1 periods.\n");
+        }
 
-    if(!strcmp(stringBuffer, "inputtest"))
-    {
-        // Create some sanity checks on the input arguments.
+        double width = (type == EFFECT_CHASE) ? 1.0 / no_of_channels : 0.5;
+        if(nrhs == 8)
+        {
+            width = mxGetScalar(prhs[7]);
+            if(!(width >= 0 && width <= 1))
+                mexErrMsgTxt("dmx.mex::The width must be between 0 and 1.\n");
+        }
 
-        if(nrhs != 3)
-            mexErrMsgTxt("dmx.mex::This function needs exactly three arguments.\n");
+        EnterCriticalSection(&engine_lock);
+        int slot = effect_add(type, channel_list, (USHORT) no_of_channels, frequency, level_to_16bit(low), level_to_16bit(high), spread, width);
+        LeaveCriticalSection(&engine_lock);
 
-        // Check if the inputs are numeric arrays.
-        if(!mxIsNumeric(prhs[1]))
-            mexErrMsgTxt("dmx.mex::Addresses must be numbers.\n");
+        if(slot < 0)
+            mexErrMsgTxt("dmx.mex::All the effect slots are used. Stop some with dmx('effect', 'stop', effect_ids).\n");
 
-        if(!mxIsNumeric(prhs[2]))
-            mexErrMsgTxt("dmx.mex::Data values must be numbers.\n");
+        plhs[0] = mxCreateDoubleScalar(slot + 1);
+    }
 
-        // Check dimensions of the address array
-        if(mxGetNumberOfDimensions(prhs[1]) > 2)
-            mexErrMsgTxt("dmx.mex::Addresses must be packed into a vector.\n");
 
-        // Check dimensions of the data array
-        if(mxGetNumberOfDimensions(prhs[2]) > 2)
-            mexErrMsgTxt("dmx.mex::Data values must be packed into a vector.\n");
 
-        // Get the dimensions of each array
-        mwSize no_of_elements_address, no_of_elements_data;
-        no_of_elements_address = mxGetNumberOfElements(prhs[1]);
-        no_of_elements_data = mxGetNumberOfElements(prhs[2]);
+    /*
+        dmx('sync', enable, [frame_period_ms])
+        stats = dmx('sync')
+
+        Enables or disables locking the refresh thread to the frame clock of the uDMX. 'frame_period_ms' is where the estimate
+        starts from, the default is 22.676 ms (a full DMX512 frame). This can only be changed while the refresh thread is stopped.
+        Called without arguments, it returns what the loop measured: whether it's locked, the frame period, the RMS and the last
+        phase error in milliseconds, and how many transfers it saw, how many of them told it where a boundary was,
+        and how many transfers with data ran over a boundary.
+    */
 
-        if(no_of_elements_address != no_of_elements_data)
-            mexErrMsgTxt("dmx.mex::The address and data array do not have the same number of elements.\n");
+    if(!strcmp(stringBuffer, "sync"))
+    {
+        LstK_Free(deviceList);
 
-        if(no_of_elements_address > 512)
-            mexErrMsgTxt("dmx.mex::You only can have 512 elements in a DMX512 frame.\n");
+        if(nrhs == 1)
+        {
+            const char *field_names[] = {"enabled", "locked", "period_ms", "phase_error_ms", "last_phase_error_ms", "transfers", "observations", "split_transfers"};
+            double ticks_to_ms = (qpc_frequency != 0) ? 1000.0 / (double) qpc_frequency : 0;
+
+            plhs[0] = mxCreateStructMatrix(1, 1, 8, field_names);
+            mxSetField(plhs[0], 0, "enabled", mxCreateLogicalScalar(frame_sync.enabled));
+            mxSetField(plhs[0], 0, "locked", mxCreateLogicalScalar(frame_sync.locked));
+            mxSetField(plhs[0], 0, "period_ms", mxCreateDoubleScalar((qpc_frequency != 0) ? frame_sync.period * ticks_to_ms : frame_sync.nominal_period_us / 1000.0));
+            mxSetField(plhs[0], 0, "phase_error_ms", mxCreateDoubleScalar(sqrt(frame_sync.phase_error_square) * ticks_to_ms));
+            mxSetField(plhs[0], 0, "last_phase_error_ms", mxCreateDoubleScalar(frame_sync.phase_error * ticks_to_ms));
+            mxSetField(plhs[0], 0, "transfers", mxCreateDoubleScalar(frame_sync.no_of_transfers));
+            mxSetField(plhs[0], 0, "observations", mxCreateDoubleScalar(frame_sync.no_of_observations));
+            mxSetField(plhs[0], 0, "split_transfers", mxCreateDoubleScalar(frame_sync.split_transfers));
+            return;
+        }
 
+        if(nrhs > 3)
+            mexErrMsgTxt("dmx.mex::This function needs at most three arguments.\n");
 
-        // Check if the input arrays are empty.
-        if(mxIsEmpty(prhs[1]))
-            mexErrMsgTxt("dmx.mex::Addresses must not be empty.");
+        if(!mxIsNumeric(prhs[1]) && !mxIsLogical(prhs[1]))
+            mexErrMsgTxt("dmx.mex::The frame sync can be enabled with true, and disabled with false.\n");
 
-        if(mxIsEmpty(prhs[2]))
-            mexErrMsgTxt("dmx.mex::Data values must not be empty.");
+        double nominal_period_us = SYNC_NOMINAL_PERIOD_US;
+        if(nrhs == 3)
+        {
+            if(!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1 || !(mxGetScalar(prhs[2]) >= 1 && mxGetScalar(prhs[2]) <= 1000))
+                mexErrMsgTxt("dmx.mex::The frame period must be between 1 and 1000 ms.\n");
+            nominal_period_us = mxGetScalar(prhs[2]) * 1000.0;
+        }
 
-        // Are we getting vectors?
-        size_t addresses_no_of_rows = mxGetM(prhs[1]);
-        size_t addresses_no_of_columns = mxGetN(prhs[1]);
-        size_t data_values_no_of_rows = mxGetM(prhs[2]);
-        size_t data_values_no_of_columns = mxGetN(prhs[2]);
-        #ifdef VERBOSE
-        mexPrintf("dmx.mex::Addresses have %d rows and %d columns,\nData values have %d rows and %d columns.\n", addresses_no_of_rows, addresses_no_of_columns, data_values_no_of_rows, data_values_no_of_columns);
-        #endif
+        if(session.running)
+            mexErrMsgTxt("dmx.mex::The frame sync can't be changed while the refresh thread is running. Call dmx('stop') first.\n");
 
-        if(addresses_no_of_rows != 1 && addresses_no_of_columns != 1)
-            mexErrMsgTxt("dmx.mex::The addresses must be in a vector.\n");
+        sync_reset(nominal_period_us);
+        frame_sync.enabled = (mxGetScalar(prhs[1]) != 0);
+    }
 
-        if(data_values_no_of_rows != 1 && data_values_no_of_columns != 1)
-            mexErrMsgTxt("dmx.mex::The data valaues must be in a vector.\n");
 
 
-        USHORT addresses_converted[512];
-        UCHAR data_values_converted[512];
+    /*
+        dmx('config', name, value, ...)
+        config = dmx('config')
+
+        Settings for the refresh thread and the transfers, as name-value pairs. They can't be changed while the refresh
+        thread is running, the thread settings take effect with the next dmx('start').
+        'priority' is 'normal', 'above_normal', 'highest' or 'time_critical'.
+        'affinity' is a vector of CPU numbers (starting from 0) the thread may run on, [] lets Windows decide.
+        'timer_resolution' is in ms (1-15), this is how often Windows wakes up sleeping threads while the refresh thread runs.
+        0 leaves it alone.
+        'mmcss' is an MMCSS task name, such as 'Pro Audio' or 'Games'. '' doesn't use MMCSS.
+        'pipeline_chunk' is the number of channels in one transfer when a range is pipelined (8-512), 0 turns the pipeline off.
+        'pipeline_window' is how many transfers can be in flight at the same time (1-16).
+        'pipeline_order' is 'ascending' or 'descending', the order the chunks of a range go in.
+        Called without arguments, it returns the settings, whether MMCSS accepted the thread, the CPU the last transfer was
+        issued from, and how late the transfers were issued, compared to when they were due: the mean, the standard
+        deviation (the jitter), the 99th percentile and the worst, in ms.
+    */
 
-        mxDouble *addresses_input_pointer = mxGetData(prhs[1]);
-        mxDouble *data_values_input_pointer = mxGetData(prhs[2]);
+    if(!strcmp(stringBuffer, "config"))
+    {
+        LstK_Free(deviceList);
 
-        // Is the list of addresses in strictly monotonically increasing order?
-        for(unsigned int i = 1; i<no_of_elements_address; i++)
+        if(nrhs == 1)
         {
-            if(addresses_input_pointer[i] - addresses_input_pointer[i-1] != 1)
-                mexErrMsgTxt("dmx.mex::The addresses must increase one by one.\n");
-
+            const char *field_names[] = {"priority", "affinity", "timer_resolution_ms", "mmcss", "mmcss_active", "cpu",
+                "issues", "issue_late_ms", "issue_jitter_ms", "issue_late_p99_ms", "issue_late_max_ms",
+                "pipeline_chunk", "pipeline_window", "pipeline_order"};
+            double ticks_to_ms = (qpc_frequency != 0) ? 1000.0 / (double) qpc_frequency : 0;
+            double mean = (worker.no_of_issues != 0) ? worker.issue_late_sum / worker.no_of_issues : 0;
+            double variance = (worker.no_of_issues != 0) ? worker.issue_late_square_sum / worker.no_of_issues - mean * mean : 0;
+            const char *priority_name = "normal";
+            mwSize no_of_cpus = 0;
+
+            if(worker.priority == THREAD_PRIORITY_ABOVE_NORMAL)
+                priority_name = "above_normal";
+            else if(worker.priority == THREAD_PRIORITY_HIGHEST)
+                priority_name = "highest";
+            else if(worker.priority == THREAD_PRIORITY_TIME_CRITICAL)
+                priority_name = "time_critical";
+
+            for(unsigned int cpu = 0; cpu < sizeof(DWORD_PTR) * 8; cpu++)
+                no_of_cpus += (worker.affinity_mask >> cpu) & 1;
+            mxArray *affinity = mxCreateDoubleMatrix(1, no_of_cpus, mxREAL);
+            mxDouble *affinity_pointer = mxGetData(affinity);
+            for(unsigned int cpu = 0; cpu < sizeof(DWORD_PTR) * 8; cpu++)
+            {
+                if((worker.affinity_mask >> cpu) & 1)
+                    *affinity_pointer++ = cpu;
+            }
+
+            plhs[0] = mxCreateStructMatrix(1, 1, 14, field_names);
+            mxSetField(plhs[0], 0, "priority", mxCreateString(priority_name));
+            mxSetField(plhs[0], 0, "affinity", affinity);
+            mxSetField(plhs[0], 0, "timer_resolution_ms", mxCreateDoubleScalar(worker.timer_resolution_ms));
+            mxSetField(plhs[0], 0, "mmcss", mxCreateString(worker.mmcss_task));
+            mxSetField(plhs[0], 0, "mmcss_active", mxCreateLogicalScalar(worker.mmcss_active));
+            mxSetField(plhs[0], 0, "cpu", mxCreateDoubleScalar(worker.cpu));
+            mxSetField(plhs[0], 0, "issues", mxCreateDoubleScalar(worker.no_of_issues));
+            mxSetField(plhs[0], 0, "issue_late_ms", mxCreateDoubleScalar(mean * ticks_to_ms));
+            mxSetField(plhs[0], 0, "issue_jitter_ms", mxCreateDoubleScalar(sqrt(max(variance, 0)) * ticks_to_ms));
+            mxSetField(plhs[0], 0, "issue_late_p99_ms", mxCreateDoubleScalar(worker_issue_percentile(0.99)));
+            mxSetField(plhs[0], 0, "issue_late_max_ms", mxCreateDoubleScalar(worker.issue_late_max * ticks_to_ms));
+            mxSetField(plhs[0], 0, "pipeline_chunk", mxCreateDoubleScalar(pipeline.chunk_size));
+            mxSetField(plhs[0], 0, "pipeline_window", mxCreateDoubleScalar(pipeline.window));
+            mxSetField(plhs[0], 0, "pipeline_order", mxCreateString((pipeline.order == PIPELINE_DESCENDING) ? "descending" : "ascending"));
+            return;
         }
 
-        //Copy the arrays over while casting them to the required format.
-        for(unsigned int i = 0; i<no_of_elements_address; i++)
+        if(nrhs % 2 == 0)
+            mexErrMsgTxt("dmx.mex::The settings are name-value pairs.\n");
+
+        if(session.running)
+            mexErrMsgTxt("dmx.mex::The settings can't be changed while the refresh thread is running. Call dmx('stop') first.\n");
+
+        // Check everything first, so a mistake doesn't leave half of the settings changed.
+        int priority = worker.priority;
+        DWORD_PTR affinity_mask = worker.affinity_mask;
+        UINT timer_resolution_ms = worker.timer_resolution_ms;
+        char mmcss_task[WORKER_MAX_MMCSS_TASK];
+        strcpy(mmcss_task, worker.mmcss_task);
+        USHORT pipeline_chunk = pipeline.chunk_size;
+        ULONG pipeline_window = pipeline.window;
+        UCHAR pipeline_order = pipeline.order;
+
+        for(int i = 1; i < nrhs; i += 2)
         {
-            // In this loop, we fetch the input data, and cast it before saving.
-            #ifdef VERBOSE
-            mexPrintf("%d: Addr: %d; Data: %d.\n", i, (USHORT) addresses_input_pointer[i], (UCHAR) data_values_input_pointer[i]);
-            #endif
-            addresses_converted[i] = (USHORT) addresses_input_pointer[i] -1; // off-by-one error: the dongle expects [0-511], reality expects [1-512].
-            data_values_converted[i] = (UCHAR) data_values_input_pointer[i];
+            char setting_name[32];
+
+            if(!mxIsChar(prhs[i]) || mxGetString(prhs[i], setting_name, sizeof(setting_name)))
+                mexErrMsgTxt("dmx.mex::The settings are 'priority', 'affinity', 'timer_resolution', 'mmcss', 'pipeline_chunk', 'pipeline_window' and 'pipeline_order'.\n");
+
+            if(!strcmp(setting_name, "priority"))
+            {
+                char priority_name[16];
+
+                if(!mxIsChar(prhs[i + 1]) || mxGetString(prhs[i + 1], priority_name, sizeof(priority_name)))
+                    mexErrMsgTxt("dmx.mex::The priority must be 'normal', 'above_normal', 'highest' or 'time_critical'.\n");
+
+                if(!strcmp(priority_name, "normal"))
+                    priority = THREAD_PRIORITY_NORMAL;
+                else if(!strcmp(priority_name, "above_normal"))
+                    priority = THREAD_PRIORITY_ABOVE_NORMAL;
+                else if(!strcmp(priority_name, "highest"))
+                    priority = THREAD_PRIORITY_HIGHEST;
+                else if(!strcmp(priority_name, "time_critical"))
+                    priority = THREAD_PRIORITY_TIME_CRITICAL;
+                else
+                    mexErrMsgTxt("dmx.mex::The priority must be 'normal', 'above_normal', 'highest' or 'time_critical'.\n");
+            }
+            else if(!strcmp(setting_name, "affinity"))
+            {
+                DWORD_PTR process_mask, system_mask;
+
+                if(!mxIsDouble(prhs[i + 1]) || mxIsComplex(prhs[i + 1]))
+                    mexErrMsgTxt("dmx.mex::The affinity must be a vector of CPU numbers.\n");
+
+                if(!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+                    process_mask = ~(DWORD_PTR) 0;
+
+                affinity_mask = 0;
+                mxDouble *cpu_input_pointer = mxGetData(prhs[i + 1]);
+                for(mwSize j = 0; j < mxGetNumberOfElements(prhs[i + 1]); j++)
+                {
+                    if(!(cpu_input_pointer[j] >= 0 && cpu_input_pointer[j] < sizeof(DWORD_PTR) * 8) || cpu_input_pointer[j] != (int) cpu_input_pointer[j])
+                        mexErrMsgTxt("dmx.mex::The CPU numbers must be integers between 0 and 63.\n");
+                    affinity_mask |= (DWORD_PTR) 1 << (int) cpu_input_pointer[j];
+                }
+
+                if((affinity_mask & ~process_mask) != 0)
+                    mexErrMsgTxt("dmx.mex::Matlab is not allowed to run on some of these CPUs.\n");
+            }
+            else if(!strcmp(setting_name, "timer_resolution"))
+            {
+                if(!mxIsNumeric(prhs[i + 1]) || mxGetNumberOfElements(prhs[i + 1]) != 1)
+                    mexErrMsgTxt("dmx.mex::The timer resolution must be a number, in ms.\n");
+
+                double timer_resolution_input = mxGetScalar(prhs[i + 1]);
+                if(!(timer_resolution_input >= 0 && timer_resolution_input <= 15) || timer_resolution_input != (int) timer_resolution_input)
+                    mexErrMsgTxt("dmx.mex::The timer resolution must be a whole number of ms, between 1 and 15, or 0 to leave it alone.\n");
+                timer_resolution_ms = (UINT) timer_resolution_input;
+            }
+            else if(!strcmp(setting_name, "mmcss"))
+            {
+                if(!mxIsChar(prhs[i + 1]) || mxGetString(prhs[i + 1], mmcss_task, sizeof(mmcss_task)))
+                    mexErrMsgTxt("dmx.mex::The MMCSS task must be a name, such as 'Pro Audio', or ''.\n");
+            }
+            else if(!strcmp(setting_name, "pipeline_chunk"))
+            {
+                if(!mxIsNumeric(prhs[i + 1]) || mxGetNumberOfElements(prhs[i + 1]) != 1)
+                    mexErrMsgTxt("dmx.mex::The pipeline chunk must be a number of channels.\n");
+
+                double chunk_input = mxGetScalar(prhs[i + 1]);
+                if(!(chunk_input == 0 || (chunk_input >= 8 && chunk_input <= 512)) || chunk_input != (int) chunk_input)
+                    mexErrMsgTxt("dmx.mex::The pipeline chunk must be a whole number of channels, between 8 and 512, or 0 to turn the pipeline off.\n");
+                pipeline_chunk = (USHORT) chunk_input;
+            }
+            else if(!strcmp(setting_name, "pipeline_window"))
+            {
+                if(!mxIsNumeric(prhs[i + 1]) || mxGetNumberOfElements(prhs[i + 1]) != 1)
+                    mexErrMsgTxt("dmx.mex::The pipeline window must be a number of transfers.\n");
+
+                double window_input = mxGetScalar(prhs[i + 1]);
+                if(!(window_input >= 1 && window_input <= PIPELINE_MAX_WINDOW) || window_input != (int) window_input)
+                    mexErrMsgTxt("dmx.mex::The pipeline window must be a whole number of transfers, between 1 and 16.\n");
+                pipeline_window = (ULONG) window_input;
+            }
+            else if(!strcmp(setting_name, "pipeline_order"))
+            {
+                char order_name[16];
+
+                if(!mxIsChar(prhs[i + 1]) || mxGetString(prhs[i + 1], order_name, sizeof(order_name)))
+                    mexErrMsgTxt("dmx.mex::The pipeline order must be 'ascending' or 'descending'.\n");
+
+                if(!strcmp(order_name, "ascending"))
+                    pipeline_order = PIPELINE_ASCENDING;
+                else if(!strcmp(order_name, "descending"))
+                    pipeline_order = PIPELINE_DESCENDING;
+                else
+                    mexErrMsgTxt("dmx.mex::The pipeline order must be 'ascending' or 'descending'.\n");
+            }
+            else
+                mexErrMsgTxt("dmx.mex::The settings are 'priority', 'affinity', 'timer_resolution', 'mmcss', 'pipeline_chunk', 'pipeline_window' and 'pipeline_order'.\n");
         }
 
+        worker.priority = priority;
+        worker.affinity_mask = affinity_mask;
+        worker.timer_resolution_ms = timer_resolution_ms;
+        strcpy(worker.mmcss_task, mmcss_task);
+        pipeline.chunk_size = pipeline_chunk;
+        pipeline.window = pipeline_window;
+        pipeline.order = pipeline_order;
+    }
 
-        // Add the offset.
-        USHORT start_address = addresses_converted[0];
-        USHORT end_address = addresses_converted[no_of_elements_address - 1];
-        USHORT no_of_channels = end_address - start_address;
 
 
-        #ifdef VERBOSE
-        mexPrintf("dmx.mex::All sanity checks passed, showing converted address range: %03d - %03d = %d\n", end_address, start_address, no_of_channels);
-        #endif
+    /*
+        error = dmx('last_error')
+        dmx('last_error', 'clear')
+
+        Returns the last error that was recorded: what kind it was ('code', 0 is none, 1 is a wrong argument, 2 is no device,
+        3 is a failed transfer), an 'identifier' for Matlab's MException, the 'message', the 'command' it came from
+        ('refresh' is the refresh thread), the Windows error code if there was one, when it happened (in seconds
+        on the performance counter), and how many errors there were since dmx('start').
+        While the refresh thread is running, dmx('send') and dmx('set') don't throw, they return 'fail', and record the
+        error here. The failed transfers are always recorded.
+    */
 
-        // Check the work: dmx('inputtest', [100, 101, 102, 103, 104, 105], [255, 255; 255, 255; 0, 0]);
+    if(!strcmp(stringBuffer, "last_error"))
+    {
+        LstK_Free(deviceList);
 
+        if(nrhs == 2)
+        {
+            char option[8];
 
-    }
+            if(!mxIsChar(prhs[1]) || mxGetString(prhs[1], option, sizeof(option)) || strcmp(option, "clear"))
+                mexErrMsgTxt("dmx.mex::The only option is 'clear'.\n");
 
+            EnterCriticalSection(&engine_lock);
+            memset(&last_error, 0, sizeof(last_error));
+            LeaveCriticalSection(&engine_lock);
+            return;
+        }
 
+        if(nrhs > 2)
+            mexErrMsgTxt("dmx.mex::This function needs at most two arguments.\n");
+
+        const char *field_names[] = {"code", "identifier", "message", "command", "system_error", "time", "count"};
+        const char *identifiers[] = {"dmx:none", "dmx:argument", "dmx:device", "dmx:transfer"};
+
+        // Copy it first, so the refresh thread can't change it halfway through.
+        EnterCriticalSection(&engine_lock);
+        LONG code = last_error.code;
+        DWORD system_error = last_error.system_error;
+        LONGLONG timestamp = last_error.timestamp;
+        ULONG no_of_errors = last_error.no_of_errors;
+        char command[sizeof(last_error.command)], message[sizeof(last_error.message)];
+        strcpy(command, last_error.command);
+        strcpy(message, last_error.message);
+        LeaveCriticalSection(&engine_lock);
+
+        plhs[0] = mxCreateStructMatrix(1, 1, 7, field_names);
+        mxSetField(plhs[0], 0, "code", mxCreateDoubleScalar(code));
+        mxSetField(plhs[0], 0, "identifier", mxCreateString(identifiers[code]));
+        mxSetField(plhs[0], 0, "message", mxCreateString(message));
+        mxSetField(plhs[0], 0, "command", mxCreateString(command));
+        mxSetField(plhs[0], 0, "system_error", mxCreateDoubleScalar(system_error));
+        mxSetField(plhs[0], 0, "time", mxCreateDoubleScalar((qpc_frequency != 0) ? (double) timestamp / qpc_frequency : 0));
+        mxSetField(plhs[0], 0, "count", mxCreateDoubleScalar(no_of_errors));
+    }
 
-    /*
-        dmx('send')
 
-        This one checks the input arguments:
-        -'addresses' are the addresses to be changed in the DMX frame (1-512)
-        -'data_values' are the bytes that are to be assinged to the addresses (0-255)
 
-        Each input is a vector. The addresses must be strictly monotonically increasing.
-        The number of addresses must match with the number of data values.
+    /*
+        tuning = dmx('probe')
+        dmx('probe', 'clear')
+
+        Measures how long transfers of 1-512 channels take on the device (or the simulator), and works out the largest
+        transfer that gets a universe out the quickest, and the gap needed between two transfers. Every transfer sends
+        what the device has anyway, so nothing changes on the bus. The result is kept for this device, and from then on,
+        longer ranges are split into transfers of this size. Returns the device's InstanceID, the sizes, the median
+        latency for each (NaN if it didn't work), the chunk size and the gap, and the latency of cmd_SetSingleChannel
+        (NaN if the device didn't take it, then single channels go with cmd_SetChannelRange).
+        dmx('probe', 'clear') forgets all devices, so everything goes in one transfer again.
     */
 
-    if(!strcmp(stringBuffer, "send"))
+    if(!strcmp(stringBuffer, "probe"))
     {
-        /*
-            The Sanity check and data preparation stuff
-        */
+        UCHAR output[512];
 
-        if(nrhs != 3)
-            mexErrMsgTxt("dmx.mex::This function needs exactly three arguments.\n");
+        if(nrhs > 2)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::This function needs at most two arguments.\n");
+        }
 
-        // Check if the inputs are numeric arrays.
-        if(!mxIsNumeric(prhs[1]))
-            mexErrMsgTxt("dmx.mex::Addresses must be numbers.\n");
+        if(nrhs == 2)
+        {
+            char option[8];
 
-        if(!mxIsNumeric(prhs[2]))
-            mexErrMsgTxt("dmx.mex::Data values must be numbers.\n");
+            LstK_Free(deviceList);
+            if(!mxIsChar(prhs[1]) || mxGetString(prhs[1], option, sizeof(option)) || strcmp(option, "clear"))
+                mexErrMsgTxt("dmx.mex::The only option is 'clear'.\n");
 
-        // Check dimensions of the address array
-        if(mxGetNumberOfDimensions(prhs[1]) > 2)
-            mexErrMsgTxt("dmx.mex::Addresses must be packed into a vector.\n");
+            if(session.running)
+                mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
 
-        // Check dimensions of the data array
-        if(mxGetNumberOfDimensions(prhs[2]) > 2)
-            mexErrMsgTxt("dmx.mex::Data values must be packed into a vector.\n");
+            memset(&tuning.devices, 0, sizeof(tuning.devices));
+            tuning.no_of_devices = 0;
+            tuning.next_slot = 0;
+            tuning.open_device = NULL;
+            return;
+        }
 
-        // Get the dimensions of each array
-        mwSize no_of_elements_address, no_of_elements_data;
-        no_of_elements_address = mxGetNumberOfElements(prhs[1]);
-        no_of_elements_data = mxGetNumberOfElements(prhs[2]);
+        if(session.running)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+        }
 
-        if(no_of_elements_address != no_of_elements_data)
-            mexErrMsgTxt("dmx.mex::The address and data array do not have the same number of elements.\n");
+        if(!simulator.enabled && daemon.shm != NULL)
+            mexErrMsgTxt("dmx.mex::The daemon has the device. Call dmx('daemon', false) first.\n");
 
-        if(no_of_elements_address > 512)
-            mexErrMsgTxt("dmx.mex::You only can have 512 elements in a DMX512 frame.\n");
+        if(!simulator.enabled && net.only)
+            mexErrMsgTxt("dmx.mex::There is no uDMX, only the network. Call dmx('artnet', false) or dmx('sacn', false) first.\n");
 
+        if(!simulator.enabled)
+        {
+            const char *error_message = udmx_open(deviceList, &handle);
+            if(error_message != NULL)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt(error_message);
+            }
+        }
 
-        // Check if the input arrays are empty.
-        if(mxIsEmpty(prhs[1]))
-            mexErrMsgTxt("dmx.mex::Addresses must not be empty.");
+        // Whatever the device should have now, so the probes don't change anything.
+        EnterCriticalSection(&engine_lock);
+        output_render(0, 511, output);
+        LeaveCriticalSection(&engine_lock);
 
-        if(mxIsEmpty(prhs[2]))
-            mexErrMsgTxt("dmx.mex::Data values must not be empty.");
+        const transfer_tuning *device_tuning = tuning_probe(handle, simulator.enabled ? TUNING_SIMULATOR_ID : tuning.open_instance_id, output);
 
-        // Are we getting vectors?
-        size_t addresses_no_of_rows = mxGetM(prhs[1]);
-        size_t addresses_no_of_columns = mxGetN(prhs[1]);
-        size_t data_values_no_of_rows = mxGetM(prhs[2]);
-        size_t data_values_no_of_columns = mxGetN(prhs[2]);
-        #ifdef VERBOSE
-        mexPrintf("dmx.mex::Addresses have %d rows and %d columns,\nData values have %d rows and %d columns.\n", addresses_no_of_rows, addresses_no_of_columns, data_values_no_of_rows, data_values_no_of_columns);
-        #endif
+        if(handle != NULL)
+            Usb.Free(handle);
+        LstK_Free(deviceList);
 
-        if(addresses_no_of_rows != 1 && addresses_no_of_columns != 1)
-            mexErrMsgTxt("dmx.mex::The addresses must be in a vector.\n");
+        if(device_tuning == NULL)
+            mexErrMsgTxt("dmx.mex::Not even a 1-channel transfer worked. Is the device all right?\n");
 
-        if(data_values_no_of_rows != 1 && data_values_no_of_columns != 1)
-            mexErrMsgTxt("dmx.mex::The data valaues must be in a vector.\n");
+        const char *field_names[] = {"instance_id", "sizes", "latency_ms", "max_chunk", "spacing_ms", "single_latency_ms"};
+        mxArray *sizes = mxCreateDoubleMatrix(1, TUNING_NO_OF_SIZES, mxREAL);
+        mxArray *latencies = mxCreateDoubleMatrix(1, TUNING_NO_OF_SIZES, mxREAL);
+        mxDouble *sizes_output_pointer = mxGetData(sizes);
+        mxDouble *latencies_output_pointer = mxGetData(latencies);
 
+        for(int i = 0; i < TUNING_NO_OF_SIZES; i++)
+        {
+            sizes_output_pointer[i] = tuning_sizes[i];
+            latencies_output_pointer[i] = (device_tuning->latency_us[i] > 0) ? device_tuning->latency_us[i] / 1000.0 : mxGetNaN();
+        }
 
-        USHORT addresses_converted[512];
-        UCHAR data_values_converted[512];
+        plhs[0] = mxCreateStructMatrix(1, 1, 6, field_names);
+        mxSetField(plhs[0], 0, "instance_id", mxCreateString(device_tuning->instance_id));
+        mxSetField(plhs[0], 0, "sizes", sizes);
+        mxSetField(plhs[0], 0, "latency_ms", latencies);
+        mxSetField(plhs[0], 0, "max_chunk", mxCreateDoubleScalar(device_tuning->max_chunk));
+        mxSetField(plhs[0], 0, "spacing_ms", mxCreateDoubleScalar(device_tuning->spacing_us / 1000.0));
+        mxSetField(plhs[0], 0, "single_latency_ms", mxCreateDoubleScalar((device_tuning->single_latency_us > 0) ? device_tuning->single_latency_us / 1000.0 : mxGetNaN()));
+    }
 
-        mxDouble *addresses_input_pointer = mxGetData(prhs[1]);
-        mxDouble *data_values_input_pointer = mxGetData(prhs[2]);
 
-        // Is the list of addresses in strictly monotonically increasing order?
-        for(unsigned int i = 1; i<no_of_elements_address; i++)
+
+    /*
+        result = dmx('pipeline_bench', no_of_updates)
+
+        Sends the whole universe 'no_of_updates' times (100 if it's not given) the usual way, and then the same with
+        the pipeline, as it was set with dmx('config', 'pipeline_chunk', ...). What's sent is what the device should have
+        anyway, so nothing changes on the bus. Returns the mean time of an update both ways in ms, and how many times
+        quicker the pipeline was. Works with the simulator too.
+    */
+
+    if(!strcmp(stringBuffer, "pipeline_bench"))
+    {
+        UCHAR output[512];
+        ULONG no_of_updates = 100;
+        double update_time_ms[2];
+        BOOL success = TRUE;
+
+        if(nrhs > 2)
         {
-            if(addresses_input_pointer[i] - addresses_input_pointer[i-1] != 1)
-                mexErrMsgTxt("dmx.mex::The addresses must increase one by one.\n");
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::This function needs at most two arguments.\n");
+        }
 
+        if(nrhs == 2)
+        {
+            double updates_input = mxIsNumeric(prhs[1]) && mxGetNumberOfElements(prhs[1]) == 1 ? mxGetScalar(prhs[1]) : 0;
+            if(!(updates_input >= 1 && updates_input <= 100000) || updates_input != (ULONG) updates_input)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::The number of updates must be a whole number, between 1 and 100000.\n");
+            }
+            no_of_updates = (ULONG) updates_input;
         }
 
-        //Copy the arrays over while casting them to the required format.
-        for(unsigned int i = 0; i<no_of_elements_address; i++)
+        if(pipeline.chunk_size == 0)
         {
-            // In this loop, we fetch the input data, and cast it before saving.
-            #ifdef VERBOSE
-            mexPrintf("%d: Addr: %d; Data: %d.\n", i, (USHORT) addresses_input_pointer[i], (UCHAR) data_values_input_pointer[i]);
-            #endif
-            addresses_converted[i] = (USHORT) addresses_input_pointer[i] -1; // off-by-one error: the dongle expects [0-511], reality expects [1-512].
-            data_values_converted[i] = (UCHAR) data_values_input_pointer[i];
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::The pipeline is off. Set it up with dmx('config', 'pipeline_chunk', ...) first.\n");
         }
 
+        if(session.running)
+        {
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::The refresh thread is using the device. Call dmx('stop') first.\n");
+        }
 
-        USHORT start_address;
-        USHORT end_address;
-        USHORT no_of_channels;
+        if(!simulator.enabled && daemon.shm != NULL)
+            mexErrMsgTxt("dmx.mex::The daemon has the device. Call dmx('daemon', false) first.\n");
 
-        // Add the offset.
-        if(no_of_elements_address > 1)
+        if(!simulator.enabled && net.only)
+            mexErrMsgTxt("dmx.mex::There is no uDMX, only the network. Call dmx('artnet', false) or dmx('sacn', false) first.\n");
+
+        if(!simulator.enabled)
         {
-            start_address = addresses_converted[0];
-            end_address = addresses_converted[no_of_elements_address - 1];
-            no_of_channels = end_address - start_address + 1;
+            const char *error_message = udmx_open(deviceList, &handle);
+            if(error_message != NULL)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt(error_message);
+            }
         }
-        else
+
+        EnterCriticalSection(&engine_lock);
+        output_render(0, 511, output);
+        LeaveCriticalSection(&engine_lock);
+
+        // First without the pipeline, then with it.
+        USHORT pipeline_chunk = pipeline.chunk_size;
+        for(int pass = 0; pass < 2 && success; pass++)
         {
-            // Special case: only 1 channel argument:
-            start_address = addresses_converted[0];
-            no_of_channels = 1;
+            pipeline.chunk_size = (pass == 0) ? 0 : pipeline_chunk;
+
+            LONGLONG start = now_ticks();
+            for(ULONG i = 0; i < no_of_updates && success; i++)
+                success = udmx_send_range(handle, 0, 512, output);
+            update_time_ms[pass] = (double) (now_ticks() - start) * 1000.0 / qpc_frequency / no_of_updates;
         }
+        pipeline.chunk_size = pipeline_chunk;
 
+        if(handle != NULL)
+            Usb.Free(handle);
+        LstK_Free(deviceList);
 
-        #ifdef VERBOSE
-        mexPrintf("dmx.mex::All sanity checks passed, showing converted address range: %03d - %03d = %d\n", end_address, start_address, no_of_channels);
-        #endif
+        if(!success)
+            mexErrMsgTxt("dmx.mex::A transfer failed during the benchmark.\n");
 
-        // Check the work: dmx('inputtest', [100, 101, 102, 103, 104, 105], [255, 255; 255, 255; 0, 0]);
+        const char *field_names[] = {"updates", "single_ms", "pipelined_ms", "speedup"};
+        plhs[0] = mxCreateStructMatrix(1, 1, 4, field_names);
+        mxSetField(plhs[0], 0, "updates", mxCreateDoubleScalar(no_of_updates));
+        mxSetField(plhs[0], 0, "single_ms", mxCreateDoubleScalar(update_time_ms[0]));
+        mxSetField(plhs[0], 0, "pipelined_ms", mxCreateDoubleScalar(update_time_ms[1]));
+        mxSetField(plhs[0], 0, "speedup", mxCreateDoubleScalar(update_time_ms[0] / update_time_ms[1]));
+    }
 
-        /*
-            The USB transfer stuff
-        */
 
 
-        bool isPresent = FALSE;
+    /*
+        fail = dmx('blackout')
+        fail = dmx('blackout', on)
 
-        // Open the device, fail if cannot
-        if (!LstK_FindByVidPid(deviceList, UDMX_VENDOR_ID, UDMX_PRODUCT_ID, &deviceInfo))
-            mexErrMsgTxt("dmx.mex::Could not find the uDMX device.\n");
+        Puts every channel to 0, or brings them back with dmx('blackout', false). The levels, the masters, the curves and
+        everything else are kept, only the output is 0. While the refresh thread is running, this goes in the urgent lane,
+        so it doesn't wait for the frame that's going out. Without the refresh thread, it's sent straight away.
+    */
 
-        // If we didn't die before, then load the driver API
-        LibK_LoadDriverAPI(&Usb, deviceInfo->DriverID);
+    if(!strcmp(stringBuffer, "blackout"))
+    {
+        BOOL blackout = TRUE;
 
-        // Open device.
-        if(!Usb.Init(&handle, deviceInfo))
+        if(nrhs > 2)
         {
-            errorCode = GetLastError();
-            mexPrintf("dmx.mex::Error code: %d", errorCode);
-            mexErrMsgTxt("dmx.mex::Failed to open device.\n");
+            LstK_Free(deviceList);
+            mexErrMsgTxt("dmx.mex::This function needs at most two arguments.\n");
         }
 
-        DWORD transferred = 0;
-	    BOOL success;
-	    WINUSB_SETUP_PACKET Pkt;
-	    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+        if(nrhs == 2)
+        {
+            if((!mxIsLogical(prhs[1]) && !mxIsNumeric(prhs[1])) || mxGetNumberOfElements(prhs[1]) != 1)
+            {
+                LstK_Free(deviceList);
+                mexErrMsgTxt("dmx.mex::The blackout is either true or false.\n");
+            }
+            blackout = (mxGetScalar(prhs[1]) != 0);
+        }
 
-        memset(&Pkt, 0, sizeof(Pkt));
-        defPkt->BmRequest.Dir	= 0; // This should be BMREQUEST_DIR_HOST_TO_DEVICE
-        defPkt->BmRequest.Type	= 2; // This should be BMREQUEST_TYPE_VENDOR
-        defPkt->Request			= (UCHAR) cmd_SetChannelRange;
-        defPkt->Value			= (UINT) no_of_channels;
-        defPkt->Index			= start_address;
-        defPkt->Length			= no_of_channels;
+        EnterCriticalSection(&engine_lock);
+        urgent.blackout = blackout;
+        shadow_mark_dirty(0, 511);
+        urgent_mark(0, 511, TRUE);
+        LeaveCriticalSection(&engine_lock);
 
+        BOOL success;
+        const char *error_message = shadow_flush(deviceList, &success);
+        DWORD system_error = GetLastError();
 
-        success = UsbK_ControlTransfer(handle, Pkt, data_values_converted, no_of_channels, &transferred, NULL);
-        #ifdef VERBOSE
-        mexPrintf("dmx.mex::UsbK_ControlTransfer():\n\tPkt.Value (no_of_channels): %d,\n\tPkt.Index (start_address): %d,\n\tPkt.Length (no_of_channels): %d\n", Pkt.Value, Pkt.Index, Pkt.Length);
-        mexPrintf("dmx.mex::Transferred %d Bytes.\n", transferred);
-        mexPrintf("dmx.mex::Cleaning up..\n");
-        #endif
-        // All done, clean up.
-        Usb.Free(handle);
         LstK_Free(deviceList);
+        if(error_message != NULL)
+            command_failed(DMX_ERROR_DEVICE, stringBuffer, error_message, system_error);
+        else if(!success)
+            error_record(DMX_ERROR_TRANSFER, stringBuffer, "The transfer failed.", flush_system_error);
 
-        plhs[0] = mxCreateLogicalScalar(!success); // fail. :)
+        command_result(nlhs, plhs, NULL, error_message != NULL || !success, FALSE); // fail. :)
+    }
 
 
-    }
 
+    /*
+        dmx('critical', channels)
+        info = dmx('critical')
+
+        Flags channels as critical, such as shutters, or the intensity of something that must go dark on time. While the
+        refresh thread is running, writes to these channels go in the urgent lane, ahead of the frame that's going out.
+        'channels' is a vector of addresses, or a cell array of patched parameter names. [] clears the flags.
+        Called without arguments, it returns the critical channels, whether the blackout is on, and how the urgent lane
+        did since dmx('start'): how many urgent transfers went out, and the mean, the worst and the last latency from
+        the write to the end of the transfer, in ms.
+    */
+
+    if(!strcmp(stringBuffer, "critical"))
+    {
+        LstK_Free(deviceList);
+
+        if(nrhs > 2)
+            mexErrMsgTxt("dmx.mex::This function needs at most two arguments.\n");
+
+        if(nrhs == 2)
+        {
+            ULONG channel_list[512];
+            mwSize no_of_channels;
+
+            const char *error_message = channels_from_input(prhs[1], channel_list, &no_of_channels);
+            if(error_message != NULL)
+                mexErrMsgTxt(error_message);
+
+            EnterCriticalSection(&engine_lock);
+            memset(urgent.critical, 0, sizeof(urgent.critical));
+            for(mwSize i = 0; i < no_of_channels; i++)
+                urgent.critical[channel_list[i]] = TRUE;
+            LeaveCriticalSection(&engine_lock);
+            return;
+        }
+
+        const char *field_names[] = {"channels", "blackout", "urgent_writes", "latency_ms", "latency_max_ms", "last_latency_ms"};
+        double ticks_to_ms = (qpc_frequency != 0) ? 1000.0 / (double) qpc_frequency : 0;
+        mwSize no_of_critical = 0;
+
+        UCHAR critical[512];
+
+        // Copy it first, so the refresh thread can't change it halfway through.
+        EnterCriticalSection(&engine_lock);
+        memcpy(critical, urgent.critical, sizeof(critical));
+        ULONG no_of_writes = urgent.no_of_writes;
+        double latency_mean = (no_of_writes != 0) ? (double) urgent.latency_sum / no_of_writes * ticks_to_ms : 0;
+        double latency_max = urgent.latency_max * ticks_to_ms;
+        double last_latency = urgent.last_latency * ticks_to_ms;
+        LeaveCriticalSection(&engine_lock);
+
+        for(USHORT channel = 0; channel < 512; channel++)
+            no_of_critical += critical[channel];
+        mxArray *channels = mxCreateDoubleMatrix(1, no_of_critical, mxREAL);
+        mxDouble *channels_output_pointer = mxGetData(channels);
+        for(USHORT channel = 0; channel < 512; channel++)
+        {
+            if(critical[channel])
+                *channels_output_pointer++ = channel + 1;
+        }
 
+        plhs[0] = mxCreateStructMatrix(1, 1, 6, field_names);
+        mxSetField(plhs[0], 0, "channels", channels);
+        mxSetField(plhs[0], 0, "blackout", mxCreateLogicalScalar(urgent.blackout));
+        mxSetField(plhs[0], 0, "urgent_writes", mxCreateDoubleScalar(no_of_writes));
+        mxSetField(plhs[0], 0, "latency_ms", mxCreateDoubleScalar(latency_mean));
+        mxSetField(plhs[0], 0, "latency_max_ms", mxCreateDoubleScalar(latency_max));
+        mxSetField(plhs[0], 0, "last_latency_ms", mxCreateDoubleScalar(last_latency));
+    }
 
 
 
@@ -0,0 +1,165 @@
+#ifndef __udmx_shm_included__
+#define __udmx_shm_included__
+
+/*
+    udmx_shm.h
+
+    The shared memory between udmxd (which has the device) and its clients (dmx.mex, or anything else that
+    can map a named file mapping: Python with mmap, a C program, etc.)
+
+    Every client (a source) gets a layer of its own with udmx_shm_claim(). It writes the channels it wants to change
+    into its layer, and then signals the doorbell event. The daemon takes a copy of every layer, merges them, and
+    sends what is different from what it sent the last time. A channel is merged either as highest takes precedence
+    (HTP: the highest level from any source), or latest takes precedence (LTP: the level from the source that changed
+    it last). This is set for each channel in htp[], and it's LTP by default, which is what you get with one source.
+
+    The layers are protected by a sequence counter (a seqlock):
+    -The writer makes the counter odd, writes the channels, and then makes it even again.
+    -The reader copies the layer, and if the counter was odd, or it changed in the meantime, it tries again.
+    So the reader never waits on a lock, and never sends half of a write. Every layer has one writer only (the client
+    that claimed it), so the writers don't need a lock either. If a client dies in the middle of a write, the
+    daemon keeps using the last good copy of its layer until it notices that the client is gone.
+    When a client is gone (it released its layer, exited, or crashed), the layer is free to claim again, but the
+    levels it sent stay on: the daemon holds them until another source changes those channels. Only the timeout
+    makes a layer's levels drop out.
+*/
+
+#include <windows.h>
+#include <string.h>
+
+#define UDMX_SHM_NAME "Local\\udmxd_universe"
+#define UDMX_SHM_DOORBELL_NAME "Local\\udmxd_doorbell"
+#define UDMX_SHM_MAGIC 0x584D4455 // "UDMX"
+#define UDMX_SHM_VERSION 2
+
+#define UDMX_SHM_MAX_SOURCES 32
+
+// A reader gives up on a layer after this many tries, and keeps the copy it had.
+#define UDMX_SHM_READ_TRIES 16
+
+typedef struct
+{
+    volatile LONG owner;                // the process ID of the client, 0 if the layer is free
+    volatile LONG epoch;                // goes up every time the layer is claimed, so the daemon can tell it's a new source
+    volatile LONG sequence;             // odd while the layer is being written
+    LONG timeout_ms;                    // the layer drops out this long after its last write, 0 if it doesn't
+    volatile LONGLONG last_write;       // QueryPerformanceCounter() at the last write
+    UCHAR levels[512];
+    USHORT generation[512];             // goes up with every write to the channel, even if the level is the same
+} udmx_shm_layer;
+
+typedef struct
+{
+    // Set by the daemon once, before it creates the doorbell.
+    ULONG magic;
+    ULONG version;
+    DWORD daemon_pid;                   // 0 after the daemon exited properly
+    LONGLONG qpc_frequency;
+
+    // The clients write these.
+    UCHAR htp[512];                     // 1 if the channel is HTP, 0 if it's LTP
+    udmx_shm_layer layers[UDMX_SHM_MAX_SOURCES];
+
+    // The daemon writes these.
+    UCHAR universe[512];                // what it sent last
+    volatile LONG device_connected;
+    volatile LONG no_of_sources;        // the layers in the merge
+    volatile LONGLONG heartbeat;        // QueryPerformanceCounter() at the top of the daemon's loop
+    volatile LONGLONG frames_sent;
+    volatile LONGLONG failed_transfers;
+} udmx_shm;
+
+static BOOL udmx_shm_process_alive(DWORD pid)
+{
+    DWORD exit_code = 0;
+
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if(process == NULL)
+        return FALSE;
+
+    BOOL alive = GetExitCodeProcess(process, &exit_code) && exit_code == STILL_ACTIVE;
+    CloseHandle(process);
+    return alive;
+}
+
+// Takes a free layer (or one whose client is gone). Returns its index, or -1 if all of them are in use.
+static int udmx_shm_claim(udmx_shm *shm, LONG timeout_ms)
+{
+    LONG me = (LONG) GetCurrentProcessId();
+    LARGE_INTEGER now;
+
+    for(int i = 0; i < UDMX_SHM_MAX_SOURCES; i++)
+    {
+        udmx_shm_layer *layer = &shm->layers[i];
+        LONG owner = layer->owner;
+
+        if(owner != 0 && udmx_shm_process_alive((DWORD) owner))
+            continue;
+        if(InterlockedCompareExchange(&layer->owner, me, owner) != owner)
+            continue;
+
+        // A new source starts with nothing written. The counter may be odd already, if the last one died writing.
+        if(!(layer->sequence & 1))
+            InterlockedIncrement(&layer->sequence);
+        QueryPerformanceCounter(&now);
+        layer->timeout_ms = timeout_ms;
+        layer->last_write = now.QuadPart;
+        memset(layer->levels, 0, sizeof(layer->levels));
+        memset(layer->generation, 0, sizeof(layer->generation));
+        InterlockedIncrement(&layer->epoch);
+        InterlockedIncrement(&layer->sequence);
+        return i;
+    }
+
+    return -1;
+}
+
+static void udmx_shm_release(udmx_shm *shm, int layer)
+{
+    InterlockedExchange(&shm->layers[layer].owner, 0);
+}
+
+// Writes 'no_of_channels' channels from 'first' (0-based) into our layer. The caller signals the doorbell.
+static void udmx_shm_write(udmx_shm *shm, int layer_index, USHORT first, USHORT no_of_channels, const UCHAR *data)
+{
+    udmx_shm_layer *layer = &shm->layers[layer_index];
+    LARGE_INTEGER now;
+
+    // The interlocked increments are full barriers, so the writes stay between them.
+    InterlockedIncrement(&layer->sequence);
+    memcpy(&layer->levels[first], data, no_of_channels);
+    for(USHORT i = first; i < first + no_of_channels; i++)
+        layer->generation[i]++;
+    QueryPerformanceCounter(&now);
+    layer->last_write = now.QuadPart;
+    InterlockedIncrement(&layer->sequence);
+}
+
+// Takes a consistent copy of a layer, and which claim it belongs to. Returns FALSE if it couldn't, and then the
+// copy is garbage.
+static BOOL udmx_shm_read(udmx_shm *shm, int layer_index, UCHAR *levels, USHORT *generation, LONG *epoch)
+{
+    udmx_shm_layer *layer = &shm->layers[layer_index];
+
+    for(int i = 0; i < UDMX_SHM_READ_TRIES; i++)
+    {
+        LONG before = layer->sequence;
+        if(before & 1)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        MemoryBarrier();
+        memcpy(levels, layer->levels, 512);
+        memcpy(generation, layer->generation, 512 * sizeof(USHORT));
+        *epoch = layer->epoch;
+        MemoryBarrier();
+        if(layer->sequence == before)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+#endif
@@ -0,0 +1,599 @@
+/*
+    udmxd: the uDMX output daemon.
+
+    This keeps the uDMX open, merges what its clients put in their layers of the shared memory (see udmx_shm.h),
+    and sends the result.
+    It's a console program: start it before Matlab (or anything else) wants to use the lights, and stop it with Ctrl+C.
+    If Matlab crashes, the lights stay where they were, and more than one program can use the same device.
+
+    Usage: udmxd [max_chunk]
+    max_chunk is the most channels that go in one transfer, for the clones that can't take a whole universe.
+    dmx('probe') tells you what's best for yours. The default is 512.
+
+    udmxd bench
+    prints how long merging the sources takes, from 1 to 32 of them, and exits.
+
+    Compile it with the Visual Studio command prompt, from this directory:
+    cl udmxd.c libusbK.lib
+*/
+
+// Comment this line out if you don't want to see every transfer in the console.
+//#define VERBOSE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+#include <emmintrin.h> // SSE2, every x64 CPU has it
+
+#include "libusbk.h"
+
+#include "uDMX_cmds.h"
+#include "udmx_shm.h"
+
+// This is my device, your might be different.
+#define UDMX_VENDOR_ID (UINT)0x16c0
+#define UDMX_PRODUCT_ID (UINT)0x05dc
+
+// The longest we wait for the doorbell. This is how often the heartbeat is updated, and how often we try to
+// get the device back when it's unplugged.
+#define DAEMON_PERIOD_MS 100
+
+// How many ticks 'udmxd bench' times for each number of sources.
+#define BENCH_TICKS 20000
+
+static KUSB_DRIVER_API Usb;
+static HANDLE doorbell;
+static volatile LONG stop_requested;
+
+static BOOL WINAPI console_handler(DWORD control_type)
+{
+    InterlockedExchange(&stop_requested, TRUE);
+    SetEvent(doorbell); // Wakes the main loop up.
+    return TRUE;
+}
+
+/*
+    Merge.
+
+    Every tick, each layer that has an owner is copied, and the channels whose generation changed get the tick number
+    as their stamp. Then, from the layers that take part in the merge:
+    -HTP channels get the highest level
+    -LTP channels get the level from the layer with the highest stamp (0 means the layer never wrote it)
+    and htp[] selects between the two. It's all SSE2: 16 channels at a time for the levels, and 4 for the stamps.
+    A layer drops out of the merge when it hasn't written anything for its timeout (if it has one). When its client
+    exits (or crashes, or releases the layer), its levels are not dropped: they go into the held layer, so the
+    lights stay where they were. A held channel stays until a source that is still running changes it.
+*/
+
+typedef struct
+{
+    LONG owner;                     // who we last saw in the layer
+    LONG epoch;                     // ...and which claim it was, the stamps are for this one
+    BOOL owner_alive;
+    BOOL active;                    // takes part in the merge
+    LONG timeout_ms;                // the layer's timeout and last write, as we last saw them
+    LONGLONG last_write;
+    UCHAR levels[512];
+    USHORT generation[512];
+    ULONG stamps[512];              // the tick when the channel last changed, 0 if it never did
+} merge_layer;
+
+static merge_layer merge_layers[UDMX_SHM_MAX_SOURCES];
+static ULONG merge_tick;
+
+// The levels of the sources that are gone. A channel is held while its stamp here is not 0.
+static merge_layer merge_held;
+static BOOL merge_holding;          // is anything held at all
+
+// The stamps are compared as signed numbers. Long before they would overflow, we move them all back. The order
+// of the ones that are still recent stays the same, the really old ones all become 1.
+#define MERGE_TICK_LIMIT 0x40000000UL
+
+static void merge_renumber(void)
+{
+    ULONG shift = MERGE_TICK_LIMIT / 2;
+
+    for(int i = 0; i <= UDMX_SHM_MAX_SOURCES; i++)
+    {
+        merge_layer *layer = (i < UDMX_SHM_MAX_SOURCES) ? &merge_layers[i] : &merge_held;
+        for(int channel = 0; channel < 512; channel++)
+        {
+            ULONG stamp = layer->stamps[channel];
+            if(stamp != 0)
+                layer->stamps[channel] = (stamp > shift) ? stamp - shift : 1;
+        }
+    }
+    merge_tick -= shift;
+}
+
+static __m128i merge_select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Stamps the channels whose generation is different from the last copy, and keeps the new copy.
+static void merge_stamp(merge_layer *layer, const UCHAR *levels, const USHORT *generation)
+{
+    __m128i tick = _mm_set1_epi32((int) merge_tick);
+
+    for(int i = 0; i < 512; i += 8)
+    {
+        __m128i same = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *) &generation[i]), _mm_loadu_si128((const __m128i *) &layer->generation[i]));
+        __m128i changed = _mm_xor_si128(same, _mm_set1_epi32(-1));
+
+        // Each 16-bit mask becomes a 32-bit one, for the stamps.
+        __m128i changed_low = _mm_unpacklo_epi16(changed, changed);
+        __m128i changed_high = _mm_unpackhi_epi16(changed, changed);
+        __m128i *stamps = (__m128i *) &layer->stamps[i];
+        _mm_storeu_si128(&stamps[0], merge_select(changed_low, tick, _mm_loadu_si128(&stamps[0])));
+        _mm_storeu_si128(&stamps[1], merge_select(changed_high, tick, _mm_loadu_si128(&stamps[1])));
+    }
+
+    memcpy(layer->levels, levels, sizeof(layer->levels));
+    memcpy(layer->generation, generation, sizeof(layer->generation));
+}
+
+static void merge_universe(merge_layer *const *sources, int no_of_sources, const UCHAR *htp, UCHAR *output)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    for(int i = 0; i < 512; i += 16)
+    {
+        __m128i highest = zero;
+        __m128i latest_stamp[4] = {zero, zero, zero, zero};
+        __m128i latest_level[4] = {zero, zero, zero, zero};
+
+        for(int source = 0; source < no_of_sources; source++)
+        {
+            __m128i levels = _mm_loadu_si128((const __m128i *) &sources[source]->levels[i]);
+            highest = _mm_max_epu8(highest, levels);
+
+            // The levels go to 32 bits, next to their stamps.
+            __m128i levels_low = _mm_unpacklo_epi8(levels, zero);
+            __m128i levels_high = _mm_unpackhi_epi8(levels, zero);
+            __m128i levels32[4] = {_mm_unpacklo_epi16(levels_low, zero), _mm_unpackhi_epi16(levels_low, zero),
+                                   _mm_unpacklo_epi16(levels_high, zero), _mm_unpackhi_epi16(levels_high, zero)};
+
+            for(int k = 0; k < 4; k++)
+            {
+                __m128i stamp = _mm_loadu_si128((const __m128i *) &sources[source]->stamps[i + 4 * k]);
+                __m128i newer = _mm_cmpgt_epi32(stamp, latest_stamp[k]);
+                latest_stamp[k] = merge_select(newer, stamp, latest_stamp[k]);
+                latest_level[k] = merge_select(newer, levels32[k], latest_level[k]);
+            }
+        }
+
+        __m128i latest = _mm_packus_epi16(_mm_packs_epi32(latest_level[0], latest_level[1]), _mm_packs_epi32(latest_level[2], latest_level[3]));
+        __m128i is_htp = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *) &htp[i]), zero);
+        _mm_storeu_si128((__m128i *) &output[i], merge_select(is_htp, highest, latest));
+    }
+}
+
+// A source is gone, and it didn't have a timeout: its channels are held. LTP channels keep the level of the latest
+// source that changed them, HTP channels the highest level from any of the sources that are gone.
+static void merge_hold(const merge_layer *layer, const UCHAR *htp)
+{
+    for(int channel = 0; channel < 512; channel++)
+    {
+        ULONG stamp = layer->stamps[channel];
+        if(stamp == 0)
+            continue;
+
+        if(htp[channel] && merge_held.stamps[channel] != 0)
+            merge_held.levels[channel] = max(merge_held.levels[channel], layer->levels[channel]);
+        else if(stamp >= merge_held.stamps[channel])
+            merge_held.levels[channel] = layer->levels[channel];
+        merge_held.stamps[channel] = max(merge_held.stamps[channel], stamp);
+        merge_holding = TRUE;
+    }
+}
+
+// A source that is still running changed a held channel: it's not held any more.
+static void merge_release(const merge_layer *const *sources, int no_of_sources)
+{
+    BOOL holding = FALSE;
+
+    for(int i = 0; i < 512; i += 4)
+    {
+        __m128i held = _mm_loadu_si128((const __m128i *) &merge_held.stamps[i]);
+        for(int source = 0; source < no_of_sources; source++)
+            held = _mm_andnot_si128(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *) &sources[source]->stamps[i]), held), held);
+        _mm_storeu_si128((__m128i *) &merge_held.stamps[i], held);
+        holding = holding || _mm_movemask_epi8(_mm_cmpeq_epi32(held, _mm_setzero_si128())) != 0xFFFF;
+    }
+    merge_holding = holding;
+}
+
+// Puts the held channels over the merge of the running sources. LTP channels are held as they were, HTP channels
+// are still the highest level.
+static void merge_apply_held(const UCHAR *htp, UCHAR *output)
+{
+    for(int channel = 0; channel < 512; channel++)
+    {
+        if(merge_held.stamps[channel] == 0)
+            continue;
+        output[channel] = htp[channel] ? max(output[channel], merge_held.levels[channel]) : merge_held.levels[channel];
+    }
+}
+
+// Returns TRUE if the layer has a timeout, and it ran out. Otherwise, 'next_timeout_ms' is how long we can wait.
+static BOOL merge_timed_out(const udmx_shm *shm, const merge_layer *layer, LONGLONG now, DWORD *next_timeout_ms)
+{
+    if(layer->timeout_ms <= 0)
+        return FALSE;
+
+    LONGLONG left = layer->last_write + layer->timeout_ms * shm->qpc_frequency / 1000 - now;
+    if(left <= 0)
+        return TRUE;
+    *next_timeout_ms = min(*next_timeout_ms, (DWORD) (left * 1000 / shm->qpc_frequency) + 1);
+    return FALSE;
+}
+
+// Copies the layers, works out which ones take part, and merges them into 'universe'. 'check_owners' makes it look
+// at whether the clients are still running; that's a system call for each, so it's not done on every tick.
+// Returns how long we can wait before a source times out, in milliseconds (or DAEMON_PERIOD_MS).
+static DWORD merge_tick_run(udmx_shm *shm, BOOL check_owners, UCHAR *universe)
+{
+    merge_layer *sources[UDMX_SHM_MAX_SOURCES];
+    UCHAR levels[512];
+    USHORT generation[512];
+    LONG epoch;
+    int no_of_sources = 0;
+    DWORD next_timeout_ms = DAEMON_PERIOD_MS;
+    LARGE_INTEGER now;
+
+    if(++merge_tick >= MERGE_TICK_LIMIT)
+        merge_renumber();
+    QueryPerformanceCounter(&now);
+
+    for(int i = 0; i < UDMX_SHM_MAX_SOURCES; i++)
+    {
+        udmx_shm_layer *shared = &shm->layers[i];
+        merge_layer *layer = &merge_layers[i];
+        LONG owner = shared->owner;
+        BOOL new_owner = (owner != layer->owner);
+        BOOL was_active = layer->active;
+
+        layer->active = FALSE;
+        if(new_owner || check_owners)
+        {
+            layer->owner = owner;
+            layer->owner_alive = (owner != 0) && udmx_shm_process_alive((DWORD) owner);
+        }
+
+        // The client released the layer, or died. The slot can be claimed again, but what it sent stays on: without
+        // a timeout, it's held, and with one, the last copy stays in the merge until the timeout runs out.
+        if(!layer->owner_alive)
+        {
+            if(!was_active)
+                continue;
+            if(layer->timeout_ms == 0)
+            {
+                merge_hold(layer, shm->htp);
+                continue;
+            }
+            if(merge_timed_out(shm, layer, now.QuadPart, &next_timeout_ms))
+                continue;
+
+            layer->active = TRUE;
+            sources[no_of_sources++] = layer;
+            continue;
+        }
+
+        // If we can't get a good copy, the last one will do.
+        if(udmx_shm_read(shm, i, levels, generation, &epoch))
+        {
+            if(epoch != layer->epoch)
+            {
+                // A new source: it starts with nothing. If the old one was still in the merge (it was released and
+                // reclaimed between two ticks), its channels are held.
+                if(was_active && layer->timeout_ms == 0)
+                    merge_hold(layer, shm->htp);
+                layer->epoch = epoch;
+                memset(layer->generation, 0, sizeof(layer->generation));
+                memset(layer->stamps, 0, sizeof(layer->stamps));
+            }
+            merge_stamp(layer, levels, generation);
+        }
+        else if(new_owner)
+            continue; // ...but only if it's from the same source.
+
+        layer->timeout_ms = shared->timeout_ms;
+        layer->last_write = shared->last_write;
+        if(merge_timed_out(shm, layer, now.QuadPart, &next_timeout_ms))
+            continue;
+
+        layer->active = TRUE;
+        sources[no_of_sources++] = layer;
+    }
+
+    if(merge_holding)
+        merge_release(sources, no_of_sources);
+    merge_universe(sources, no_of_sources, shm->htp, universe);
+    if(merge_holding)
+        merge_apply_held(shm->htp, universe);
+    shm->no_of_sources = no_of_sources;
+
+    return next_timeout_ms;
+}
+
+// udmxd bench: the merge with 1 to 32 sources, every channel changing on every tick.
+static int merge_bench(void)
+{
+    merge_layer *sources[UDMX_SHM_MAX_SOURCES];
+    UCHAR levels[UDMX_SHM_MAX_SOURCES][512], htp[512], universe[512];
+    USHORT generation[UDMX_SHM_MAX_SOURCES][512];
+    LARGE_INTEGER frequency, start, end;
+
+    QueryPerformanceFrequency(&frequency);
+    srand(1);
+    for(int channel = 0; channel < 512; channel++)
+        htp[channel] = channel & 1; // Half of each.
+    for(int i = 0; i < UDMX_SHM_MAX_SOURCES; i++)
+    {
+        sources[i] = &merge_layers[i];
+        for(int channel = 0; channel < 512; channel++)
+        {
+            levels[i][channel] = (UCHAR) rand();
+            generation[i][channel] = 0;
+        }
+    }
+
+    printf("sources   stamp+merge (us per tick)   merge only (us per tick)\n");
+    for(int no_of_sources = 1; no_of_sources <= UDMX_SHM_MAX_SOURCES; no_of_sources *= 2)
+    {
+        merge_tick = 0;
+        memset(merge_layers, 0, sizeof(merge_layers));
+
+        QueryPerformanceCounter(&start);
+        for(int tick = 0; tick < BENCH_TICKS; tick++)
+        {
+            merge_tick++;
+            for(int i = 0; i < no_of_sources; i++)
+            {
+                generation[i][tick & 511]++;
+                merge_stamp(sources[i], levels[i], generation[i]);
+            }
+            merge_universe(sources, no_of_sources, htp, universe);
+        }
+        QueryPerformanceCounter(&end);
+        double with_stamps = (double) (end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart / BENCH_TICKS;
+
+        QueryPerformanceCounter(&start);
+        for(int tick = 0; tick < BENCH_TICKS; tick++)
+        {
+            merge_universe(sources, no_of_sources, htp, universe);
+            htp[tick & 511] ^= universe[tick & 511] & 1; // So the compiler can't take the merge out of the loop.
+        }
+        QueryPerformanceCounter(&end);
+        double merge_only = (double) (end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart / BENCH_TICKS;
+
+        printf("%7d   %25.2f   %24.2f\n", no_of_sources, with_stamps, merge_only);
+    }
+
+    return 0;
+}
+
+// Finds and opens the uDMX device. Returns NULL when all is well, otherwise an error message.
+static const char *device_open(KLST_HANDLE *device_list, KUSB_HANDLE *handle)
+{
+    KLST_DEVINFO_HANDLE device_info = NULL;
+
+    if(!LstK_Init(device_list, 0))
+        return "An error occured getting the device list.";
+
+    if(!LstK_FindByVidPid(*device_list, UDMX_VENDOR_ID, UDMX_PRODUCT_ID, &device_info))
+    {
+        LstK_Free(*device_list);
+        return "Could not find the uDMX device.";
+    }
+
+    LibK_LoadDriverAPI(&Usb, device_info->DriverID);
+
+    if(!Usb.Init(handle, device_info))
+    {
+        LstK_Free(*device_list);
+        return "Failed to open device.";
+    }
+
+    return NULL;
+}
+
+// Sends channels [start_address, start_address + no_of_channels - 1]. With 'single', the one channel goes with
+// cmd_SetSingleChannel, otherwise everything goes with cmd_SetChannelRange.
+static BOOL device_send(KUSB_HANDLE handle, USHORT start_address, USHORT no_of_channels, PUCHAR data, BOOL single)
+{
+    WINUSB_SETUP_PACKET Pkt;
+    KUSB_SETUP_PACKET* defPkt = (KUSB_SETUP_PACKET*)&Pkt;
+    UINT transferred = 0;
+
+    memset(&Pkt, 0, sizeof(Pkt));
+    defPkt->BmRequest.Dir	= 0; // This should be BMREQUEST_DIR_HOST_TO_DEVICE
+    defPkt->BmRequest.Type	= 2; // This should be BMREQUEST_TYPE_VENDOR
+    defPkt->Index			= start_address;
+
+    if(single)
+    {
+        defPkt->Request			= (UCHAR) cmd_SetSingleChannel;
+        defPkt->Value			= data[0];
+        defPkt->Length			= 0;
+        return Usb.ControlTransfer(handle, Pkt, NULL, 0, &transferred, NULL);
+    }
+
+    defPkt->Request			= (UCHAR) cmd_SetChannelRange;
+    defPkt->Value			= no_of_channels;
+    defPkt->Length			= no_of_channels;
+    return Usb.ControlTransfer(handle, Pkt, data, no_of_channels, &transferred, NULL);
+}
+
+// Not every clone takes cmd_SetSingleChannel, same as in dmx.c's probe. We send channel 1 with it, with what is
+// going out there anyway: if that fails, we stick to cmd_SetChannelRange.
+static BOOL device_probe_single(KUSB_HANDLE handle, PUCHAR universe)
+{
+    return device_send(handle, 0, 1, universe, TRUE);
+}
+
+int main(int argc, char *argv[])
+{
+    KLST_HANDLE device_list = NULL;
+    KUSB_HANDLE handle = NULL;
+    UCHAR universe[512], sent[512];
+    BOOL resync = TRUE;
+    BOOL single = FALSE; // If the device takes cmd_SetSingleChannel
+    LARGE_INTEGER counter;
+    USHORT max_chunk = 512;
+    DWORD wait_ms = DAEMON_PERIOD_MS;
+    LONGLONG last_owner_check = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "bench"))
+        return merge_bench();
+
+    if(argc > 1)
+    {
+        int chunk = atoi(argv[1]);
+        if(chunk < 1 || chunk > 512)
+        {
+            fprintf(stderr, "udmxd: max_chunk must be between 1 and 512.\n");
+            return 1;
+        }
+        max_chunk = (USHORT) chunk;
+    }
+
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(udmx_shm), UDMX_SHM_NAME);
+    if(mapping == NULL)
+    {
+        fprintf(stderr, "udmxd: Could not create the shared universe. Error code: %lu\n", GetLastError());
+        return 1;
+    }
+    BOOL existed = (GetLastError() == ERROR_ALREADY_EXISTS);
+
+    udmx_shm *shm = (udmx_shm *) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(udmx_shm));
+    if(shm == NULL)
+    {
+        fprintf(stderr, "udmxd: Could not map the shared universe. Error code: %lu\n", GetLastError());
+        CloseHandle(mapping);
+        return 1;
+    }
+
+    // The clients keep the mapping alive, so it can be there from a daemon before us. That's fine, unless that daemon
+    // is still running. Whatever the clients wrote in the meantime stays, and goes out as soon as we have the device.
+    if(existed && shm->magic == UDMX_SHM_MAGIC && shm->daemon_pid != 0 && shm->daemon_pid != GetCurrentProcessId() && udmx_shm_process_alive(shm->daemon_pid))
+    {
+        fprintf(stderr, "udmxd: Another udmxd is already running (process %lu).\n", shm->daemon_pid);
+        UnmapViewOfFile(shm);
+        CloseHandle(mapping);
+        return 1;
+    }
+    if(!existed || shm->magic != UDMX_SHM_MAGIC || shm->version != UDMX_SHM_VERSION)
+    {
+        memset(shm, 0, sizeof(udmx_shm));
+        shm->magic = UDMX_SHM_MAGIC;
+        shm->version = UDMX_SHM_VERSION;
+    }
+
+    QueryPerformanceFrequency(&counter);
+    shm->qpc_frequency = counter.QuadPart;
+    shm->device_connected = FALSE;
+    shm->daemon_pid = GetCurrentProcessId();
+
+    doorbell = CreateEventA(NULL, FALSE, FALSE, UDMX_SHM_DOORBELL_NAME);
+    if(doorbell == NULL)
+    {
+        fprintf(stderr, "udmxd: Could not create the doorbell. Error code: %lu\n", GetLastError());
+        shm->daemon_pid = 0;
+        UnmapViewOfFile(shm);
+        CloseHandle(mapping);
+        return 1;
+    }
+
+    SetConsoleCtrlHandler(console_handler, TRUE);
+    printf("udmxd: Running, with %u channels in a transfer. Press Ctrl+C to stop.\n", max_chunk);
+
+    while(!stop_requested)
+    {
+        WaitForSingleObject(doorbell, wait_ms);
+        if(stop_requested)
+            break;
+
+        QueryPerformanceCounter(&counter);
+        shm->heartbeat = counter.QuadPart;
+
+        // The merge goes on even without the device, so the sources keep their order.
+        BOOL check_owners = (counter.QuadPart - last_owner_check >= DAEMON_PERIOD_MS * shm->qpc_frequency / 1000);
+        if(check_owners)
+            last_owner_check = counter.QuadPart;
+        wait_ms = merge_tick_run(shm, check_owners, universe);
+
+        if(handle == NULL)
+        {
+            const char *error_message = device_open(&device_list, &handle);
+            if(error_message != NULL)
+                continue; // Try again in a bit.
+
+            single = device_probe_single(handle, universe);
+            printf("udmxd: The device is connected%s.\n", single ? "" : ", without cmd_SetSingleChannel");
+            shm->device_connected = TRUE;
+            resync = TRUE;
+        }
+
+        // The range of channels that changed since the last transfer, or everything after we (re)opened the device.
+        USHORT first = 0, last = 511;
+        if(!resync)
+        {
+            while(first < 512 && universe[first] == sent[first])
+                first++;
+            if(first == 512)
+                continue;
+            while(universe[last] == sent[last])
+                last--;
+        }
+
+        // Only a change of one channel goes with cmd_SetSingleChannel, never the one-channel end of a split range.
+        BOOL success = TRUE;
+        for(USHORT start_address = first; start_address <= last && success; start_address += max_chunk)
+        {
+            USHORT no_of_channels = min(last - start_address + 1, max_chunk);
+            success = device_send(handle, start_address, no_of_channels, &universe[start_address], single && first == last);
+
+            #ifdef VERBOSE
+            printf("udmxd: %u channels from %u: %s\n", no_of_channels, start_address, success ? "OK" : "failed");
+            #endif
+        }
+
+        if(success)
+        {
+            memcpy(&sent[first], &universe[first], last - first + 1);
+            memcpy(shm->universe, sent, sizeof(sent));
+            resync = FALSE;
+            InterlockedIncrement64(&shm->frames_sent);
+        }
+        else
+        {
+            // It was probably unplugged. We'll find it again, and send everything.
+            fprintf(stderr, "udmxd: The transfer failed (error code: %lu), reopening the device.\n", GetLastError());
+            InterlockedIncrement64(&shm->failed_transfers);
+            shm->device_connected = FALSE;
+            Usb.Free(handle);
+            LstK_Free(device_list);
+            handle = NULL;
+            device_list = NULL;
+        }
+    }
+
+    printf("udmxd: Stopping.\n");
+    shm->device_connected = FALSE;
+    shm->daemon_pid = 0;
+
+    if(handle != NULL)
+    {
+        Usb.Free(handle);
+        LstK_Free(device_list);
+    }
+    CloseHandle(doorbell);
+    UnmapViewOfFile(shm);
+    CloseHandle(mapping);
+
+    return 0;
+}